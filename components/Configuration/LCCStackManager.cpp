@@ -19,7 +19,10 @@ COPYRIGHT (c) 2020 Mike Dunston
 #include "CDIHelper.h"
 #include "FileSystemManager.h"
 #if defined(CONFIG_LCC_CAN_ENABLED)
-#include <freertos_drivers/esp32/Esp32HardwareCanAdapter.hxx>
+#include <driver/can.h>
+#include <esp_task.h>
+#include <Metrics.h>
+#include <nmranet_config.h>
 #endif // CONFIG_LCC_CAN_ENABLED
 #include <openlcb/SimpleStack.hxx>
 #include <utils/AutoSyncFileFlow.hxx>
@@ -33,118 +36,261 @@ static constexpr const char LCC_CAN_MARKER_FILE[] = "lcc-can";
 
 #if defined(CONFIG_LCC_CAN_ENABLED)
 
-/// Bridge class that connects a native CAN controller to the OpenMRN core
-/// stack, sending and receiving CAN frames directly. The CAN controller must
-/// have a driver matching the Can controller base class defined in
-/// OpenMRN/arduino.
-class CanBridge : public Executable
+/// Number of CAN frames received from the native CAN driver.
+static Counter can_frames_received("lcc_can_frames_received_total"
+                                 , "CAN frames received");
+
+/// Number of CAN frames handed to the native CAN driver.
+static Counter can_frames_sent("lcc_can_frames_sent_total"
+                             , "CAN frames sent");
+
+/// Number of CAN frames dropped due to being invalid or the bus not running.
+static Counter can_frames_dropped("lcc_can_frames_dropped_total"
+                                , "CAN frames dropped");
+
+/// Number of times transmit was delayed by a full TX queue.
+static Counter can_tx_queue_full("lcc_can_tx_queue_full_total"
+                               , "CAN transmits delayed by a full TX queue");
+
+/// Bridge class that connects the ESP32 native CAN driver to the OpenMRN core
+/// stack, sending and receiving CAN frames directly.
+///
+/// Received frames are collected by a dedicated task which sleeps in the
+/// native driver until a frame arrives and then drains up to
+/// @ref RX_BATCH_SIZE frames into @ref CanHubFlow buffers before sleeping
+/// again. Frames generated by the stack are handed to the bounded TX queue of
+/// the native driver from the stack's executor, when the TX queue is full the
+/// write port waits for roughly one frame time before retrying so that the
+/// remaining frames stay queued on the hub port.
+class CanBridge
 {
 public:
-    /// Constructor.
-    ///
-    /// @param port is the CAN hardware driver implementation.
-    /// @param can_hub is the core CAN frame router of the OpenMRN stack,
-    /// usually comes from stack()->can_hub().
-    CanBridge(Can *port, CanHubFlow *can_hub)
-        : port_(port)
-        , canHub_(can_hub)
+  /// Constructor.
+  ///
+  /// @param can_hub is the core CAN frame router of the OpenMRN stack,
+  /// usually comes from stack()->can_hub().
+  /// @param rx_pin is the ESP32 pin that is connected to the external
+  /// transceiver RX.
+  /// @param tx_pin is the ESP32 pin that is connected to the external
+  /// transceiver TX.
+  CanBridge(CanHubFlow *can_hub, gpio_num_t rx_pin, gpio_num_t tx_pin)
+    : canHub_(can_hub)
+  {
+    // Configure the ESP32 CAN driver to use 125kbps and accept all frames.
+    can_timing_config_t can_timing_config = CAN_TIMING_CONFIG_125KBITS();
+    can_filter_config_t can_filter_config = CAN_FILTER_CONFIG_ACCEPT_ALL();
+    // Note: not using the CAN_GENERAL_CONFIG_DEFAULT macro due to a missing
+    // cast for CAN_IO_UNUSED.
+    can_general_config_t can_general_config =
     {
-        port_->enable();
-        can_hub->register_port(&writePort_);
+      .mode = CAN_MODE_NORMAL,
+      .tx_io = tx_pin,
+      .rx_io = rx_pin,
+      .clkout_io = (gpio_num_t)CAN_IO_UNUSED,
+      .bus_off_io = (gpio_num_t)CAN_IO_UNUSED,
+      .tx_queue_len = (uint32_t)config_can_tx_buffer_size(),
+      .rx_queue_len = (uint32_t)config_can_rx_buffer_size(),
+      .alerts_enabled = CAN_ALERT_NONE,
+      .clkout_divider = 0
+    };
+    ESP_ERROR_CHECK(can_driver_install(&can_general_config, &can_timing_config
+                                     , &can_filter_config));
+    ESP_ERROR_CHECK(can_start());
+    canHub_->register_port(&writePort_);
+    os_thread_create(nullptr, "CAN-BRIDGE", RX_TASK_PRIORITY
+                   , RX_TASK_STACK_SIZE, rx_task, this);
+  }
+
+  ~CanBridge()
+  {
+    canHub_->unregister_port(&writePort_);
+    can_stop();
+    can_driver_uninstall();
+  }
+
+  /// Stops the RX task, this will block until the task has exited.
+  void shutdown()
+  {
+    run_ = false;
+    while (running_)
+    {
+      vTaskDelay(pdMS_TO_TICKS(1));
     }
+  }
+
+private:
+  /// Maximum number of frames to drain from the native driver per wakeup of
+  /// the RX task.
+  static constexpr uint8_t RX_BATCH_SIZE = 8;
 
-    ~CanBridge()
+  /// Maximum time the RX task will sleep waiting for a frame, this is also
+  /// the interval at which the bus status is checked.
+  static constexpr TickType_t RX_WAIT_TICKS = pdMS_TO_TICKS(250);
+
+  /// Time to wait before retrying a transmit when the TX queue of the native
+  /// driver is full, this is roughly the time for one frame at 125kbps.
+  static constexpr long long TX_RETRY_NSEC = MSEC_TO_NSEC(1);
+
+  /// Stack size to allocate for the RX task.
+  static constexpr uint32_t RX_TASK_STACK_SIZE = 2048;
+
+  /// Priority to use for the RX task, this needs to be lower than the
+  /// OpenMRN executor.
+  static constexpr UBaseType_t RX_TASK_PRIORITY = ESP_TASK_TCPIP_PRIO - 2;
+
+  /// Background task which receives frames from the native CAN driver.
+  static void *rx_task(void *param)
+  {
+    CanBridge *bridge = static_cast<CanBridge *>(param);
+    bridge->running_ = true;
+    while (bridge->run_)
     {
-        port_->disable();
+      can_message_t msg;
+      if (can_receive(&msg, RX_WAIT_TICKS) != ESP_OK)
+      {
+        // nothing received, verify that the bus has not been disabled.
+        bridge->check_bus_status();
+        continue;
+      }
+      uint8_t count = 0;
+      do
+      {
+        bridge->receive(&msg);
+      } while (++count < RX_BATCH_SIZE && can_receive(&msg, 0) == ESP_OK);
     }
+    bridge->running_ = false;
+    return nullptr;
+  }
 
-    /// Called by the loop.
-    void run() override
+  /// Converts a frame from the native CAN driver and passes it to the stack.
+  ///
+  /// @param msg is the received frame.
+  void receive(can_message_t *msg)
+  {
+    if (msg->flags & CAN_MSG_FLAG_DLC_NON_COMP)
     {
-        loop_for_write();
-        loop_for_read();
+      LOG(WARNING, "[CAN] Dropping non-compliant frame: %08x"
+        , (unsigned)msg->identifier);
+      can_frames_dropped.inc();
+      return;
     }
+    auto *b = canHub_->alloc();
+    struct can_frame *frame = b->data();
+    memset(frame, 0, sizeof(struct can_frame));
+    frame->can_id = msg->identifier;
+    frame->can_dlc = msg->data_length_code;
+    memcpy(frame->data, msg->data, msg->data_length_code);
+    if (msg->flags & CAN_MSG_FLAG_EXTD)
+    {
+      SET_CAN_FRAME_EFF(*frame);
+    }
+    if (msg->flags & CAN_MSG_FLAG_RTR)
+    {
+      SET_CAN_FRAME_RTR(*frame);
+    }
+    b->data()->skipMember_ = &writePort_;
+    canHub_->send(b);
+    can_frames_received.inc();
+  }
 
-private:
-    /// Handles data going out of OpenMRN and towards the CAN port.
-    void loop_for_write()
+  /// Initiates recovery when the native CAN driver has disabled the bus due
+  /// to errors and restarts the driver when the recovery has completed.
+  void check_bus_status()
+  {
+    can_status_info_t status;
+    if (can_get_status_info(&status) != ESP_OK)
+    {
+      return;
+    }
+    if (status.state == CAN_STATE_BUS_OFF)
     {
-        if (!writeBuffer_)
-        {
-            return;
-        }
-        if (port_->availableForWrite() <= 0)
-        {
-            return;
-        }
-        port_->write(writeBuffer_->data());
-        writeBuffer_ = nullptr;
-        writePort_.notify();
+      LOG(WARNING, "[CAN] Bus off (tx-err:%u, rx-err:%u), initiating recovery"
+        , (unsigned)status.tx_error_counter
+        , (unsigned)status.rx_error_counter);
+      can_initiate_recovery();
     }
+    else if (status.state == CAN_STATE_STOPPED)
+    {
+      // recovery leaves the driver in the stopped state.
+      LOG(INFO, "[CAN] Bus recovered, restarting");
+      can_start();
+    }
+  }
 
-    /// Handles data coming from the CAN port.
-    void loop_for_read()
+  friend class WritePort;
+  class WritePort : public CanHubPort
+  {
+  public:
+    WritePort(CanBridge *parent)
+      : CanHubPort(parent->canHub_->service())
     {
-        while (port_->available())
-        {
-            auto *b = canHub_->alloc();
-            port_->read(b->data());
-            b->data()->skipMember_ = &writePort_;
-            canHub_->send(b);
-        }
     }
 
-    friend class WritePort;
-    class WritePort : public CanHubPort
+    Action entry() override
     {
-    public:
-        WritePort(CanBridge *parent)
-            : CanHubPort(parent->canHub_->service())
-            , parent_(parent)
-        {
-        }
-
-        Action entry() override
-        {
-            parent_->writeBuffer_ = message();
-            return wait_and_call(STATE(write_done));
-        }
-
-        Action write_done()
-        {
-            return release_and_exit();
-        }
-
-    private:
-        CanBridge *parent_;
-    };
+      const struct can_frame *frame = message()->data();
+      bzero(&msg_, sizeof(can_message_t));
+      msg_.flags = CAN_MSG_FLAG_NONE;
+      msg_.identifier = frame->can_id;
+      msg_.data_length_code = frame->can_dlc;
+      memcpy(msg_.data, frame->data, frame->can_dlc);
+      if (IS_CAN_FRAME_EFF(*frame))
+      {
+        msg_.flags |= CAN_MSG_FLAG_EXTD;
+      }
+      if (IS_CAN_FRAME_RTR(*frame))
+      {
+        msg_.flags |= CAN_MSG_FLAG_RTR;
+      }
+      return call_immediately(STATE(transmit));
+    }
+
+    Action transmit()
+    {
+      esp_err_t res = can_transmit(&msg_, 0);
+      if (res == ESP_ERR_TIMEOUT)
+      {
+        // TX queue is full, retry after the next frame has been sent.
+        can_tx_queue_full.inc();
+        return sleep_and_call(&timer_, TX_RETRY_NSEC, STATE(transmit));
+      }
+      else if (res != ESP_OK)
+      {
+        // the bus is not running, drop the frame rather than holding up the
+        // stack until it has recovered.
+        LOG(VERBOSE, "[CAN] Dropping frame %08x: %s"
+          , (unsigned)msg_.identifier, esp_err_to_name(res));
+        can_frames_dropped.inc();
+      }
+      else
+      {
+        can_frames_sent.inc();
+      }
+      return release_and_exit();
+    }
+
+  private:
+    /// Frame being transmitted.
+    can_message_t msg_;
 
-    /// Hardware driver.
-    Can *port_;
-    /// Next buffer we are trying to write into the driver's FIFO.
-    Buffer<CanHubData> *writeBuffer_{nullptr};
-    /// Connection to the stack.
-    CanHubFlow *canHub_;
-    /// State flow with queues for output frames generated by the stack.
-    WritePort writePort_{this};
+    /// Timer used when waiting for space in the TX queue.
+    StateFlowTimer timer_{this};
+  };
+
+  /// Connection to the stack.
+  CanHubFlow *canHub_;
+
+  /// State flow with queues for output frames generated by the stack.
+  WritePort writePort_{this};
+
+  /// When false the RX task will exit.
+  volatile bool run_{true};
+
+  /// True while the RX task is running.
+  volatile bool running_{false};
 };
 
 static std::unique_ptr<CanBridge> canBridge;
-bool can_run = true;
-bool can_running = false;
-
-static void* can_bridge_task(void *param)
-{
-  can_running = true;
-  while (can_run)
-  {
-    canBridge->run();
-    vTaskDelay(pdMS_TO_TICKS(1));
-  }
-  canBridge.reset(nullptr);
-  can_running = false;
-  return nullptr;
-}
 #endif // CONFIG_LCC_CAN_ENABLED
 
 LCCStackManager::LCCStackManager(const esp32cs::Esp32ConfigDef &cfg) : cfg_(cfg)
@@ -215,14 +361,10 @@ LCCStackManager::LCCStackManager(const esp32cs::Esp32ConfigDef &cfg) : cfg_(cfg)
   {
     LOG(INFO, "[LCC] Enabling CAN interface (rx: %d, tx: %d)"
       , CONFIG_LCC_CAN_RX_PIN, CONFIG_LCC_CAN_TX_PIN);
-    can_ = new Esp32HardwareCan("esp32can"
-                              , (gpio_num_t)CONFIG_LCC_CAN_RX_PIN
-                              , (gpio_num_t)CONFIG_LCC_CAN_TX_PIN
-                              , false);
     canBridge.reset(
-        new CanBridge((Can *)can_
-                    , ((openlcb::SimpleCanStack *)stack_)->can_hub()));
-    os_thread_create(nullptr,  "CAN-BRIDGE", -1, 2048, can_bridge_task, nullptr);
+        new CanBridge(((openlcb::SimpleCanStack *)stack_)->can_hub()
+                    , (gpio_num_t)CONFIG_LCC_CAN_RX_PIN
+                    , (gpio_num_t)CONFIG_LCC_CAN_TX_PIN));
   }
 #endif // CONFIG_LCC_CAN_ENABLED
 #endif // CONFIG_LCC_TCP_STACK
@@ -291,12 +433,9 @@ void LCCStackManager::shutdown()
 #if defined(CONFIG_LCC_CAN_ENABLED)
   if (canBridge.get() != nullptr)
   {
-    can_run = false;
     // wait for can task shutdown
-    while (can_running)
-    {
-      vTaskDelay(pdMS_TO_TICKS(1));
-    }
+    canBridge->shutdown();
+    canBridge.reset(nullptr);
   }
 #endif // CONFIG_LCC_CAN_ENABLED
 
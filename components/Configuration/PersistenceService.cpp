@@ -0,0 +1,94 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "PersistenceService.h"
+#include "FileSystemManager.h"
+
+#include <esp_timer.h>
+#include <utils/logging.h>
+
+PersistenceService::PersistenceService()
+  : Service(&executor_)
+  , executor_("persist", CONFIG_PERSISTENCE_TASK_PRIORITY
+            , CONFIG_PERSISTENCE_TASK_STACK_SIZE)
+{
+}
+
+PersistenceService::~PersistenceService()
+{
+  flush();
+  executor_.shutdown();
+}
+
+void PersistenceService::store(const std::string &name, std::string content)
+{
+  bool was_empty;
+  {
+    OSMutexLock l(&lock_);
+    was_empty = pending_.empty();
+    auto it = pending_.find(name);
+    if (it != pending_.end())
+    {
+      // the previous snapshot has not been written yet, only the latest
+      // snapshot needs to be written.
+      it->second = std::move(content);
+      coalesced_++;
+      return;
+    }
+    pending_.emplace(name, std::move(content));
+  }
+  if (was_empty)
+  {
+    executor_.add(new CallbackExecutable([this]()
+    {
+      write_pending();
+    }));
+  }
+}
+
+void PersistenceService::flush()
+{
+  executor_.sync_run([this]()
+  {
+    write_pending();
+  });
+}
+
+void PersistenceService::write_pending()
+{
+  std::map<std::string, std::string> pending;
+  size_t coalesced;
+  {
+    OSMutexLock l(&lock_);
+    pending.swap(pending_);
+    coalesced = coalesced_;
+    coalesced_ = 0;
+  }
+  if (pending.empty())
+  {
+    return;
+  }
+  int64_t start = esp_timer_get_time();
+  auto fs = Singleton<FileSystemManager>::instance();
+  for (auto &entry : pending)
+  {
+    fs->store(entry.first.c_str(), entry.second);
+  }
+  LOG(VERBOSE, "[Persist] Wrote %zu file(s) in %lld ms (%zu coalesced)"
+    , pending.size(), USEC_TO_MSEC(esp_timer_get_time() - start)
+    , coalesced);
+}
@@ -21,6 +21,11 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include <executor/Service.hxx>
 #include <executor/StateFlow.hxx>
 
+/// Periodically invokes a callback to persist the state of a manager.
+///
+/// The callback is invoked on the executor of the provided @ref Service, it
+/// should build a snapshot of the state and hand it to
+/// @ref PersistenceService rather than writing to the filesystem directly.
 class AutoPersistFlow : private StateFlowBase
 {
 public:
@@ -63,6 +63,10 @@ constexpr const char * JSON_PULLUP_NODE = "pullUp";
 constexpr const char * JSON_TURNOUTS_NODE = "turnouts";
 constexpr const char * JSON_TURNOUTS_READABLE_STRINGS_NODE = "readableStrings";
 
+constexpr const char * JSON_ROUTES_NODE = "routes";
+constexpr const char * JSON_EVENT_NODE = "event";
+constexpr const char * JSON_DURATION_NODE = "duration";
+
 constexpr const char * JSON_S88_NODE = "s88";
 constexpr const char * JSON_S88_SENSOR_BASE_NODE = "sensorIDBase";
 
@@ -78,6 +82,13 @@ constexpr const char * JSON_DECODER_MANUFACTURER_NODE = "manufacturer";
 constexpr const char * JSON_CREATE_NODE = "create";
 constexpr const char * JSON_OVERALL_STATE_NODE = "overallState";
 constexpr const char * JSON_LAST_UPDATE_NODE = "lastUpdate";
+constexpr const char * JSON_BACKUP_NODE = "backup";
+constexpr const char * JSON_RESTORE_NODE = "restore";
+constexpr const char * JSON_RESUME_NODE = "resume";
+constexpr const char * JSON_CVS_NODE = "cvs";
+constexpr const char * JSON_PROGRESS_NODE = "done";
+constexpr const char * JSON_TOTAL_NODE = "total";
+constexpr const char * JSON_FAILED_NODE = "failed";
 
 constexpr const char * JSON_LCC_NODE = "lcc";
 constexpr const char * JSON_LCC_FORCE_RESET_NODE = "reset";
@@ -156,6 +167,10 @@ constexpr const char * JSON_VALUE_FAULT = "Fault";
 constexpr const char * JSON_VALUE_ERROR = "Error";
 constexpr const char * JSON_VALUE_THROWN = "Thrown";
 constexpr const char * JSON_VALUE_CLOSED = "Closed";
+constexpr const char * JSON_VALUE_IDLE = "Idle";
+constexpr const char * JSON_VALUE_QUEUED = "Queued";
+constexpr const char * JSON_VALUE_RUNNING = "Running";
+constexpr const char * JSON_VALUE_COMPLETE = "Complete";
 constexpr const char * JSON_VALUE_LONG_ADDRESS = "Long Address";
 constexpr const char * JSON_VALUE_SHORT_ADDRESS = "Short Address";
 constexpr const char * JSON_VALUE_MOBILE_DECODER = "Mobile Decoder";
@@ -30,11 +30,6 @@ namespace openlcb
 class AutoSyncFileFlow;
 class Service;
 
-namespace openmrn_arduino
-{
-  class Esp32HardwareCan;
-}
-
 namespace esp32cs
 {
 
@@ -59,7 +54,6 @@ private:
   int fd_;
   uint64_t nodeID_{0};
   openlcb::SimpleStackBase *stack_;
-  openmrn_arduino::Esp32HardwareCan *can_;
   AutoSyncFileFlow *configAutoSync_;
 };
 
@@ -0,0 +1,89 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef PERSISTENCE_SERVICE_H_
+#define PERSISTENCE_SERVICE_H_
+
+#include <executor/Executor.hxx>
+#include <executor/Service.hxx>
+#include <map>
+#include <os/OS.hxx>
+#include <string>
+#include <utils/Singleton.hxx>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PERSISTENCE_TASK_PRIORITY
+#define CONFIG_PERSISTENCE_TASK_PRIORITY 1
+#endif
+
+#ifndef CONFIG_PERSISTENCE_TASK_STACK_SIZE
+#define CONFIG_PERSISTENCE_TASK_STACK_SIZE 4096
+#endif
+
+/// Writes persistent configuration data on a dedicated low priority thread.
+///
+/// SPIFFS and SD writes can take hundreds of milliseconds, managers build a
+/// snapshot of their state while holding their own lock and hand it to
+/// @ref store which returns immediately. The snapshot is written by the
+/// persistence thread via @ref FileSystemManager. When a file is stored again
+/// before the previous snapshot has been written only the latest snapshot is
+/// written.
+///
+/// This is also a @ref Service so that flows which need to perform file I/O
+/// directly (such as @ref AutoPersistFlow for the train database journal) can
+/// be executed on the persistence thread.
+class PersistenceService : public Service
+                         , public Singleton<PersistenceService>
+{
+public:
+  /// Constructor.
+  PersistenceService();
+
+  /// Destructor, this will write all pending snapshots.
+  ~PersistenceService();
+
+  /// Queues a snapshot to be written to the persistent filesystem.
+  ///
+  /// @param name is the name of the file to write.
+  /// @param content is the content to write, this replaces any pending
+  /// content for the same file.
+  void store(const std::string &name, std::string content);
+
+  /// Writes all pending snapshots, the caller will be blocked until the
+  /// snapshots have been written.
+  void flush();
+
+private:
+  /// @ref Executor for the persistence thread.
+  Executor<1> executor_;
+
+  /// Lock protecting @ref pending_.
+  OSMutex lock_;
+
+  /// Snapshots which have not yet been written, by file name.
+  std::map<std::string, std::string> pending_;
+
+  /// Number of snapshots which were replaced before being written.
+  size_t coalesced_{0};
+
+  /// Writes all pending snapshots, this must be called on the persistence
+  /// thread.
+  void write_pending();
+};
+
+#endif // PERSISTENCE_SERVICE_H_
@@ -18,6 +18,7 @@ COPYRIGHT (c) 2020 Mike Dunston
 #include "RMTTrackDevice.h"
 #include "EStopHandler.h"
 #include "Esp32RailComDriver.h"
+#include "RailComFeedback.h"
 #include "TrackPowerBitInterface.h"
 
 #include <dcc/DccOutput.hxx>
@@ -150,6 +151,7 @@ static std::unique_ptr<ProgrammingTrackBackend> prog_track_backend;
 #if CONFIG_OPS_RAILCOM
 static std::unique_ptr<dcc::RailcomHubFlow> railcom_hub;
 static std::unique_ptr<dcc::RailcomPrintfFlow> railcom_dumper;
+static std::unique_ptr<RailComFeedbackCache> railcom_feedback;
 #endif // CONFIG_OPS_RAILCOM
 
 /// Updates the status display with the current state of the track outputs.
@@ -379,6 +381,7 @@ void init_dcc_vfs(openlcb::Node *node, Service *service
 #if defined(CONFIG_OPS_RAILCOM)
   railcom_hub.reset(new dcc::RailcomHubFlow(service));
   opsRailComDriver.hw_init(railcom_hub.get());
+  railcom_feedback.reset(new RailComFeedbackCache(railcom_hub.get()));
 #if defined(CONFIG_OPS_RAILCOM_DUMP_PACKETS)
   railcom_dumper.reset(new dcc::RailcomPrintfFlow(railcom_hub.get()));
 #endif
@@ -39,6 +39,9 @@
 
 #include "can_ioctl.h"
 #include "DuplexedTrackIf.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "track_ioctl.h"
 
 #include <dcc/Packet.hxx>
 #include <executor/Executor.hxx>
@@ -50,6 +53,15 @@
 namespace esp32cs
 {
 
+/// Number of DCC packets written to the track devices.
+static Counter packets_written("dcc_packets_written_total"
+                             , "DCC packets written to the track devices");
+
+/// Number of times writing was suspended until a track device had space in
+/// its packet queue.
+static Counter write_waits("dcc_packet_write_waits_total"
+                         , "DCC packet writes delayed by a full packet queue");
+
 DuplexedTrackIf::DuplexedTrackIf(Service *service, int pool_size, int ops_fd
                                , int prog_fd)
     : StateFlow<Buffer<dcc::Packet>, QList<1>>(service)
@@ -60,16 +72,62 @@ DuplexedTrackIf::DuplexedTrackIf(Service *service, int pool_size, int ops_fd
 
 StateFlowBase::Action DuplexedTrackIf::entry()
 {
-  auto *p = message()->data();
-  auto fd = p->packet_header.send_long_preamble ?
-    fd_prog_ : fd_ops_;
-  HASSERT(fd >= 0);
-  int ret = ::write(fd, p, sizeof(*p));
-  if (ret < 0)
+  batch_[0] = static_cast<Buffer<dcc::Packet> *>(message());
+  batchSize_ = 1;
+  batchIndex_ = 0;
+  {
+    AtomicHolder h(this);
+    unsigned priority;
+    while (batchSize_ < MAX_BATCH_SIZE)
+    {
+      QMember *next = queue_next(&priority);
+      if (!next)
+      {
+        break;
+      }
+      batch_[batchSize_++] = static_cast<Buffer<dcc::Packet> *>(next);
+    }
+  }
+  return call_immediately(STATE(write_batch));
+}
+
+StateFlowBase::Action DuplexedTrackIf::write_batch()
+{
+  while (batchIndex_ < batchSize_)
   {
-    HASSERT(errno == ENOSPC);
-    ::ioctl(fd, CAN_IOC_WRITE_ACTIVE, this);
-    return wait();
+    auto fd = get_fd(batch_[batchIndex_]->data());
+    HASSERT(fd >= 0);
+    size_t count = 0;
+    while (batchIndex_ + count < batchSize_ &&
+           get_fd(batch_[batchIndex_ + count]->data()) == fd)
+    {
+      packets_[count] = batch_[batchIndex_ + count]->data();
+      count++;
+    }
+    TrackPacketBatch request = {packets_, count};
+    int ret = ::ioctl(fd, TRACK_IOC_WRITE_PACKETS, &request);
+    if (ret < 0)
+    {
+      HASSERT(errno == ENOSPC);
+      ret = 0;
+    }
+    packets_written.inc(ret);
+    // release the packets which have been consumed, the first entry of the
+    // batch is the current message and will be released on exit.
+    for (int index = 0; index < ret; index++, batchIndex_++)
+    {
+      TRACE_EVENT(TraceEvent::TRACK_WRITE, packets_[index]->feedback_key, fd);
+      if (batchIndex_)
+      {
+        batch_[batchIndex_]->unref();
+      }
+    }
+    if ((size_t)ret < count)
+    {
+      write_waits.inc();
+      ::ioctl(fd, CAN_IOC_WRITE_ACTIVE, this);
+      return wait();
+    }
   }
   return finish();
 }
@@ -16,14 +16,24 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 **********************************************************************/
 
 #include "MonitoredHBridge.h"
+#include <algorithm>
 #include <dcc/ProgrammingTrackBackend.hxx>
 #include <json.hpp>
-#include <numeric>
+#include <StateBroadcast.h>
 #include <StatusLED.h>
 
 namespace esp32cs
 {
 
+static_assert(CONFIG_ADC_AVERAGE_READING_COUNT > 4 &&
+              CONFIG_ADC_AVERAGE_READING_COUNT <= UINT8_MAX,
+              "ADC_AVERAGE_READING_COUNT must be between 5 and 255");
+
+static_assert(CONFIG_DCC_PROG_ACK_MIN_PULSE_US <=
+              CONFIG_DCC_PROG_ACK_MAX_PULSE_US,
+              "DCC_PROG_ACK_MIN_PULSE_US must not exceed "
+              "DCC_PROG_ACK_MAX_PULSE_US");
+
 HBridgeShortDetector::HBridgeShortDetector(openlcb::Node *node
                                          , const adc1_channel_t senseChannel
                                          , const Gpio *enablePin
@@ -83,6 +93,15 @@ HBridgeShortDetector::HBridgeShortDetector(openlcb::Node *node
   configure();
 }
 
+HBridgeShortDetector::~HBridgeShortDetector()
+{
+  if (sampleTimer_)
+  {
+    esp_timer_stop(sampleTimer_);
+    esp_timer_delete(sampleTimer_);
+  }
+}
+
 string HBridgeShortDetector::getState()
 {
   switch (state_)
@@ -161,82 +180,216 @@ void HBridgeShortDetector::configure()
     LOG(INFO, "[%s] Prog ACK: %u/4096 (%.2f mA)", name_.c_str(), progAckLimit_
       , ((progAckLimit_ * maxMilliAmps_) / 4096.0f));
   }
+
+  esp_timer_create_args_t timer_args;
+  timer_args.callback = [](void *arg)
+  {
+    static_cast<HBridgeShortDetector *>(arg)->sample();
+  };
+  timer_args.arg = this;
+  timer_args.dispatch_method = ESP_TIMER_TASK;
+  timer_args.name = name_.c_str();
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sampleTimer_));
+  start_sampling(CONFIG_DCC_HBRIDGE_SAMPLE_RATE);
+}
+
+void HBridgeShortDetector::start_sampling(uint32_t rate)
+{
+  if (overCurrentTripSamples_)
+  {
+    // the timer is already running, restart it only if the rate changes.
+    if (sampleRate_ == rate)
+    {
+      return;
+    }
+    esp_timer_stop(sampleTimer_);
+  }
+  sampleRate_ = rate;
+  overCurrentTripSamples_ =
+    std::max((CONFIG_DCC_HBRIDGE_OVERCURRENT_TRIP_MS * rate) / 1000, 1U);
+  ESP_ERROR_CHECK(esp_timer_start_periodic(sampleTimer_, 1000000ULL / rate));
+  LOG(VERBOSE, "[%s] Sampling at %u Hz, over-current shutdown after %u samples"
+    , name_.c_str(), rate, overCurrentTripSamples_.load());
 }
 
-void HBridgeShortDetector::poll_33hz(openlcb::WriteHelper *helper, Notifiable *done)
+void HBridgeShortDetector::enable_prog_response(bool enable)
+{
+  // the acknowledgement state is reset by sample() since it runs on the
+  // esp_timer task.
+  progEnable_ = enable;
+  start_sampling(enable ? CONFIG_DCC_PROG_ACK_SAMPLE_RATE
+                        : CONFIG_DCC_HBRIDGE_SAMPLE_RATE);
+}
+
+void HBridgeShortDetector::sample()
 {
-  vector<int> samples;
+  uint16_t reading = adc1_get_raw(channel_);
+
+  // update the running averages by replacing the samples which are leaving
+  // each window with the new sample.
+  uint8_t peak_index = (sampleIndex_ + CONFIG_ADC_AVERAGE_READING_COUNT -
+                        PEAK_SAMPLE_COUNT) % CONFIG_ADC_AVERAGE_READING_COUNT;
+  peakSum_ = peakSum_ + reading - samples_[peak_index];
+  sampleSum_ = sampleSum_ + reading - samples_[sampleIndex_];
+  samples_[sampleIndex_] = reading;
+  if (++sampleIndex_ >= CONFIG_ADC_AVERAGE_READING_COUNT)
+  {
+    sampleIndex_ = 0;
+  }
+  lastReading_ = sampleSum_ / CONFIG_ADC_AVERAGE_READING_COUNT;
+  uint32_t peak = peakSum_ / PEAK_SAMPLE_COUNT;
+  if (peak > peakReading_.load())
+  {
+    peakReading_ = peak;
+  }
+
+  if (progEnable_)
+  {
+    if (!ackActive_)
+    {
+      ackActive_ = true;
+      ackStart_ = 0;
+      ackBaseline_ = 0;
+    }
+    detect_ack(peak);
+  }
+  else
+  {
+    ackActive_ = false;
+  }
+
+  if (!enablePin_->is_set())
+  {
+    shutdownSamples_ = 0;
+    overCurrentSamples_ = 0;
+    return;
+  }
 
-  // collect samples from ADC
-  while(samples.size() < adcSampleCount_)
+  if (reading < shutdownLimit_)
   {
-    samples.push_back(adc1_get_raw(channel_));
-    ets_delay_us(1);
+    shutdownSamples_ = 0;
   }
-  // average the collected samples
-  lastReading_ = (std::accumulate(samples.begin(), samples.end(), 0) / samples.size());
+  else if (++shutdownSamples_ >= SHUTDOWN_SAMPLE_COUNT)
+  {
+    // the current is above the shutdown limit, disable the h-bridge
+    // immediately rather than waiting for the average to catch up.
+    enablePin_->clr();
+    tripState_ = STATE_SHUTDOWN;
+    return;
+  }
+
+  if (lastReading_ < overCurrentLimit_)
+  {
+    overCurrentSamples_ = 0;
+  }
+  else if (++overCurrentSamples_ >= overCurrentTripSamples_)
+  {
+    enablePin_->clr();
+    tripState_ = STATE_OVERCURRENT;
+  }
+}
+
+void HBridgeShortDetector::detect_ack(uint32_t reading)
+{
+  uint32_t baseline = ackBaseline_ / ACK_BASELINE_WEIGHT;
+  int64_t now = esp_timer_get_time();
+  if (!ackStart_)
+  {
+    if (reading >= baseline + progAckLimit_)
+    {
+      ackStart_ = now;
+    }
+    else
+    {
+      // follow slow changes of the idle current draw of the decoder.
+      ackBaseline_ += reading;
+      ackBaseline_ -= baseline;
+    }
+    return;
+  }
+  int64_t width = now - ackStart_;
+  if (reading < baseline + (progAckLimit_ >> 1))
+  {
+    // the pulse has ended, check that it was the expected length.
+    ackStart_ = 0;
+    if (width >= CONFIG_DCC_PROG_ACK_MIN_PULSE_US &&
+        width <= CONFIG_DCC_PROG_ACK_MAX_PULSE_US)
+    {
+      // the backend must be notified from its own executor.
+      auto backend = Singleton<ProgrammingTrackBackend>::instance();
+      backend->service()->executor()->add(
+        new CallbackExecutable([backend]()
+        {
+          backend->notify_service_mode_ack();
+        }));
+    }
+  }
+  else if (width > CONFIG_DCC_PROG_ACK_MAX_PULSE_US)
+  {
+    // the current draw has increased for longer than an acknowledgement,
+    // use it as the new baseline.
+    ackStart_ = 0;
+    ackBaseline_ = reading * ACK_BASELINE_WEIGHT;
+  }
+}
+
+void HBridgeShortDetector::poll_33hz(openlcb::WriteHelper *helper, Notifiable *done)
+{
+  // collect the results of the sampling since the last poll.
+  uint32_t peak = peakReading_.exchange(0);
+  uint8_t trip = tripState_.exchange(0);
 
-  // if this is the PROG track check up front if we have a short or ACK.
+  // if this is the PROG track check up front if we have a short, ACKs are
+  // reported by detect_ack.
   if (isProgTrack_ && progEnable_)
   {
-    LOG(VERBOSE, "[%s] reading: %d", name_.c_str(), lastReading_);
+    LOG(VERBOSE, "[%s] reading: %d, peak: %d", name_.c_str(), lastReading_
+      , peak);
     auto backend = Singleton<ProgrammingTrackBackend>::instance();
-    if (lastReading_ >= overCurrentLimit_)
+    if (trip || peak >= overCurrentLimit_)
     {
       // note that only over current is checked here since this should be
       // triggered before the shutdown current has been reached.
       backend->notify_service_mode_short();
     }
-    else if (lastReading_ >= progAckLimit_)
-    {
-      // send the ack over to the backend since it is over the limit.
-      backend->notify_service_mode_ack();
-    }
   }
 
   uint8_t previous_state = state_;
 
-  if (lastReading_ >= shutdownLimit_)
+  if (trip == STATE_SHUTDOWN)
   {
-    // If the average sample exceeds the shutdown limit (~90% typically)
-    // trigger an immediate shutdown.
+    // The sampling detected a current above the shutdown limit (~90%
+    // typically) and has already disabled the h-bridge.
     LOG_ERROR("[%s] Shutdown threshold breached %6.2f mA (raw: %d / %d)"
             , name_.c_str()
-            , getUsage() / 1000.0f
-            , lastReading_
+            , (peak * maxMilliAmps_) / 4096.0f
+            , peak
             , shutdownLimit_);
-    enablePin_->clr();
     state_ = STATE_SHUTDOWN;
 #if CONFIG_STATUS_LED
     Singleton<StatusLED>::instance()->setStatusLED((StatusLED::LED)targetLED_
                                                  , StatusLED::COLOR::RED_BLINK);
 #endif // CONFIG_STATUS_LED
   }
-  else if (lastReading_ >= overCurrentLimit_)
+  else if (trip == STATE_OVERCURRENT)
   {
-    // If we have at least a couple averages that are over the soft limit
-    // trigger an immediate shutdown as a short is likely to have occurred.
-    if(overCurrentCheckCount_++ >= overCurrentRetryCount_)
-    {
-      // disable the h-bridge output
-      enablePin_->clr();
-      LOG_ERROR("[%s] Overcurrent detected %6.2f mA (raw: %d / %d)"
-              , name_.c_str()
-              , getUsage() / 1000.0f
-              , lastReading_
-              , overCurrentLimit_);
-      state_ = STATE_OVERCURRENT;
+    // The sampling detected that the average current remained above the
+    // soft limit and has already disabled the h-bridge.
+    LOG_ERROR("[%s] Overcurrent detected %6.2f mA (raw: %d / %d)"
+            , name_.c_str()
+            , (peak * maxMilliAmps_) / 4096.0f
+            , peak
+            , overCurrentLimit_);
+    state_ = STATE_OVERCURRENT;
 #if CONFIG_STATUS_LED
-      Singleton<StatusLED>::instance()->setStatusLED((StatusLED::LED)targetLED_
-                                                   , StatusLED::COLOR::RED);
+    Singleton<StatusLED>::instance()->setStatusLED((StatusLED::LED)targetLED_
+                                                 , StatusLED::COLOR::RED);
 #endif // CONFIG_STATUS_LED
-    }
   }
   else
   {
     if (enablePin_->is_set())
     {
-      overCurrentCheckCount_ = 0;
       state_ = STATE_ON;
 #if CONFIG_STATUS_LED
       // check if we are over the warning limit and update the LED accordingly.
@@ -269,6 +422,8 @@ void HBridgeShortDetector::poll_33hz(openlcb::WriteHelper *helper, Notifiable *d
   bool async_event_req = false;
   if (previous_state != state_)
   {
+    StateBroadcast::publish(StateType::TRACK_POWER, isProgTrack_
+                          , get_state_for_dccpp());
     if (previous_state == STATE_SHUTDOWN || state_ == STATE_SHUTDOWN)
     {
       shutdownProducer_.SendEventReport(helper, done);
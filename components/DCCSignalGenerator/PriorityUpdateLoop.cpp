@@ -0,0 +1,308 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "PriorityUpdateLoop.h"
+
+#include <algorithm>
+#include <dcc/Loco.hxx>
+#include <Metrics.h>
+#include <StateBroadcast.h>
+#include <Trace.h>
+#include <utils/logging.h>
+
+namespace esp32cs
+{
+
+/// Time between refresh packets sent for the same refresh source.
+static Histogram refresh_interval("dcc_refresh_interval_ms"
+                                , "Time between refresh packets of a source"
+                                , {50, 100, 200, 500, 1000, 2000, 5000});
+
+/// Number of idle packets generated due to no refresh source being due.
+static Counter refresh_idle("dcc_refresh_idle_total"
+                          , "Idle packets sent by the refresh loop");
+
+PriorityUpdateLoop::PriorityUpdateLoop(Service *service
+                                     , dcc::PacketFlowInterface *track_send)
+  : StateFlow<Buffer<dcc::Packet>, QList<1>>(service)
+  , trackSend_(track_send)
+{
+}
+
+bool PriorityUpdateLoop::add_refresh_source(dcc::PacketSource *source
+                                          , unsigned priority)
+{
+  // accessory and e-stop sources are NonTrainPacketSource instances which
+  // always report address zero.
+  bool train = source->legacy_address() != 0;
+  AtomicHolder h(this);
+  if (priority >= EXCLUSIVE_MIN_PRIORITY)
+  {
+    // The source is always registered, if there is a higher priority source
+    // already present the caller is expected to remove it.
+    bool highest = std::none_of(exclusiveSources_.begin()
+                              , exclusiveSources_.end()
+    , [priority](const ExclusiveSource &entry)
+      {
+        return entry.priority > priority;
+      });
+    exclusiveSources_.push_back({source, priority});
+    return highest;
+  }
+  long long now = os_get_time_monotonic();
+  refreshSources_.push_back({source, 0, now, train, train});
+  return true;
+}
+
+void PriorityUpdateLoop::remove_refresh_source(dcc::PacketSource *source)
+{
+  AtomicHolder h(this);
+  exclusiveSources_.erase(
+    std::remove_if(exclusiveSources_.begin(), exclusiveSources_.end()
+    , [source](const ExclusiveSource &entry)
+      {
+        return entry.source == source;
+      })
+  , exclusiveSources_.end());
+  refreshSources_.erase(
+    std::remove_if(refreshSources_.begin(), refreshSources_.end()
+    , [source](const RefreshSource &entry)
+      {
+        return entry.source == source;
+      })
+  , refreshSources_.end());
+
+  // compact the pending updates to drop any for this source.
+  size_t count = 0;
+  for (size_t index = 0; index < pendingCount_; index++)
+  {
+    const PendingUpdate &update =
+      pending_[(pendingHead_ + index) % MAX_PENDING_UPDATES];
+    if (update.source != source)
+    {
+      pending_[(pendingHead_ + count) % MAX_PENDING_UPDATES] = update;
+      count++;
+    }
+  }
+  pendingCount_ = count;
+}
+
+void PriorityUpdateLoop::notify_update(dcc::PacketSource *source
+                                     , unsigned code)
+{
+  TRACE_EVENT(TraceEvent::UPDATE_NOTIFY, source->legacy_address(), code);
+  // every speed or function change passes through here regardless of which
+  // throttle made the change.
+  if (code != dcc::DccTrainUpdateCode::REFRESH)
+  {
+    StateBroadcast::publish_loco(source);
+  }
+  AtomicHolder h(this);
+  RefreshSource *entry = find_refresh_source(source);
+  if (entry)
+  {
+    entry->lastUpdated = os_get_time_monotonic();
+  }
+
+  // If there is already a pending update for the same source and code there
+  // is no need to add another as the source will generate the packet based on
+  // the latest state.
+  for (size_t index = 0; index < pendingCount_; index++)
+  {
+    const PendingUpdate &update =
+      pending_[(pendingHead_ + index) % MAX_PENDING_UPDATES];
+    if (update.source == source && update.code == code)
+    {
+      return;
+    }
+  }
+  if (pendingCount_ < MAX_PENDING_UPDATES)
+  {
+    pending_[(pendingHead_ + pendingCount_) % MAX_PENDING_UPDATES] =
+      {source, code};
+    pendingCount_++;
+  }
+  else
+  {
+    // The source has been marked as recently updated so it will receive the
+    // next available refresh slots.
+    LOG(VERBOSE, "[DCC] Pending update queue is full, dropping update");
+  }
+}
+
+StateFlowBase::Action PriorityUpdateLoop::entry()
+{
+  dcc::Packet *packet = message()->data();
+  dcc::PacketSource *source = nullptr;
+  unsigned code = dcc::DccTrainUpdateCode::REFRESH;
+  {
+    AtomicHolder h(this);
+    if (!exclusiveSources_.empty())
+    {
+      auto exclusive = std::max_element(exclusiveSources_.begin()
+                                      , exclusiveSources_.end()
+      , [](const ExclusiveSource &a, const ExclusiveSource &b)
+        {
+          return a.priority < b.priority;
+        });
+      // The PROG track packets do not reach the OPS track so every
+      // PROG_REFRESH_PERIOD slot is given to the OPS track while in service
+      // mode. An e-stop takes these slots, otherwise they are used for user
+      // actions or background refresh.
+      if (exclusive->priority < PROGRAMMING_PRIORITY ||
+          ++progSlots_ < PROG_REFRESH_PERIOD)
+      {
+        source = exclusive->source;
+      }
+      else
+      {
+        progSlots_ = 0;
+        auto estop = std::find_if(exclusiveSources_.begin()
+                                , exclusiveSources_.end()
+        , [](const ExclusiveSource &entry)
+          {
+            return entry.priority == ESTOP_PRIORITY;
+          });
+        if (estop != exclusiveSources_.end())
+        {
+          source = estop->source;
+        }
+      }
+    }
+    if (!source && pendingCount_)
+    {
+      source = pending_[pendingHead_].source;
+      code = pending_[pendingHead_].code;
+      pendingHead_ = (pendingHead_ + 1) % MAX_PENDING_UPDATES;
+      pendingCount_--;
+      RefreshSource *entry = find_refresh_source(source);
+      if (entry)
+      {
+        entry->lastSent = os_get_time_monotonic();
+      }
+    }
+  }
+
+  if (source)
+  {
+    source->get_next_packet(code, packet);
+    TRACE_EVENT(TraceEvent::UPDATE_SEND, packet->feedback_key, code);
+  }
+  else
+  {
+    fill_refresh_packet(os_get_time_monotonic(), packet);
+  }
+
+  // We pass on the filled packet to the track processor.
+  trackSend_->send(transfer_message());
+  return exit();
+}
+
+void PriorityUpdateLoop::fill_refresh_packet(long long now
+                                           , dcc::Packet *packet)
+{
+  dcc::PacketSource *source = nullptr;
+  bool speed = false;
+  long long interval = 0;
+  {
+    AtomicHolder h(this);
+    RefreshSource *selected = nullptr;
+    unsigned long long best = 0;
+    for (auto &entry : refreshSources_)
+    {
+      long long since_sent = now - entry.lastSent;
+      if (since_sent < MIN_REFRESH_INTERVAL)
+      {
+        continue;
+      }
+      long long since_updated = now - entry.lastUpdated;
+      uint8_t weight = NORMAL_WEIGHT;
+      if (since_updated < ACTIVE_PERIOD)
+      {
+        weight = ACTIVE_WEIGHT;
+      }
+      else if (since_updated > IDLE_PERIOD)
+      {
+        weight = IDLE_WEIGHT;
+      }
+      unsigned long long score = (unsigned long long)since_sent * weight;
+      if (!selected || score > best)
+      {
+        selected = &entry;
+        best = score;
+      }
+    }
+    if (selected)
+    {
+      source = selected->source;
+      // only locomotives alternate between speed and function refresh,
+      // accessory sources always receive the refresh code.
+      speed = selected->train && selected->speedNext;
+      selected->speedNext = selected->train && !selected->speedNext;
+      if (selected->lastSent)
+      {
+        interval = now - selected->lastSent;
+      }
+      selected->lastSent = now;
+    }
+  }
+
+  if (interval)
+  {
+    refresh_interval.observe(NSEC_TO_MSEC(interval));
+  }
+
+  if (!source)
+  {
+    // Either there are no refresh sources or all of them have been sent a
+    // packet very recently, send an idle packet instead.
+    packet->set_dcc_idle();
+    refresh_idle.inc();
+  }
+  else if (speed)
+  {
+    source->get_next_packet(dcc::DccTrainUpdateCode::SPEED, packet);
+    // This is a refresh packet rather than a user action so it does not need
+    // the additional repeats.
+    packet->packet_header.rept_count = 0;
+  }
+  else
+  {
+    source->get_next_packet(dcc::DccTrainUpdateCode::REFRESH, packet);
+  }
+  if (source)
+  {
+    TRACE_EVENT(TraceEvent::REFRESH_SEND, packet->feedback_key, speed);
+  }
+}
+
+PriorityUpdateLoop::RefreshSource *PriorityUpdateLoop::find_refresh_source(
+  dcc::PacketSource *source)
+{
+  auto it = std::find_if(refreshSources_.begin(), refreshSources_.end()
+  , [source](const RefreshSource &entry)
+    {
+      return entry.source == source;
+    });
+  if (it != refreshSources_.end())
+  {
+    return &(*it);
+  }
+  return nullptr;
+}
+
+} // namespace esp32cs
@@ -17,7 +17,9 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 
 #include "RMTTrackDevice.h"
 #include "sdkconfig.h"
+#include "Trace.h"
 
+#include <algorithm>
 #include <dcc/DccDebug.hxx>
 #include <soc/gpio_struct.h>
 
@@ -161,6 +163,38 @@ static constexpr DRAM_ATTR uint8_t PACKET_BIT_MASK[] =
   0x08, 0x04, 0x02, 0x01  //
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Lookup table of the RMT items for each possible packet byte value. Each
+// entry holds the eight data bits (MSB first) followed by the end of byte
+// marker. This table is shared by all track devices as the bit timing is
+// identical and is populated by the first RMTTrackDevice constructor.
+///////////////////////////////////////////////////////////////////////////////
+static DRAM_ATTR rmt_item32_t DCC_RMT_BYTE_ITEMS[256][9];
+
+///////////////////////////////////////////////////////////////////////////////
+// Populates the DCC_RMT_BYTE_ITEMS lookup table.
+///////////////////////////////////////////////////////////////////////////////
+static void init_byte_lookup_table()
+{
+  static bool initialized = false;
+  if (initialized)
+  {
+    return;
+  }
+  for (uint16_t value = 0; value < 256; value++)
+  {
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      DCC_RMT_BYTE_ITEMS[value][bit].val =
+        value & PACKET_BIT_MASK[bit] ? DCC_RMT_ONE_BIT.val
+                                     : DCC_RMT_ZERO_BIT.val;
+    }
+    // end of byte marker
+    DCC_RMT_BYTE_ITEMS[value][8].val = DCC_RMT_ZERO_BIT.val;
+  }
+  initialized = true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // RMTTrackDevice constructor.
 //
@@ -184,7 +218,24 @@ RMTTrackDevice::RMTTrackDevice(const char *name
                              , channel_(channel)
                              , dccPreambleBitCount_(dccPreambleBitCount)
                              , railcomDriver_(railcomDriver)
-                             , packetQueue_(DeviceBuffer<dcc::Packet>::create(packet_queue_len))
+                             , packetQueue_(DeviceBuffer<QueuedPacket>::create(packet_queue_len))
+                             , packetsSent_("dcc_track_packets_sent_total"
+                                          , "DCC packets transmitted"
+                                          , StringPrintf("track=\"%s\"", name))
+                             , idlePackets_("dcc_track_idle_packets_total"
+                                          , "DCC idle packets transmitted"
+                                          , StringPrintf("track=\"%s\"", name))
+                             , queueFull_("dcc_track_queue_full_total"
+                                        , "DCC packets rejected due to a full queue"
+                                        , StringPrintf("track=\"%s\"", name))
+                             , queueDepth_("dcc_track_queue_depth"
+                                         , "DCC packets waiting to be transmitted"
+                                         , StringPrintf("track=\"%s\"", name)
+                                         , [this]()
+                                           {
+                                             AtomicHolder l(&packetQueueLock_);
+                                             return (int32_t)packetQueue_->pending();
+                                           })
 {
   uint16_t maxBitCount = dccPreambleBitCount_             // preamble bits
                         + 1                               // packet start bit
@@ -192,11 +243,17 @@ RMTTrackDevice::RMTTrackDevice(const char *name
                         +  dcc::Packet::MAX_PAYLOAD       // end of byte bits
                         + 1                               // end of packet bit
                         + 1;                              // RMT extra bit
-  HASSERT(maxBitCount <= MAX_RMT_BITS);
+  HASSERT(maxBitCount <= MAX_DCC_PACKET_ITEMS);
 
   uint8_t memoryBlocks = (maxBitCount / RMT_MEM_ITEM_NUM) + 1;
   HASSERT(memoryBlocks <= MAX_RMT_MEMORY_BLOCKS);
 
+  // Pre-encode the DCC IDLE packet since it will be sent whenever there is
+  // nothing in the packet queue.
+  init_byte_lookup_table();
+  idlePacket_.length =
+    encode_packet(dcc::Packet(dcc::Packet::DCC_IDLE()), &idlePacket_);
+
   LOG(INFO
     , "[%s] DCC config: zero: %duS, one: %duS, preamble-bits: %d, wave: %s"
     , name_, CONFIG_DCC_RMT_TICKS_ZERO_PULSE, CONFIG_DCC_RMT_TICKS_ONE_PULSE
@@ -261,8 +318,8 @@ RMTTrackDevice::RMTTrackDevice(const char *name
 // ESP VFS callback for ::write()
 //
 // This will write *ONE* dcc::Packet to either the OPS or PROG packet queue. If
-// there is no space in the packet queue the packet will be rejected and errno
-// set to ENOSPC.
+// there is no space in the packet queue or packet cache the packet will be
+// rejected and errno set to ENOSPC.
 //
 // NOTE: At this time Marklin packets will be actively rejected.
 ///////////////////////////////////////////////////////////////////////////////
@@ -282,32 +339,92 @@ ssize_t RMTTrackDevice::write(int fd, const void * data, size_t size)
     return -1;
   }
 
+  return write_packets(&sourcePacket, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes multiple dcc::Packets to the packet queue.
+//
+// Each packet is encoded (or found in the packet cache) before it is added to
+// the packet queue so that the RMT ISR only needs to copy the encoded data.
+// Marklin packets are consumed but discarded.
+//
+// Returns the number of packets consumed from the start of packets or -1 with
+// errno set to ENOSPC if the packet queue or packet cache is full.
+///////////////////////////////////////////////////////////////////////////////
+ssize_t RMTTrackDevice::write_packets(const dcc::Packet * const *packets
+                                    , size_t count)
+{
+  size_t available;
+  {
+    AtomicHolder l(&packetQueueLock_);
+    available = packetQueue_->space();
+  }
+  size_t consumed = 0;
+  while (consumed < count && available)
   {
+    const dcc::Packet *packet = packets[consumed];
+    if (packet->packet_header.is_marklin)
+    {
+      // drop marklin packets as unsupported for now.
+      consumed++;
+      continue;
+    }
+    // encoding is done without holding the packet queue lock.
+    EncodedPacket *encoded = acquire_encoded_packet(*packet);
+    if (!encoded)
+    {
+      // all cache entries are queued or being transmitted.
+      break;
+    }
     AtomicHolder l(&packetQueueLock_);
-    dcc::Packet* writePacket;
-    if (packetQueue_->space() &&
-        packetQueue_->data_write_pointer(&writePacket))
+    QueuedPacket *writePacket;
+    if (!packetQueue_->space() ||
+        !packetQueue_->data_write_pointer(&writePacket))
     {
-      memcpy(writePacket, data, size);
-      packetQueue_->advance(1);
-      return 1;
+      release_encoded_packet(encoded);
+      break;
     }
+    writePacket->encoded = encoded;
+    writePacket->rept_count = packet->packet_header.rept_count;
+    writePacket->feedback_key = packet->feedback_key;
+    packetQueue_->advance(1);
+    available--;
+    consumed++;
   }
-  // packet queue is full!
-  errno = ENOSPC;
-  return -1;
+  if (!consumed && count)
+  {
+    // packet queue is full!
+    queueFull_.inc();
+    errno = ENOSPC;
+    return -1;
+  }
+  return consumed;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // ESP VFS callback for ::ioctl()
 //
 // When the cmd is CAN_IOC_WRITE_ACTIVE the packet queue will be checked. When
-// there is no space in the queue the Notifiable will be stored to be called
-// after the next DCC packet has been transmitted. Any existing Notifiable will
+// there is no space in the queue or all packet cache entries are in use the
+// Notifiable will be stored to be called after the next DCC packet has been
+// transmitted. Any existing Notifiable will
 // be called to requeue themselves if necessary.
+//
+// When the cmd is TRACK_IOC_WRITE_PACKETS the provided packets will be added
+// to the packet queue, the number of packets consumed will be returned.
 ///////////////////////////////////////////////////////////////////////////////
 int RMTTrackDevice::ioctl(int fd, int cmd, va_list args)
 {
+  // Attempt to write multiple packets to the queue
+  if (cmd == TRACK_IOC_WRITE_PACKETS)
+  {
+    const TrackPacketBatch *batch =
+      reinterpret_cast<const TrackPacketBatch *>(va_arg(args, uintptr_t));
+    HASSERT(batch);
+    return write_packets(batch->packets, batch->count);
+  }
+
   // Attempt to write a Packet to the queue
   if (IOC_TYPE(cmd) == CAN_IOC_MAGIC && IOC_SIZE(cmd) == NOTIFIABLE_TYPE &&
       cmd == CAN_IOC_WRITE_ACTIVE)
@@ -316,7 +433,12 @@ int RMTTrackDevice::ioctl(int fd, int cmd, va_list args)
     HASSERT(n);
     {
       AtomicHolder l(&packetQueueLock_);
-      if (!packetQueue_->space())
+      if (!packetQueue_->space() ||
+          std::none_of(packetCache_, packetCache_ + PACKET_CACHE_SIZE
+                     , [](const EncodedPacket &entry)
+                       {
+                         return !entry.refs;
+                       }))
       {
         // stash the notifiable so we can call it later when there is space
         std::swap(n, notifiable_);
@@ -351,12 +473,12 @@ void RMTTrackDevice::rmt_transmit_complete()
   // send the packet to the RMT, note not using memcpy for the packet as this
   // directly accesses hardware registers.
   RMT.apb_conf.fifo_mask = RMT_DATA_MODE_MEM;
-  for(uint32_t index = 0; index < pktLength_; index++)
+  for(uint32_t index = 0; index < packet_->length; index++)
   {
-    RMTMEM.chan[channel_].data32[index].val = packet_[index].val;
+    RMTMEM.chan[channel_].data32[index].val = packet_->data[index].val;
   }
   // RMT marker for "end of data"
-  RMTMEM.chan[channel_].data32[pktLength_].val = 0;
+  RMTMEM.chan[channel_].data32[packet_->length].val = 0;
   // start transmit
   RMT.conf_ch[channel_].conf1.mem_rd_rst = 1;
   RMT.conf_ch[channel_].conf1.mem_owner = RMT_MEM_OWNER_TX;
@@ -374,14 +496,8 @@ void RMTTrackDevice::send(Buffer<dcc::Packet> *b, unsigned prio)
   // discard.
   if (!b->data()->packet_header.is_marklin)
   {
-    AtomicHolder l(&packetQueueLock_);
-    dcc::Packet* writePacket;
-    if (packetQueue_->space() &&
-        packetQueue_->data_write_pointer(&writePacket))
-    {
-      memcpy(writePacket, b->data(), b->size());
-      packetQueue_->advance(1);
-    }
+    const dcc::Packet *packet = b->data();
+    write_packets(&packet, 1);
   }
   b->unref();
 }
@@ -391,6 +507,8 @@ void RMTTrackDevice::send(Buffer<dcc::Packet> *b, unsigned prio)
 ///////////////////////////////////////////////////////////////////////////////
 void RMTTrackDevice::encode_next_packet()
 {
+  packetsSent_.inc();
+
   // Check if we need to encode the next packet or if we still have at least
   // one repeat left of the current packet.
   if (--pktRepeatCount_ >= 0)
@@ -399,14 +517,27 @@ void RMTTrackDevice::encode_next_packet()
   }
   // attempt to fetch a packet from the queue or use an idle packet
   Notifiable* n = nullptr;
-  dcc::Packet packet{dcc::Packet::DCC_IDLE()};
+  QueuedPacket packet;
+  bool have_packet = false;
   {
     AtomicHolder l(&packetQueueLock_);
+    // the previous packet has been transmitted, release its cache entry.
+    if (packet_ != &idlePacket_)
+    {
+      release_encoded_packet(packet_);
+      // a cache entry may have been freed, check if we have a pending
+      // notifiable to wake up.
+      std::swap(n, notifiable_);
+    }
     if (packetQueue_->get(&packet, 1))
     {
+      have_packet = true;
       // since we removed a packet from the queue, check if we have a pending
       // notifiable to wake up.
-      std::swap(n, notifiable_);
+      if (!n)
+      {
+        std::swap(n, notifiable_);
+      }
     }
   }
   if (n)
@@ -415,34 +546,116 @@ void RMTTrackDevice::encode_next_packet()
   }
   // TODO: add encoding for Marklin-Motorola
 
+  if (have_packet)
+  {
+    // the packet was encoded before it was queued.
+    packet_ = packet.encoded;
+    // record the repeat count
+    pktRepeatCount_ = packet.rept_count;
+    TRACE_EVENT(TraceEvent::RMT_ENCODE, packet.feedback_key
+              , channel_ | (packet.rept_count << 8));
+    railcomDriver_->set_feedback_key(packet.feedback_key);
+  }
+  else
+  {
+    packet_ = &idlePacket_;
+    pktRepeatCount_ = 0;
+    idlePackets_.inc();
+    railcomDriver_->set_feedback_key(0);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Retrieves the pre-encoded RMT data for the packet from the cache, if the
+// packet is not in the cache it will be encoded into the oldest cache entry
+// which is not in use. The returned entry holds a reference which must be
+// released via release_encoded_packet.
+//
+// Returns nullptr if all cache entries are in use.
+///////////////////////////////////////////////////////////////////////////////
+RMTTrackDevice::EncodedPacket *RMTTrackDevice::acquire_encoded_packet(
+  const dcc::Packet &packet)
+{
+  EncodedPacket *entry = nullptr;
+  {
+    AtomicHolder l(&packetQueueLock_);
+    for (uint8_t index = 0; index < PACKET_CACHE_SIZE; index++)
+    {
+      EncodedPacket &cached = packetCache_[index];
+      if (cached.length && cached.dlc == packet.dlc &&
+          !memcmp(cached.payload, packet.payload, packet.dlc))
+      {
+        cached.refs++;
+        return &cached;
+      }
+    }
+    for (uint8_t count = 0; count < PACKET_CACHE_SIZE && !entry; count++)
+    {
+      EncodedPacket *candidate = &packetCache_[packetCacheNext_++];
+      if (packetCacheNext_ >= PACKET_CACHE_SIZE)
+      {
+        packetCacheNext_ = 0;
+      }
+      if (!candidate->refs)
+      {
+        // hide the entry from lookups until it has been encoded.
+        entry = candidate;
+        entry->refs = 1;
+        entry->length = 0;
+      }
+    }
+  }
+  if (entry)
+  {
+    uint32_t length = encode_packet(packet, entry);
+    AtomicHolder l(&packetQueueLock_);
+    entry->length = length;
+  }
+  return entry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Releases a reference on a packet cache entry, packetQueueLock_ must be held.
+///////////////////////////////////////////////////////////////////////////////
+void RMTTrackDevice::release_encoded_packet(EncodedPacket *encoded)
+{
+  if (encoded != &idlePacket_)
+  {
+    encoded->refs--;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a dcc::Packet into RMT format, returns the number of RMT items.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t RMTTrackDevice::encode_packet(const dcc::Packet &packet
+                                 , EncodedPacket *encoded)
+{
+  uint32_t length;
   // encode the preamble bits
-  for (pktLength_ = 0; pktLength_ < dccPreambleBitCount_; pktLength_++)
+  for (length = 0; length < dccPreambleBitCount_; length++)
   {
-    packet_[pktLength_].val = DCC_RMT_ONE_BIT.val;
+    encoded->data[length].val = DCC_RMT_ONE_BIT.val;
   }
   // start of payload marker
-  packet_[pktLength_++].val = DCC_RMT_ZERO_BIT.val;
-  // encode the packet bits
+  encoded->data[length++].val = DCC_RMT_ZERO_BIT.val;
+  // encode the packet bytes including the end of byte marker
   for (uint8_t dlc = 0; dlc < packet.dlc; dlc++)
   {
-    for(uint8_t bit = 0; bit < 8; bit++)
-    {
-      packet_[pktLength_++].val =
-        packet.payload[dlc] & PACKET_BIT_MASK[bit] ?
-          DCC_RMT_ONE_BIT.val : DCC_RMT_ZERO_BIT.val;
-    }
-    // end of byte marker
-    packet_[pktLength_++].val = DCC_RMT_ZERO_BIT.val;
+    memcpy(&encoded->data[length], DCC_RMT_BYTE_ITEMS[packet.payload[dlc]]
+         , sizeof(DCC_RMT_BYTE_ITEMS[0]));
+    length += RMT_ITEMS_PER_BYTE;
   }
   // set the last bit of the encoded payload to be an end of packet marker
-  packet_[pktLength_ - 1].val = DCC_RMT_ONE_BIT.val;
+  encoded->data[length - 1].val = DCC_RMT_ONE_BIT.val;
   // add an extra ONE bit to the end to prevent mangling of the last bit by
   // the RMT
-  packet_[pktLength_++].val = DCC_RMT_ONE_BIT.val;
-  // record the repeat count
-  pktRepeatCount_ = packet.packet_header.rept_count;
+  encoded->data[length++].val = DCC_RMT_ONE_BIT.val;
 
-  railcomDriver_->set_feedback_key(packet.feedback_key);
+  // record the cache key, the length is set by the caller.
+  encoded->dlc = packet.dlc;
+  memcpy(encoded->payload, packet.payload, packet.dlc);
+  return length;
 }
 
 } // namespace esp32cs
@@ -0,0 +1,216 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "RailComFeedback.h"
+
+#include <esp_timer.h>
+#include <Trace.h>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+/// Time after the last RailCom data was received that the track is
+/// considered to be no longer occupied.
+static constexpr int64_t OCCUPANCY_TIMEOUT_USEC = MSEC_TO_USEC(500);
+
+/// Dynamic variable sub-index for the actual speed (0-255 km/h).
+static constexpr uint8_t DYN_SPEED = 0;
+
+/// Dynamic variable sub-index for the actual speed above 255 km/h.
+static constexpr uint8_t DYN_SPEED_HIGH = 1;
+
+/// Dynamic variable sub-index for the receive statistics (QoS).
+static constexpr uint8_t DYN_QOS = 7;
+
+// Returns true if RailCom data was received recently enough for the track
+// to be considered occupied.
+static inline bool is_recent(int64_t last_data)
+{
+  return last_data &&
+         (esp_timer_get_time() - last_data) < OCCUPANCY_TIMEOUT_USEC;
+}
+
+RailComFeedbackCache::RailComFeedbackCache(dcc::RailcomHubFlow *hub)
+  : hub_(hub)
+{
+  // a cutout contains at most eight datagrams (two in channel 1 and six in
+  // channel 2).
+  packets_.reserve(8);
+  hub_->register_port(this);
+}
+
+RailComFeedbackCache::~RailComFeedbackCache()
+{
+  hub_->unregister_port(this);
+}
+
+void RailComFeedbackCache::send(Buffer<dcc::RailcomHubData> *buf
+                              , unsigned prio)
+{
+  auto b = get_buffer_deleter(buf);
+  const dcc::Feedback &fb = *b->data();
+  dcc::parse_railcom_data(fb, &packets_);
+  TRACE_EVENT(TraceEvent::RAILCOM_REPLY, fb.feedbackKey, packets_.size());
+  if (packets_.empty())
+  {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  uint16_t address = fb.feedbackKey;
+  PomCallback pom_done;
+  int16_t pom_value = -1;
+  {
+    OSMutexLock l(&lock_);
+    cutouts_++;
+    broadcast_.process_packet(fb);
+    RailComLocoFeedback *loco = nullptr;
+    bool garbage = false;
+    for (auto &packet : packets_)
+    {
+      if (packet.type == dcc::RailcomPacket::GARBAGE)
+      {
+        garbage = true;
+        continue;
+      }
+      lastData_ = now;
+      if (packet.railcom_channel != 2)
+      {
+        // channel 1 is only used for address broadcasts which are handled by
+        // the broadcast decoder.
+        continue;
+      }
+      if (!address)
+      {
+        unmatched_++;
+        continue;
+      }
+      if (!loco)
+      {
+        loco = &locos_[address];
+      }
+      matched_++;
+      loco->lastSeen = now;
+      if (packet.type == dcc::RailcomPacket::MOB_POM &&
+          address == pomAddress_ && pomDone_)
+      {
+        // the pending request is consumed by the first reply.
+        loco->pomCV = pomCV_;
+        loco->pomValue = pom_value = packet.argument & 0xFF;
+        loco->pomTime = now;
+        pom_done = std::move(pomDone_);
+        pomDone_ = nullptr;
+        pomAddress_ = 0;
+        pomCV_ = 0;
+      }
+      else if (packet.type == dcc::RailcomPacket::MOB_DYN)
+      {
+        // dynamic variables are an 8 bit value followed by a 6 bit
+        // sub-index.
+        uint8_t value = (packet.argument >> 6) & 0xFF;
+        uint8_t index = packet.argument & 0x3F;
+        if (index == DYN_SPEED)
+        {
+          loco->speed = value;
+        }
+        else if (index == DYN_SPEED_HIGH)
+        {
+          loco->speed = value + 256;
+        }
+        else if (index == DYN_QOS)
+        {
+          loco->qos = value;
+        }
+      }
+    }
+    if (garbage)
+    {
+      garbage_++;
+    }
+  }
+  if (pom_done)
+  {
+    pom_done(pom_value);
+  }
+}
+
+bool RailComFeedbackCache::get(uint16_t address, RailComLocoFeedback *feedback)
+{
+  OSMutexLock l(&lock_);
+  auto ent = locos_.find(address);
+  if (ent == locos_.end())
+  {
+    return false;
+  }
+  *feedback = ent->second;
+  return true;
+}
+
+void RailComFeedbackCache::expect_pom(uint16_t address, uint16_t cv
+                                    , PomCallback done)
+{
+  OSMutexLock l(&lock_);
+  pomAddress_ = address;
+  pomCV_ = cv;
+  pomDone_ = std::move(done);
+}
+
+void RailComFeedbackCache::cancel_pom()
+{
+  OSMutexLock l(&lock_);
+  pomAddress_ = 0;
+  pomCV_ = 0;
+  pomDone_ = nullptr;
+}
+
+uint16_t RailComFeedbackCache::current_address()
+{
+  OSMutexLock l(&lock_);
+  return is_recent(lastData_) ? broadcast_.current_address() : 0;
+}
+
+bool RailComFeedbackCache::occupied()
+{
+  OSMutexLock l(&lock_);
+  return is_recent(lastData_);
+}
+
+std::string RailComFeedbackCache::get_state_as_json()
+{
+  OSMutexLock l(&lock_);
+  std::string json =
+    StringPrintf("{\"occupied\":%s,\"address\":%d,\"cutouts\":%u,"
+                 "\"garbage\":%u,\"matched\":%u,\"unmatched\":%u,\"locos\":["
+               , is_recent(lastData_) ? "true" : "false"
+               , broadcast_.current_address()
+               , (unsigned)cutouts_, (unsigned)garbage_, (unsigned)matched_
+               , (unsigned)unmatched_);
+  for (auto &ent : locos_)
+  {
+    if (json.back() != '[')
+    {
+      json += ",";
+    }
+    json += StringPrintf("{\"address\":%d,\"speed\":%d,\"qos\":%d}"
+                       , ent.first, ent.second.speed, ent.second.qos);
+  }
+  json += "]}";
+  return json;
+}
+
+} // namespace esp32cs
@@ -54,18 +54,24 @@ public:
     }
 
 protected:
-    /// Sends a queued packet to either the OPS or PROG track.
+    /// Collects the current packet and any other queued packets (up to
+    /// @ref MAX_BATCH_SIZE) into a batch to be sent to the track.
+    Action entry() override;
+
+    /// Sends the pending batch of packets to either the OPS or PROG track.
     ///
     /// Track selection is made based on the DCC header flag for a longer
-    /// preamble which is only used for PROG track packets.
+    /// preamble which is only used for PROG track packets. Consecutive packets
+    /// for the same track are written with a single TRACK_IOC_WRITE_PACKETS
+    /// call.
     ///
-    /// If the packet can not be written to the file descriptor it will be held
-    /// until the device driver alerts that it is ready for another packet.
+    /// If the packets can not be written to the file descriptor they will be
+    /// held until the device driver alerts that it is ready for more packets.
     ///
     /// Note: Both OPS and PROG packets will be processed by this method and if
     /// either device driver prevents the write operation both tracks will be
     /// blocked.
-    Action entry() override;
+    Action write_batch();
 
     /// @return next action.
     Action finish()
@@ -73,6 +79,9 @@ protected:
         return release_and_exit();
     }
 
+    /// Maximum number of packets to send to the track in one batch.
+    static constexpr size_t MAX_BATCH_SIZE = 8;
+
     /// File descriptor for the OPS track output.
     const int fd_ops_;
 
@@ -81,6 +90,25 @@ protected:
 
     /// Packet pool from which to allocate packets.
     FixedPool pool_;
+
+    /// Packet buffers in the current batch, the first entry is always the
+    /// current message of this flow.
+    Buffer<dcc::Packet> *batch_[MAX_BATCH_SIZE];
+
+    /// Packets being passed to the device driver.
+    const dcc::Packet *packets_[MAX_BATCH_SIZE];
+
+    /// Number of entries in @ref batch_.
+    size_t batchSize_{0};
+
+    /// Index of the first entry in @ref batch_ which has not been sent.
+    size_t batchIndex_{0};
+
+    /// @return the file descriptor to use for the packet.
+    int get_fd(const dcc::Packet *packet)
+    {
+        return packet->packet_header.send_long_preamble ? fd_prog_ : fd_ops_;
+    }
 };
 
 } // namespace esp32cs
@@ -0,0 +1,190 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef PRIORITY_UPDATE_LOOP_H_
+#define PRIORITY_UPDATE_LOOP_H_
+
+#include <dcc/Packet.hxx>
+#include <dcc/PacketFlowInterface.hxx>
+#include <dcc/PacketSource.hxx>
+#include <dcc/UpdateLoop.hxx>
+#include <executor/StateFlow.hxx>
+#include <vector>
+
+#include "sdkconfig.h"
+
+namespace esp32cs
+{
+
+/// Implementation of a command station update loop which prioritizes packets
+/// based on the source of the packet and how recently it has been updated.
+///
+/// Packets are selected using the following order:
+/// 1. Exclusive sources (priority >= EXCLUSIVE_MIN_PRIORITY), only the
+///    highest priority exclusive source will receive packet slots. When this
+///    is the programming track, every PROG_REFRESH_PERIOD slot is still given
+///    to the OPS track while the PROG track is in service mode: to the e-stop
+///    source when one is registered, otherwise to the following steps.
+/// 2. User actions reported via notify_update(), these are sent in the order
+///    they were received with duplicates coalesced.
+/// 3. Background refresh, the source which has waited the longest (weighted
+///    by how recently it was updated) will receive the next packet slot.
+///    Every other refresh slot for a locomotive will be a speed packet.
+///
+/// Usage is identical to dcc::SimpleUpdateLoop.
+class PriorityUpdateLoop : public StateFlow<Buffer<dcc::Packet>, QList<1>>
+                         , private dcc::UpdateLoopBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to execute this flow on.
+  /// @param track_send is where filled in packets will be sent.
+  PriorityUpdateLoop(Service *service, dcc::PacketFlowInterface *track_send);
+
+  /// Adds a new refresh source.
+  ///
+  /// @param source is the @ref PacketSource to add.
+  /// @param priority is the priority of the source, when this is at least
+  /// EXCLUSIVE_MIN_PRIORITY the source will receive all packet slots until it
+  /// is removed or a higher priority exclusive source is added.
+  ///
+  /// @return false if there is a higher priority exclusive source already
+  /// registered, true otherwise.
+  bool add_refresh_source(dcc::PacketSource *source
+                        , unsigned priority) override;
+
+  /// Removes a refresh source, any pending updates for the source will be
+  /// discarded.
+  ///
+  /// @param source is the @ref PacketSource to remove.
+  void remove_refresh_source(dcc::PacketSource *source) override;
+
+  /// Queues an urgent update for a packet source.
+  ///
+  /// @param source is the @ref PacketSource which has been updated.
+  /// @param code is the update code to pass to the source.
+  void notify_update(dcc::PacketSource *source, unsigned code) override;
+
+  /// Entry to the state flow, called when a new packet needs to be sent.
+  Action entry() override;
+
+private:
+  /// Maximum number of pending urgent updates.
+  static constexpr size_t MAX_PENDING_UPDATES = 16;
+
+  /// Minimum time between two packets to the same refresh source.
+  static constexpr long long MIN_REFRESH_INTERVAL = MSEC_TO_NSEC(5);
+
+  /// Sources updated within this time period receive additional refresh
+  /// packet slots.
+  static constexpr long long ACTIVE_PERIOD =
+    SEC_TO_NSEC(CONFIG_DCC_REFRESH_ACTIVE_PERIOD_SEC);
+
+  /// Sources which have not been updated within this time period receive
+  /// fewer refresh packet slots.
+  static constexpr long long IDLE_PERIOD =
+    SEC_TO_NSEC(CONFIG_DCC_REFRESH_IDLE_PERIOD_SEC);
+
+  /// Refresh weighting for sources which have been recently updated.
+  static constexpr uint8_t ACTIVE_WEIGHT = 4;
+
+  /// Refresh weighting for sources which are neither active nor idle.
+  static constexpr uint8_t NORMAL_WEIGHT = 2;
+
+  /// Refresh weighting for idle sources.
+  static constexpr uint8_t IDLE_WEIGHT = 1;
+
+  /// While the programming track source is registered one in this many
+  /// packet slots is used for user actions or background refresh.
+  static constexpr uint8_t PROG_REFRESH_PERIOD = 4;
+
+  /// Background refresh state for a single @ref PacketSource.
+  struct RefreshSource
+  {
+    /// Source to request packets from.
+    dcc::PacketSource *source;
+
+    /// Last time a packet was sent from this source.
+    long long lastSent;
+
+    /// Last time an update was reported for this source.
+    long long lastUpdated;
+
+    /// When true the source is a locomotive.
+    bool train;
+
+    /// When true the next refresh packet will be a speed packet, this is
+    /// only set for locomotives.
+    bool speedNext;
+  };
+
+  /// Exclusive @ref PacketSource registration.
+  struct ExclusiveSource
+  {
+    /// Source to request packets from.
+    dcc::PacketSource *source;
+
+    /// Priority of the source.
+    unsigned priority;
+  };
+
+  /// Pending urgent update for a @ref PacketSource.
+  struct PendingUpdate
+  {
+    /// Source to request packets from.
+    dcc::PacketSource *source;
+
+    /// Update code to send to the source.
+    unsigned code;
+  };
+
+  /// Location to send filled in packets.
+  dcc::PacketFlowInterface *trackSend_;
+
+  /// Background refresh sources.
+  std::vector<RefreshSource> refreshSources_;
+
+  /// Exclusive sources, only the highest priority one will be used.
+  std::vector<ExclusiveSource> exclusiveSources_;
+
+  /// Circular buffer of pending urgent updates.
+  PendingUpdate pending_[MAX_PENDING_UPDATES];
+
+  /// Index of the oldest entry in @ref pending_.
+  size_t pendingHead_{0};
+
+  /// Number of entries in @ref pending_.
+  size_t pendingCount_{0};
+
+  /// Number of consecutive packet slots given to the programming track
+  /// source.
+  uint8_t progSlots_{0};
+
+  /// Fills the packet with the next background refresh packet.
+  ///
+  /// @param now is the current time.
+  /// @param packet is the packet to fill.
+  void fill_refresh_packet(long long now, dcc::Packet *packet);
+
+  /// @return the refresh entry for the source or nullptr if not found.
+  RefreshSource *find_refresh_source(dcc::PacketSource *source);
+};
+
+} // namespace esp32cs
+
+#endif // PRIORITY_UPDATE_LOOP_H_
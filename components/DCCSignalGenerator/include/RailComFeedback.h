@@ -0,0 +1,171 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef RAILCOM_FEEDBACK_H_
+#define RAILCOM_FEEDBACK_H_
+
+#include <dcc/RailCom.hxx>
+#include <dcc/RailcomBroadcastDecoder.hxx>
+#include <dcc/RailcomHub.hxx>
+#include <functional>
+#include <os/OS.hxx>
+#include <string>
+#include <unordered_map>
+#include <utils/Singleton.hxx>
+#include <vector>
+
+namespace esp32cs
+{
+
+/// Latest RailCom feedback received from a single locomotive decoder.
+struct RailComLocoFeedback
+{
+  /// Time the last channel 2 datagram was received, from
+  /// esp_timer_get_time().
+  int64_t lastSeen{0};
+
+  /// Actual speed reported by the decoder (km/h), -1 if not reported.
+  int16_t speed{-1};
+
+  /// Quality of service reported by the decoder (percentage of packets that
+  /// were not received correctly), -1 if not reported.
+  int16_t qos{-1};
+
+  /// CV number of the last POM read reply, zero if no reply has been
+  /// received.
+  uint16_t pomCV{0};
+
+  /// Value of @ref pomCV reported by the decoder, -1 if no reply has been
+  /// received.
+  int16_t pomValue{-1};
+
+  /// Time the POM reply was received.
+  int64_t pomTime{0};
+};
+
+/// Decodes RailCom cutout data from the OPS track and keeps the latest
+/// feedback for each locomotive address.
+///
+/// Channel 2 datagrams are attributed to the locomotive using the feedback
+/// key of the DCC packet preceding the cutout, which is the DCC address of
+/// the packet. Channel 1 address broadcasts are decoded via
+/// dcc::RailcomBroadcastDecoder to identify the locomotive occupying the
+/// track.
+///
+/// This is registered as a port on the RailcomHubFlow and processes the
+/// feedback synchronously on the hub's executor.
+class RailComFeedbackCache : public dcc::RailcomHubPortInterface
+                           , public Singleton<RailComFeedbackCache>
+{
+public:
+  /// Constructor.
+  ///
+  /// @param hub is the @ref dcc::RailcomHubFlow to receive feedback from.
+  RailComFeedbackCache(dcc::RailcomHubFlow *hub);
+
+  /// Destructor.
+  ~RailComFeedbackCache();
+
+  /// Processes a single RailCom cutout.
+  ///
+  /// @param buf is the RailCom data to process.
+  /// @param prio is the priority of the data (unused).
+  void send(Buffer<dcc::RailcomHubData> *buf, unsigned prio) override;
+
+  /// Retrieves the latest feedback for a locomotive.
+  ///
+  /// @param address is the DCC address of the locomotive.
+  /// @param feedback will receive the feedback.
+  ///
+  /// @return false if no feedback has been received for the address.
+  bool get(uint16_t address, RailComLocoFeedback *feedback);
+
+  /// Callback invoked with the CV value reported by the decoder in reply to
+  /// a POM read request.
+  typedef std::function<void(int16_t)> PomCallback;
+
+  /// Prepares for a POM read request so that the decoder reply can be
+  /// associated with the CV. This must be called before the POM read packet
+  /// is sent, only one POM read request can be pending.
+  ///
+  /// @param address is the DCC address of the locomotive.
+  /// @param cv is the CV number being read.
+  /// @param done is invoked once with the reply from the decoder, this is
+  /// called on the executor of the RailcomHubFlow and must not block.
+  void expect_pom(uint16_t address, uint16_t cv, PomCallback done);
+
+  /// Discards the pending POM read request, if any.
+  void cancel_pom();
+
+  /// @return the address most recently broadcast on channel 1, zero if no
+  /// locomotive is currently broadcasting its address.
+  uint16_t current_address();
+
+  /// @return true if RailCom data has been received recently, indicating
+  /// that the track is occupied by a RailCom capable decoder.
+  bool occupied();
+
+  /// @return the status of the RailCom decoding as JSON.
+  std::string get_state_as_json();
+
+private:
+  /// Hub the cache is registered with.
+  dcc::RailcomHubFlow *hub_;
+
+  /// Lock protecting the cached feedback.
+  OSMutex lock_;
+
+  /// Feedback for each locomotive address.
+  std::unordered_map<uint16_t, RailComLocoFeedback> locos_;
+
+  /// Decoder for the channel 1 address broadcasts.
+  dcc::RailcomBroadcastDecoder broadcast_;
+
+  /// Decoded datagrams of the cutout being processed, reused to avoid
+  /// allocations for each cutout.
+  std::vector<dcc::RailcomPacket> packets_;
+
+  /// DCC address of the pending POM read request, zero when there is no
+  /// pending request.
+  uint16_t pomAddress_{0};
+
+  /// CV number of the pending POM read request.
+  uint16_t pomCV_{0};
+
+  /// Callback for the pending POM read request.
+  PomCallback pomDone_;
+
+  /// Time any valid RailCom data was last received.
+  int64_t lastData_{0};
+
+  /// Number of cutouts which have been processed.
+  uint32_t cutouts_{0};
+
+  /// Number of cutouts which contained data that could not be decoded.
+  uint32_t garbage_{0};
+
+  /// Number of channel 2 datagrams attributed to a locomotive.
+  uint32_t matched_{0};
+
+  /// Number of channel 2 datagrams which could not be attributed to a
+  /// locomotive.
+  uint32_t unmatched_{0};
+};
+
+} // namespace esp32cs
+
+#endif // RAILCOM_FEEDBACK_H_
@@ -19,7 +19,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #define ESTOP_HANDLER_H_
 
 #include <dcc/PacketSource.hxx>
-#include <dcc/SimpleUpdateLoop.hxx>
+#include <dcc/UpdateLoop.hxx>
 #include <openlcb/Defs.hxx>
 #include <openlcb/EventHandlerTemplates.hxx>
 #include <utils/Atomic.hxx>
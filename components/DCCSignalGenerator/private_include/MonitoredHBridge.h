@@ -31,13 +31,28 @@ COPYRIGHT (c) 2018-2020 Mike Dunston
 #include <utils/Debouncer.hxx>
 #include <utils/format_utils.hxx>
 #include <utils/logging.h>
+#include <atomic>
 #include <driver/adc.h>
 #include <esp_adc_cal.h>
 #include <esp_bit_defs.h>
+#include <esp_timer.h>
 
 namespace esp32cs
 {
 
+/// Monitors the current sense output of an h-bridge.
+///
+/// The current sense input is sampled at CONFIG_DCC_HBRIDGE_SAMPLE_RATE into
+/// a fixed ring of CONFIG_ADC_AVERAGE_READING_COUNT samples from which a
+/// running average is maintained. Short circuits are detected as part of the
+/// sampling and the h-bridge is disabled immediately, the 33hz polling only
+/// reports the resulting state changes.
+///
+/// While the PROG track is in service mode the sample rate is raised to
+/// CONFIG_DCC_PROG_ACK_SAMPLE_RATE and each sample is checked for a decoder
+/// acknowledgement: a rise of at least 60mA above the baseline current which
+/// lasts between CONFIG_DCC_PROG_ACK_MIN_PULSE_US and
+/// CONFIG_DCC_PROG_ACK_MAX_PULSE_US.
 class HBridgeShortDetector : public DefaultConfigUpdateListener
                            , public openlcb::Polling
 {
@@ -59,6 +74,8 @@ public:
                      , const std::string &bridgeType
                      , const esp32cs::TrackOutputConfig &cfg);
 
+  ~HBridgeShortDetector();
+
   enum STATE : uint8_t
   {
     STATE_OVERCURRENT       = BIT(0)
@@ -152,10 +169,12 @@ public:
 
   void poll_33hz(openlcb::WriteHelper *helper, Notifiable *done) override;
 
-  void enable_prog_response(bool enable)
-  {
-    progEnable_ = enable;
-  }
+  /// Enables or disables the PROG track acknowledgement detection.
+  ///
+  /// @param enable when true the current sense input will be sampled at
+  /// CONFIG_DCC_PROG_ACK_SAMPLE_RATE and acknowledgement pulses will be
+  /// reported to the ProgrammingTrackBackend.
+  void enable_prog_response(bool enable);
 
 private:
   const adc1_channel_t channel_;
@@ -170,8 +189,6 @@ private:
   const uint32_t progAckLimit_;
   const esp32cs::TrackOutputConfig cfg_;
   const uint8_t targetLED_;
-  const uint8_t adcSampleCount_{CONFIG_ADC_AVERAGE_READING_COUNT};
-  const uint8_t overCurrentRetryCount_{CONFIG_DCC_HBRIDGE_OVERCURRENT_BEFORE_SHUTDOWN};
   const uint64_t currentReportInterval_{SEC_TO_USEC(CONFIG_DCC_HBRIDGE_USAGE_REPORT_INTERVAL)};
   uint32_t warnLimit_{0};
   openlcb::MemoryBit<uint8_t> shortBit_;
@@ -181,10 +198,88 @@ private:
   uint64_t lastReport_{0};
   uint32_t lastReading_{0};
   uint8_t state_{STATE_OFF};
-  uint8_t overCurrentCheckCount_{0};
-  bool progEnable_{false};
+
+  /// When true the PROG track is in service mode and @ref sample checks for
+  /// acknowledgements, set by @ref enable_prog_response.
+  std::atomic<bool> progEnable_{false};
+
+  /// Periodic timer driving @ref sample.
+  esp_timer_handle_t sampleTimer_{nullptr};
+
+  /// Current rate of @ref sampleTimer_ in Hz.
+  std::atomic<uint32_t> sampleRate_{CONFIG_DCC_HBRIDGE_SAMPLE_RATE};
+
+  /// Number of consecutive samples with the average above the over-current
+  /// limit before the h-bridge will be shut down, depends on
+  /// @ref sampleRate_.
+  std::atomic<uint16_t> overCurrentTripSamples_{0};
+
+  /// Most recent current sense samples.
+  uint16_t samples_[CONFIG_ADC_AVERAGE_READING_COUNT]{0};
+
+  /// Index in @ref samples_ which will receive the next sample.
+  uint8_t sampleIndex_{0};
+
+  /// Sum of all entries in @ref samples_.
+  uint32_t sampleSum_{0};
+
+  /// Sum of the last @ref PEAK_SAMPLE_COUNT entries in @ref samples_.
+  uint32_t peakSum_{0};
+
+  /// Number of consecutive samples above the shutdown limit.
+  uint8_t shutdownSamples_{0};
+
+  /// Number of consecutive samples with the average above the over-current
+  /// limit.
+  uint16_t overCurrentSamples_{0};
+
+  /// Highest short term average since the last @ref poll_33hz.
+  std::atomic<uint32_t> peakReading_{0};
+
+  /// State the h-bridge was shut down with by @ref sample, consumed by
+  /// @ref poll_33hz.
+  std::atomic<uint8_t> tripState_{0};
+
+  /// When true @ref detect_ack has been called since @ref progEnable_ was
+  /// set, only accessed by @ref sample.
+  bool ackActive_{false};
+
+  /// Baseline current draw of the PROG track in service mode, this is the
+  /// ADC reading multiplied by @ref ACK_BASELINE_WEIGHT. Only accessed by
+  /// @ref sample.
+  uint32_t ackBaseline_{0};
+
+  /// Start time of the current acknowledgement pulse, zero when there is no
+  /// pulse in progress. Only accessed by @ref sample.
+  int64_t ackStart_{0};
+
+  /// Weight of the previous baseline when a new sample is added to
+  /// @ref ackBaseline_.
+  static constexpr uint8_t ACK_BASELINE_WEIGHT = 16;
+
+  /// Number of samples used for the short term average which is used for
+  /// the PROG track acknowledgement and peak current.
+  static constexpr uint8_t PEAK_SAMPLE_COUNT = 4;
+
+  /// Number of consecutive samples above the shutdown limit before the
+  /// h-bridge will be shut down, this filters single sample ADC noise.
+  static constexpr uint8_t SHUTDOWN_SAMPLE_COUNT = 2;
 
   void configure();
+
+  /// Collects a single current sense sample and shuts down the h-bridge if a
+  /// short circuit has been detected.
+  void sample();
+
+  /// Checks the PROG track current for a decoder acknowledgement pulse.
+  ///
+  /// @param reading is the short term average of the current sense input.
+  void detect_ack(uint32_t reading);
+
+  /// (Re)starts the sampling timer.
+  ///
+  /// @param rate is the number of samples per second.
+  void start_sampling(uint32_t rate);
 };
 
 } // namespace esp32cs
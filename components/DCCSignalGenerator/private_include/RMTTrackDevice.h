@@ -37,8 +37,10 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include <utils/StringPrintf.hxx>
 
 #include "can_ioctl.h"
+#include "Metrics.h"
 #include "MonitoredHBridge.h"
 #include "sdkconfig.h"
+#include "track_ioctl.h"
 
 namespace esp32cs
 {
@@ -77,19 +79,105 @@ private:
   // maximum number of bits that can be transmitted as one packet.
   static constexpr uint8_t MAX_RMT_BITS = (RMT_MEM_ITEM_NUM * MAX_RMT_MEMORY_BLOCKS);
 
+  // number of RMT items used for each byte of the packet payload, eight data
+  // bits followed by the end of byte marker.
+  static constexpr uint8_t RMT_ITEMS_PER_BYTE = 9;
+
+  // maximum number of preamble bits used by any track output.
+  static constexpr uint8_t MAX_PREAMBLE_BITS =
+    CONFIG_OPS_DCC_PREAMBLE_BITS > CONFIG_PROG_DCC_PREAMBLE_BITS ?
+      CONFIG_OPS_DCC_PREAMBLE_BITS : CONFIG_PROG_DCC_PREAMBLE_BITS;
+
+  // maximum number of RMT items in an encoded DCC packet: preamble bits,
+  // packet start bit, payload bytes with end of byte markers, end of packet
+  // bit and the extra bit to prevent mangling by the RMT.
+  static constexpr uint8_t MAX_DCC_PACKET_ITEMS = MAX_PREAMBLE_BITS + 1
+    + (dcc::Packet::MAX_PAYLOAD * RMT_ITEMS_PER_BYTE) + 1 + 1;
+
+  static_assert(MAX_DCC_PACKET_ITEMS <= MAX_RMT_BITS,
+                "DCC preamble bits exceed the RMT memory");
+
+  // number of encoded packets to keep in the cache.
+  static constexpr uint8_t PACKET_CACHE_SIZE = CONFIG_DCC_RMT_PACKET_CACHE_SIZE;
+
+  // DCC packet which has been converted to RMT format.
+  struct EncodedPacket
+  {
+    // number of payload bytes in the source packet.
+    uint8_t dlc{0};
+
+    // payload of the source packet, used as the cache key.
+    uint8_t payload[dcc::Packet::MAX_PAYLOAD];
+
+    // number of RMT items in the encoded packet.
+    uint32_t length{0};
+
+    // number of queued or transmitting packets using this entry, the entry
+    // is only replaced when this is zero.
+    uint8_t refs{0};
+
+    // RMT items for the encoded packet, this is sized for the longest DCC
+    // packet rather than the RMT memory to reduce the size of the cache.
+    rmt_item32_t data[MAX_DCC_PACKET_ITEMS];
+  };
+
+  // DCC packet waiting in the packet queue, the packet is encoded before it
+  // is queued so that the RMT ISR only needs to copy the encoded data.
+  struct QueuedPacket
+  {
+    // encoded packet data, this holds a reference on the cache entry.
+    EncodedPacket *encoded;
+
+    // number of times the packet should be repeated.
+    uint8_t rept_count;
+
+    // RailCom feedback key of the source packet.
+    uintptr_t feedback_key;
+  };
+
   const char *name_;
   const rmt_channel_t channel_;
   const uint8_t dccPreambleBitCount_;
   RailcomDriver *railcomDriver_;
   Atomic packetQueueLock_;
-  DeviceBuffer<dcc::Packet> *packetQueue_;
+  DeviceBuffer<QueuedPacket> *packetQueue_;
   Notifiable* notifiable_{nullptr};
   int8_t pktRepeatCount_{0};
-  uint32_t pktLength_{0};
-  rmt_item32_t packet_[MAX_RMT_BITS];
+
+  // pre-encoded DCC IDLE packet, used when the packet queue is empty.
+  EncodedPacket idlePacket_;
+
+  // cache of recently encoded packets.
+  EncodedPacket packetCache_[PACKET_CACHE_SIZE];
+
+  // index of the next cache entry to be replaced on a cache miss.
+  uint8_t packetCacheNext_{0};
+
+  // encoded packet which is currently being transmitted.
+  EncodedPacket *packet_{&idlePacket_};
+
+  // number of packets transmitted, including repeats and idle packets.
+  Counter packetsSent_;
+
+  // number of idle packets transmitted due to an empty packet queue.
+  Counter idlePackets_;
+
+  // number of packets rejected due to a full packet queue.
+  Counter queueFull_;
+
+  // number of packets waiting in the packet queue.
+  Gauge queueDepth_;
 
   void encode_next_packet();
 
+  ssize_t write_packets(const dcc::Packet * const *packets, size_t count);
+
+  uint32_t encode_packet(const dcc::Packet &packet, EncodedPacket *encoded);
+
+  EncodedPacket *acquire_encoded_packet(const dcc::Packet &packet);
+
+  void release_encoded_packet(EncodedPacket *encoded);
+
   DISALLOW_COPY_AND_ASSIGN(RMTTrackDevice);
 };
 
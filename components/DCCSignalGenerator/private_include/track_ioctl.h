@@ -0,0 +1,48 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef TRACK_IOCTL_H_
+#define TRACK_IOCTL_H_
+
+#include <dcc/Packet.hxx>
+#include <stddef.h>
+
+#include "stropts.h"
+
+/// Magic number for the /dev/track ioctl calls.
+#define TRACK_IOC_MAGIC ('t')
+
+/// Collection of dcc::Packets to be written to the track packet queue via
+/// @ref TRACK_IOC_WRITE_PACKETS.
+struct TrackPacketBatch
+{
+  /// Packets to be written, these are copied into the packet queue.
+  const dcc::Packet * const *packets;
+
+  /// Number of entries in @ref packets.
+  size_t count;
+};
+
+/// Writes multiple packets to the track packet queue. Argument is a pointer
+/// to a @ref TrackPacketBatch. The return value is the number of packets from
+/// the start of the batch which have been consumed, Marklin packets are
+/// consumed but discarded. When no packets could be consumed due to the
+/// packet queue being full -1 is returned and errno is set to ENOSPC.
+#define TRACK_IOC_WRITE_PACKETS \
+  IOW(TRACK_IOC_MAGIC, 1, sizeof(TrackPacketBatch))
+
+#endif // TRACK_IOCTL_H_
@@ -0,0 +1,509 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "Routes.h"
+#include "Turnouts.h"
+
+#include <algorithm>
+#include <DuplexedTrackIf.h>
+#include <FileSystemManager.h>
+#include <dcc/DccDebug.hxx>
+#include <JsonConstants.h>
+#include <PersistenceService.h>
+#include <json.hpp>
+#include <StateBroadcast.h>
+#include <utils/format_utils.hxx>
+#include <utils/StringPrintf.hxx>
+
+using nlohmann::json;
+
+static constexpr const char *ROUTES_JSON_FILE = "routes.json";
+
+/// Maximum number of turnouts in a single route.
+static constexpr size_t MAX_ROUTE_STEPS = 64;
+
+/// Highest DCC accessory address which can be used in a route.
+static constexpr uint16_t MAX_ROUTE_ADDRESS = 2044;
+
+// Returns true if the route name only contains letters, digits, '_' and '-'.
+// Route names are used as a DCC++ command argument and are written to JSON
+// without escaping.
+static bool is_valid_name(const std::string &name)
+{
+  return !name.empty() &&
+         std::all_of(name.begin(), name.end(), [](char ch)
+                     {
+                       return isalnum((unsigned char)ch) || ch == '_' ||
+                              ch == '-';
+                     });
+}
+
+RouteManager::RouteManager(openlcb::Node *node, Service *service)
+  : StateFlowBase(service)
+  , eventHandler_(node
+    , [this](const openlcb::EventRegistryEntry &entry
+           , openlcb::EventReport *report, BarrierNotifiable *done)
+      {
+        event_received(report->event);
+      }, nullptr)
+{
+  LOG(INFO, "[Route] Initializing route database");
+  json root = json::parse(
+    Singleton<FileSystemManager>::instance()->load(ROUTES_JSON_FILE)
+  , nullptr, false);
+  if (root.is_discarded() || !root.is_array())
+  {
+    LOG_ERROR("[Route] %s is corrupt, no routes loaded!", ROUTES_JSON_FILE);
+    root = json::array();
+  }
+  // exceptions are disabled so every member is checked before get<>() is
+  // used, entries which are incomplete are skipped.
+  for (auto &entry : root)
+  {
+    if (!entry.is_object() || !entry.contains(JSON_NAME_NODE) ||
+        !entry[JSON_NAME_NODE].is_string() ||
+        !entry.contains(JSON_TURNOUTS_NODE) ||
+        !entry[JSON_TURNOUTS_NODE].is_array() ||
+        (entry.contains(JSON_EVENT_NODE) &&
+         !entry[JSON_EVENT_NODE].is_string()))
+    {
+      LOG_ERROR("[Route] Skipping incomplete route entry");
+      continue;
+    }
+    Route route;
+    route.name = entry[JSON_NAME_NODE].get<std::string>();
+    if (!is_valid_name(route.name))
+    {
+      LOG_ERROR("[Route] Skipping route with invalid name");
+      continue;
+    }
+    route.event = 0;
+    if (entry.contains(JSON_EVENT_NODE) &&
+        !entry[JSON_EVENT_NODE].get<std::string>().empty())
+    {
+      route.event =
+        string_to_uint64(entry[JSON_EVENT_NODE].get<std::string>());
+    }
+    bool valid = true;
+    for (auto &step : entry[JSON_TURNOUTS_NODE])
+    {
+      if (!step.is_object() || !step.contains(JSON_ADDRESS_NODE) ||
+          !step[JSON_ADDRESS_NODE].is_number_unsigned() ||
+          !step.contains(JSON_STATE_NODE) ||
+          !step[JSON_STATE_NODE].is_number())
+      {
+        valid = false;
+        break;
+      }
+      route.steps.push_back({step[JSON_ADDRESS_NODE].get<uint16_t>()
+                           , step[JSON_STATE_NODE].get<int>() != 0});
+    }
+    if (!valid)
+    {
+      LOG_ERROR("[Route %s] Skipping route with invalid turnouts"
+              , route.name.c_str());
+      continue;
+    }
+    route.id = nextId_++;
+    routes_.push_back(std::move(route));
+  }
+  LOG(INFO, "[Route] Loaded %zu route(s)", routes_.size());
+  // the stack has not been started yet so the events can be registered
+  // directly.
+  register_events();
+  start_flow(STATE(wait_for_route));
+}
+
+bool RouteManager::parse_steps(const std::string &list
+                             , std::vector<RouteStep> *steps)
+{
+  steps->clear();
+  size_t pos = 0;
+  while (pos < list.length())
+  {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos)
+    {
+      end = list.length();
+    }
+    std::string entry = list.substr(pos, end - pos);
+    pos = end + 1;
+    size_t sep = entry.find(':');
+    if (sep == std::string::npos || sep == 0 || sep + 1 == entry.length())
+    {
+      return false;
+    }
+    char *parse_end;
+    unsigned long address = strtoul(entry.c_str(), &parse_end, 10);
+    if (parse_end != entry.c_str() + sep || address == 0 ||
+        address > MAX_ROUTE_ADDRESS)
+    {
+      return false;
+    }
+    unsigned long state = strtoul(entry.c_str() + sep + 1, &parse_end, 10);
+    if (*parse_end || state > 1)
+    {
+      return false;
+    }
+    steps->push_back({(uint16_t)address, state == 1});
+  }
+  return !steps->empty() && steps->size() <= MAX_ROUTE_STEPS;
+}
+
+bool RouteManager::createOrUpdate(const std::string &name
+                                , std::vector<RouteStep> steps
+                                , uint64_t event)
+{
+  if (!is_valid_name(name) || steps.empty() ||
+      steps.size() > MAX_ROUTE_STEPS)
+  {
+    LOG_ERROR("[Route] Rejecting invalid route");
+    return false;
+  }
+  bool event_changed = false;
+  {
+    OSMutexLock l(&lock_);
+    Route *route = find(name);
+    if (route)
+    {
+      LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Route %s] Updated with %zu turnout(s)"
+        , name.c_str(), steps.size());
+      event_changed = route->event != event;
+      route->event = event;
+      route->steps = std::move(steps);
+    }
+    else
+    {
+      LOG(INFO, "[Route %s] Created with %zu turnout(s)", name.c_str()
+        , steps.size());
+      event_changed = event != 0;
+      routes_.push_back({name, event, std::move(steps), nextId_++});
+    }
+    persist();
+  }
+  if (event_changed)
+  {
+    update_events();
+  }
+  return true;
+}
+
+bool RouteManager::remove(const std::string &name)
+{
+  bool had_event = false;
+  {
+    OSMutexLock l(&lock_);
+    auto it = std::find_if(routes_.begin(), routes_.end()
+                         , [&name](const Route &route)
+                           {
+                             return route.name == name;
+                           });
+    if (it == routes_.end())
+    {
+      LOG(WARNING, "[Route %s] not found", name.c_str());
+      return false;
+    }
+    LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Route %s] Deleted", name.c_str());
+    had_event = it->event != 0;
+    routes_.erase(it);
+    // a queued execution of the route is discarded, if the route is
+    // currently being executed it will complete.
+    pending_.erase(std::remove(pending_.begin(), pending_.end(), name)
+                 , pending_.end());
+    persist();
+  }
+  if (had_event)
+  {
+    update_events();
+  }
+  return true;
+}
+
+bool RouteManager::trigger(const std::string &name)
+{
+  OSMutexLock l(&lock_);
+  if (!find(name))
+  {
+    LOG(WARNING, "[Route %s] not found", name.c_str());
+    return false;
+  }
+  if (std::find(pending_.begin(), pending_.end(), name) == pending_.end())
+  {
+    LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Route %s] Queued", name.c_str());
+    pending_.push_back(name);
+  }
+  if (waiting_)
+  {
+    waiting_ = false;
+    notify();
+  }
+  return true;
+}
+
+bool RouteManager::getStateAsJson(size_t index, std::string *json)
+{
+  OSMutexLock l(&lock_);
+  if (index >= routes_.size())
+  {
+    return false;
+  }
+  json->append(to_json(routes_[index], true));
+  return true;
+}
+
+std::string RouteManager::getStateAsJson(const std::string &name)
+{
+  OSMutexLock l(&lock_);
+  Route *route = find(name);
+  if (route)
+  {
+    return to_json(*route, true);
+  }
+  return "";
+}
+
+std::string RouteManager::get_state_for_dccpp()
+{
+  OSMutexLock l(&lock_);
+  if (routes_.empty())
+  {
+    return COMMAND_FAILED_RESPONSE;
+  }
+  std::string status;
+  for (auto &route : routes_)
+  {
+    int state = 0;
+    if (route.name == active_)
+    {
+      state = 2;
+    }
+    else if (std::find(pending_.begin(), pending_.end(), route.name) !=
+             pending_.end())
+    {
+      state = 1;
+    }
+    status += StringPrintf("<route %s %zu %d>", route.name.c_str()
+                         , route.steps.size(), state);
+  }
+  return status;
+}
+
+StateFlowBase::Action RouteManager::wait_for_route()
+{
+  OSMutexLock l(&lock_);
+  active_.clear();
+  while (!pending_.empty())
+  {
+    std::string name = std::move(pending_.front());
+    pending_.pop_front();
+    Route *route = find(name);
+    if (route)
+    {
+      // the steps are copied so the route can be updated or removed while it
+      // is being executed.
+      active_ = std::move(name);
+      activeId_ = route->id;
+      steps_ = route->steps;
+      step_ = 0;
+      startTime_ = os_get_time_monotonic();
+      LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Route %s] Setting %zu turnout(s)"
+        , active_.c_str(), steps_.size());
+      return call_immediately(STATE(send_step));
+    }
+  }
+  waiting_ = true;
+  return wait();
+}
+
+StateFlowBase::Action RouteManager::send_step()
+{
+  if (step_ < steps_.size())
+  {
+    // the packet is allocated from the track pool so that the route will not
+    // queue more packets than the track can accept.
+    return allocate_and_call(Singleton<esp32cs::DuplexedTrackIf>::instance()
+                           , STATE(fill_packet));
+  }
+
+  long long duration = os_get_time_monotonic() - startTime_;
+  OSMutexLock l(&lock_);
+  LOG(INFO, "[Route %s] Completed %zu turnout(s) in %lldms", active_.c_str()
+    , steps_.size(), NSEC_TO_MSEC(duration));
+  // the id was captured when the route was started as the route may have
+  // been removed while it was being executed.
+  StateBroadcast::publish(StateType::ROUTE, activeId_
+    , StringPrintf("{\"%s\":\"%s\",\"%s\":\"%s\",\"%s\":%zu,\"%s\":%lld}"
+                 , JSON_NAME_NODE, active_.c_str()
+                 , JSON_STATE_NODE, JSON_VALUE_COMPLETE
+                 , JSON_COUNT_NODE, steps_.size()
+                 , JSON_DURATION_NODE, NSEC_TO_MSEC(duration)));
+  return call_immediately(STATE(wait_for_route));
+}
+
+StateFlowBase::Action RouteManager::fill_packet()
+{
+  auto track = Singleton<esp32cs::DuplexedTrackIf>::instance();
+  auto b = get_allocation_result(track);
+  const RouteStep &step = steps_[step_++];
+
+  // update the turnout state without sending a DCC packet for it, the packet
+  // is sent below.
+  Singleton<TurnoutManager>::instance()->set(step.address, step.thrown, false);
+
+  dcc::Packet *pkt = b->data();
+  pkt->start_dcc_packet();
+  // shift address by one to account for the output pair state bit (thrown).
+  pkt->add_dcc_basic_accessory((step.address << 1) | step.thrown, true);
+  pkt->packet_header.rept_count = CONFIG_ROUTE_PACKET_REPEATS;
+  LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Route %s] Packet: %s", active_.c_str()
+    , dcc::packet_to_string(*pkt, true).c_str());
+  track->send(b);
+
+  if (step_ < steps_.size() && step_ % CONFIG_ROUTE_PACKET_BATCH_SIZE)
+  {
+    // the batch is not yet complete, send the next packet immediately.
+    return call_immediately(STATE(send_step));
+  }
+  return sleep_and_call(&timer_, MSEC_TO_NSEC(CONFIG_ROUTE_PACKET_SPACING_MS)
+                      , STATE(send_step));
+}
+
+RouteManager::Route *RouteManager::find(const std::string &name)
+{
+  for (auto &route : routes_)
+  {
+    if (route.name == name)
+    {
+      return &route;
+    }
+  }
+  return nullptr;
+}
+
+std::string RouteManager::to_json(const Route &route, bool readable)
+{
+  std::string content =
+    StringPrintf("{\"%s\":\"%s\",\"%s\":\"%s\",", JSON_NAME_NODE
+               , route.name.c_str(), JSON_EVENT_NODE
+               , route.event ? uint64_to_string_hex(route.event, 16).c_str()
+                             : "");
+  if (readable)
+  {
+    const char *state = JSON_VALUE_IDLE;
+    if (route.name == active_)
+    {
+      state = JSON_VALUE_RUNNING;
+    }
+    else if (std::find(pending_.begin(), pending_.end(), route.name) !=
+             pending_.end())
+    {
+      state = JSON_VALUE_QUEUED;
+    }
+    content += StringPrintf("\"%s\":\"%s\",", JSON_STATE_NODE, state);
+  }
+  content += StringPrintf("\"%s\":[", JSON_TURNOUTS_NODE);
+  for (auto &step : route.steps)
+  {
+    if (content.back() != '[')
+    {
+      content += ",";
+    }
+    if (readable)
+    {
+      content += StringPrintf("{\"%s\":%d,\"%s\":\"%s\"}", JSON_ADDRESS_NODE
+                            , step.address, JSON_STATE_NODE
+                            , step.thrown ? JSON_VALUE_THROWN
+                                          : JSON_VALUE_CLOSED);
+    }
+    else
+    {
+      content += StringPrintf("{\"%s\":%d,\"%s\":%d}", JSON_ADDRESS_NODE
+                            , step.address, JSON_STATE_NODE, step.thrown);
+    }
+  }
+  content += "]}";
+  return content;
+}
+
+void RouteManager::persist()
+{
+  std::string content = "[";
+  for (auto &route : routes_)
+  {
+    if (content.length() > 1)
+    {
+      content += ",";
+    }
+    content += to_json(route, false);
+  }
+  content += "]";
+  LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Route] Persisting %zu routes"
+    , routes_.size());
+  Singleton<PersistenceService>::instance()->store(ROUTES_JSON_FILE
+                                                 , std::move(content));
+}
+
+void RouteManager::register_events()
+{
+  openlcb::EventRegistry::instance()->unregister_handler(&eventHandler_);
+  std::vector<uint64_t> events;
+  {
+    OSMutexLock l(&lock_);
+    for (auto &route : routes_)
+    {
+      if (route.event &&
+          std::find(events.begin(), events.end(), route.event) == events.end())
+      {
+        events.push_back(route.event);
+      }
+    }
+  }
+  for (uint64_t event : events)
+  {
+    eventHandler_.add_entry(event
+                          , openlcb::CallbackEventHandler::IS_CONSUMER);
+  }
+}
+
+void RouteManager::update_events()
+{
+  service()->executor()->add(new CallbackExecutable([this]()
+  {
+    register_events();
+  }));
+}
+
+void RouteManager::event_received(uint64_t event)
+{
+  std::vector<std::string> names;
+  {
+    OSMutexLock l(&lock_);
+    for (auto &route : routes_)
+    {
+      if (route.event == event)
+      {
+        names.push_back(route.name);
+      }
+    }
+  }
+  for (auto &name : names)
+  {
+    LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Route %s] Triggered by event %s"
+      , name.c_str(), uint64_to_string_hex(event, 16).c_str());
+    trigger(name);
+  }
+}
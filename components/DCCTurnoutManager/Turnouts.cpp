@@ -21,7 +21,9 @@ COPYRIGHT (c) 2017-2019 Mike Dunston
 #include <dcc/DccDebug.hxx>
 #include <dcc/UpdateLoop.hxx>
 #include <JsonConstants.h>
+#include <PersistenceService.h>
 #include <json.hpp>
+#include <StateBroadcast.h>
 #include <utils/StringPrintf.hxx>
 
 using nlohmann::json;
@@ -39,7 +41,8 @@ static constexpr const char *TURNOUT_TYPE_STRINGS[] =
 };
 
 TurnoutManager::TurnoutManager(openlcb::Node *node, Service *service)
-  : turnoutEventConsumer_(node, this)
+  : addressIndex_(TURNOUT_ADDRESS_SPACE, 0)
+  , turnoutEventConsumer_(node, this)
   , persistFlow_(service, SEC_TO_NSEC(CONFIG_TURNOUT_PERSISTENCE_INTERVAL_SEC)
               , std::bind(&TurnoutManager::persist, this))
   , dirty_(false)
@@ -50,10 +53,9 @@ TurnoutManager::TurnoutManager(openlcb::Node *node, Service *service)
     Singleton<FileSystemManager>::instance()->load(TURNOUTS_JSON_FILE));
   for (auto turnout : root)
   {
-    turnouts_.push_back(
-      std::make_unique<Turnout>(turnout[JSON_ADDRESS_NODE].get<int>()
-                              , turnout[JSON_STATE_NODE].get<int>()
-                              , (TurnoutType)turnout[JSON_TYPE_NODE].get<int>()));
+    add(std::make_unique<Turnout>(turnout[JSON_ADDRESS_NODE].get<int>()
+                                , turnout[JSON_STATE_NODE].get<int>()
+                                , (TurnoutType)turnout[JSON_TYPE_NODE].get<int>()));
   }
   LOG(INFO, "[Turnout] Loaded %d DCC turnout(s)", turnouts_.size());
 }
@@ -66,56 +68,93 @@ void TurnoutManager::clear()
     turnout.reset(nullptr);
   }
   turnouts_.clear();
+  std::fill(addressIndex_.begin(), addressIndex_.end(), 0);
   dirty_ = true;
 }
 
-#define FIND_TURNOUT(address) \
-  std::find_if(turnouts_.begin(), turnouts_.end(),        \
-    [address](std::unique_ptr<Turnout> & turnout) -> bool \
-    {                                                     \
-      return (turnout->getAddress() == address);          \
-    }                                                     \
-  )
+int TurnoutManager::find(const uint16_t address)
+{
+  if (address < TURNOUT_ADDRESS_SPACE)
+  {
+    return addressIndex_[address] - 1;
+  }
+  // addresses outside of the accessory address space can only be created via
+  // DCC++ commands, these are not indexed.
+  for (size_t index = 0; index < turnouts_.size(); index++)
+  {
+    if (turnouts_[index]->getAddress() == address)
+    {
+      return index;
+    }
+  }
+  return -1;
+}
 
-string TurnoutManager::set(uint16_t address, bool thrown, bool sendDCC)
+Turnout *TurnoutManager::add(std::unique_ptr<Turnout> turnout)
 {
-  OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  uint16_t address = turnout->getAddress();
+  turnout->setId(turnouts_.size() + 1);
+  turnouts_.push_back(std::move(turnout));
+  if (address < TURNOUT_ADDRESS_SPACE)
   {
-    elem->get()->set(thrown, sendDCC);
-    dirty_ = true;
-    return StringPrintf("<H %d %d>"
-                      , std::distance(turnouts_.begin(), elem) + 1
-                      , elem->get()->isThrown());
+    addressIndex_[address] = turnouts_.size();
+  }
+  return turnouts_.back().get();
+}
+
+void TurnoutManager::reindex(size_t first)
+{
+  for (size_t index = first; index < turnouts_.size(); index++)
+  {
+    turnouts_[index]->setId(index + 1);
+    uint16_t address = turnouts_[index]->getAddress();
+    if (address < TURNOUT_ADDRESS_SPACE)
+    {
+      addressIndex_[address] = index + 1;
+    }
+  }
+}
+
+size_t TurnoutManager::set_state(const uint16_t address, bool thrown
+                               , bool sendDCC)
+{
+  int index = find(address);
+  if (index < 0)
+  {
+    // we didn't find it, create it and set it
+    add(std::make_unique<Turnout>(address));
+    index = turnouts_.size() - 1;
   }
+  turnouts_[index]->set(thrown, sendDCC);
+  dirty_ = true;
+  return index;
+}
 
-  // we didn't find it, create it and set it
-  turnouts_.push_back(std::make_unique<Turnout>(turnouts_.size() + 1
-                                              , address));
-  turnouts_.back().get()->set(thrown, sendDCC);
-  return StringPrintf("<H %d %d>", turnouts_.size()
-                    , turnouts_.back().get()->isThrown());
+string TurnoutManager::set(uint16_t address, bool thrown, bool sendDCC)
+{
+  OSMutexLock h(&mux_);
+  size_t index = set_state(address, thrown, sendDCC);
+  return StringPrintf("<H %d %d>", turnouts_[index]->getId()
+                    , turnouts_[index]->isThrown());
 }
 
 string TurnoutManager::toggle(uint16_t address)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  int index = find(address);
+  if (index >= 0)
   {
-    elem->get()->toggle();
+    turnouts_[index]->toggle();
     dirty_ = true;
-    return StringPrintf("<H %d %d>"
-                      , std::distance(turnouts_.begin(), elem)
-                      , elem->get()->isThrown());
+    return StringPrintf("<H %d %d>", turnouts_[index]->getId()
+                      , turnouts_[index]->isThrown());
   }
 
   // we didn't find it, create it and throw it
-  turnouts_.push_back(std::make_unique<Turnout>(address, -1));
-  turnouts_.back().get()->toggle();
-  return StringPrintf("<H %d %d>", turnouts_.size()
-                    , turnouts_.back().get()->isThrown());
+  auto turnout = add(std::make_unique<Turnout>(address));
+  turnout->toggle();
+  dirty_ = true;
+  return StringPrintf("<H %d %d>", turnout->getId(), turnout->isThrown());
 }
 
 string TurnoutManager::getStateAsJson(bool readable)
@@ -124,6 +163,18 @@ string TurnoutManager::getStateAsJson(bool readable)
   return get_state_as_json(readable);
 }
 
+bool TurnoutManager::getStateAsJson(size_t index, string *json
+                                  , bool readable)
+{
+  OSMutexLock h(&mux_);
+  if (index >= turnouts_.size())
+  {
+    return false;
+  }
+  json->append(turnouts_[index]->toJson(readable));
+  return true;
+}
+
 string TurnoutManager::get_state_for_dccpp()
 {
   OSMutexLock h(&mux_);
@@ -148,27 +199,31 @@ Turnout *TurnoutManager::createOrUpdate(const uint16_t address
                                       , const TurnoutType type)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  int index = find(address);
+  dirty_ = true;
+  if (index >= 0)
   {
-    elem->get()->update(address, type);
-    dirty_ = true;
-    return elem->get();
+    turnouts_[index]->update(address, type);
+    return turnouts_[index].get();
   }
   // we didn't find it, create it!
-  turnouts_.push_back(std::make_unique<Turnout>(address, false, type));
-  dirty_ = true;
-  return turnouts_.back().get();
+  return add(std::make_unique<Turnout>(address, false, type));
 }
 
 bool TurnoutManager::remove(const uint16_t address)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  int index = find(address);
+  if (index >= 0)
   {
     LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Turnout %d] Deleted", address);
-    turnouts_.erase(elem);
+    turnouts_.erase(turnouts_.begin() + index);
+    if (address < TURNOUT_ADDRESS_SPACE)
+    {
+      addressIndex_[address] = 0;
+    }
+    // the turnouts after the removed turnout have shifted down by one.
+    reindex(index);
     dirty_ = true;
     return true;
   }
@@ -191,10 +246,10 @@ Turnout *TurnoutManager::getByIndex(const uint16_t index)
 Turnout *TurnoutManager::get(const uint16_t address)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  int index = find(address);
+  if (index >= 0)
   {
-    return elem->get();
+    return turnouts_[index].get();
   }
   LOG(WARNING, "[Turnout %d] not found", address);
   return nullptr;
@@ -238,8 +293,11 @@ void TurnoutManager::send(Buffer<dcc::Packet> *b, unsigned prio)
     uint8_t boardIndex = (pkt->payload[1] & 0b00000110) >> 1;
     // least significant bit of the second byte is thrown/closed indicator.
     bool state = pkt->payload[1] & 0b00000001;
-    // Set the turnout to the requested state, don't send a DCC packet.
-    set(decodeDCCAccessoryAddress(boardAddress, boardIndex), state);
+    // Set the turnout to the requested state, the DCC++ response is not
+    // needed so the state is set directly.
+    OSMutexLock h(&mux_);
+    set_state(decodeDCCAccessoryAddress(boardAddress, boardIndex), state
+            , true);
   }
   b->unref();
 }
@@ -274,8 +332,8 @@ void TurnoutManager::persist()
   }
   LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Turnout] Persisting %zu turnouts"
     , turnouts_.size());
-  Singleton<FileSystemManager>::instance()->store(TURNOUTS_JSON_FILE
-                                                   , get_state_as_json(false));
+  Singleton<PersistenceService>::instance()->store(TURNOUTS_JSON_FILE
+                                                 , get_state_as_json(false));
 }
 
 void encodeDCCAccessoryAddress(uint16_t *board, int8_t *port
@@ -339,6 +397,10 @@ void Turnout::set(bool thrown, bool sendDCCPacket)
   }
   LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Turnout %d] Set to %s", _address
     , _thrown ? JSON_VALUE_THROWN : JSON_VALUE_CLOSED);
+  // the message uses the DCC++ ID to match the <T> command responses, the
+  // DCC address is used as the broadcast id for subscribers which need it.
+  StateBroadcast::publish(StateType::TURNOUT, _address
+                        , StringPrintf("<H %d %d>", _id, _thrown));
 }
 
 void Turnout::get_next_packet(unsigned code, dcc::Packet* packet)
@@ -0,0 +1,219 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef ROUTES_H_
+#define ROUTES_H_
+
+#include <deque>
+#include <executor/StateFlow.hxx>
+#include <openlcb/CallbackEventHandler.hxx>
+#include <os/OS.hxx>
+#include <stdint.h>
+#include <string>
+#include <utils/Singleton.hxx>
+#include <vector>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_ROUTE_PACKET_SPACING_MS
+#define CONFIG_ROUTE_PACKET_SPACING_MS 100
+#endif
+
+#ifndef CONFIG_ROUTE_PACKET_BATCH_SIZE
+#define CONFIG_ROUTE_PACKET_BATCH_SIZE 1
+#endif
+
+#ifndef CONFIG_ROUTE_PACKET_REPEATS
+#define CONFIG_ROUTE_PACKET_REPEATS 2
+#endif
+
+/// Single turnout of a route.
+struct RouteStep
+{
+  /// DCC accessory address of the turnout.
+  uint16_t address;
+
+  /// Requested state of the turnout.
+  bool thrown;
+};
+
+/// Manages named routes, each of which sets a list of turnouts.
+///
+/// Routes are triggered via @ref trigger (REST and DCC++) or by an LCC event
+/// assigned to the route. Triggered routes are queued and executed one at a
+/// time: the turnout state is updated via @ref TurnoutManager and the
+/// accessory packets are sent directly to the track in batches of
+/// CONFIG_ROUTE_PACKET_BATCH_SIZE with CONFIG_ROUTE_PACKET_SPACING_MS between
+/// batches, rather than registering every turnout as a refresh source. This
+/// limits the number of solenoids energized at the same time and prevents a
+/// large route from flooding the track packet queue.
+///
+/// Completion of a route is published via @ref StateBroadcast as
+/// @ref StateType::ROUTE using an id which is assigned when the route is
+/// loaded or created and does not change when other routes are removed.
+class RouteManager : public StateFlowBase, public Singleton<RouteManager>
+{
+public:
+  /// Constructor.
+  ///
+  /// @param node is the @ref openlcb::Node to register the route events on.
+  /// @param service is the @ref Service to execute routes on.
+  RouteManager(openlcb::Node *node, Service *service);
+
+  /// Parses a list of route steps.
+  ///
+  /// The list is a comma separated set of "ADDRESS:STATE" entries where
+  /// STATE is 1 for thrown and 0 for closed, for example "1:1,2:0,17:1".
+  ///
+  /// @param list is the list to parse.
+  /// @param steps will receive the route steps.
+  ///
+  /// @return false if the list is not valid.
+  static bool parse_steps(const std::string &list
+                        , std::vector<RouteStep> *steps);
+
+  /// Creates or updates a route.
+  ///
+  /// @param name is the name of the route, this may only contain letters,
+  /// digits, '_' and '-'.
+  /// @param steps are the turnouts to set, in order.
+  /// @param event is the LCC event which triggers the route, zero for none.
+  ///
+  /// @return false if the route is not valid.
+  bool createOrUpdate(const std::string &name, std::vector<RouteStep> steps
+                    , uint64_t event = 0);
+
+  /// Removes a route.
+  ///
+  /// @param name is the name of the route to remove.
+  ///
+  /// @return false if the route does not exist.
+  bool remove(const std::string &name);
+
+  /// Queues a route for execution, a route which is already queued will not
+  /// be queued a second time.
+  ///
+  /// @param name is the name of the route to execute.
+  ///
+  /// @return false if the route does not exist.
+  bool trigger(const std::string &name);
+
+  /// Serializes a single route as JSON.
+  ///
+  /// @param index is the index of the route to serialize.
+  /// @param json is the string to append the route to.
+  ///
+  /// @return false if index is beyond the last route.
+  bool getStateAsJson(size_t index, std::string *json);
+
+  /// @return the route as JSON or an empty string if the route does not
+  /// exist.
+  std::string getStateAsJson(const std::string &name);
+
+  /// @return all routes in the DCC++ "<route NAME COUNT STATE>" format.
+  std::string get_state_for_dccpp();
+
+private:
+  /// Route definition.
+  struct Route
+  {
+    /// Name of the route.
+    std::string name;
+
+    /// LCC event which triggers the route, zero when not assigned.
+    uint64_t event;
+
+    /// Turnouts to set, in order.
+    std::vector<RouteStep> steps;
+
+    /// Identifier used for the @ref StateBroadcast messages of the route.
+    uint16_t id;
+  };
+
+  /// Lock protecting @ref routes_, @ref pending_, @ref active_ and
+  /// @ref waiting_.
+  OSMutex lock_;
+
+  /// All known routes.
+  std::vector<Route> routes_;
+
+  /// Names of the routes waiting to be executed.
+  std::deque<std::string> pending_;
+
+  /// Name of the route being executed, empty when idle.
+  std::string active_;
+
+  /// Identifier of the route being executed.
+  uint16_t activeId_{0};
+
+  /// Identifier to assign to the next route which is loaded or created.
+  uint16_t nextId_{0};
+
+  /// Turnouts of the route being executed.
+  std::vector<RouteStep> steps_;
+
+  /// Index in @ref steps_ of the next turnout to set.
+  size_t step_{0};
+
+  /// Time the route being executed was started.
+  long long startTime_{0};
+
+  /// When true the flow is waiting for routes to be triggered.
+  bool waiting_{false};
+
+  /// Handler for the LCC events assigned to routes, the registry entry user
+  /// argument is not used as the route is found by event.
+  openlcb::CallbackEventHandler eventHandler_;
+
+  /// Timer used for pacing the accessory packets.
+  StateFlowTimer timer_{this};
+
+  STATE_FLOW_STATE(wait_for_route);
+  STATE_FLOW_STATE(send_step);
+  STATE_FLOW_STATE(fill_packet);
+
+  /// Finds a route by name, @ref lock_ must be held.
+  ///
+  /// @param name is the name of the route.
+  ///
+  /// @return the route or nullptr if there is no route with the name.
+  Route *find(const std::string &name);
+
+  /// Serializes a route as JSON, @ref lock_ must be held.
+  ///
+  /// @param route is the route to serialize.
+  /// @param readable when true the route state will be included and the
+  /// turnout state will be serialized as a readable string.
+  std::string to_json(const Route &route, bool readable);
+
+  /// Stores all routes, @ref lock_ must be held.
+  void persist();
+
+  /// Re-registers the route events with the LCC stack, this must be called
+  /// on the executor of this flow.
+  void register_events();
+
+  /// Schedules @ref register_events on the executor of this flow.
+  void update_events();
+
+  /// Triggers the route(s) assigned to an LCC event.
+  ///
+  /// @param event is the event which was received.
+  void event_received(uint64_t event);
+};
+
+#endif // ROUTES_H_
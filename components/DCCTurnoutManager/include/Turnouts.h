@@ -49,6 +49,20 @@ public:
   {
     return _address;
   }
+
+  /// @return the DCC++ turnout ID, this is maintained by the TurnoutManager.
+  uint16_t getId()
+  {
+    return _id;
+  }
+
+  /// Sets the DCC++ turnout ID.
+  ///
+  /// @param id is the position of the turnout in the TurnoutManager plus one.
+  void setId(uint16_t id)
+  {
+    _id = id;
+  }
   bool isThrown()
   {
     return _thrown;
@@ -68,10 +82,18 @@ public:
   void get_next_packet(unsigned code, dcc::Packet* packet) override;
 private:
   uint16_t _address;
+  uint16_t _id{0};
   bool _thrown;
   TurnoutType _type;
 };
 
+/// Manages the DCC turnouts known by the command station.
+///
+/// Turnouts are kept in creation order in @ref turnouts_, this order is used
+/// for the DCC++ turnout index. Lookups by DCC accessory address go through
+/// @ref addressIndex_ which maps the address directly to the position in
+/// @ref turnouts_ so that the accessory packets received via LCC events do
+/// not require a scan of all turnouts.
 class TurnoutManager : public dcc::PacketFlowInterface
                      , public Singleton<TurnoutManager>
 {
@@ -85,6 +107,16 @@ public:
   std::string set(uint16_t, bool=false, bool=true);
   std::string toggle(uint16_t);
   std::string getStateAsJson(bool=true);
+
+  /// Serializes a single turnout as JSON.
+  ///
+  /// @param index is the index of the turnout to serialize.
+  /// @param json is the string to append the turnout to.
+  /// @param readable when true the turnout type and state will be serialized
+  /// as readable strings.
+  ///
+  /// @return false if index is beyond the last turnout.
+  bool getStateAsJson(size_t index, std::string *json, bool readable=true);
   std::string get_state_for_dccpp();
   Turnout *createOrUpdate(const uint16_t, const TurnoutType=TurnoutType::LEFT);
   bool remove(const uint16_t);
@@ -93,9 +125,52 @@ public:
   uint16_t count();
   void send(Buffer<dcc::Packet> *, unsigned);
 private:
+  /// Number of entries in @ref addressIndex_, this covers the full 11-bit
+  /// DCC accessory address space.
+  static constexpr uint16_t TURNOUT_ADDRESS_SPACE = 2048;
+
   std::string get_state_as_json(bool);
   void persist();
+
+  /// Finds a turnout by DCC accessory address, @ref mux_ must be held.
+  ///
+  /// @param address is the DCC accessory address of the turnout.
+  ///
+  /// @return the index of the turnout in @ref turnouts_ or -1 if there is no
+  /// turnout with the address.
+  int find(const uint16_t address);
+
+  /// Adds a turnout to @ref turnouts_ and @ref addressIndex_, @ref mux_ must
+  /// be held.
+  ///
+  /// @param turnout is the turnout to add.
+  ///
+  /// @return the turnout which was added.
+  Turnout *add(std::unique_ptr<Turnout> turnout);
+
+  /// Sets the state of a turnout, creating it if it does not exist,
+  /// @ref mux_ must be held.
+  ///
+  /// @param address is the DCC accessory address of the turnout.
+  /// @param thrown is the requested state of the turnout.
+  /// @param sendDCC when true a DCC packet will be sent for the turnout.
+  ///
+  /// @return the index of the turnout in @ref turnouts_.
+  size_t set_state(const uint16_t address, bool thrown, bool sendDCC);
+
+  /// Rebuilds @ref addressIndex_ and the DCC++ IDs for the turnouts starting
+  /// at the provided index in @ref turnouts_, @ref mux_ must be held.
+  ///
+  /// @param first is the first index in @ref turnouts_ to update.
+  void reindex(size_t first = 0);
+
   std::vector<std::unique_ptr<Turnout>> turnouts_;
+
+  /// Position in @ref turnouts_ (plus one) of the turnout for each DCC
+  /// accessory address, zero when there is no turnout with the address. This
+  /// is allocated on the heap as the TurnoutManager is created on the stack
+  /// of app_main.
+  std::vector<uint16_t> addressIndex_;
   openlcb::DccAccyConsumer turnoutEventConsumer_;
   AutoPersistFlow persistFlow_;
   bool dirty_;
@@ -16,184 +16,309 @@ COPYRIGHT (c) 2019 Mike Dunston
 **********************************************************************/
 
 #include "DCCProgrammer.h"
+#include "sdkconfig.h"
 
 #include <dcc/ProgrammingTrackBackend.hxx>
 #include <dcc/DccDebug.hxx>
 #include <DuplexedTrackIf.h>
-#include <utils/Uninitialized.hxx>
+#include <RailComFeedback.h>
 
 // number of attempts the programming track will make to read/write a CV
 static constexpr uint8_t PROG_TRACK_CV_ATTEMPTS = 3;
 
-static bool enterServiceMode()
-{
-  BufferPtr<ProgrammingTrackRequest> req =
-    invoke_flow(Singleton<ProgrammingTrackBackend>::instance()
-              , ProgrammingTrackRequest::ENTER_SERVICE_MODE);
-  return req->data()->resultCode == 0;
-}
+/// Number of decoder reset packets sent after entering service mode.
+static constexpr unsigned SERVICE_MODE_RESET_COUNT = 15;
+
+/// Number of decoder reset packets sent after a write to give the decoder
+/// time to store the new value before it is verified.
+static constexpr unsigned WRITE_RECOVERY_RESET_COUNT = 5;
+
+/// Number of times a service mode packet is repeated while waiting for an
+/// acknowledgement.
+static constexpr unsigned SERVICE_MODE_PACKET_REPEAT_COUNT = 15;
+
+/// Number of times a POM read request will be sent before giving up.
+static constexpr uint8_t POM_READ_ATTEMPTS = 3;
+
+/// Time to wait for the RailCom reply to a POM read request.
+static constexpr uint32_t POM_READ_TIMEOUT_MSEC = 250;
 
-static void leaveServiceMode()
+/// Direct mode instruction for verifying a single bit of a CV.
+static constexpr uint8_t SERVICE_MODE_VERIFY_BIT_CMD = 0x78;
+
+/// Verify bit data, the low three bits are the bit number to verify as one.
+static constexpr uint8_t SERVICE_MODE_VERIFY_BIT_ONE = 0xE8;
+
+CVProgrammer::CVProgrammer(Service *service) : StateFlowBase(service)
 {
-  invoke_flow(Singleton<ProgrammingTrackBackend>::instance()
-            , ProgrammingTrackRequest::EXIT_SERVICE_MODE);
+  start_flow(STATE(wait_for_jobs));
 }
 
-static bool sendServiceModeDecoderReset()
+void CVProgrammer::submit(std::vector<CVJob> jobs)
 {
-  BufferPtr<ProgrammingTrackRequest> req =
-    invoke_flow(Singleton<ProgrammingTrackBackend>::instance()
-              , ProgrammingTrackRequest::SEND_RESET, 15);
-  return (req->data()->resultCode == 0);
+  OSMutexLock l(&lock_);
+  for (auto &job : jobs)
+  {
+    pending_.push_back(std::move(job));
+  }
+  if (waiting_)
+  {
+    waiting_ = false;
+    notify();
+  }
 }
 
-static bool sendServiceModePacketWithAck(dcc::Packet pkt)
+StateFlowBase::Action CVProgrammer::wait_for_jobs()
 {
-  BufferPtr<ProgrammingTrackRequest> req =
-   invoke_flow(Singleton<ProgrammingTrackBackend>::instance()
-             , ProgrammingTrackRequest::SEND_PROGRAMMING_PACKET, pkt
-             , 15);
-  return req->data()->hasAck_;
+  {
+    OSMutexLock l(&lock_);
+    if (pending_.empty())
+    {
+      waiting_ = true;
+      return wait();
+    }
+  }
+  return invoke_subflow_and_wait(Singleton<ProgrammingTrackBackend>::instance()
+                               , STATE(service_mode_entered)
+                               , ProgrammingTrackRequest::ENTER_SERVICE_MODE);
 }
 
-static bool executeProgTrackWriteRequest(dcc::Packet pkt)
+StateFlowBase::Action CVProgrammer::service_mode_entered()
 {
-  if (enterServiceMode())
+  auto b = get_buffer_deleter(
+    full_allocation_result(Singleton<ProgrammingTrackBackend>::instance()));
+  if (b->data()->resultCode != 0)
   {
-    LOG(VERBOSE, "[PROG] Resetting DCC Decoder");
-    if (!sendServiceModeDecoderReset())
+    LOG_ERROR("[PROG] Failed to enter programming mode!");
+    std::deque<CVJob> failed;
     {
-      leaveServiceMode();
-      return false;
+      OSMutexLock l(&lock_);
+      failed.swap(pending_);
     }
-    LOG(VERBOSE, "[PROG] Sending DCC packet: %s", dcc::packet_to_string(pkt).c_str());
-    if (!sendServiceModePacketWithAck(pkt))
+    for (auto &job : failed)
     {
-      leaveServiceMode();
-      return false;
+      if (job.done)
+      {
+        job.done(job.cv, -1);
+      }
     }
-    LOG(VERBOSE, "[PROG] Resetting DCC Decoder (after PROG)");
-    if (!sendServiceModeDecoderReset())
+    return call_immediately(STATE(wait_for_jobs));
+  }
+  LOG(VERBOSE, "[PROG] Resetting DCC Decoder");
+  return send_reset(SERVICE_MODE_RESET_COUNT);
+}
+
+StateFlowBase::Action CVProgrammer::reset_sent()
+{
+  take_ack();
+  if (job_.type != CVJobType::READ_BYTE && attempt_)
+  {
+    // this reset followed a write, verify the written value.
+    return call_immediately(STATE(verify));
+  }
+  return call_immediately(STATE(start_job));
+}
+
+StateFlowBase::Action CVProgrammer::start_job()
+{
+  {
+    OSMutexLock l(&lock_);
+    if (!pending_.empty())
     {
-      leaveServiceMode();
-      return false;
+      job_ = std::move(pending_.front());
+      pending_.pop_front();
+      attempt_ = 0;
+      return call_immediately(STATE(start_attempt));
     }
-    leaveServiceMode();
-    return true;
   }
-  return false;
+  // all jobs have been processed, the programming track can now be released.
+  job_ = {};
+  attempt_ = 0;
+  return invoke_subflow_and_wait(Singleton<ProgrammingTrackBackend>::instance()
+                               , STATE(service_mode_left)
+                               , ProgrammingTrackRequest::EXIT_SERVICE_MODE);
 }
 
-int16_t readCV(const uint16_t cv)
+StateFlowBase::Action CVProgrammer::start_attempt()
 {
-  int16_t value = -1;
-  if (enterServiceMode())
-  {
-    for(int attempt = 0; attempt < PROG_TRACK_CV_ATTEMPTS && value == -1; attempt++) {
-      LOG(INFO, "[PROG %d/%d] Attempting to read CV %d", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv);
-      // reset cvValue to all bits OFF
-      value = 0;
-      for(uint8_t bit = 0; bit < 8; bit++) {
-        LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7]", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, bit);
-        dcc::Packet pkt;
-        pkt.start_dcc_svc_packet();
-        pkt.add_dcc_prog_command(0x78, cv, 0xE8 + bit);
-        if (sendServiceModePacketWithAck(pkt))
-        {
-          LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7] ON", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, bit);
-          value &= (1 << bit);
-        } else {
-          LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7] OFF", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, bit);
-        }
-      }
-      dcc::Packet pkt;
-      pkt.set_dcc_svc_verify_byte(cv, value);
-      if (sendServiceModePacketWithAck(pkt))
-      {
-        LOG(INFO, "[PROG %d/%d] CV %d, verified as %d", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, value);
-      }
-      else
-      {
-        LOG(WARNING, "[PROG %d/%d] CV %d, could not be verified", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv);
-        value = -1;
-      }
-    }
-    LOG(INFO, "[PROG] CV %d value is %d", cv, value);
-    leaveServiceMode();
+  attempt_++;
+  dcc::Packet pkt;
+  if (job_.type == CVJobType::READ_BYTE)
+  {
+    LOG(INFO, "[PROG %d/%d] Attempting to read CV %d", attempt_
+      , PROG_TRACK_CV_ATTEMPTS, job_.cv);
+    value_ = 0;
+    bit_ = 0;
+    return call_immediately(STATE(read_bit));
+  }
+  else if (job_.type == CVJobType::WRITE_BYTE)
+  {
+    LOG(INFO, "[PROG %d/%d] Attempting to write CV %d as %d", attempt_
+      , PROG_TRACK_CV_ATTEMPTS, job_.cv, job_.value);
+    pkt.set_dcc_svc_write_byte(job_.cv, job_.value);
   }
   else
   {
-    LOG_ERROR("[PROG] Failed to enter programming mode!");
+    LOG(INFO, "[PROG %d/%d] Attempting to write CV %d bit %d as %d", attempt_
+      , PROG_TRACK_CV_ATTEMPTS, job_.cv, job_.bit, job_.value);
+    pkt.set_dcc_svc_write_bit(job_.cv, job_.bit, job_.value);
   }
-  return value;
+  return send_packet(pkt, STATE(write_done));
 }
 
-bool writeProgCVByte(const uint16_t cv, const uint8_t value)
+StateFlowBase::Action CVProgrammer::read_bit()
 {
-  bool writeVerified = false;
-  dcc::Packet pkt, verifyPkt;
-  pkt.set_dcc_svc_write_byte(cv, value);
-  verifyPkt.set_dcc_svc_verify_byte(cv, value);
-  
-  for(uint8_t attempt = 1;
-      attempt <= PROG_TRACK_CV_ATTEMPTS && !writeVerified;
-      attempt++)
-  {
-    LOG(INFO, "[PROG %d/%d] Attempting to write CV %d as %d", attempt
-      , PROG_TRACK_CV_ATTEMPTS, cv, value);
-
-    if (executeProgTrackWriteRequest(pkt) &&
-        executeProgTrackWriteRequest(verifyPkt))
-    {
-      // write byte and verify byte were successful
-      writeVerified = true;
-    }
+  dcc::Packet pkt;
+  pkt.start_dcc_svc_packet();
+  pkt.add_dcc_prog_command(SERVICE_MODE_VERIFY_BIT_CMD, job_.cv
+                         , SERVICE_MODE_VERIFY_BIT_ONE + bit_);
+  return send_packet(pkt, STATE(read_bit_done));
+}
 
-    if (!writeVerified)
-    {
-      LOG(WARNING, "[PROG %d/%d] CV %d write value %d could not be verified."
-        , attempt, PROG_TRACK_CV_ATTEMPTS, cv, value);
-    }
-    else
-    {
-      LOG(INFO, "[PROG %d/%d] CV %d write value %d verified.", attempt
-        , PROG_TRACK_CV_ATTEMPTS, cv, value);
-    }
+StateFlowBase::Action CVProgrammer::read_bit_done()
+{
+  if (take_ack())
+  {
+    value_ |= (1 << bit_);
+  }
+  LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7] %s", attempt_
+    , PROG_TRACK_CV_ATTEMPTS, job_.cv, bit_
+    , (value_ & (1 << bit_)) ? "ON" : "OFF");
+  if (++bit_ < 8)
+  {
+    return call_immediately(STATE(read_bit));
   }
-  return writeVerified;
+  return call_immediately(STATE(verify));
 }
 
-bool writeProgCVBit(const uint16_t cv, const uint8_t bit, const bool value)
+StateFlowBase::Action CVProgrammer::write_done()
 {
-  bool writeVerified = false;
-  dcc::Packet pkt, verifyPkt;
-  pkt.set_dcc_svc_write_bit(cv, bit, value);
-  verifyPkt.set_dcc_svc_verify_bit(cv, bit, value);
-
-  for(uint8_t attempt = 1;
-      attempt <= PROG_TRACK_CV_ATTEMPTS && !writeVerified;
-      attempt++) {
-    LOG(INFO, "[PROG %d/%d] Attempting to write CV %d bit %d as %d", attempt
-      , PROG_TRACK_CV_ATTEMPTS, cv, bit, value);
-    if (executeProgTrackWriteRequest(pkt) &&
-        executeProgTrackWriteRequest(verifyPkt))
-    {
-      // write byte and verify byte were successful
-      writeVerified = true;
-    }
+  if (!take_ack())
+  {
+    return call_immediately(STATE(attempt_failed));
+  }
+  LOG(VERBOSE, "[PROG] Resetting DCC Decoder (after PROG)");
+  return send_reset(WRITE_RECOVERY_RESET_COUNT);
+}
 
-    if (!writeVerified)
-    {
-      LOG(WARNING, "[PROG %d/%d] CV %d write bit %d could not be verified."
-        , attempt, PROG_TRACK_CV_ATTEMPTS, cv, bit);
-    }
-    else
-    {
-      LOG(INFO, "[PROG %d/%d] CV %d write bit %d verified.", attempt
-        , PROG_TRACK_CV_ATTEMPTS, cv, bit);
-    }
+StateFlowBase::Action CVProgrammer::verify()
+{
+  dcc::Packet pkt;
+  if (job_.type == CVJobType::READ_BYTE)
+  {
+    pkt.set_dcc_svc_verify_byte(job_.cv, value_);
+  }
+  else if (job_.type == CVJobType::WRITE_BYTE)
+  {
+    pkt.set_dcc_svc_verify_byte(job_.cv, job_.value);
+  }
+  else
+  {
+    pkt.set_dcc_svc_verify_bit(job_.cv, job_.bit, job_.value);
+  }
+  return send_packet(pkt, STATE(verify_done));
+}
+
+StateFlowBase::Action CVProgrammer::verify_done()
+{
+  if (!take_ack())
+  {
+    return call_immediately(STATE(attempt_failed));
+  }
+  if (job_.type == CVJobType::READ_BYTE)
+  {
+    LOG(INFO, "[PROG %d/%d] CV %d, verified as %d", attempt_
+      , PROG_TRACK_CV_ATTEMPTS, job_.cv, value_);
+    return complete_job(value_);
+  }
+  LOG(INFO, "[PROG %d/%d] CV %d write value %d verified.", attempt_
+    , PROG_TRACK_CV_ATTEMPTS, job_.cv, job_.value);
+  return complete_job(job_.value);
+}
+
+StateFlowBase::Action CVProgrammer::attempt_failed()
+{
+  LOG(WARNING, "[PROG %d/%d] CV %d could not be verified.", attempt_
+    , PROG_TRACK_CV_ATTEMPTS, job_.cv);
+  if (attempt_ < PROG_TRACK_CV_ATTEMPTS)
+  {
+    return call_immediately(STATE(start_attempt));
+  }
+  return complete_job(-1);
+}
+
+StateFlowBase::Action CVProgrammer::service_mode_left()
+{
+  take_ack();
+  return call_immediately(STATE(wait_for_jobs));
+}
+
+StateFlowBase::Action CVProgrammer::send_packet(dcc::Packet pkt
+                                              , Callback next)
+{
+  LOG(VERBOSE, "[PROG] Sending DCC packet: %s"
+    , dcc::packet_to_string(pkt).c_str());
+  return invoke_subflow_and_wait(Singleton<ProgrammingTrackBackend>::instance()
+                               , next
+                               , ProgrammingTrackRequest::SEND_PROGRAMMING_PACKET
+                               , pkt, SERVICE_MODE_PACKET_REPEAT_COUNT);
+}
+
+StateFlowBase::Action CVProgrammer::send_reset(unsigned count)
+{
+  return invoke_subflow_and_wait(Singleton<ProgrammingTrackBackend>::instance()
+                               , STATE(reset_sent)
+                               , ProgrammingTrackRequest::SEND_RESET, count);
+}
+
+bool CVProgrammer::take_ack()
+{
+  auto b = get_buffer_deleter(
+    full_allocation_result(Singleton<ProgrammingTrackBackend>::instance()));
+  return b->data()->hasAck_;
+}
+
+StateFlowBase::Action CVProgrammer::complete_job(int16_t result)
+{
+  LOG(INFO, "[PROG] CV %d result %d", job_.cv, result);
+  if (job_.done)
+  {
+    job_.done(job_.cv, result);
   }
-  return writeVerified;
+  // clear the attempt counter so the next reset is not treated as a write
+  // recovery.
+  attempt_ = 0;
+  return call_immediately(STATE(start_job));
+}
+
+// Submits a single job to the CVProgrammer and blocks until it completes.
+static int16_t execute_cv_job(CVJob job)
+{
+  int16_t result = -1;
+  SyncNotifiable n;
+  job.done = [&result, &n](uint16_t cv, int16_t value)
+  {
+    result = value;
+    n.notify();
+  };
+  Singleton<CVProgrammer>::instance()->submit({std::move(job)});
+  n.wait_for_notification();
+  return result;
+}
+
+int16_t readCV(const uint16_t cv)
+{
+  return execute_cv_job({CVJobType::READ_BYTE, cv, 0, 0, nullptr});
+}
+
+bool writeProgCVByte(const uint16_t cv, const uint8_t value)
+{
+  return execute_cv_job({CVJobType::WRITE_BYTE, cv, value, 0, nullptr}) >= 0;
+}
+
+bool writeProgCVBit(const uint16_t cv, const uint8_t bit, const bool value)
+{
+  return execute_cv_job({CVJobType::WRITE_BIT, cv, value, bit, nullptr}) >= 0;
 }
 
 void writeOpsCVByte(const uint16_t locoAddress, const uint16_t cv
@@ -256,3 +381,121 @@ void writeOpsCVBit(const uint16_t locoAddress, const uint16_t cv
     LOG_ERROR("[OPS] Failed to retrieve DCC Packet for programming request");
   }
 }
+
+OpsCVReader::OpsCVReader(Service *service) : StateFlowBase(service)
+{
+  start_flow(STATE(wait_for_request));
+}
+
+void OpsCVReader::submit(uint16_t address, uint16_t cv, CVJobCallback done)
+{
+  OSMutexLock l(&lock_);
+  pending_.push_back({address, cv, std::move(done)});
+  if (waiting_)
+  {
+    waiting_ = false;
+    notify();
+  }
+}
+
+StateFlowBase::Action OpsCVReader::wait_for_request()
+{
+  OSMutexLock l(&lock_);
+  if (pending_.empty())
+  {
+    waiting_ = true;
+    return wait();
+  }
+  request_ = std::move(pending_.front());
+  pending_.pop_front();
+  attempt_ = 0;
+  return call_immediately(STATE(send_request));
+}
+
+StateFlowBase::Action OpsCVReader::send_request()
+{
+  attempt_++;
+  uint16_t address = request_.address;
+  uint16_t cv = request_.cv;
+  {
+    OSMutexLock l(&lock_);
+    value_ = -1;
+  }
+  dcc::PacketFlowInterface::message_type *pkt = nullptr;
+  mainBufferPool->alloc(&pkt);
+  if (!pkt)
+  {
+    LOG_ERROR("[OPS] Failed to retrieve DCC Packet for programming request");
+    return call_immediately(STATE(request_done));
+  }
+  LOG(INFO, "[OPS %d/%d] Reading CV %d for loco %d", attempt_
+    , POM_READ_ATTEMPTS, cv, address);
+  Singleton<esp32cs::RailComFeedbackCache>::instance()->expect_pom(
+    address, cv, [this, address, cv](int16_t value)
+    {
+      reply_received(address, cv, value);
+    });
+  pkt->data()->start_dcc_packet();
+  if(address > 127)
+  {
+    pkt->data()->add_dcc_address(dcc::DccLongAddress(address));
+  }
+  else
+  {
+    pkt->data()->add_dcc_address(dcc::DccShortAddress(address));
+  }
+  pkt->data()->add_dcc_pom_read1(cv - 1);
+  pkt->data()->packet_header.rept_count = 3;
+  Singleton<esp32cs::DuplexedTrackIf>::instance()->send(pkt);
+
+  // the decoder replies via RailCom in the cutout following the packet.
+  return sleep_and_call(&timer_, MSEC_TO_NSEC(POM_READ_TIMEOUT_MSEC)
+                      , STATE(request_done));
+}
+
+StateFlowBase::Action OpsCVReader::request_done()
+{
+  int16_t value;
+  {
+    OSMutexLock l(&lock_);
+    value = value_;
+  }
+  if (value < 0)
+  {
+    Singleton<esp32cs::RailComFeedbackCache>::instance()->cancel_pom();
+    if (attempt_ < POM_READ_ATTEMPTS)
+    {
+      return call_immediately(STATE(send_request));
+    }
+    LOG(WARNING, "[OPS] No RailCom reply for CV %d from loco %d"
+      , request_.cv, request_.address);
+  }
+  else
+  {
+    LOG(INFO, "[OPS] CV %d for loco %d is %d", request_.cv, request_.address
+      , value);
+  }
+  if (request_.done)
+  {
+    request_.done(request_.cv, value);
+  }
+  return call_immediately(STATE(wait_for_request));
+}
+
+void OpsCVReader::reply_received(uint16_t address, uint16_t cv, int16_t value)
+{
+  {
+    OSMutexLock l(&lock_);
+    if (address != request_.address || cv != request_.cv)
+    {
+      // reply to a request which has already timed out.
+      return;
+    }
+    value_ = value;
+  }
+  // the timer can only be triggered on the executor of the flow.
+  service()->executor()->add(new CallbackExecutable([this]()
+  {
+    timer_.ensure_triggered();
+  }));
+}
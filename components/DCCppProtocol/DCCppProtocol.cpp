@@ -33,8 +33,8 @@ and has been adapter for use in ESP32 COMMAND STATION.
 #include <esp_wifi.h>
 #include <esp_wifi_types.h>
 #include <memory>
-#include <HttpStringUtils.h>
 #include <openlcb/SimpleStack.hxx>
+#include <Trace.h>
 #if CONFIG_GPIO_OUTPUTS
 #include <Outputs.h>
 #endif // CONFIG_GPIO_OUTPUTS
@@ -45,20 +45,83 @@ and has been adapter for use in ESP32 COMMAND STATION.
 #include <S88Sensors.h>
 #endif // CONFIG_GPIO_S88
 #endif // CONFIG_GPIO_SENSORS
+#include <Routes.h>
 #include <Turnouts.h>
 
 using dcc::SpeedType;
+using esp32cs::TraceEvent;
+using esp32cs::TraceSource;
 using std::vector;
 
 vector<std::unique_ptr<DCCPPProtocolCommand>> commands;
 
+// Number of slots in the command lookup table, this must be a power of two
+// and at least twice the number of registered commands.
+static constexpr size_t COMMAND_TABLE_SIZE = 64;
+
+// Entry in the command lookup table.
+struct CommandTableEntry
+{
+  // Hash of the command ID.
+  uint32_t hash;
+
+  // Command ID.
+  string id;
+
+  // Command handler, nullptr when the slot is not used.
+  DCCPPProtocolCommand *command;
+};
+
+// Open addressed hash table of command IDs to handlers, collisions are
+// resolved via linear probing. The table is never more than half full so
+// most lookups are resolved with a single probe.
+static CommandTableEntry commandTable[COMMAND_TABLE_SIZE];
+
+// FNV-1a hash of the command ID.
+static inline uint32_t command_hash(const char *id, size_t length)
+{
+  uint32_t hash = 2166136261UL;
+  for (size_t idx = 0; idx < length; idx++)
+  {
+    hash = (hash ^ (uint8_t)id[idx]) * 16777619UL;
+  }
+  return hash;
+}
+
+// Returns the handler for the command ID or nullptr if it is not registered.
+static DCCPPProtocolCommand *find_command(const char *id, size_t length)
+{
+  uint32_t hash = command_hash(id, length);
+  for (size_t slot = hash & (COMMAND_TABLE_SIZE - 1);
+       commandTable[slot].command;
+       slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1))
+  {
+    if (commandTable[slot].hash == hash &&
+        !commandTable[slot].id.compare(0, string::npos, id, length))
+    {
+      return commandTable[slot].command;
+    }
+  }
+  return nullptr;
+}
+
+static inline bool is_space(char ch)
+{
+  return ch == ' ';
+}
+
+static inline bool is_not_space(char ch)
+{
+  return ch != ' ';
+}
+
 // <R {CV} {CALLBACK} {CALLBACK-SUB}> command handler, this command attempts
 // to read a CV value from the PROGRAMMING track. The returned value will be
 // the actual CV value or -1 when there is a failure reading or verifying the
 // CV.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ReadCVCommand, "R", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(ReadCVCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t cv = std::stoi(arguments[0]);
   uint16_t callback = std::stoi(arguments[1]);
@@ -77,7 +140,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ReadCVCommand,
 // verifying the CV value.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVByteProgCommand, "W", 4)
 DCC_PROTOCOL_COMMAND_HANDLER(WriteCVByteProgCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t cv = std::stoi(arguments[0]);
   int16_t value = std::stoi(arguments[1]);
@@ -97,7 +160,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(WriteCVByteProgCommand,
 // there is a failure writing or verifying the CV value.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVBitProgCommand, "B", 5)
 DCC_PROTOCOL_COMMAND_HANDLER(WriteCVBitProgCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   int cv = std::stoi(arguments[0]);
   uint8_t bit = std::stoi(arguments[1]);
@@ -117,7 +180,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(WriteCVBitProgCommand,
 // on the MAIN OPERATIONS track for a given LOCO. No verification is attempted.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVByteOpsCommand, "w", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(WriteCVByteOpsCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   writeOpsCVByte(std::stoi(arguments[0]), std::stoi(arguments[1])
                , std::stoi(arguments[2]));
@@ -129,7 +192,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(WriteCVByteOpsCommand,
 // is attempted.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVBitOpsCommand, "b", 4)
 DCC_PROTOCOL_COMMAND_HANDLER(WriteCVBitOpsCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   writeOpsCVBit(std::stoi(arguments[0]), std::stoi(arguments[1])
               , std::stoi(arguments[2]), arguments[3][0] == '1');
@@ -151,7 +214,7 @@ string convert_loco_to_dccpp_state(openlcb::TrainImpl *impl, size_t id)
 // <F> command handler, this command sends the current free heap space as response.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(FreeHeapCommand, "F", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(FreeHeapCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return StringPrintf("<f %d>", os_get_free_heap());
 })
@@ -160,7 +223,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(FreeHeapCommand,
 // locomotives.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(EStopCommand, "estop", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(EStopCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   esp32cs::initiate_estop();
   return COMMAND_SUCCESSFUL_RESPONSE;
@@ -168,14 +231,14 @@ DCC_PROTOCOL_COMMAND_HANDLER(EStopCommand,
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(CurrentDrawCommand, "c", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(CurrentDrawCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return esp32cs::get_track_state_for_dccpp();
 })
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(PowerOnCommand, "1", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(PowerOnCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   esp32cs::enable_ops_track_output();
   // hardcoded response since enable/disable is deferred until the next
@@ -185,7 +248,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(PowerOnCommand,
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(PowerOffCommand, "0", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(PowerOffCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   esp32cs::disable_track_outputs();
   // hardcoded response since enable/disable is deferred until the next
@@ -193,33 +256,27 @@ DCC_PROTOCOL_COMMAND_HANDLER(PowerOffCommand,
   return StringPrintf("<p0 %s>", CONFIG_OPS_TRACK_NAME);
 })
 
-#define GET_LOCO_VIA_EXECUTOR(NAME, address)                                          \
-  openlcb::TrainImpl *NAME = nullptr;                                                 \
-  {                                                                                   \
-    SyncNotifiable n;                                                                 \
-    Singleton<esp32cs::LCCStackManager>::instance()->stack()->executor()->add(        \
-    new CallbackExecutable([&]()                                                      \
-    {                                                                                 \
-      NAME = Singleton<commandstation::AllTrainNodes>::instance()->get_train_impl(    \
-                                        commandstation::DccMode::DCC_128, address);   \
-      n.notify();                                                                     \
-    }));                                                                              \
-    n.wait_for_notification();                                                        \
-  }
+// Retrieves the train for a DCC address. Existing trains are found without
+// involving the LCC executor, only the creation of a new train will block
+// until the LCC executor has processed it.
+#define GET_LOCO(NAME, address)                                                       \
+  openlcb::TrainImpl *NAME =                                                          \
+    Singleton<commandstation::AllTrainNodes>::instance()->find_or_create_train_impl(  \
+                                        commandstation::DccMode::DCC_128, address)
 
 // <t {REGISTER} {LOCO} {SPEED} {DIRECTION}> command handler, this command
 // converts the provided locomotive control command into a compatible DCC
 // locomotive control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ThrottleCommandAdapter, "t", 4)
 DCC_PROTOCOL_COMMAND_HANDLER(ThrottleCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   int reg_num = std::stoi(arguments[0]);
   uint16_t loco_addr = std::stoi(arguments[1]);
   uint8_t req_speed = std::stoi(arguments[2]);
   uint8_t req_dir = std::stoi(arguments[3]);
 
-  GET_LOCO_VIA_EXECUTOR(impl, loco_addr);
+  GET_LOCO(impl, loco_addr);
   LOG(INFO, "[DCC++ loco %d] Set speed to %d", loco_addr, req_speed);
   LOG(INFO, "[DCC++ loco %d] Set direction to %s", loco_addr
       , req_dir ? "FWD" : "REV");
@@ -228,6 +285,8 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleCommandAdapter,
   {
     speed.set_direction(SpeedType::REVERSE);
   }
+  TRACE_EVENT(TraceEvent::THROTTLE, loco_addr
+            , trace_throttle_arg(TraceSource::DCCPP, speed.get_wire()));
   impl->set_speed(speed);
   return convert_loco_to_dccpp_state(impl, reg_num);
 });
@@ -237,13 +296,13 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleCommandAdapter,
 // locomotive control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ThrottleExCommandAdapter, "tex", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t loco_addr = std::stoi(arguments[0]);
   int8_t req_speed = std::stoi(arguments[1]);
   int8_t req_dir = std::stoi(arguments[2]);
 
-  GET_LOCO_VIA_EXECUTOR(impl, loco_addr);
+  GET_LOCO(impl, loco_addr);
 
   if (req_speed >= 0)
   {
@@ -258,6 +317,8 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
     }
     LOG(INFO, "[DCC++ loco %d] Set speed to %d (%s)", loco_addr, abs(req_speed)
       , impl->get_speed().direction() == SpeedType::FORWARD ? "FWD" : "REV");
+    TRACE_EVENT(TraceEvent::THROTTLE, loco_addr
+              , trace_throttle_arg(TraceSource::DCCPP, speed.get_wire()));
     impl->set_speed(speed);
   }
   else if (req_dir >= 0)
@@ -266,6 +327,8 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
     speed.set_direction(req_dir ? SpeedType::FORWARD : SpeedType::REVERSE);
     LOG(INFO, "[DCC++ loco %d] Set direction to %s", loco_addr
       , impl->get_speed().direction() == SpeedType::FORWARD ? "FWD" : "REV");
+    TRACE_EVENT(TraceEvent::THROTTLE, loco_addr
+              , trace_throttle_arg(TraceSource::DCCPP, speed.get_wire()));
     impl->set_speed(speed);
   }
   return convert_loco_to_dccpp_state(impl, 0);
@@ -275,7 +338,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
 // locomotive function update into a compatible DCC function control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(FunctionCommandAdapter, "f", 2)
 DCC_PROTOCOL_COMMAND_HANDLER(FunctionCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t loco_addr = std::stoi(arguments[0]);
   uint8_t func_byte = std::stoi(arguments[1]);
@@ -283,7 +346,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(FunctionCommandAdapter,
   uint8_t last{4};
   uint8_t bits{func_byte};
 
-  GET_LOCO_VIA_EXECUTOR(impl, loco_addr);
+  GET_LOCO(impl, loco_addr);
 
   // check this is a request for functions F13-F28
   if(arguments.size() > 2)
@@ -333,13 +396,13 @@ DCC_PROTOCOL_COMMAND_HANDLER(FunctionCommandAdapter,
 // locomotive function update into a compatible DCC function control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(FunctionExCommandAdapter, "fex", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(FunctionExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   int loco_addr = std::stoi(arguments[0]);
   int function = std::stoi(arguments[1]);
   int state = std::stoi(arguments[2]);
 
-  GET_LOCO_VIA_EXECUTOR(impl, loco_addr);
+  GET_LOCO(impl, loco_addr);
   LOG(INFO, "[DCC++ loco %d] Set function %d to %d", loco_addr, function
     , state);
   impl->set_fn(function, state);
@@ -354,7 +417,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(FunctionExCommandAdapter,
 // SHOW  : <C>
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ConsistCommandAdapter, "C", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(ConsistCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   // TODO: reimplement
   /*
@@ -461,7 +524,7 @@ where
 */
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(TurnoutCommandAdapter, "T", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(TurnoutCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   auto turnoutManager = Singleton<TurnoutManager>::instance();
   if (arguments.empty())
@@ -534,7 +597,7 @@ where
 */
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(TurnoutExCommandAdapter, "Tex", 1)
 DCC_PROTOCOL_COMMAND_HANDLER(TurnoutExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if (!arguments.empty())
   {
@@ -571,7 +634,7 @@ where
 */
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(AccessoryCommand, "a", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(AccessoryCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return Singleton<TurnoutManager>::instance()->set(
       decodeDCCAccessoryAddress(std::stoi(arguments[0])
@@ -581,12 +644,40 @@ DCC_PROTOCOL_COMMAND_HANDLER(AccessoryCommand,
 })
 
 
+/*
+ <route>:               lists all defined routes
+      returns: <route NAME COUNT STATE> for each defined route or <X> if no
+               routes are defined
+ <route NAME>:          queues the route NAME for execution
+      returns: <O> if successful and <X> if the route does not exist
+
+where
+  NAME:       the name of the route
+  COUNT:      the number of turnouts in the route
+  STATE:      0 (idle), 1 (queued) or 2 (running)
+*/
+DECLARE_DCC_PROTOCOL_COMMAND_CLASS(RouteCommand, "route", 0)
+DCC_PROTOCOL_COMMAND_HANDLER(RouteCommand,
+[](const vector<string> &arguments)
+{
+  auto routeManager = Singleton<RouteManager>::instance();
+  if (arguments.empty())
+  {
+    return routeManager->get_state_for_dccpp();
+  }
+  if (routeManager->trigger(arguments[0]))
+  {
+    return COMMAND_SUCCESSFUL_RESPONSE;
+  }
+  return COMMAND_FAILED_RESPONSE;
+})
+
 // <e> command handler, this command will clear all stored Turnouts, Outputs,
 // Sensors and S88 Sensors (if enabled) after sending this command. Note, when
 // running with the PCB configuration only turnouts will be cleared.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ConfigErase, "e", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(ConfigErase,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   Singleton<TurnoutManager>::instance()->clear();
 #if CONFIG_GPIO_SENSORS
@@ -610,7 +701,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ConfigErase,
 // PCB configuration only turnouts will be stored.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ConfigStore, "E", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(ConfigStore,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return StringPrintf("<e %d %d %d>"
                     , Singleton<TurnoutManager>::instance()->count()
@@ -635,7 +726,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ConfigStore,
 // command.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(StatusCommand, "s", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(StatusCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   wifi_mode_t mode;
   const esp_app_desc_t *app_data = esp_ota_get_app_description();
@@ -704,6 +795,7 @@ void DCCPPProtocolHandler::init()
 #endif
   registerCommand(new TurnoutCommandAdapter());
   registerCommand(new TurnoutExCommandAdapter());
+  registerCommand(new RouteCommand());
 #if defined(CONFIG_GPIO_SENSORS)
   registerCommand(new SensorCommandAdapter());
 #if defined(CONFIG_GPIO_S88)
@@ -717,88 +809,130 @@ void DCCPPProtocolHandler::init()
 
 string DCCPPProtocolHandler::process(const string &commandString)
 {
-  vector<string> parts;
-  http::tokenize(commandString, parts);
-  string commandID = parts.front();
-  parts.erase(parts.begin());
-  LOG(VERBOSE, "Command: %s, argument count: %d", commandID.c_str()
-    , parts.size());
-  auto command = std::find_if(commands.begin(), commands.end()
-  , [commandID](const auto &cmd)
+  vector<string> args;
+  return process(commandString.data(), commandString.length(), args);
+}
+
+string DCCPPProtocolHandler::process(const char *command, size_t length
+                                   , vector<string> &args)
+{
+  // tokenize the command in place, the first token is the command ID and
+  // the remaining tokens are assigned to the reused arguments container.
+  const char *end = command + length;
+  const char *pos = std::find_if(command, end, is_not_space);
+  const char *id_end = std::find_if(pos, end, is_space);
+  int id_len = id_end - pos;
+  size_t count = 0;
+  for (const char *token = std::find_if(id_end, end, is_not_space);
+       token != end; token = std::find_if(token, end, is_not_space))
+  {
+    const char *token_end = std::find_if(token, end, is_space);
+    if (count == args.size())
     {
-      return cmd->getID() == commandID;
-    });
-  if (command != commands.end())
+      args.emplace_back();
+    }
+    args[count++].assign(token, token_end - token);
+    token = token_end;
+  }
+  // drop any arguments left over from a previous command, the strings
+  // themselves are retained so their storage can be reused.
+  args.resize(count);
+
+  LOG(VERBOSE, "Command: %.*s, argument count: %zu", id_len, pos, count);
+  DCCPPProtocolCommand *handler = find_command(pos, id_len);
+  if (handler)
   {
-    if (parts.size() >= (*command)->getMinArgCount())
+    if (count >= handler->getMinArgCount())
     {
-      return (*command)->process(parts);
+      return handler->process(args);
     }
     else
     {
-      LOG_ERROR("%s requires (at least) %zu args but %zu args were provided, "
-                "reporting failure", commandID.c_str()
-              , (*command)->getMinArgCount(), parts.size());
+      LOG_ERROR("%.*s requires (at least) %zu args but %zu args were "
+                "provided, reporting failure", id_len, pos
+              , handler->getMinArgCount(), count);
     }
   }
   else
   {
-    LOG_ERROR("No command handler for [%s]", commandID.c_str());
+    LOG_ERROR("No command handler for [%.*s]", id_len, pos);
   }
   return COMMAND_FAILED_RESPONSE;
 }
 
 void DCCPPProtocolHandler::registerCommand(DCCPPProtocolCommand *cmd)
 {
-  for (const auto& command : commands)
+  string id = cmd->getID();
+  if (find_command(id.data(), id.length()))
   {
-    if(!command->getID().compare(cmd->getID()))
-    {
-      LOG_ERROR("Ignoring attempt to register second command with ID: %s",
-        cmd->getID().c_str());
-      return;
-    }
+    LOG_ERROR("Ignoring attempt to register second command with ID: %s",
+      id.c_str());
+    delete cmd;
+    return;
   }
-  LOG(VERBOSE, "Registering interface command %s", cmd->getID().c_str());
+  if (commands.size() >= COMMAND_TABLE_SIZE / 2)
+  {
+    LOG_ERROR("Command table is full, ignoring command with ID: %s"
+            , id.c_str());
+    delete cmd;
+    return;
+  }
+  LOG(VERBOSE, "Registering interface command %s", id.c_str());
+  uint32_t hash = command_hash(id.data(), id.length());
+  size_t slot = hash & (COMMAND_TABLE_SIZE - 1);
+  while (commandTable[slot].command)
+  {
+    slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+  }
+  commandTable[slot] = {hash, std::move(id), cmd};
   commands.emplace_back(cmd);
 }
 
 DCCPPProtocolConsumer::DCCPPProtocolConsumer()
 {
-  _buffer.resize(256);
 }
 
 std::string DCCPPProtocolConsumer::feed(uint8_t *data, size_t len)
 {
-  for(size_t i = 0; i < len; i++)
-  {
-    _buffer.emplace_back(data[i]);
-  }
-  return processData();
-}
-
-string DCCPPProtocolConsumer::processData()
-{
-  auto s = _buffer.begin();
-  auto consumed = _buffer.begin();
   string response;
-  for(; s != _buffer.end();)
+  for (size_t idx = 0; idx < len; idx++)
   {
-    s = std::find(s, _buffer.end(), '<');
-    auto e = std::find(s, _buffer.end(), '>');
-    if(s != _buffer.end() && e != _buffer.end())
+    char ch = data[idx];
+    if (ch == '<')
+    {
+      // start of a new command, any partial command is discarded.
+      _inCommand = true;
+      _overflow = false;
+      _commandLength = 0;
+    }
+    else if (!_inCommand)
+    {
+      // discard data outside of a command.
+      continue;
+    }
+    else if (ch == '>')
+    {
+      _inCommand = false;
+      if (_overflow)
+      {
+        LOG_ERROR("Discarding command longer than %zu bytes"
+                , DCCPP_MAX_COMMAND_LENGTH);
+        response += COMMAND_FAILED_RESPONSE;
+      }
+      else
+      {
+        response += DCCPPProtocolHandler::process(_command, _commandLength
+                                                , _args);
+      }
+    }
+    else if (_commandLength < DCCPP_MAX_COMMAND_LENGTH)
+    {
+      _command[_commandLength++] = ch;
+    }
+    else
     {
-      // discard the <
-      s++;
-      // discard the >
-      *e = 0;
-      std::string str(reinterpret_cast<char*>(&*s));
-      response += DCCPPProtocolHandler::process(std::move(str));
-      consumed = e;
+      _overflow = true;
     }
-    s = e;
   }
-  // drop everything we used from the buffer.
-  _buffer.erase(_buffer.begin(), consumed);
   return response;
 }
@@ -0,0 +1,557 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "DecoderBackup.h"
+#include "DCCProgrammer.h"
+#include "StateBroadcast.h"
+
+#include <algorithm>
+#include <FileSystemManager.h>
+#include <JsonConstants.h>
+#include <PersistenceService.h>
+#include <stdlib.h>
+#include <utils/Crc.hxx>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+using std::string;
+using std::vector;
+
+/// Highest CV number which can be addressed in direct mode.
+static constexpr uint16_t MAX_CV_NUMBER = 1024;
+
+/// Maximum number of CVs which can be requested for a single backup.
+static constexpr size_t MAX_BACKUP_CVS = 4096;
+
+/// Number of consecutive CVs which can fail before the job is stopped, this
+/// typically indicates that the decoder is no longer responding.
+static constexpr size_t MAX_CONSECUTIVE_FAILURES = 32;
+
+/// Header at the start of a stored decoder image, the last byte is the
+/// format version.
+static constexpr char IMAGE_HEADER[] = {'D', 'C', 'V', 1};
+
+/// Size of the header for each run of consecutive CVs in a decoder image:
+/// index high, index low, first CV (2), count (2).
+static constexpr size_t IMAGE_RUN_HEADER_SIZE = 6;
+
+/// Size of the CRC-16 at the end of a decoder image.
+static constexpr size_t IMAGE_CRC_SIZE = 2;
+
+// Converts a CV key to the CV number.
+static inline uint16_t key_cv(uint32_t key)
+{
+  return key & 0xFFFF;
+}
+
+// Converts a CV key to the index page (CV31 << 8 | CV32).
+static inline uint16_t key_index(uint32_t key)
+{
+  return key >> 16;
+}
+
+// Returns the file name used for the decoder image of a roster address.
+static inline string image_file(uint16_t address)
+{
+  return StringPrintf("decoder-%d.cv", address);
+}
+
+// Appends a little-endian uint16_t to the buffer.
+static inline void append_uint16(string &buf, uint16_t value)
+{
+  buf.push_back(value & 0xFF);
+  buf.push_back(value >> 8);
+}
+
+// Reads a little-endian uint16_t from the buffer.
+static inline uint16_t read_uint16(const uint8_t *buf)
+{
+  return buf[0] | (buf[1] << 8);
+}
+
+// Returns true if a CV should not be written during a restore. CV7 and CV8
+// are read-only and writing CV8 resets most decoders to factory defaults,
+// CV31 and CV32 are written as part of selecting the index page.
+static inline bool skip_restore(uint32_t key)
+{
+  uint16_t cv = key_cv(key);
+  return !key_index(key) &&
+         (cv == CV_NAMES::DECODER_VERSION ||
+          cv == CV_NAMES::DECODER_MANUFACTURER ||
+          cv == CV_NAMES::INDEXED_CV_HIGH ||
+          cv == CV_NAMES::INDEXED_CV_LOW);
+}
+
+static constexpr const char *STATUS_NAMES[] =
+{
+  "idle", "running", "complete", "failed", "cancelled"
+};
+
+bool DecoderBackup::parse_cv_list(const string &list, vector<uint32_t> *cvs)
+{
+  const char *pos = list.c_str();
+  while (*pos)
+  {
+    char *end;
+    uint8_t index_high = 0, index_low = 0;
+    unsigned long first = strtoul(pos, &end, 10);
+    if (*end == '.')
+    {
+      // index page prefix, CV31.CV32:
+      index_high = first;
+      index_low = strtoul(end + 1, &end, 10);
+      if (*end != ':' || first > UINT8_MAX)
+      {
+        return false;
+      }
+      pos = end + 1;
+      first = strtoul(pos, &end, 10);
+    }
+    unsigned long last = first;
+    if (*end == '-')
+    {
+      pos = end + 1;
+      last = strtoul(pos, &end, 10);
+    }
+    if (end == pos || first == 0 || first > last || last > MAX_CV_NUMBER ||
+        (*end && *end != ',') ||
+        cvs->size() + (last - first) + 1 > MAX_BACKUP_CVS)
+    {
+      return false;
+    }
+    for (uint16_t cv = first; cv <= last; cv++)
+    {
+      cvs->push_back(cv_key(cv, index_high, index_low));
+    }
+    pos = *end ? end + 1 : end;
+  }
+  return !cvs->empty();
+}
+
+bool DecoderBackup::backup(uint16_t address, const vector<uint32_t> &cvs
+                         , bool resume)
+{
+  // the image is loaded before taking the lock since loading waits for
+  // pending writes.
+  std::map<uint32_t, uint8_t> image;
+  if (resume)
+  {
+    load_image(address, &image);
+  }
+  OSMutexLock l(&lock_);
+  if (status_ == Status::RUNNING)
+  {
+    return false;
+  }
+  op_ = Operation::BACKUP;
+  address_ = address;
+  cvs_ = cvs;
+  image_.swap(image);
+  plan_.clear();
+  for (auto key : cvs_)
+  {
+    if (!image_.count(key))
+    {
+      plan_.push_back(key);
+    }
+  }
+  LOG(INFO, "[Backup] Reading %zu/%zu CVs for %d", plan_.size(), cvs_.size()
+    , address_);
+  start();
+  return true;
+}
+
+bool DecoderBackup::restore(uint16_t address)
+{
+  // the image is loaded before taking the lock since loading waits for
+  // pending writes.
+  std::map<uint32_t, uint8_t> image;
+  if (!load_image(address, &image))
+  {
+    return false;
+  }
+  OSMutexLock l(&lock_);
+  if (status_ == Status::RUNNING)
+  {
+    return false;
+  }
+  image_.swap(image);
+  op_ = Operation::RESTORE;
+  address_ = address;
+  cvs_.clear();
+  plan_.clear();
+  for (auto &ent : image_)
+  {
+    if (!skip_restore(ent.first))
+    {
+      plan_.push_back(ent.first);
+    }
+  }
+  LOG(INFO, "[Backup] Writing %zu CVs for %d", plan_.size(), address_);
+  start();
+  return true;
+}
+
+bool DecoderBackup::resume()
+{
+  OSMutexLock l(&lock_);
+  if (status_ != Status::FAILED && status_ != Status::CANCELLED)
+  {
+    return false;
+  }
+  if (op_ == Operation::BACKUP)
+  {
+    // retry all CVs which are not in the image, including those which
+    // previously failed.
+    plan_.clear();
+    for (auto key : cvs_)
+    {
+      if (!image_.count(key))
+      {
+        plan_.push_back(key);
+      }
+    }
+  }
+  else
+  {
+    // retry the CVs which could not be written and continue with the CVs
+    // which were not processed. Keys sort by index page so the combined plan
+    // keeps the CVs of each page together.
+    plan_.erase(plan_.begin(), plan_.begin() + next_);
+    plan_.insert(plan_.end(), failed_.begin(), failed_.end());
+    std::sort(plan_.begin(), plan_.end());
+  }
+  LOG(INFO, "[Backup] Resuming with %zu CVs for %d", plan_.size(), address_);
+  start();
+  return true;
+}
+
+void DecoderBackup::cancel()
+{
+  OSMutexLock l(&lock_);
+  if (status_ == Status::RUNNING)
+  {
+    cancelRequested_ = true;
+  }
+}
+
+string DecoderBackup::get_state_as_json()
+{
+  OSMutexLock l(&lock_);
+  return state_json();
+}
+
+string DecoderBackup::get_image_as_json(uint16_t address)
+{
+  std::map<uint32_t, uint8_t> image;
+  bool running;
+  {
+    OSMutexLock l(&lock_);
+    running = (status_ == Status::RUNNING && address == address_);
+    if (running)
+    {
+      image = image_;
+    }
+  }
+  if (!running && !load_image(address, &image))
+  {
+    return "";
+  }
+  string json = StringPrintf("{\"%s\":%d,\"%s\":[", JSON_ADDRESS_NODE
+                           , address, JSON_CVS_NODE);
+  for (auto &ent : image)
+  {
+    if (json.back() != '[')
+    {
+      json += ",";
+    }
+    json += StringPrintf("{\"%s\":%d,\"%s\":%d", JSON_CV_NODE
+                       , key_cv(ent.first), JSON_VALUE_NODE, ent.second);
+    if (key_index(ent.first))
+    {
+      json += StringPrintf(",\"cv31\":%d,\"cv32\":%d", (int)(ent.first >> 24)
+                         , key_index(ent.first) & 0xFF);
+    }
+    json += "}";
+  }
+  json += "]}";
+  return json;
+}
+
+void DecoderBackup::start()
+{
+  status_ = Status::RUNNING;
+  next_ = 0;
+  done_ = 0;
+  failed_.clear();
+  consecutiveFailures_ = 0;
+  cancelRequested_ = false;
+  publish_state();
+  if (plan_.empty())
+  {
+    batch_done();
+  }
+  else
+  {
+    submit_batch();
+  }
+}
+
+void DecoderBackup::submit_batch()
+{
+  uint16_t index = key_index(plan_[next_]);
+  if (!index)
+  {
+    submit_cvs();
+    return;
+  }
+  // the index page is selected before the CVs of the batch are queued so
+  // that they are not processed when the page could not be selected. The
+  // decoder retains the index page so this is only done once per batch.
+  indexFailed_ = false;
+  CVJobCallback done = [this](uint16_t cv, int16_t result)
+  {
+    index_done(result);
+  };
+  vector<CVJob> jobs;
+  jobs.push_back({CVJobType::WRITE_BYTE, CV_NAMES::INDEXED_CV_HIGH
+                , (uint8_t)(index >> 8), 0, done});
+  jobs.push_back({CVJobType::WRITE_BYTE, CV_NAMES::INDEXED_CV_LOW
+                , (uint8_t)(index & 0xFF), 0, done});
+  outstanding_ = jobs.size();
+  Singleton<CVProgrammer>::instance()->submit(std::move(jobs));
+}
+
+void DecoderBackup::submit_cvs()
+{
+  vector<CVJob> jobs;
+  uint16_t index = key_index(plan_[next_]);
+  while (next_ < plan_.size() && key_index(plan_[next_]) == index &&
+         jobs.size() < CONFIG_DCCPP_DECODER_BACKUP_BATCH_SIZE)
+  {
+    uint32_t key = plan_[next_++];
+    CVJobCallback done = [this, key](uint16_t cv, int16_t result)
+    {
+      job_done(key, result);
+    };
+    if (op_ == Operation::BACKUP)
+    {
+      jobs.push_back({CVJobType::READ_BYTE, key_cv(key), 0, 0, done});
+    }
+    else
+    {
+      jobs.push_back(
+        {CVJobType::WRITE_BYTE, key_cv(key), image_[key], 0, done});
+    }
+  }
+  outstanding_ = jobs.size();
+  Singleton<CVProgrammer>::instance()->submit(std::move(jobs));
+}
+
+void DecoderBackup::index_done(int16_t result)
+{
+  OSMutexLock l(&lock_);
+  if (result < 0)
+  {
+    indexFailed_ = true;
+  }
+  if (--outstanding_)
+  {
+    return;
+  }
+  if (!indexFailed_)
+  {
+    submit_cvs();
+    return;
+  }
+  // the CVs of this batch would be read from (or written to) the wrong
+  // page, they are recorded as failed without being processed.
+  uint16_t index = key_index(plan_[next_]);
+  LOG_ERROR("[Backup] Failed to select index page %d.%d for %d", index >> 8
+          , index & 0xFF, address_);
+  for (size_t count = 0; next_ < plan_.size() &&
+       key_index(plan_[next_]) == index &&
+       count < CONFIG_DCCPP_DECODER_BACKUP_BATCH_SIZE; count++)
+  {
+    failed_.push_back(plan_[next_++]);
+    done_++;
+  }
+  consecutiveFailures_++;
+  publish_state();
+  batch_done();
+}
+
+void DecoderBackup::job_done(uint32_t key, int16_t result)
+{
+  vector<std::pair<uint32_t, uint8_t>> image;
+  uint16_t address = 0;
+  {
+    OSMutexLock l(&lock_);
+    done_++;
+    if (result < 0)
+    {
+      LOG(WARNING, "[Backup] CV %d (index %d) failed", key_cv(key)
+        , key_index(key));
+      failed_.push_back(key);
+      consecutiveFailures_++;
+    }
+    else
+    {
+      consecutiveFailures_ = 0;
+      if (op_ == Operation::BACKUP)
+      {
+        image_[key] = result;
+      }
+    }
+    publish_state();
+    if (--outstanding_)
+    {
+      return;
+    }
+    // the decoder image is stored after every batch of a backup, only the
+    // values are copied with the lock held.
+    if (op_ == Operation::BACKUP)
+    {
+      image.assign(image_.begin(), image_.end());
+      address = address_;
+    }
+    batch_done();
+  }
+  if (!image.empty())
+  {
+    store_image(address, image);
+  }
+}
+
+void DecoderBackup::batch_done()
+{
+  if (cancelRequested_)
+  {
+    status_ = Status::CANCELLED;
+  }
+  else if (consecutiveFailures_ >= MAX_CONSECUTIVE_FAILURES)
+  {
+    LOG_ERROR("[Backup] Decoder %d is not responding, stopping.", address_);
+    status_ = Status::FAILED;
+  }
+  else if (next_ < plan_.size())
+  {
+    submit_batch();
+    return;
+  }
+  else
+  {
+    status_ = Status::COMPLETE;
+  }
+  LOG(INFO, "[Backup] %d %s: %zu/%zu CVs, %zu failed", address_
+    , STATUS_NAMES[(uint8_t)status_], done_, plan_.size(), failed_.size());
+  publish_state();
+}
+
+void DecoderBackup::publish_state()
+{
+  StateBroadcast::publish(StateType::DECODER_BACKUP, 0, state_json());
+}
+
+string DecoderBackup::state_json()
+{
+  return StringPrintf("{\"%s\":{\"%s\":\"%s\",\"%s\":%d,\"%s\":\"%s\","
+                      "\"%s\":%zu,\"%s\":%zu,\"%s\":%zu}}"
+                    , JSON_BACKUP_NODE
+                    , JSON_TYPE_NODE
+                    , op_ == Operation::BACKUP ? JSON_BACKUP_NODE
+                                               : JSON_RESTORE_NODE
+                    , JSON_ADDRESS_NODE, address_
+                    , JSON_STATE_NODE, STATUS_NAMES[(uint8_t)status_]
+                    , JSON_PROGRESS_NODE, done_
+                    , JSON_TOTAL_NODE, plan_.size()
+                    , JSON_FAILED_NODE, failed_.size());
+}
+
+bool DecoderBackup::load_image(uint16_t address
+                             , std::map<uint32_t, uint8_t> *image)
+{
+  image->clear();
+  // the decoder image may still be queued for writing.
+  Singleton<PersistenceService>::instance()->flush();
+  auto fs = Singleton<FileSystemManager>::instance();
+  string name = image_file(address);
+  if (!fs->exists(name))
+  {
+    return false;
+  }
+  string data = fs->load(name);
+  const uint8_t *buf = (const uint8_t *)data.data();
+  size_t size = data.size();
+  if (size < sizeof(IMAGE_HEADER) + 2 + IMAGE_CRC_SIZE ||
+      data.compare(0, sizeof(IMAGE_HEADER), IMAGE_HEADER
+                 , sizeof(IMAGE_HEADER)) ||
+      crc_16_ibm(buf, size - IMAGE_CRC_SIZE) !=
+        read_uint16(buf + size - IMAGE_CRC_SIZE))
+  {
+    LOG_ERROR("[Backup] Decoder image for %d is damaged.", address);
+    return false;
+  }
+  size -= IMAGE_CRC_SIZE;
+  size_t offs = sizeof(IMAGE_HEADER) + 2;
+  while (offs + IMAGE_RUN_HEADER_SIZE <= size)
+  {
+    const uint8_t *run = buf + offs;
+    uint16_t cv = read_uint16(run + 2);
+    uint16_t count = read_uint16(run + 4);
+    offs += IMAGE_RUN_HEADER_SIZE;
+    if (offs + count > size)
+    {
+      break;
+    }
+    for (uint16_t idx = 0; idx < count; idx++)
+    {
+      (*image)[cv_key(cv + idx, run[0], run[1])] = buf[offs + idx];
+    }
+    offs += count;
+  }
+  return true;
+}
+
+void DecoderBackup::store_image(
+  uint16_t address, const vector<std::pair<uint32_t, uint8_t>> &image)
+{
+  string data(IMAGE_HEADER, sizeof(IMAGE_HEADER));
+  append_uint16(data, address);
+  // consecutive CVs on the same index page are stored as a single run.
+  size_t run = 0;
+  uint32_t last = 0;
+  for (auto &ent : image)
+  {
+    if (!run || ent.first != last + 1)
+    {
+      run = data.size();
+      data.push_back(ent.first >> 24);
+      data.push_back(key_index(ent.first) & 0xFF);
+      append_uint16(data, key_cv(ent.first));
+      append_uint16(data, 0);
+    }
+    data.push_back(ent.second);
+    uint16_t count = read_uint16((const uint8_t *)data.data() + run + 4) + 1;
+    data[run + 4] = count & 0xFF;
+    data[run + 5] = count >> 8;
+    last = ent.first;
+  }
+  append_uint16(data, crc_16_ibm(data.data(), data.size()));
+  Singleton<PersistenceService>::instance()->store(image_file(address)
+                                                 , std::move(data));
+}
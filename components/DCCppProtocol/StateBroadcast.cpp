@@ -0,0 +1,190 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "StateBroadcast.h"
+
+#include <algorithm>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+using openlcb::SpeedType;
+
+/// Highest function number included in the locomotive state broadcast.
+static constexpr uint8_t LOCO_BROADCAST_MAX_FUNCTION = 28;
+
+/// Bit set in the locomotive speed byte when moving forward.
+static constexpr uint8_t LOCO_SPEED_FORWARD = 0x80;
+
+/// Locomotive speed byte value for emergency stop.
+static constexpr uint8_t LOCO_SPEED_ESTOP = 1;
+
+OSMutex StateBroadcast::lock_;
+std::vector<StateSubscriber *> StateBroadcast::subscribers_;
+
+// Combines the type and id into a single key for coalescing.
+static inline uint32_t state_key(StateType type, uint16_t id)
+{
+  return ((uint32_t)type << 16) | id;
+}
+
+StateSubscriber::StateSubscriber(std::function<void()> wakeup, uint32_t types)
+  : wakeup_(std::move(wakeup)), types_(types)
+{
+  queue_.reserve(CONFIG_DCCPP_STATE_BROADCAST_QUEUE_SIZE);
+  StateBroadcast::subscribe(this);
+}
+
+StateSubscriber::~StateSubscriber()
+{
+  StateBroadcast::unsubscribe(this);
+}
+
+size_t StateSubscriber::drain(std::string *buf)
+{
+  OSMutexLock l(&lock_);
+  size_t count = queue_.size();
+  for (auto &pending : queue_)
+  {
+    buf->append(pending.message);
+  }
+  queue_.clear();
+  return count;
+}
+
+size_t StateSubscriber::drain(
+  std::function<void(StateType, uint16_t, const std::string &)> handler)
+{
+  OSMutexLock l(&lock_);
+  size_t count = queue_.size();
+  for (auto &pending : queue_)
+  {
+    handler((StateType)(pending.key >> 16), pending.key & 0xFFFF
+          , pending.message);
+  }
+  queue_.clear();
+  return count;
+}
+
+bool StateSubscriber::empty()
+{
+  OSMutexLock l(&lock_);
+  return queue_.empty();
+}
+
+void StateSubscriber::enqueue(StateType type, uint32_t key
+                            , const std::string &message)
+{
+  if (!(types_ & state_type_bit(type)))
+  {
+    return;
+  }
+  bool was_empty;
+  {
+    OSMutexLock l(&lock_);
+    was_empty = queue_.empty();
+    auto it = std::find_if(queue_.begin(), queue_.end()
+    , [key](const PendingState &pending)
+      {
+        return pending.key == key;
+      });
+    if (it != queue_.end())
+    {
+      // the client has not yet received the previous state, replace it with
+      // the latest state.
+      it->message = message;
+      return;
+    }
+    if (queue_.size() >= CONFIG_DCCPP_STATE_BROADCAST_QUEUE_SIZE)
+    {
+      queue_.erase(queue_.begin());
+      dropped_++;
+    }
+    queue_.push_back({key, message});
+  }
+  if (was_empty && wakeup_)
+  {
+    wakeup_();
+  }
+}
+
+void StateBroadcast::publish(StateType type, uint16_t id
+                           , const std::string &message)
+{
+  uint32_t key = state_key(type, id);
+  OSMutexLock l(&lock_);
+  for (auto subscriber : subscribers_)
+  {
+    subscriber->enqueue(type, key, message);
+  }
+}
+
+void StateBroadcast::publish_loco(openlcb::TrainImpl *impl)
+{
+  uint16_t address = impl->legacy_address();
+  if (!address)
+  {
+    // not a locomotive.
+    return;
+  }
+  SpeedType speed(impl->get_speed());
+  uint8_t speed_byte = 0;
+  if (impl->get_emergencystop())
+  {
+    speed_byte = LOCO_SPEED_ESTOP;
+  }
+  else if (speed.mph())
+  {
+    // speed zero is stop and one is emergency stop, the remaining values
+    // are the 126 speed steps.
+    speed_byte = std::min((int)(speed.mph() + 0.5f) + 1, 127);
+  }
+  if (speed.direction() == SpeedType::FORWARD)
+  {
+    speed_byte |= LOCO_SPEED_FORWARD;
+  }
+  uint32_t functions = 0;
+  for (uint8_t fn = 0; fn <= LOCO_BROADCAST_MAX_FUNCTION; fn++)
+  {
+    if (impl->get_fn(fn))
+    {
+      functions |= (1UL << fn);
+    }
+  }
+  publish(StateType::LOCO, address
+        , StringPrintf("<l %d 0 %d %u>", address, speed_byte
+                     , (unsigned)functions));
+}
+
+void StateBroadcast::subscribe(StateSubscriber *subscriber)
+{
+  OSMutexLock l(&lock_);
+  subscribers_.push_back(subscriber);
+  LOG(VERBOSE, "[State] %zu subscriber(s)", subscribers_.size());
+}
+
+void StateBroadcast::unsubscribe(StateSubscriber *subscriber)
+{
+  OSMutexLock l(&lock_);
+  subscribers_.erase(
+    std::remove(subscribers_.begin(), subscribers_.end(), subscriber)
+  , subscribers_.end());
+  if (subscriber->dropped())
+  {
+    LOG(INFO, "[State] Subscriber discarded %zu state update(s)"
+      , subscriber->dropped());
+  }
+}
@@ -18,7 +18,13 @@ COPYRIGHT (c) 2019 Mike Dunston
 #ifndef DCC_PROG_H_
 #define DCC_PROG_H_
 
+#include <dcc/Packet.hxx>
+#include <deque>
+#include <executor/StateFlow.hxx>
+#include <functional>
 #include <stdint.h>
+#include <utils/Singleton.hxx>
+#include <vector>
 
 enum CV_NAMES
 {
@@ -32,6 +38,8 @@ enum CV_NAMES
 , CONSIST_FUNCTION_CONTROL_F1_F8      = 21
 , CONSIST_FUNCTION_CONTROL_FL_F9_F12  = 22
 , DECODER_CONFIG                      = 29
+, INDEXED_CV_HIGH                     = 31
+, INDEXED_CV_LOW                      = 32
 };
 
 static constexpr uint8_t CONSIST_ADDRESS_REVERSED_ORIENTATION = 0x80;
@@ -70,6 +78,200 @@ enum CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS
 , F12_BIT = 4
 };
 
+/// Type of a programming track job.
+enum class CVJobType : uint8_t
+{
+  /// Read the value of a CV, the result is the CV value.
+  READ_BYTE,
+
+  /// Write the value of a CV, the result is the written value.
+  WRITE_BYTE,
+
+  /// Write a single bit of a CV, the result is the written bit value.
+  WRITE_BIT
+};
+
+/// Callback invoked when a programming track job has completed.
+///
+/// The first parameter is the CV number, the second is the result of the job
+/// or -1 if the job failed.
+typedef std::function<void(uint16_t, int16_t)> CVJobCallback;
+
+/// Single programming track job.
+struct CVJob
+{
+  /// Type of job to perform.
+  CVJobType type{CVJobType::READ_BYTE};
+
+  /// CV number to read or write.
+  uint16_t cv{0};
+
+  /// Value to write, unused for @ref CVJobType::READ_BYTE.
+  uint8_t value{0};
+
+  /// Bit to write, only used for @ref CVJobType::WRITE_BIT.
+  uint8_t bit{0};
+
+  /// Callback to invoke when the job has completed.
+  CVJobCallback done;
+};
+
+/// Asynchronous programming track job engine.
+///
+/// Jobs are queued and executed in order on the provided @ref Service. The
+/// programming track is switched into service mode once for all queued jobs
+/// and only left when the queue has been drained, avoiding the service mode
+/// entry and decoder reset overhead for each CV.
+///
+/// Completion of each job is reported via the job's @ref CVJobCallback which
+/// is invoked on the executor of the @ref Service.
+class CVProgrammer : public StateFlowBase, public Singleton<CVProgrammer>
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to execute jobs on, this should be
+  /// the same service as the ProgrammingTrackBackend.
+  CVProgrammer(Service *service);
+
+  /// Queues a batch of jobs for execution.
+  ///
+  /// @param jobs are the jobs to execute, in order.
+  void submit(std::vector<CVJob> jobs);
+
+private:
+  /// Pending jobs.
+  std::deque<CVJob> pending_;
+
+  /// Lock protecting @ref pending_ and @ref waiting_.
+  OSMutex lock_;
+
+  /// When true the flow is waiting for jobs to be submitted.
+  bool waiting_{false};
+
+  /// Job currently being executed.
+  CVJob job_;
+
+  /// Current attempt for @ref job_.
+  uint8_t attempt_{0};
+
+  /// Current bit being read for @ref CVJobType::READ_BYTE.
+  uint8_t bit_{0};
+
+  /// Value assembled from the bit reads for @ref CVJobType::READ_BYTE.
+  uint8_t value_{0};
+
+  STATE_FLOW_STATE(wait_for_jobs);
+  STATE_FLOW_STATE(service_mode_entered);
+  STATE_FLOW_STATE(reset_sent);
+  STATE_FLOW_STATE(start_job);
+  STATE_FLOW_STATE(start_attempt);
+  STATE_FLOW_STATE(read_bit);
+  STATE_FLOW_STATE(read_bit_done);
+  STATE_FLOW_STATE(write_done);
+  STATE_FLOW_STATE(verify);
+  STATE_FLOW_STATE(verify_done);
+  STATE_FLOW_STATE(attempt_failed);
+  STATE_FLOW_STATE(service_mode_left);
+
+  /// Sends a service mode packet and waits for the result.
+  ///
+  /// @param pkt is the packet to send.
+  /// @param next is the state to call once the packet has been sent, this
+  /// must call @ref take_ack.
+  Action send_packet(dcc::Packet pkt, Callback next);
+
+  /// Sends decoder reset packets and calls @ref reset_sent.
+  ///
+  /// @param count is the number of reset packets to send.
+  Action send_reset(unsigned count);
+
+  /// Releases the result of the last programming track request.
+  ///
+  /// @return true if the decoder acknowledged the last packet.
+  bool take_ack();
+
+  /// Completes the current job.
+  ///
+  /// @param result is the result to report via the job callback.
+  Action complete_job(int16_t result);
+};
+
+/// Reads CVs from locomotives on the OPS track using POM read requests, the
+/// decoder replies via RailCom.
+///
+/// Reads are queued and executed one at a time on the provided @ref Service.
+/// The flow sleeps until the RailComFeedbackCache reports the reply or the
+/// timeout expires so that the caller is never blocked. Completion of each
+/// read is reported via its @ref CVJobCallback on the executor of the
+/// @ref Service.
+class OpsCVReader : public StateFlowBase, public Singleton<OpsCVReader>
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to execute the reads on.
+  OpsCVReader(Service *service);
+
+  /// Queues a CV read.
+  ///
+  /// @param address is the DCC address of the locomotive.
+  /// @param cv is the CV number to read.
+  /// @param done is the callback to invoke with the CV value, or -1 if the
+  /// decoder did not reply.
+  void submit(uint16_t address, uint16_t cv, CVJobCallback done);
+
+private:
+  /// Single POM read request.
+  struct Request
+  {
+    /// DCC address of the locomotive.
+    uint16_t address{0};
+
+    /// CV number to read.
+    uint16_t cv{0};
+
+    /// Callback to invoke when the read has completed.
+    CVJobCallback done;
+  };
+
+  /// Pending requests.
+  std::deque<Request> pending_;
+
+  /// Lock protecting @ref pending_, @ref waiting_, @ref request_ and
+  /// @ref value_.
+  OSMutex lock_;
+
+  /// When true the flow is waiting for requests to be submitted.
+  bool waiting_{false};
+
+  /// Request currently being executed.
+  Request request_;
+
+  /// Current attempt for @ref request_.
+  uint8_t attempt_{0};
+
+  /// Value reported by the decoder for @ref request_, -1 until a reply has
+  /// been received.
+  int16_t value_{-1};
+
+  /// Timer used for the reply timeout, this is triggered early when the
+  /// reply is received.
+  StateFlowTimer timer_{this};
+
+  STATE_FLOW_STATE(wait_for_request);
+  STATE_FLOW_STATE(send_request);
+  STATE_FLOW_STATE(request_done);
+
+  /// Records the reply to a POM read request, this is called on the
+  /// executor of the RailcomHubFlow.
+  ///
+  /// @param address is the DCC address of the locomotive.
+  /// @param cv is the CV number which was read.
+  /// @param value is the value reported by the decoder.
+  void reply_received(uint16_t address, uint16_t cv, int16_t value);
+};
+
 int16_t readCV(const uint16_t);
 bool writeProgCVByte(const uint16_t, const uint8_t);
 bool writeProgCVBit(const uint16_t, const uint8_t, const bool);
@@ -29,7 +29,7 @@ class DCCPPProtocolCommand
 {
 public:
   virtual ~DCCPPProtocolCommand() {}
-  virtual std::string process(const std::vector<std::string>) = 0;
+  virtual std::string process(const std::vector<std::string> &) = 0;
   virtual std::string getID() = 0;
   virtual size_t getMinArgCount() = 0;
 };
@@ -38,7 +38,7 @@ public:
 class name : public DCCPPProtocolCommand                          \
 {                                                                 \
 public:                                                           \
-  std::string process(const std::vector<std::string>) override;   \
+  std::string process(const std::vector<std::string> &) override; \
   std::string getID() override                                    \
   {                                                               \
     return id;                                                    \
@@ -50,7 +50,7 @@ public:                                                           \
 };
 
 #define DCC_PROTOCOL_COMMAND_HANDLER(name, func)                  \
-std::string name::process(const std::vector<std::string> args)    \
+std::string name::process(const std::vector<std::string> &args)   \
 {                                                                 \
  return func(args);                                               \
 }
@@ -61,17 +61,32 @@ class DCCPPProtocolHandler
 public:
   static void init();
   static std::string process(const std::string &);
+  // Processes a single command (without the surrounding < and >). The
+  // arguments container is reused between calls to avoid allocations.
+  static std::string process(const char *, size_t, std::vector<std::string> &);
   static void registerCommand(DCCPPProtocolCommand *);
 };
 
+// Maximum length of a single command, including arguments but excluding the
+// surrounding < and >.
+static constexpr size_t DCCPP_MAX_COMMAND_LENGTH = 128;
+
 class DCCPPProtocolConsumer
 {
 public:
   DCCPPProtocolConsumer();
   std::string feed(uint8_t *, size_t);
 private:
-  std::string processData();
-  std::vector<uint8_t> _buffer;
+  // Command text received since the last '<'.
+  char _command[DCCPP_MAX_COMMAND_LENGTH];
+  // Number of bytes used in _command.
+  size_t _commandLength{0};
+  // True when a '<' has been received and the matching '>' has not.
+  bool _inCommand{false};
+  // True when the current command has exceeded DCCPP_MAX_COMMAND_LENGTH.
+  bool _overflow{false};
+  // Arguments of the command being processed, reused for every command.
+  std::vector<std::string> _args;
 };
 
 const std::string COMMAND_FAILED_RESPONSE = "<X>";
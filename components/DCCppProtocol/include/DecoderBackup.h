@@ -0,0 +1,227 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef DECODER_BACKUP_H_
+#define DECODER_BACKUP_H_
+
+#include <map>
+#include <os/OS.hxx>
+#include <stdint.h>
+#include <string>
+#include <utils/Singleton.hxx>
+#include <vector>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_DCCPP_DECODER_BACKUP_BATCH_SIZE
+#define CONFIG_DCCPP_DECODER_BACKUP_BATCH_SIZE 16
+#endif
+
+/// Reads and writes the full CV contents of a decoder on the programming
+/// track in the background.
+///
+/// CVs are identified by a key which combines the CV number (1-1024) with an
+/// optional index page (the values of CV31 and CV32) for decoders which use
+/// indexed CVs in the range 257-512. Keys are built via @ref cv_key.
+///
+/// The CVs are read or written in batches of
+/// CONFIG_DCCPP_DECODER_BACKUP_BATCH_SIZE via @ref CVProgrammer, the index
+/// page is selected before each batch that requires it and the batch is only
+/// queued once the page has been selected. Progress is published via
+/// @ref StateBroadcast as @ref StateType::DECODER_BACKUP.
+///
+/// The decoder image is stored via @ref PersistenceService after every batch
+/// under the roster address so that an interrupted backup can be resumed
+/// without reading the already stored CVs again.
+class DecoderBackup : public Singleton<DecoderBackup>
+{
+public:
+  /// Builds a CV key.
+  ///
+  /// @param cv is the CV number.
+  /// @param index_high is the value to write to CV31, zero when the CV is not
+  /// indexed.
+  /// @param index_low is the value to write to CV32.
+  ///
+  /// @return the CV key.
+  static constexpr uint32_t cv_key(uint16_t cv, uint8_t index_high = 0
+                                 , uint8_t index_low = 0)
+  {
+    return ((uint32_t)index_high << 24) | ((uint32_t)index_low << 16) | cv;
+  }
+
+  /// Parses a list of CVs.
+  ///
+  /// The list is a comma separated set of CV numbers or ranges (first-last),
+  /// each optionally prefixed by "CV31.CV32:" to select an index page, for
+  /// example "1-256,16.0:257-512".
+  ///
+  /// @param list is the list to parse.
+  /// @param cvs will receive the CV keys.
+  ///
+  /// @return false if the list is not valid.
+  static bool parse_cv_list(const std::string &list
+                          , std::vector<uint32_t> *cvs);
+
+  /// Starts reading the provided CVs from the decoder on the programming
+  /// track.
+  ///
+  /// @param address is the roster address to store the decoder image under.
+  /// @param cvs are the CV keys to read.
+  /// @param resume when true the CVs already stored in the decoder image for
+  /// the address will not be read again.
+  ///
+  /// @return false if another job is running.
+  bool backup(uint16_t address, const std::vector<uint32_t> &cvs
+            , bool resume);
+
+  /// Starts writing the stored decoder image for a roster address to the
+  /// decoder on the programming track.
+  ///
+  /// @param address is the roster address of the decoder image.
+  ///
+  /// @return false if another job is running or there is no decoder image.
+  bool restore(uint16_t address);
+
+  /// Resumes the last job after it has failed or has been cancelled. Only
+  /// the CVs which have not been completed will be processed.
+  ///
+  /// @return false if there is no job to resume.
+  bool resume();
+
+  /// Requests that the running job stops after the current batch.
+  void cancel();
+
+  /// @return the state of the current (or last) job as JSON.
+  std::string get_state_as_json();
+
+  /// @return the stored decoder image for a roster address as JSON or an
+  /// empty string if there is no decoder image.
+  std::string get_image_as_json(uint16_t address);
+
+private:
+  /// Type of job.
+  enum class Operation : uint8_t
+  {
+    BACKUP,
+    RESTORE
+  };
+
+  /// Status of the job.
+  enum class Status : uint8_t
+  {
+    IDLE,
+    RUNNING,
+    COMPLETE,
+    FAILED,
+    CANCELLED
+  };
+
+  /// Lock protecting all members.
+  OSMutex lock_;
+
+  /// Type of the current job.
+  Operation op_{Operation::BACKUP};
+
+  /// Status of the current job.
+  Status status_{Status::IDLE};
+
+  /// Roster address of the current job.
+  uint16_t address_{0};
+
+  /// CV keys requested for the current backup.
+  std::vector<uint32_t> cvs_;
+
+  /// CV keys to be processed by the current run of the job.
+  std::vector<uint32_t> plan_;
+
+  /// Offset of the next CV key in @ref plan_ to submit.
+  size_t next_{0};
+
+  /// Number of CV keys in @ref plan_ which have been processed.
+  size_t done_{0};
+
+  /// CV keys which could not be read or written.
+  std::vector<uint32_t> failed_;
+
+  /// Number of consecutive CV keys which could not be read or written.
+  size_t consecutiveFailures_{0};
+
+  /// Number of jobs of the current batch which have not completed.
+  size_t outstanding_{0};
+
+  /// When true the index page could not be selected for the next batch.
+  bool indexFailed_{false};
+
+  /// When true the job will stop after the current batch.
+  bool cancelRequested_{false};
+
+  /// Decoder image for @ref address_, CV key to value.
+  std::map<uint32_t, uint8_t> image_;
+
+  /// Starts processing @ref plan_ from the beginning.
+  void start();
+
+  /// Starts the next batch of CVs, selecting the index page first when
+  /// required.
+  void submit_batch();
+
+  /// Submits the CVs of the next batch to the @ref CVProgrammer.
+  void submit_cvs();
+
+  /// Records the result of a single CV read or write.
+  ///
+  /// @param key is the CV key.
+  /// @param result is the result of the job or -1 if it failed.
+  void job_done(uint32_t key, int16_t result);
+
+  /// Records the result of selecting the index page and submits the CVs of
+  /// the batch once both index CVs have been written.
+  ///
+  /// @param result is the result of the job or -1 if it failed.
+  void index_done(int16_t result);
+
+  /// Submits the next batch or completes the job when there are no more CVs
+  /// to process.
+  void batch_done();
+
+  /// Publishes the state of the job via @ref StateBroadcast.
+  void publish_state();
+
+  /// @return the state of the job as JSON, @ref lock_ must be held.
+  std::string state_json();
+
+  /// Loads the stored decoder image for a roster address, this waits for
+  /// pending writes and must not be called with @ref lock_ held.
+  ///
+  /// @param address is the roster address.
+  /// @param image will receive the CV values of the decoder image.
+  ///
+  /// @return false if there is no valid decoder image.
+  bool load_image(uint16_t address, std::map<uint32_t, uint8_t> *image);
+
+  /// Queues a decoder image to be written, this is called without
+  /// @ref lock_ held.
+  ///
+  /// @param address is the roster address of the decoder image.
+  /// @param image are the CV keys and values of the decoder image, in key
+  /// order.
+  void store_image(uint16_t address
+                 , const std::vector<std::pair<uint32_t, uint8_t>> &image);
+};
+
+#endif // DECODER_BACKUP_H_
@@ -0,0 +1,195 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef STATE_BROADCAST_H_
+#define STATE_BROADCAST_H_
+
+#include <functional>
+#include <os/OS.hxx>
+#include <openlcb/TrainInterface.hxx>
+#include <string>
+#include <vector>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_DCCPP_STATE_BROADCAST_QUEUE_SIZE
+#define CONFIG_DCCPP_STATE_BROADCAST_QUEUE_SIZE 16
+#endif
+
+/// Categories of state which are broadcast to all connected clients.
+enum class StateType : uint8_t
+{
+  TURNOUT,
+  SENSOR,
+  OUTPUT,
+  TRACK_POWER,
+  LOCO,
+  DECODER_BACKUP,
+  ROUTE,
+  METRICS,
+  POM_READ
+};
+
+/// @return the bit used for a @ref StateType in a subscriber type mask.
+static constexpr uint32_t state_type_bit(StateType type)
+{
+  return 1UL << (uint8_t)type;
+}
+
+/// Type mask of all @ref StateType values which are published in the DCC++
+/// response format.
+static constexpr uint32_t DCCPP_STATE_TYPES =
+  state_type_bit(StateType::TURNOUT) | state_type_bit(StateType::SENSOR) |
+  state_type_bit(StateType::OUTPUT) | state_type_bit(StateType::TRACK_POWER) |
+  state_type_bit(StateType::LOCO);
+
+/// Type mask of all @ref StateType values.
+static constexpr uint32_t ALL_STATE_TYPES =
+  DCCPP_STATE_TYPES | state_type_bit(StateType::DECODER_BACKUP) |
+  state_type_bit(StateType::ROUTE) | state_type_bit(StateType::METRICS) |
+  state_type_bit(StateType::POM_READ);
+
+/// Receives state change messages published via @ref StateBroadcast.
+///
+/// Messages are held in a bounded queue until the client drains them. When a
+/// message for the same state (type and id) is already pending it is replaced
+/// in place so that a slow client only receives the latest state. When the
+/// queue is full the oldest pending message is discarded.
+///
+/// The subscriber registers itself with @ref StateBroadcast on construction
+/// and is removed on destruction.
+class StateSubscriber
+{
+public:
+  /// Constructor.
+  ///
+  /// @param wakeup is an optional callback which will be invoked when a
+  /// message is queued and the queue was previously empty. This is called
+  /// from the context of the publisher and must not block or publish state.
+  /// @param types is the mask of @ref StateType values to receive, see
+  /// @ref state_type_bit.
+  StateSubscriber(std::function<void()> wakeup = nullptr
+                , uint32_t types = DCCPP_STATE_TYPES);
+
+  /// Destructor.
+  ~StateSubscriber();
+
+  /// Moves all pending messages into the provided buffer.
+  ///
+  /// @param buf is the buffer to append the messages to.
+  ///
+  /// @return number of messages which were appended.
+  size_t drain(std::string *buf);
+
+  /// Removes all pending messages and passes them to a handler.
+  ///
+  /// @param handler is invoked for each message with the @ref StateType and
+  /// id it was published with. This is called with the subscriber lock held
+  /// and must not block or publish state.
+  ///
+  /// @return number of messages which were passed to the handler.
+  size_t drain(
+    std::function<void(StateType, uint16_t, const std::string &)> handler);
+
+  /// @return true if there are no pending messages.
+  bool empty();
+
+  /// @return number of messages which have been discarded due to the queue
+  /// being full.
+  size_t dropped()
+  {
+    return dropped_;
+  }
+
+private:
+  /// Pending state change message.
+  struct PendingState
+  {
+    /// Combined @ref StateType and id of the state.
+    uint32_t key;
+
+    /// DCC++ formatted message.
+    std::string message;
+  };
+
+  /// Gives @ref StateBroadcast access to @ref enqueue.
+  friend class StateBroadcast;
+
+  /// Lock protecting @ref queue_.
+  OSMutex lock_;
+
+  /// Pending messages in the order they were first published.
+  std::vector<PendingState> queue_;
+
+  /// Callback to invoke when the queue transitions from empty to non-empty.
+  std::function<void()> wakeup_;
+
+  /// Mask of the @ref StateType values this subscriber receives.
+  const uint32_t types_;
+
+  /// Number of messages discarded due to the queue being full.
+  size_t dropped_{0};
+
+  /// Adds or replaces a pending message.
+  ///
+  /// @param type is the category of the state.
+  /// @param key is the combined @ref StateType and id of the state.
+  /// @param message is the DCC++ formatted message.
+  void enqueue(StateType type, uint32_t key, const std::string &message);
+};
+
+/// Publishes state changes to all registered @ref StateSubscriber instances.
+///
+/// Messages use the DCC++ response format so that they can be forwarded to
+/// JMRI and WebSocket clients without translation, with the exception of
+/// @ref StateType::DECODER_BACKUP, @ref StateType::ROUTE,
+/// @ref StateType::METRICS and @ref StateType::POM_READ which use JSON and
+/// are only delivered to subscribers which request them.
+class StateBroadcast
+{
+public:
+  /// Publishes a state change to all subscribers.
+  ///
+  /// @param type is the category of the state.
+  /// @param id is the identifier of the state within the category.
+  /// @param message is the DCC++ formatted message describing the state.
+  static void publish(StateType type, uint16_t id, const std::string &message);
+
+  /// Publishes the speed, direction and function state of a locomotive as a
+  /// DCC++ EX "<l ADDRESS 0 SPEED FUNCTIONS>" message.
+  ///
+  /// @param impl is the locomotive which has been updated.
+  static void publish_loco(openlcb::TrainImpl *impl);
+
+private:
+  /// Gives @ref StateSubscriber access to the registration methods.
+  friend class StateSubscriber;
+
+  /// Lock protecting @ref subscribers_.
+  static OSMutex lock_;
+
+  /// All registered subscribers.
+  static std::vector<StateSubscriber *> subscribers_;
+
+  /// Registers a subscriber.
+  static void subscribe(StateSubscriber *subscriber);
+
+  /// Removes a subscriber.
+  static void unsubscribe(StateSubscriber *subscriber);
+};
+
+#endif // STATE_BROADCAST_H_
@@ -30,18 +30,24 @@ static constexpr const char * HTTP_METHOD_PUT = "PUT";
 std::map<HttpHeader, string> well_known_http_headers =
 {
   { ACCEPT, "Accept" }
+, { ACCEPT_RANGES, "Accept-Ranges" }
 , { CACHE_CONTROL, "Cache-Control" }
 , { CONNECTION, "Connection" }
 , { CONTENT_ENCODING, "Content-Encoding" }
 , { CONTENT_TYPE, "Content-Type" }
 , { CONTENT_LENGTH, "Content-Length" }
 , { CONTENT_DISPOSITION, "Content-Disposition" }
+, { CONTENT_RANGE, "Content-Range" }
+, { ETAG, "ETag" }
 , { EXPECT, "Expect" }
 , { HOST, "Host" }
 , { IF_MODIFIED_SINCE, "If-Modified-Since" }
+, { IF_NONE_MATCH, "If-None-Match" }
 , { LAST_MODIFIED, "Last-Modified" }
 , { LOCATION, "Location" }
 , { ORIGIN, "Origin" }
+, { RANGE, "Range" }
+, { TRANSFER_ENCODING, "Transfer-Encoding" }
 , { UPGRADE, "Upgrade" }
 , { WS_VERSION, "Sec-WebSocket-Version" }
 , { WS_KEY, "Sec-WebSocket-Key" }
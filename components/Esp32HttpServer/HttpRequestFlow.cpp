@@ -18,9 +18,26 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include "Httpd.h"
 #include "HttpStringUtils.h"
 
+#include <Metrics.h>
+
 namespace http
 {
 
+/// Number of HTTP requests processed.
+static esp32cs::Counter requests_processed("http_requests_total"
+                                         , "HTTP requests processed");
+
+/// Number of HTTP requests which failed to be processed.
+static esp32cs::Counter requests_failed("http_request_errors_total"
+                                      , "HTTP requests which failed");
+
+/// Time taken from receiving the first byte of a request until the response
+/// has been sent.
+static esp32cs::Histogram request_duration("http_request_duration_ms"
+                                         , "HTTP request processing time"
+                                         , {5, 10, 25, 50, 100, 250, 500
+                                          , 1000});
+
 static vector<string> captive_portal_uris =
 {
   "/generate_204",                  // Android
@@ -35,6 +52,17 @@ static vector<string> captive_portal_uris =
   "/kindle-wifi/wifistub.html"      // Kindle
 };
 
+/// Space reserved ahead of each chunk of a chunked response body for the
+/// chunk size (up to eight hex digits) and the trailing end of line.
+static constexpr size_t HTTP_CHUNK_HEADER_SIZE = 10;
+
+/// Length of @ref HTML_EOL.
+static constexpr size_t HTTP_EOL_SIZE = 2;
+
+/// Final (zero length) chunk of a chunked response body, this includes the
+/// empty trailer.
+static constexpr const char * HTTP_LAST_CHUNK = "0\r\n\r\n";
+
 HttpRequestFlow::HttpRequestFlow(Httpd *server, int fd
                                , uint32_t remote_ip)
                                : StateFlowBase(server)
@@ -81,6 +109,12 @@ StateFlowBase::Action HttpRequestFlow::parse_header_data()
     return yield_and_call(STATE(read_more_data));
   }
 
+  // the processing time is measured from the first data received rather
+  // than from when the connection started waiting for the next request.
+  if (raw_header_.empty() && req_.raw_method().empty())
+  {
+    start_time_ = esp_timer_get_time();
+  }
   raw_header_.append((char *)buf_.data()
                    , header_read_size_ - helper_.remaining_);
 
@@ -856,6 +890,16 @@ StateFlowBase::Action HttpRequestFlow::send_response_body()
       , "[Httpd fd:%d,uri:%s] HEAD request, no body required.", fd_
       , req_.uri().c_str());
   }
+  else if (res_->is_streamed())
+  {
+    LOG(CONFIG_HTTP_REQ_FLOW_LOG_LEVEL
+      , "[Httpd fd:%d,uri:%s] Sending %s body.", fd_, req_.uri().c_str()
+      , res_->get_body_length() ? "streamed" : "chunked");
+    response_body_offs_ = 0;
+    chunk_buf_.resize(HTTP_CHUNK_HEADER_SIZE +
+                      config_httpd_response_chunk_size() + HTTP_EOL_SIZE);
+    return call_immediately(STATE(send_response_body_chunk));
+  }
   else if (res_->get_body_length())
   {
     LOG(CONFIG_HTTP_REQ_FLOW_LOG_LEVEL
@@ -909,8 +953,74 @@ StateFlowBase::Action HttpRequestFlow::send_response_body_split()
                       , remaining, STATE(send_response_body_split));
 }
 
+StateFlowBase::Action HttpRequestFlow::send_response_body_chunk()
+{
+  // check if there has been an error and abort if needed
+  if (helper_.hasError_)
+  {
+    chunk_buf_.clear();
+    chunk_buf_.shrink_to_fit();
+    return yield_and_call(STATE(abort_request));
+  }
+  // the body data is generated after the space reserved for the chunk size
+  // so the chunk can be sent with a single write.
+  uint8_t *data = chunk_buf_.data() + HTTP_CHUNK_HEADER_SIZE;
+  size_t len = res_->get_body_chunk(data, config_httpd_response_chunk_size());
+  if (res_->get_body_length())
+  {
+    // the body length was sent in the headers, send the data as-is.
+    if (!len)
+    {
+      chunk_buf_.clear();
+      chunk_buf_.shrink_to_fit();
+      if (response_body_offs_ < res_->get_body_length())
+      {
+        // the body ended early, the client can not detect this without the
+        // connection being closed.
+        LOG_ERROR("[Httpd fd:%d,uri:%s] Body ended after %zu of %zu bytes."
+                , fd_, req_.uri().c_str(), response_body_offs_
+                , res_->get_body_length());
+        return yield_and_call(STATE(abort_request));
+      }
+      return yield_and_call(STATE(request_complete));
+    }
+    response_body_offs_ += len;
+    return write_repeated(&helper_, fd_, data, len
+                        , STATE(send_response_body_chunk));
+  }
+  if (!len)
+  {
+    LOG(CONFIG_HTTP_REQ_FLOW_LOG_LEVEL
+      , "[Httpd fd:%d,uri:%s] Sent %zu byte chunked body.", fd_
+      , req_.uri().c_str(), response_body_offs_);
+    chunk_buf_.clear();
+    chunk_buf_.shrink_to_fit();
+    return write_repeated(&helper_, fd_, HTTP_LAST_CHUNK
+                        , strlen(HTTP_LAST_CHUNK), STATE(request_complete));
+  }
+  HASSERT(len <= config_httpd_response_chunk_size());
+  char header[HTTP_CHUNK_HEADER_SIZE + 1];
+  size_t header_len = snprintf(header, sizeof(header), "%zx%s", len, HTML_EOL);
+  uint8_t *chunk = data - header_len;
+  memcpy(chunk, header, header_len);
+  memcpy(data + len, HTML_EOL, HTTP_EOL_SIZE);
+  response_body_offs_ += len;
+  return write_repeated(&helper_, fd_, chunk, header_len + len + HTTP_EOL_SIZE
+                      , STATE(send_response_body_chunk));
+}
+
 StateFlowBase::Action HttpRequestFlow::request_complete()
 {
+  if (!req_.uri().empty())
+  {
+    requests_processed.inc();
+    request_duration.observe(
+      USEC_TO_MSEC(esp_timer_get_time() - start_time_));
+  }
+  if (req_.error())
+  {
+    requests_failed.inc();
+  }
 #if CONFIG_HTTP_REQ_FLOW_LOG_LEVEL == VERBOSE
   if (!req_.uri().empty())
   {
@@ -411,12 +411,17 @@ StateFlowBase::Action WebSocketFlow::frame_sent()
             , fd_, errno, strerror(errno));
     return yield_and_call(STATE(shutdown_connection));
   }
-  OSMutexLock l(&textLock_);
-  textToSend_.erase(0, data_size_);
-  if (textToSend_.empty())
   {
-    return yield_and_call(STATE(read_frame_header));
+    OSMutexLock l(&textLock_);
+    textToSend_.erase(0, data_size_);
+    if (!textToSend_.empty())
+    {
+      return yield_and_call(STATE(send_frame_header));
+    }
   }
+  // all pending text has been sent, give the handler a chance to queue more
+  // text before returning to reading frames.
+  handler_(this, WebSocketEvent::WS_EVENT_SEND_READY, nullptr, 0);
   return yield_and_call(STATE(send_frame_header));
 }
 
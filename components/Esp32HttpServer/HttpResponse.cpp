@@ -16,6 +16,9 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 **********************************************************************/
 
 #include "Httpd.h"
+#include "HttpStringUtils.h"
+
+#include <sys/stat.h>
 
 namespace http
 {
@@ -127,6 +130,23 @@ string AbstractHttpResponse::to_string(bool include_body, bool keep_alive
                  , well_known_http_headers[HttpHeader::CONTENT_TYPE].c_str()
                  , get_body_mime_type().c_str(), HTML_EOL));
   }
+  else if (is_streamed())
+  {
+    LOG(CONFIG_HTTP_RESP_LOG_LEVEL, "[resp-header] %s -> %s"
+      , well_known_http_headers[HttpHeader::TRANSFER_ENCODING].c_str()
+      , HTTP_TRANSFER_ENCODING_CHUNKED);
+    encoded_headers_.append(
+      StringPrintf("%s: %s%s"
+                 , well_known_http_headers[HttpHeader::TRANSFER_ENCODING].c_str()
+                 , HTTP_TRANSFER_ENCODING_CHUNKED, HTML_EOL));
+    LOG(CONFIG_HTTP_RESP_LOG_LEVEL, "[resp-header] %s -> %s"
+      , well_known_http_headers[HttpHeader::CONTENT_TYPE].c_str()
+      , get_body_mime_type().c_str());
+    encoded_headers_.append(
+      StringPrintf("%s: %s%s"
+                 , well_known_http_headers[HttpHeader::CONTENT_TYPE].c_str()
+                 , get_body_mime_type().c_str(), HTML_EOL));
+  }
 
   if (add_keep_alive)
   {
@@ -175,6 +195,16 @@ StaticResponse::StaticResponse(const uint8_t *payload, const size_t length
                              : AbstractHttpResponse(STATUS_OK, mime_type)
                              , payload_(payload), length_(length)
 {
+  // the entity tag is a FNV-1a hash of the payload, this is only calculated
+  // once when the static_uri is registered.
+  uint32_t hash = 2166136261UL;
+  for (size_t idx = 0; idx < length; idx++)
+  {
+    hash ^= payload[idx];
+    hash *= 16777619UL;
+  }
+  etag_ = StringPrintf("\"%08x-%zx\"", (unsigned)hash, length);
+  header(HttpHeader::ETAG, etag_);
   if (!encoding.empty())
   {
     header(HttpHeader::CONTENT_ENCODING, encoding);
@@ -189,4 +219,192 @@ StaticResponse::StaticResponse(const uint8_t *payload, const size_t length
                     , config_httpd_cache_max_age_sec()));
 }
 
+size_t JsonArrayResponse::get_body_chunk(uint8_t *buf, size_t size)
+{
+  size_t len = 0;
+  while (len < size)
+  {
+    if (pendingOffs_ >= pending_.length() && !next_element())
+    {
+      break;
+    }
+    size_t count = std::min(size - len, pending_.length() - pendingOffs_);
+    memcpy(buf + len, pending_.data() + pendingOffs_, count);
+    pendingOffs_ += count;
+    len += count;
+  }
+  return len;
+}
+
+bool JsonArrayResponse::next_element()
+{
+  pending_.clear();
+  pendingOffs_ = 0;
+  string element;
+  while (pending_.empty() && !complete_)
+  {
+    element.clear();
+    if (!generator_(index_++, &element))
+    {
+      pending_.assign("]");
+      complete_ = true;
+    }
+    else if (!element.empty())
+    {
+      if (count_++)
+      {
+        pending_.append(",");
+      }
+      pending_.append(element);
+    }
+  }
+  return !pending_.empty();
+}
+
+NotModifiedResponse::NotModifiedResponse(const string &etag)
+  : AbstractHttpResponse(HttpStatusCode::STATUS_NOT_MODIFIED)
+{
+  header(HttpHeader::ETAG, etag);
+  header(HttpHeader::LAST_MODIFIED, HTTP_BUILD_TIME);
+}
+
+FileResponse::FileResponse(HttpRequest *request, const string &path
+                         , const string &mime_type)
+  : AbstractHttpResponse(HttpStatusCode::STATUS_OK, mime_type)
+{
+  struct stat statbuf;
+  if (stat(path.c_str(), &statbuf) || !S_ISREG(statbuf.st_mode))
+  {
+    set_status(HttpStatusCode::STATUS_NOT_FOUND);
+    return;
+  }
+  size_t size = statbuf.st_size;
+  string etag = StringPrintf("\"%lx-%zx\"", (unsigned long)statbuf.st_mtime
+                           , size);
+  header(HttpHeader::ETAG, etag);
+  header(HttpHeader::ACCEPT_RANGES, HTTP_RANGE_UNIT_BYTES);
+  if (request->has_header(HttpHeader::IF_NONE_MATCH) &&
+      etag_matches(request->header(HttpHeader::IF_NONE_MATCH), etag))
+  {
+    set_status(HttpStatusCode::STATUS_NOT_MODIFIED);
+    return;
+  }
+
+  size_t first = 0;
+  size_t last = size ? size - 1 : 0;
+  if (request->has_header(HttpHeader::RANGE))
+  {
+    if (!parse_range(request->header(HttpHeader::RANGE), size, &first, &last))
+    {
+      set_status(HttpStatusCode::STATUS_RANGE_NOT_SATISFIABLE);
+      header(HttpHeader::CONTENT_RANGE
+           , StringPrintf("%s */%zu", HTTP_RANGE_UNIT_BYTES, size));
+      return;
+    }
+    if (first > 0 || last < size - 1)
+    {
+      set_status(HttpStatusCode::STATUS_PARTIAL_CONTENT);
+      header(HttpHeader::CONTENT_RANGE
+           , StringPrintf("%s %zu-%zu/%zu", HTTP_RANGE_UNIT_BYTES, first, last
+                        , size));
+    }
+  }
+  if (!size)
+  {
+    return;
+  }
+
+  file_ = fopen(path.c_str(), "r");
+  if (file_ == nullptr || (first && fseek(file_, first, SEEK_SET)))
+  {
+    LOG_ERROR("[FileResponse] Unable to read %s: %s", path.c_str()
+            , strerror(errno));
+    if (file_)
+    {
+      fclose(file_);
+      file_ = nullptr;
+    }
+    set_status(HttpStatusCode::STATUS_SERVER_ERROR);
+    return;
+  }
+  length_ = remaining_ = (last - first) + 1;
+}
+
+FileResponse::~FileResponse()
+{
+  if (file_)
+  {
+    fclose(file_);
+  }
+}
+
+size_t FileResponse::get_body_chunk(uint8_t *buf, size_t size)
+{
+  if (!file_ || !remaining_)
+  {
+    return 0;
+  }
+  size_t len = fread(buf, 1, std::min(size, remaining_), file_);
+  remaining_ -= len;
+  return len;
+}
+
+bool FileResponse::parse_range(const string &range, size_t size
+                             , size_t *first, size_t *last)
+{
+  // Only a single range using the bytes unit is supported, anything else is
+  // ignored and the full file is sent as permitted by RFC-7233 sec. 3.1.
+  string prefix = StringPrintf("%s=", HTTP_RANGE_UNIT_BYTES);
+  if (range.compare(0, prefix.length(), prefix) ||
+      range.find(',') != string::npos)
+  {
+    return true;
+  }
+  size_t dash = range.find('-', prefix.length());
+  if (dash == string::npos)
+  {
+    return true;
+  }
+  string start = range.substr(prefix.length(), dash - prefix.length());
+  string end = range.substr(dash + 1);
+  char *endptr = nullptr;
+  if (start.empty())
+  {
+    // suffix range, the last N bytes of the file.
+    size_t suffix = strtoul(end.c_str(), &endptr, 10);
+    if (end.empty() || *endptr)
+    {
+      return true;
+    }
+    if (!suffix || !size)
+    {
+      return false;
+    }
+    *first = suffix < size ? size - suffix : 0;
+    *last = size - 1;
+    return true;
+  }
+  size_t from = strtoul(start.c_str(), &endptr, 10);
+  if (*endptr)
+  {
+    return true;
+  }
+  size_t to = SIZE_MAX;
+  if (!end.empty())
+  {
+    to = strtoul(end.c_str(), &endptr, 10);
+    if (*endptr || to < from)
+    {
+      return true;
+    }
+  }
+  if (from >= size)
+  {
+    return false;
+  }
+  *first = from;
+  *last = std::min(to, size - 1);
+  return true;
+}
+
 } // namespace http
@@ -16,6 +16,9 @@ COPYRIGHT (c) 2019 Mike Dunston
 **********************************************************************/
 
 #include "Httpd.h"
+#include "HttpStringUtils.h"
+
+#include <Metrics.h>
 
 #ifdef CONFIG_IDF_TARGET
 
@@ -33,6 +36,10 @@ namespace http
 
 string HTTP_BUILD_TIME = __DATE__ " " __TIME__;
 
+/// Number of connected WebSocket clients.
+static esp32cs::Gauge websocket_clients("http_websocket_clients"
+                                      , "Connected WebSocket clients");
+
 /// Callback for a newly accepted socket connection.
 ///
 /// @param fd is the socket handle.
@@ -113,14 +120,12 @@ void Httpd::static_uri(const string &uri, const uint8_t *payload
                      , const size_t length, const string &mime_type
                      , const string &encoding)
 {
-  static_uris_.insert(
-    std::make_pair(uri
-                 , std::make_shared<StaticResponse>(payload, length, mime_type
-                                                  , encoding)));
+  auto response = std::make_shared<StaticResponse>(payload, length, mime_type
+                                                 , encoding);
+  static_uris_.insert(std::make_pair(uri, response));
   static_cached_.insert(
     std::make_pair(uri
-                 , std::make_shared<AbstractHttpResponse>(
-                    HttpStatusCode::STATUS_NOT_MODIFIED)));
+                 , std::make_shared<NotModifiedResponse>(response->etag())));
 }
 
 void Httpd::websocket_uri(const string &uri, WebSocketHandler handler)
@@ -267,12 +272,14 @@ void Httpd::add_websocket(int id, WebSocketFlow *ws)
 {
   OSMutexLock l(&websocketsLock_);
   websockets_[id] = ws;
+  websocket_clients.set(websockets_.size());
 }
 
 void Httpd::remove_websocket(int id)
 {
   OSMutexLock l(&websocketsLock_);
   websockets_.erase(id);
+  websocket_clients.set(websockets_.size());
 }
 
 bool Httpd::have_known_response(const string &uri)
@@ -284,7 +291,17 @@ std::shared_ptr<AbstractHttpResponse> Httpd::response(HttpRequest *request)
 {
   if (static_uris_.count(request->uri()))
   {
-    if (request->has_header(HttpHeader::IF_MODIFIED_SINCE) &&
+    // If-None-Match takes precedence over If-Modified-Since when both are
+    // present (RFC-7232 sec. 6).
+    if (request->has_header(HttpHeader::IF_NONE_MATCH))
+    {
+      if (etag_matches(request->header(HttpHeader::IF_NONE_MATCH)
+                     , static_uris_[request->uri()]->etag()))
+      {
+        return static_cached_[request->uri()];
+      }
+    }
+    else if (request->has_header(HttpHeader::IF_MODIFIED_SINCE) &&
        !request->header(HttpHeader::IF_MODIFIED_SINCE).compare(HTTP_BUILD_TIME))
     {
       return static_cached_[request->uri()];
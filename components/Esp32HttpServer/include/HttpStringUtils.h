@@ -212,6 +212,29 @@ static inline string url_encode(const string source)
   return encoded;
 }
 
+/// Helper which checks if an If-None-Match header value matches an entity
+/// tag as described in RFC-7232 sec. 3.2 using the weak comparison.
+///
+/// @param if_none_match is the value of the If-None-Match header.
+/// @param etag is the entity tag of the resource, including quotes.
+/// @return true if the header matches the entity tag.
+/// RFC: https://tools.ietf.org/html/rfc7232
+static inline bool etag_matches(const string &if_none_match
+                              , const string &etag)
+{
+  if (etag.empty())
+  {
+    return false;
+  }
+  if (!if_none_match.compare("*"))
+  {
+    return true;
+  }
+  // the header is a list of (optionally weak) entity tags, since the tags
+  // are quoted a substring match is sufficient.
+  return if_none_match.find(etag) != string::npos;
+}
+
 } // namespace http
 
 #endif // STRINGUTILS_H_
\ No newline at end of file
@@ -21,6 +21,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #define HTTPD_H_
 
 #include <algorithm>
+#include <functional>
 #include <map>
 #include <stdint.h>
 
@@ -177,18 +178,24 @@ enum HttpMethod
 enum HttpHeader
 {
   ACCEPT,
+  ACCEPT_RANGES,
   CACHE_CONTROL,
   CONNECTION,
   CONTENT_ENCODING,
   CONTENT_TYPE,
   CONTENT_LENGTH,
   CONTENT_DISPOSITION,
+  CONTENT_RANGE,
+  ETAG,
   EXPECT,
   HOST,
   IF_MODIFIED_SINCE,
+  IF_NONE_MATCH,
   LAST_MODIFIED,
   LOCATION,
   ORIGIN,
+  RANGE,
+  TRANSFER_ENCODING,
   UPGRADE,
   WS_VERSION,
   WS_KEY,
@@ -221,7 +228,11 @@ typedef enum
   
   /// A BINARY message has been received from a WebSocket. Note that it may be
   /// sent to the handler in pieces.
-  WS_EVENT_BINARY
+  WS_EVENT_BINARY,
+
+  /// All queued text has been sent to the WebSocket, additional text can be
+  /// queued without it accumulating behind a slow client.
+  WS_EVENT_SEND_READY
 } WebSocketEvent;
 
 // Values for Cache-Control
@@ -243,6 +254,14 @@ static constexpr const char * HTTP_CONNECTION_UPGRADE = "Upgrade";
 // TODO: introduce enum constant for this value
 static constexpr const char * HTTP_UPGRADE_HEADER_WEBSOCKET = "websocket";
 
+// Values for Accept-Ranges and Range headers
+// TODO: introduce enum constants for these
+static constexpr const char * HTTP_RANGE_UNIT_BYTES = "bytes";
+
+// Values for Transfer-Encoding header
+// TODO: introduce enum constants for these
+static constexpr const char * HTTP_TRANSFER_ENCODING_CHUNKED = "chunked";
+
 // HTTP end of line characters
 static constexpr const char * HTML_EOL = "\r\n";
 
@@ -275,6 +294,10 @@ class HttpRequestFlow;
 /// various classes.
 class Httpd;
 
+/// Forward declaration of the HttpRequest so it can be used by
+/// @ref FileResponse.
+class HttpRequest;
+
 /// This is the base class for an HTTP response.
 class AbstractHttpResponse
 {
@@ -289,7 +312,7 @@ public:
                      , const std::string &mime_type=MIME_TYPE_TEXT_PLAIN);
 
   /// Destructor.
-  ~AbstractHttpResponse();
+  virtual ~AbstractHttpResponse();
 
   /// Encodes the HTTP response headers for transmission to the client.
   ///
@@ -340,6 +363,28 @@ public:
     return 0;
   }
 
+  /// @return true if the response body is generated incrementally via
+  /// @ref get_body_chunk rather than via @ref get_body.
+  virtual bool is_streamed()
+  {
+    return false;
+  }
+
+  /// Generates the next segment of the response body.
+  ///
+  /// @param buf is the buffer to write the body segment into.
+  /// @param size is the maximum number of bytes to write into buf.
+  ///
+  /// @return the number of bytes written into buf, zero indicates there is no
+  /// more body data to send.
+  ///
+  /// Note: this method should be overriden by sub-classes which return true
+  /// from @ref is_streamed.
+  virtual size_t get_body_chunk(uint8_t *buf, size_t size)
+  {
+    return 0;
+  }
+
   /// @return the mime type to include in the HTTP response header.
   ///
   /// Note: this method should be overriden by sub-classes to supply the
@@ -350,6 +395,14 @@ public:
   }
 
 protected:
+  /// Replaces the @ref HttpStatusCode of the response.
+  ///
+  /// @param code is the @ref HttpStatusCode to use for the response.
+  void set_status(HttpStatusCode code)
+  {
+    code_ = code;
+  }
+
   /// Adds an arbitrary HTTP header to the response object.
   ///
   /// @param header is the HTTP header name to add.
@@ -456,7 +509,17 @@ public:
     return length_;
   }
 
+  /// @return the entity tag of the payload, including quotes.
+  const std::string &etag()
+  {
+    return etag_;
+  }
+
 private:
+  /// Entity tag of the payload, this is calculated from the payload content
+  /// when the response is created.
+  std::string etag_;
+
   /// Pointer to the payload to return for this URI.
   const uint8_t *payload_;
 
@@ -464,6 +527,17 @@ private:
   const size_t length_;
 };
 
+/// HTTP Response object which is used when a client already has the current
+/// version of a @ref StaticResponse.
+class NotModifiedResponse : public AbstractHttpResponse
+{
+public:
+  /// Constructor.
+  ///
+  /// @param etag is the entity tag of the resource.
+  NotModifiedResponse(const std::string &etag);
+};
+
 /// HTTP Response object which can be used to return a string based response to
 /// a given URI.
 class StringResponse : public AbstractHttpResponse
@@ -516,6 +590,178 @@ public:
   }
 };
 
+/// HTTP Response object which generates the response body on demand rather
+/// than holding it in memory. The body is sent to the client using
+/// "Transfer-Encoding: chunked" since the total length is not known ahead of
+/// time.
+///
+/// Sub-classes implement @ref get_body_chunk to supply the body, this will be
+/// called repeatedly with a buffer of up to
+/// config_httpd_response_chunk_size() bytes until it returns zero.
+class StreamedResponse : public AbstractHttpResponse
+{
+public:
+  /// Constructor.
+  ///
+  /// @param mime_type is the value to use for the Content-Type HTTP header.
+  /// @param code is the @ref HttpStatusCode to use for the response.
+  StreamedResponse(const std::string &mime_type
+                 , HttpStatusCode code=STATUS_OK)
+    : AbstractHttpResponse(code, mime_type)
+  {
+  }
+
+  /// @return true as the body will be generated by @ref get_body_chunk.
+  bool is_streamed() override
+  {
+    return true;
+  }
+
+  /// Generates the next segment of the response body.
+  ///
+  /// @param buf is the buffer to write the body segment into.
+  /// @param size is the maximum number of bytes to write into buf.
+  ///
+  /// @return the number of bytes written into buf, zero indicates there is no
+  /// more body data to send.
+  size_t get_body_chunk(uint8_t *buf, size_t size) override = 0;
+};
+
+/// Callback used by @ref JsonArrayResponse to serialize a single element of
+/// the array.
+///
+/// The callback receives the index of the element to serialize and the
+/// string to append it to, it should return false once the index is beyond
+/// the last element. Appending nothing will skip the element, this can be
+/// used for elements which have been removed since the response was created.
+typedef std::function<bool(size_t, std::string *)> JsonElementGenerator;
+
+/// HTTP Response object which streams a JSON array one element at a time so
+/// that the full array is never held in memory. Elements are generated on
+/// demand via a @ref JsonElementGenerator as the chunks of the response are
+/// sent to the client.
+class JsonArrayResponse : public StreamedResponse
+{
+public:
+  /// Constructor.
+  ///
+  /// @param generator is the @ref JsonElementGenerator used to serialize the
+  /// elements of the array.
+  JsonArrayResponse(JsonElementGenerator generator)
+    : StreamedResponse(MIME_TYPE_APPLICATION_JSON)
+    , generator_(std::move(generator))
+    , pending_("[")
+  {
+  }
+
+  /// Fills the buffer with the next segment of the JSON array.
+  ///
+  /// @param buf is the buffer to write the body segment into.
+  /// @param size is the maximum number of bytes to write into buf.
+  ///
+  /// @return the number of bytes written into buf, zero indicates the array
+  /// has been sent.
+  size_t get_body_chunk(uint8_t *buf, size_t size) override;
+
+private:
+  /// Generator for the array elements.
+  JsonElementGenerator generator_;
+
+  /// Index of the next element to serialize.
+  size_t index_{0};
+
+  /// Number of elements that have been serialized.
+  size_t count_{0};
+
+  /// Serialized data which has not yet been sent.
+  std::string pending_;
+
+  /// Index into @ref pending_ of the next byte to send.
+  size_t pendingOffs_{0};
+
+  /// Set to true once the closing bracket has been generated.
+  bool complete_{false};
+
+  /// Serializes the next element into @ref pending_.
+  ///
+  /// @return false if there is no more data to send.
+  bool next_element();
+};
+
+/// HTTP Response object which streams the content of a file to the client.
+///
+/// The file is read on demand into the response buffer of the
+/// @ref HttpRequestFlow so at most config_httpd_response_chunk_size() bytes of
+/// the file are held in memory regardless of the size of the file. Since the
+/// file size is known the body is sent with a Content-Length header rather
+/// than using "Transfer-Encoding: chunked".
+///
+/// A single "Range: bytes=first-last" request header is supported and will
+/// result in a @ref HttpStatusCode::STATUS_PARTIAL_CONTENT response, requests
+/// with multiple ranges receive the full file. The entity tag of the file is
+/// derived from the size and modification time of the file, a matching
+/// If-None-Match request header will result in a
+/// @ref HttpStatusCode::STATUS_NOT_MODIFIED response.
+class FileResponse : public AbstractHttpResponse
+{
+public:
+  /// Constructor.
+  ///
+  /// @param request is the @ref HttpRequest being responded to, this is used
+  /// for the Range and If-None-Match headers.
+  /// @param path is the file to send.
+  /// @param mime_type is the value to use for the Content-Type HTTP header.
+  FileResponse(HttpRequest *request, const std::string &path
+             , const std::string &mime_type);
+
+  /// Destructor.
+  ~FileResponse();
+
+  /// @return the number of bytes of the file which will be sent.
+  size_t get_body_length() override
+  {
+    return length_;
+  }
+
+  /// @return true if the file content will be sent.
+  bool is_streamed() override
+  {
+    return file_ != nullptr;
+  }
+
+  /// Reads the next segment of the file.
+  ///
+  /// @param buf is the buffer to read the file into.
+  /// @param size is the maximum number of bytes to read.
+  ///
+  /// @return the number of bytes read into buf, zero indicates the requested
+  /// range of the file has been sent.
+  size_t get_body_chunk(uint8_t *buf, size_t size) override;
+
+private:
+  /// Handle to the file being sent.
+  FILE *file_{nullptr};
+
+  /// Number of bytes of the file to send.
+  size_t length_{0};
+
+  /// Number of bytes of the file which have not yet been sent.
+  size_t remaining_{0};
+
+  /// Parses a Range header value.
+  ///
+  /// @param range is the Range header value.
+  /// @param size is the size of the file.
+  /// @param first will receive the first byte of the range.
+  /// @param last will receive the last byte of the range (inclusive).
+  ///
+  /// @return false if the range can not be satisfied, true if the range is
+  /// valid or should be ignored. When the range is ignored first and last
+  /// cover the full file.
+  bool parse_range(const std::string &range, size_t size, size_t *first
+                 , size_t *last);
+};
+
 /// Runtime state of an HTTP Request.
 class HttpRequest
 {
@@ -709,8 +955,9 @@ AbstractHttpResponse * name (HttpRequest * request                        \
 ///
 /// This method will be invoked when there is an event to be processed.
 ///
-/// When @ref WebSocketEvent is @ref WebSocketEvent::WS_EVENT_CONNECT or
-/// @ref WebSocketEvent::WS_EVENT_DISCONNECT data will be
+/// When @ref WebSocketEvent is @ref WebSocketEvent::WS_EVENT_CONNECT,
+/// @ref WebSocketEvent::WS_EVENT_DISCONNECT or
+/// @ref WebSocketEvent::WS_EVENT_SEND_READY data will be
 /// nullptr and data length will be zero.
 /// 
 /// When @ref WebSocketEvent is @ref WebSocketEvent::WS_EVENT_TEXT or
@@ -975,7 +1222,7 @@ private:
   /// Internal map of all registered static URIs to use when the client does
   /// not specify the @ref HttpHeader::IF_MODIFIED_SINCE or the value is not
   /// the current version.
-  std::map<std::string, std::shared_ptr<AbstractHttpResponse>> static_uris_;
+  std::map<std::string, std::shared_ptr<StaticResponse>> static_uris_;
 
   /// Internal map of all registeres static URIs to use when resource has not
   /// been modified since the client last retrieved it.
@@ -1079,6 +1326,10 @@ private:
   /// Index into the response body payload.
   size_t response_body_offs_{0};
 
+  /// Temporary buffer used for sending a streamed response body, this is only
+  /// allocated while the body is being sent.
+  std::vector<uint8_t> chunk_buf_;
+
   /// Request start time.
   uint64_t start_time_;
 
@@ -1136,6 +1387,7 @@ private:
   STATE_FLOW_STATE(send_response_headers);
   STATE_FLOW_STATE(send_response_body);
   STATE_FLOW_STATE(send_response_body_split);
+  STATE_FLOW_STATE(send_response_body_chunk);
   STATE_FLOW_STATE(request_complete);
   STATE_FLOW_STATE(upgrade_to_websocket);
   STATE_FLOW_STATE(abort_request_with_response);
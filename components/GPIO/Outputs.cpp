@@ -22,6 +22,7 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <FileSystemManager.h>
 #include <DCCppProtocol.h>
 #include <JsonConstants.h>
+#include <StateBroadcast.h>
 #include <driver/gpio.h>
 
 #include "GPIOValidation.h"
@@ -120,6 +121,16 @@ std::string OutputManager::getStateAsJson()
   return state;
 }
 
+bool OutputManager::getStateAsJson(size_t index, string *json)
+{
+  if (index >= outputs.size())
+  {
+    return false;
+  }
+  json->append(outputs[index]->toJson(true));
+  return true;
+}
+
 string OutputManager::get_state_for_dccpp()
 {
   string status;
@@ -216,9 +227,11 @@ string Output::set(bool active, bool announce)
   ESP_ERROR_CHECK(gpio_set_level((gpio_num_t)_pin, _active));
   LOG(INFO, "[Output] Output(%d) set to %s", _id
     , _active ? JSON_VALUE_ON : JSON_VALUE_OFF);
+  string message = StringPrintf("<Y %d %d>", _id, !_active);
+  StateBroadcast::publish(StateType::OUTPUT, _id, message);
   if(announce)
   {
-    return StringPrintf("<Y %d %d>", _id, !_active);
+    return message;
   }
   return COMMAND_NO_RESPONSE;
 }
@@ -319,7 +332,7 @@ where
 **********************************************************************/
 
 DCC_PROTOCOL_COMMAND_HANDLER(OutputCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if(arguments.empty())
   {
@@ -352,7 +365,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(OutputCommandAdapter,
 })
 
 DCC_PROTOCOL_COMMAND_HANDLER(OutputExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t outputID = std::stoi(arguments[0]);
   auto output = OutputManager::getOutput(outputID);
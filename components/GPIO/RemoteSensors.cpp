@@ -106,6 +106,16 @@ string RemoteSensorManager::getStateAsJson()
   return output;
 }
 
+bool RemoteSensorManager::getStateAsJson(size_t index, string *json)
+{
+  if (index >= remoteSensors.size())
+  {
+    return false;
+  }
+  json->append(remoteSensors[index]->toJson());
+  return true;
+}
+
 string RemoteSensorManager::get_state_for_dccpp()
 {
   if (remoteSensors.empty())
@@ -158,7 +168,7 @@ string RemoteSensor::toJson(bool includeState)
 }
 
 DCC_PROTOCOL_COMMAND_HANDLER(RemoteSensorsCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if(arguments.empty())
   {
@@ -42,6 +42,7 @@ S88 Sensors are reported in the same manner as generic Sensors:
 #include "sdkconfig.h"
 
 #if defined(CONFIG_GPIO_S88)
+#include <algorithm>
 #include <FileSystemManager.h>
 #include <DCCppProtocol.h>
 #include <driver/gpio.h>
@@ -121,12 +122,13 @@ S88BusManager::~S88BusManager()
 
 void S88BusManager::clear()
 {
+  OSMutexLock l(&lock_);
   buses_.clear();
 }
 
 uint16_t S88BusManager::store()
 {
-  AtomicHolder l(this);
+  OSMutexLock l(&lock_);
   uint16_t count = 0;
   string content = "[";
   for (const auto& bus : buses_)
@@ -156,11 +158,43 @@ void S88BusManager::poll_33hz(openlcb::WriteHelper *helper, Notifiable *done)
 
 void S88BusManager::poll()
 {
-  AtomicHolder l(this);
-  for (const auto& sensorBus : buses_)
+  // capture the bus configuration, the lock is not held while the buses are
+  // being shifted in so they may be reconfigured during the scan.
+  {
+    OSMutexLock l(&lock_);
+    scans_.resize(buses_.size());
+    for (size_t idx = 0; idx < buses_.size(); idx++)
+    {
+      auto &bus = buses_[idx];
+      auto &scan = scans_[idx];
+      if (scan.id != bus->getID() || scan.dataPin != bus->getDataPin() ||
+          scan.count != bus->getSensorCount())
+      {
+        scan.id = bus->getID();
+        scan.dataPin = bus->getDataPin();
+        scan.count = bus->getSensorCount();
+        scan.published = false;
+        scan.current.assign((scan.count + 7) / 8, 0);
+        scan.next.assign((scan.count + 7) / 8, 0);
+      }
+    }
+  }
+  scan();
+  publish();
+}
+
+void S88BusManager::scan()
+{
+  uint16_t max_count = 0;
+  for (const auto& scan : scans_)
+  {
+    max_count = std::max(max_count, scan.count);
+  }
+  if (!max_count)
   {
-    sensorBus->prepForRead();
+    return;
   }
+
   S88_LOAD_Pin::set(true);
   ets_delay_us(S88_SENSOR_LOAD_PRE_CLOCK_TIME);
   S88_CLOCK_Pin::set(true);
@@ -174,16 +208,23 @@ void S88BusManager::poll()
   S88_LOAD_Pin::set(false);
 
   ets_delay_us(S88_SENSOR_READ_TIME);
-  bool keepReading = true;
-  while (keepReading)
+  for (uint16_t index = 0; index < max_count; index++)
   {
-    keepReading = false;
-    for (const auto& sensorBus : buses_)
+    // all buses share the clock so one bit is shifted in from each bus per
+    // clock pulse.
+    for (auto& scan : scans_)
     {
-      if (sensorBus->hasMore())
+      if (index < scan.count)
       {
-        keepReading = true;
-        sensorBus->readNext();
+        uint8_t mask = 1 << (index & 7);
+        if (gpio_get_level(scan.dataPin))
+        {
+          scan.next[index >> 3] |= mask;
+        }
+        else
+        {
+          scan.next[index >> 3] &= ~mask;
+        }
       }
     }
     S88_CLOCK_Pin::set(true);
@@ -193,6 +234,41 @@ void S88BusManager::poll()
   }
 }
 
+void S88BusManager::publish()
+{
+  OSMutexLock l(&lock_);
+  for (size_t idx = 0; idx < scans_.size(); idx++)
+  {
+    auto &scan = scans_[idx];
+    // discard the scan if the bus was modified while it was being read, the
+    // next scan will pick up the new configuration.
+    if (idx >= buses_.size() || buses_[idx]->getID() != scan.id ||
+        buses_[idx]->getDataPin() != scan.dataPin ||
+        buses_[idx]->getSensorCount() != scan.count)
+    {
+      continue;
+    }
+    for (size_t offs = 0; offs < scan.next.size(); offs++)
+    {
+      uint8_t changed = scan.next[offs] ^ scan.current[offs];
+      if (!scan.published)
+      {
+        changed = 0xFF;
+      }
+      for (uint8_t bit = 0; changed && bit < 8; bit++)
+      {
+        if (changed & (1 << bit))
+        {
+          buses_[idx]->setSensorState((offs * 8) + bit
+                                    , scan.next[offs] & (1 << bit));
+        }
+      }
+    }
+    scan.published = true;
+    std::swap(scan.current, scan.next);
+  }
+}
+
 bool S88BusManager::createOrUpdateBus(const uint8_t id, const gpio_num_t dataPin, const uint16_t sensorCount)
 {
   // check for duplicate data pin
@@ -205,7 +281,7 @@ bool S88BusManager::createOrUpdateBus(const uint8_t id, const gpio_num_t dataPin
       return false;
     }
   }
-  AtomicHolder l(this);
+  OSMutexLock l(&lock_);
   // check for existing bus to be updated
   for (const auto& sensorBus : buses_)
   {
@@ -226,7 +302,7 @@ bool S88BusManager::createOrUpdateBus(const uint8_t id, const gpio_num_t dataPin
 
 bool S88BusManager::removeBus(const uint8_t id)
 {
-  AtomicHolder l(this);
+  OSMutexLock l(&lock_);
   const auto & ent = std::find_if(buses_.begin(), buses_.end(),
   [id](std::unique_ptr<S88SensorBus> & bus) -> bool
   {
@@ -242,7 +318,7 @@ bool S88BusManager::removeBus(const uint8_t id)
 
 string S88BusManager::get_state_as_json()
 {
-  AtomicHolder l(this);
+  OSMutexLock l(&lock_);
   string state = "[";
   for (const auto& sensorBus : buses_)
   {
@@ -256,8 +332,20 @@ string S88BusManager::get_state_as_json()
   return state;
 }
 
+bool S88BusManager::get_state_as_json(size_t index, string *json)
+{
+  OSMutexLock l(&lock_);
+  if (index >= buses_.size())
+  {
+    return false;
+  }
+  json->append(buses_[index]->toJson(true));
+  return true;
+}
+
 string S88BusManager::get_state_for_dccpp()
 {
+  OSMutexLock l(&lock_);
   string res;
   for (const auto& sensorBus : buses_)
   {
@@ -364,12 +452,6 @@ string S88SensorBus::getStateString()
   return state;
 }
 
-void S88SensorBus::readNext()
-{
-  // sensors need to pull pin LOW for ACTIVE
-  _sensors[_nextSensorToRead++]->setState(gpio_get_level(_dataPin));
-}
-
 string S88SensorBus::get_state_for_dccpp()
 {
   string status = StringPrintf("<S88 %d %d %d>", _id, _dataPin, _sensors.size());
@@ -394,7 +476,7 @@ S88Sensor::S88Sensor(uint16_t id, uint16_t index)
 }
 
 DCC_PROTOCOL_COMMAND_HANDLER(S88BusCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   auto s88 = S88BusManager::instance();
   if (arguments.empty())
@@ -19,11 +19,16 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 
 #if defined(CONFIG_GPIO_SENSORS)
 
+#include <algorithm>
+#include <atomic>
 #include <FileSystemManager.h>
 #include <DCCppProtocol.h>
 #include <driver/gpio.h>
+#include <esp_timer.h>
+#include <executor/StateFlow.hxx>
 #include <json.hpp>
 #include <JsonConstants.h>
+#include <StateBroadcast.h>
 #include <utils/StringPrintf.hxx>
 
 #include "GPIOValidation.h"
@@ -32,16 +37,199 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 
 std::vector<std::unique_ptr<Sensor>> sensors;
 
-TaskHandle_t SensorManager::_taskHandle;
 OSMutex SensorManager::_lock;
-static constexpr UBaseType_t SENSOR_TASK_PRIORITY = 1;
-static constexpr uint32_t SENSOR_TASK_STACK_SIZE = 2048;
 
 static constexpr const char * SENSORS_JSON_FILE = "sensors.json";
 
-void SensorManager::init()
+/// Number of GPIO edge events which can be queued for @ref SensorEventFlow.
+static constexpr size_t SENSOR_EVENT_QUEUE_SIZE = 32;
+
+/// Time a pin must be stable after an edge before the sensor is updated.
+static constexpr uint64_t SENSOR_DEBOUNCE_USEC =
+  MSEC_TO_USEC(CONFIG_GPIO_SENSOR_DEBOUNCE_MS);
+
+/// Processes the GPIO edge events recorded by the sensor ISR.
+///
+/// The ISR records the pin and time of each edge into a single-producer,
+/// single-consumer queue and wakes up this flow. Once a pin has been stable
+/// for @ref SENSOR_DEBOUNCE_USEC all sensors using the pin are updated.
+class SensorEventFlow : public StateFlowBase
+{
+public:
+  SensorEventFlow(Service *service) : StateFlowBase(service)
+  {
+    start_flow(STATE(drain_events));
+  }
+
+  /// Records an edge for a pin, this must only be called from the GPIO ISR.
+  ///
+  /// @param pin is the pin which has changed level.
+  void record_edge(gpio_num_t pin)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t next = (head + 1) % SENSOR_EVENT_QUEUE_SIZE;
+    if (next == tail_.load(std::memory_order_acquire))
+    {
+      // queue is full, all sensors will be read instead.
+      rescan_.store(true);
+    }
+    else
+    {
+      events_[head].pin = pin;
+      events_[head].timestamp = esp_timer_get_time();
+      head_.store(next, std::memory_order_release);
+    }
+    if (waiting_.exchange(false))
+    {
+      notify_from_isr();
+    }
+  }
+
+  /// Requests that all sensor pins be read, this is used when sensors are
+  /// created or modified. This must not be called from an ISR.
+  void request_rescan()
+  {
+    rescan_.store(true);
+    if (waiting_.exchange(false))
+    {
+      notify();
+    }
+  }
+
+private:
+  /// Edge event recorded by the GPIO ISR.
+  struct SensorEvent
+  {
+    /// Pin which changed level.
+    gpio_num_t pin;
+
+    /// Time of the edge, from esp_timer_get_time().
+    int64_t timestamp;
+  };
+
+  /// Queue of edge events, written by the ISR and read by this flow.
+  SensorEvent events_[SENSOR_EVENT_QUEUE_SIZE];
+
+  /// Index of the next entry in @ref events_ to be written by the ISR.
+  std::atomic<size_t> head_{0};
+
+  /// Index of the next entry in @ref events_ to be read by this flow.
+  std::atomic<size_t> tail_{0};
+
+  /// Set when this flow is waiting for an edge, the first caller to clear
+  /// this is responsible for waking up the flow.
+  std::atomic<bool> waiting_{false};
+
+  /// Set when all sensor pins should be read, initially set so the starting
+  /// state of all sensors is read.
+  std::atomic<bool> rescan_{true};
+
+  /// Time of the most recent edge for each pin.
+  int64_t lastEdge_[GPIO_NUM_MAX];
+
+  /// Bitmask of pins which have an edge that has not yet been debounced.
+  uint64_t pending_{0};
+
+  /// Timer used for the debounce delay.
+  StateFlowTimer timer_{this};
+
+  Action drain_events()
+  {
+    int64_t now = esp_timer_get_time();
+    if (rescan_.exchange(false))
+    {
+      OSMutexLock l(&SensorManager::_lock);
+      for (const auto& sensor : sensors)
+      {
+        if (sensor->getPin() != NON_STORED_SENSOR_PIN)
+        {
+          pending_ |= (1ULL << sensor->getPin());
+          lastEdge_[sensor->getPin()] = now - SENSOR_DEBOUNCE_USEC;
+        }
+      }
+    }
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    while (tail != head_.load(std::memory_order_acquire))
+    {
+      lastEdge_[events_[tail].pin] = events_[tail].timestamp;
+      pending_ |= (1ULL << events_[tail].pin);
+      tail = (tail + 1) % SENSOR_EVENT_QUEUE_SIZE;
+    }
+    tail_.store(tail, std::memory_order_release);
+    return call_immediately(STATE(update_sensors));
+  }
+
+  Action update_sensors()
+  {
+    int64_t now = esp_timer_get_time();
+    int64_t next_check = SENSOR_DEBOUNCE_USEC;
+    uint64_t stable = 0;
+    for (uint8_t pin = 0; pin < GPIO_NUM_MAX; pin++)
+    {
+      if (pending_ & (1ULL << pin))
+      {
+        int64_t remaining = (lastEdge_[pin] + SENSOR_DEBOUNCE_USEC) - now;
+        if (remaining <= 0)
+        {
+          stable |= (1ULL << pin);
+        }
+        else
+        {
+          next_check = std::min(next_check, remaining);
+        }
+      }
+    }
+    if (stable)
+    {
+      pending_ &= ~stable;
+      OSMutexLock l(&SensorManager::_lock);
+      for (const auto& sensor : sensors)
+      {
+        if (sensor->getPin() != NON_STORED_SENSOR_PIN &&
+            (stable & (1ULL << sensor->getPin())))
+        {
+          sensor->check();
+        }
+      }
+    }
+    if (pending_)
+    {
+      return sleep_and_call(&timer_, USEC_TO_NSEC(next_check)
+                          , STATE(drain_events));
+    }
+    // publish that we are waiting before checking the queue one last time so
+    // that an edge recorded in between is not lost.
+    waiting_.store(true);
+    if ((rescan_.load() ||
+         tail_.load(std::memory_order_relaxed) !=
+           head_.load(std::memory_order_acquire)) &&
+        waiting_.exchange(false))
+    {
+      return call_immediately(STATE(drain_events));
+    }
+    return wait_and_call(STATE(drain_events));
+  }
+};
+
+/// Flow which processes edge events for all GPIO sensors.
+static SensorEventFlow *sensorEventFlow = nullptr;
+
+// GPIO ISR handler for all sensor pins, the argument is the pin number.
+static void sensor_isr(void *arg)
+{
+  sensorEventFlow->record_edge((gpio_num_t)(intptr_t)arg);
+}
+
+void SensorManager::init(Service *service)
 {
   LOG(INFO, "[Sensors] Initializing sensors");
+  // the ISR service may have already been installed by another component.
+  esp_err_t res = gpio_install_isr_service(0);
+  if (res != ESP_ERR_INVALID_STATE)
+  {
+    ESP_ERROR_CHECK(res);
+  }
+  sensorEventFlow = new SensorEventFlow(service);
   nlohmann::json root = nlohmann::json::parse(
     Singleton<FileSystemManager>::instance()->load(SENSORS_JSON_FILE));
   if(root.contains(JSON_COUNT_NODE))
@@ -53,7 +241,6 @@ void SensorManager::init()
     }
   }
   LOG(INFO, "[Sensors] Loaded %d sensors", sensors.size());
-  xTaskCreate(sensorTask, "SensorManager", SENSOR_TASK_STACK_SIZE, NULL, SENSOR_TASK_PRIORITY, &_taskHandle);
 }
 
 void SensorManager::clear()
@@ -79,24 +266,6 @@ uint16_t SensorManager::store()
   return sensorStoredCount;
 }
 
-void SensorManager::sensorTask(void *param)
-{
-  while(true)
-  {
-    {
-      OSMutexLock l(&_lock);
-      for (const auto& sensor : sensors)
-      {
-        if (sensor->getPin() != NON_STORED_SENSOR_PIN)
-        {
-          sensor->check();
-        }
-      }
-    }
-    vTaskDelay(pdMS_TO_TICKS(50));
-  }
-}
-
 string SensorManager::getStateAsJson()
 {
   OSMutexLock l(&_lock);
@@ -113,6 +282,17 @@ string SensorManager::getStateAsJson()
   return status;
 }
 
+bool SensorManager::getStateAsJson(size_t index, string *json)
+{
+  OSMutexLock l(&_lock);
+  if (index >= sensors.size())
+  {
+    return false;
+  }
+  json->append(sensors[index]->toJson(true));
+  return true;
+}
+
 Sensor *SensorManager::getSensor(uint16_t id)
 {
   OSMutexLock l(&_lock);
@@ -194,12 +374,7 @@ Sensor::Sensor(uint16_t sensorID, gpio_num_t pin, bool pullUp, bool announce, bo
         , "[Sensors] Sensor(%d) on pin %d created, pullup %s", _sensorID, _pin
         , _pullUp ? "Enabled" : "Disabled");
     }
-    gpio_pad_select_gpio(_pin);
-    ESP_ERROR_CHECK(gpio_set_direction(_pin, GPIO_MODE_INPUT));
-    if (pullUp)
-    {
-      ESP_ERROR_CHECK(gpio_pullup_en(_pin));
-    }
+    configurePin();
   }
 }
 
@@ -212,11 +387,14 @@ Sensor::Sensor(string &data) : _lastState(false)
   LOG(CONFIG_GPIO_SENSOR_LOG_LEVEL
     , "[Sensors] Sensor(%d) on pin %d loaded, pullup %s", _sensorID, _pin
     , _pullUp ? "Enabled" : "Disabled");
-  gpio_pad_select_gpio(_pin);
-  ESP_ERROR_CHECK(gpio_set_direction(_pin, GPIO_MODE_INPUT));
-  if (_pullUp)
+  configurePin();
+}
+
+Sensor::~Sensor()
+{
+  if (_pin != NON_STORED_SENSOR_PIN)
   {
-    ESP_ERROR_CHECK(gpio_pullup_en(_pin));
+    gpio_isr_handler_remove(_pin);
   }
 }
 
@@ -237,18 +415,30 @@ string Sensor::toJson(bool includeState)
 
 void Sensor::update(gpio_num_t pin, bool pullUp)
 {
+  gpio_isr_handler_remove(_pin);
   ESP_ERROR_CHECK(gpio_reset_pin(_pin));
   _pin = pin;
   _pullUp = pullUp;
   LOG(CONFIG_GPIO_SENSOR_LOG_LEVEL
     , "[Sensors] Sensor(%d) on pin %d updated, pullup %s", _sensorID, _pin
     , _pullUp ? "Enabled" : "Disabled");
+  configurePin();
+}
+
+void Sensor::configurePin()
+{
   gpio_pad_select_gpio(_pin);
   ESP_ERROR_CHECK(gpio_set_direction(_pin, GPIO_MODE_INPUT));
   if (_pullUp)
   {
     ESP_ERROR_CHECK(gpio_pullup_en(_pin));
   }
+  ESP_ERROR_CHECK(gpio_set_intr_type(_pin, GPIO_INTR_ANYEDGE));
+  ESP_ERROR_CHECK(
+    gpio_isr_handler_add(_pin, sensor_isr, (void *)(intptr_t)_pin));
+  ESP_ERROR_CHECK(gpio_intr_enable(_pin));
+  // read the initial state of the pin.
+  sensorEventFlow->request_rescan();
 }
 
 void Sensor::check()
@@ -267,8 +457,9 @@ string Sensor::set(bool state)
   {
     _lastState = state;
     LOG(INFO, "Sensor: %d :: %s", _sensorID, _lastState ? "ACTIVE" : "INACTIVE");
-    // TODO: find a way to send this out on the JMRI interface
-    return StringPrintf("<%c %d>", state ? 'Q' : 'q', _sensorID);
+    string message = StringPrintf("<%c %d>", state ? 'Q' : 'q', _sensorID);
+    StateBroadcast::publish(StateType::SENSOR, _sensorID, message);
+    return message;
   }
   return COMMAND_NO_RESPONSE;
 }
@@ -301,7 +492,7 @@ where
 **********************************************************************/
 
 DCC_PROTOCOL_COMMAND_HANDLER(SensorCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if(arguments.empty())
   {
@@ -103,6 +103,14 @@ class OutputManager
     static Output *getOutput(uint16_t);
     static bool toggle(uint16_t);
     static std::string getStateAsJson();
+
+    /// Serializes a single output as JSON.
+    ///
+    /// @param index is the index of the output to serialize.
+    /// @param json is the string to append the output to.
+    ///
+    /// @return false if index is beyond the last output.
+    static bool getStateAsJson(size_t index, std::string *json);
     static std::string get_state_for_dccpp();
     static bool createOrUpdate(const uint16_t, const gpio_num_t, const uint8_t);
     static bool remove(const uint16_t);
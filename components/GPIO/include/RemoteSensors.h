@@ -63,6 +63,14 @@ public:
   static void createOrUpdate(const uint16_t, const uint16_t=0);
   static bool remove(const uint16_t);
   static std::string getStateAsJson();
+
+  /// Serializes a single remote sensor as JSON.
+  ///
+  /// @param index is the index of the remote sensor to serialize.
+  /// @param json is the string to append the remote sensor to.
+  ///
+  /// @return false if index is beyond the last remote sensor.
+  static bool getStateAsJson(size_t index, std::string *json);
   static std::string get_state_for_dccpp();
 };
 
@@ -22,7 +22,7 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <driver/gpio.h>
 
 #include <openlcb/RefreshLoop.hxx>
-#include <utils/Atomic.hxx>
+#include <os/OS.hxx>
 #include <utils/Singleton.hxx>
 
 #include "Sensors.h"
@@ -72,27 +72,23 @@ public:
   {
     return _sensors.size();
   }
-  void prepForRead()
+  void setSensorState(uint16_t index, bool state)
   {
-    _nextSensorToRead = 0;
+    if (index < _sensors.size())
+    {
+      _sensors[index]->setState(state);
+    }
   }
-  bool hasMore()
-  {
-    return _nextSensorToRead < _sensors.size();
-  }
-  void readNext();
   std::string get_state_for_dccpp();
 private:
   uint8_t _id;
   gpio_num_t _dataPin;
   uint16_t _sensorIDBase;
-  uint8_t _nextSensorToRead;
   uint16_t _lastSensorID;
   std::vector<S88Sensor *> _sensors;
 };
 
 class S88BusManager : public Singleton<S88BusManager>, public openlcb::Polling
-                    , private Atomic
 {
 public:
   S88BusManager(openlcb::Node *node);
@@ -104,10 +100,48 @@ public:
   bool createOrUpdateBus(const uint8_t, const gpio_num_t, const uint16_t);
   bool removeBus(const uint8_t);
   std::string get_state_as_json();
+
+  /// Serializes a single S88 bus as JSON.
+  ///
+  /// @param index is the index of the bus to serialize.
+  /// @param json is the string to append the bus to.
+  ///
+  /// @return false if index is beyond the last bus.
+  bool get_state_as_json(size_t index, std::string *json);
   std::string get_state_for_dccpp();
 private:
+  /// Scan state for a single S88 bus, this is only accessed by the S88 task.
+  struct S88BusScan
+  {
+    /// ID of the bus being scanned.
+    uint8_t id;
+
+    /// Data pin of the bus being scanned.
+    gpio_num_t dataPin;
+
+    /// Number of sensors on the bus.
+    uint16_t count;
+
+    /// When false no sensor states have been published for this bus yet.
+    bool published;
+
+    /// Sensor states from the last published scan, one bit per sensor.
+    std::vector<uint8_t> current;
+
+    /// Sensor states being collected by the active scan.
+    std::vector<uint8_t> next;
+  };
+
+  /// Shifts the sensor states of all buses into @ref S88BusScan::next.
+  void scan();
+
+  /// Publishes any sensors which have changed state since the last scan.
+  void publish();
+
   openlcb::RefreshLoop poller_;
   std::vector<std::unique_ptr<S88SensorBus>> buses_;
+  std::vector<S88BusScan> scans_;
+  OSMutex lock_;
   os_thread_t taskHandle_;
 };
 
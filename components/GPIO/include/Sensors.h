@@ -20,6 +20,7 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 
 #include <DCCppProtocol.h>
 #include <driver/gpio.h>
+#include <executor/Service.hxx>
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(SensorCommandAdapter, "S", 0)
 
@@ -30,7 +31,7 @@ class Sensor
 public:
   Sensor(uint16_t, gpio_num_t, bool=false, bool=true, bool=false);
   Sensor(std::string &);
-  virtual ~Sensor() {}
+  virtual ~Sensor();
   void update(gpio_num_t, bool=false);
   virtual std::string toJson(bool=false);
   uint16_t getID()
@@ -58,6 +59,7 @@ protected:
     _sensorID = id;
   }
 private:
+  void configurePin();
   uint16_t _sensorID;
   gpio_num_t _pin;
   bool _pullUp;
@@ -67,19 +69,26 @@ private:
 class SensorManager
 {
 public:
-  static void init();
+  static void init(Service *service);
   static void clear();
   static uint16_t store();
-  static void sensorTask(void *param);
   static std::string getStateAsJson();
+
+  /// Serializes a single sensor as JSON.
+  ///
+  /// @param index is the index of the sensor to serialize.
+  /// @param json is the string to append the sensor to.
+  ///
+  /// @return false if index is beyond the last sensor.
+  static bool getStateAsJson(size_t index, std::string *json);
   static Sensor *getSensor(uint16_t);
   static bool createOrUpdate(const uint16_t, const gpio_num_t, const bool);
   static bool remove(const uint16_t);
   static gpio_num_t getSensorPin(const uint16_t);
   static std::string get_state_for_dccpp();
 private:
-  static TaskHandle_t _taskHandle;
   static OSMutex _lock;
+  friend class SensorEventFlow;
 };
 
 #endif // SENSORS_H_
\ No newline at end of file
@@ -19,6 +19,8 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #define JMRI_CLIENT_FLOW_H_
 
 #include <DCCppProtocol.h>
+#include <Metrics.h>
+#include <StateBroadcast.h>
 #include <executor/StateFlow.hxx>
 
 class JmriClientFlow : private StateFlowBase, public DCCPPProtocolConsumer
@@ -29,6 +31,7 @@ public:
     , remoteIP_(remote_ip)
   {
     LOG(INFO, "[JMRI %s] Connected", name().c_str());
+    connectedClients_.inc();
     bzero(buf_, BUFFER_SIZE);
 
     struct timeval tm;
@@ -43,10 +46,17 @@ public:
   virtual ~JmriClientFlow()
   {
     LOG(INFO, "[JMRI %s] Disconnected", name().c_str());
+    connectedClients_.dec();
     ::close(fd_);
   }
 private:
   static const size_t BUFFER_SIZE = 128;
+
+  // metrics shared by all clients, these are defined in JmriInterface.cpp.
+  static esp32cs::Gauge connectedClients_;
+  static esp32cs::Counter bytesReceived_;
+  static esp32cs::Counter bytesSent_;
+
   int fd_;
   uint32_t remoteIP_;
   uint8_t buf_[BUFFER_SIZE];
@@ -54,6 +64,11 @@ private:
   string res_;
   StateFlowTimedSelectHelper helper_{this};
 
+  // state changes which have not yet been sent to the client, these are only
+  // drained once the previous response has been written so that a slow
+  // client receives the latest state rather than every intermediate change.
+  StateSubscriber state_;
+
   Action read_data()
   {
     // clear the buffer of data we have sent back
@@ -71,15 +86,21 @@ private:
     }
     else if (helper_.remaining_ == BUFFER_SIZE)
     {
+      if (state_.drain(&res_))
+      {
+        return yield_and_call(STATE(send_data));
+      }
       return yield_and_call(STATE(read_data));
     }
     else
     {
       buf_used_ = BUFFER_SIZE - helper_.remaining_;
       LOG(VERBOSE, "[JMRI %s] received %zu bytes", name().c_str(), buf_used_);
+      bytesReceived_.inc(buf_used_);
     }
     res_.append(feed(buf_, buf_used_));
     buf_used_ = 0;
+    state_.drain(&res_);
     return yield_and_call(STATE(send_data));
   }
 
@@ -89,6 +110,7 @@ private:
     {
       return yield_and_call(STATE(read_data));
     }
+    bytesSent_.inc(res_.length());
     return write_repeated(&helper_, fd_, res_.data(), res_.length()
                         , STATE(read_data));
   }
@@ -25,6 +25,13 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 
 std::unique_ptr<SocketListener> listener;
 
+esp32cs::Gauge JmriClientFlow::connectedClients_(
+  "jmri_clients", "Connected JMRI clients");
+esp32cs::Counter JmriClientFlow::bytesReceived_(
+  "jmri_bytes_received_total", "Bytes received from JMRI clients");
+esp32cs::Counter JmriClientFlow::bytesSent_(
+  "jmri_bytes_sent_total", "Bytes sent to JMRI clients");
+
 void init_jmri_interface()
 {
   Singleton<Esp32WiFiManager>::instance()->register_network_up_callback(
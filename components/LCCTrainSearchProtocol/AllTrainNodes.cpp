@@ -70,6 +70,7 @@ struct AllTrainNodes::Impl
 
 void AllTrainNodes::remove_train_impl(int address)
 {
+  purge_retired_trains();
   OSMutexLock l(&trainsLock_);
   auto it = std::find_if(trains_.begin(), trains_.end(), [address](Impl *impl)
   {
@@ -78,12 +79,46 @@ void AllTrainNodes::remove_train_impl(int address)
   if (it != trains_.end())
   {
     Impl *impl = (*it);
+    auto ent = trainsByAddress_.find(address);
+    if (ent != trainsByAddress_.end() && ent->second == impl)
+    {
+      trainsByAddress_.erase(ent);
+    }
     impl->node_->iface()->delete_local_node(impl->node_);
-    delete impl;
+    // other threads may still be using the TrainImpl returned by
+    // find_train_impl, it will be deleted by purge_retired_trains.
+    retiredTrains_.emplace_back(os_get_time_monotonic(), impl);
     trains_.erase(it);
+    // if another train (of a different drive type) uses the same address it
+    // will now be found by address.
+    it = std::find_if(trains_.begin(), trains_.end(), [address](Impl *other)
+    {
+      return other->train_->legacy_address() == address;
+    });
+    if (it != trains_.end())
+    {
+      trainsByAddress_.emplace(address, *it);
+    }
   }
 }
 
+void AllTrainNodes::purge_retired_trains()
+{
+  long long now = os_get_time_monotonic();
+  retiredTrains_.erase(
+    std::remove_if(retiredTrains_.begin(), retiredTrains_.end()
+    , [now](const std::pair<long long, Impl *> &entry)
+      {
+        if (now - entry.first < RETIRED_TRAIN_DELAY)
+        {
+          return false;
+        }
+        delete entry.second;
+        return true;
+      })
+  , retiredTrains_.end());
+}
+
 openlcb::TrainImpl* AllTrainNodes::get_train_impl(openlcb::NodeID id, bool allocate)
 {
   auto it = find_node(id, allocate);
@@ -96,18 +131,40 @@ openlcb::TrainImpl* AllTrainNodes::get_train_impl(openlcb::NodeID id, bool alloc
 
 openlcb::TrainImpl* AllTrainNodes::get_train_impl(DccMode drive_type, int address)
 {
+  openlcb::TrainImpl *train = find_train_impl(address);
+  if (train)
   {
-    OSMutexLock l(&trainsLock_);
-    auto it = std::find_if(trains_.begin(), trains_.end(), [address](Impl *impl)
+    return train;
+  }
+  return find_node(allocate_node(drive_type, address))->train_;
+}
+
+openlcb::TrainImpl* AllTrainNodes::find_train_impl(int address)
+{
+  OSMutexLock l(&trainsLock_);
+  auto it = trainsByAddress_.find(address);
+  if (it != trainsByAddress_.end())
+  {
+    return it->second->train_;
+  }
+  return nullptr;
+}
+
+openlcb::TrainImpl* AllTrainNodes::find_or_create_train_impl(DccMode drive_type
+                                                           , int address)
+{
+  openlcb::TrainImpl *train = find_train_impl(address);
+  if (!train)
+  {
+    // creating the train node registers it with the LCC stack which must be
+    // done on the LCC executor, sync_run will execute it inline if called
+    // from the executor.
+    tractionService_->iface()->executor()->sync_run([&]()
     {
-      return impl->train_->legacy_address() == address;
+      train = get_train_impl(drive_type, address);
     });
-    if (it != trains_.end())
-    {
-      return (*it)->train_;
-    }
   }
-  return find_node(allocate_node(drive_type, address))->train_;
+  return train;
 }
 
 AllTrainNodes::Impl* AllTrainNodes::find_node(openlcb::Node* node) 
@@ -613,6 +670,7 @@ AllTrainNodes::AllTrainNodes(TrainDb* db,
 AllTrainNodes::Impl* AllTrainNodes::create_impl(int train_id, DccMode mode,
                                                 int address)
 {
+  purge_retired_trains();
   Impl* impl = new Impl;
   impl->id = train_id;
   switch (mode) {
@@ -666,6 +724,10 @@ AllTrainNodes::Impl* AllTrainNodes::create_impl(int train_id, DccMode mode,
     impl->eventHandler_ =
         new openlcb::FixedEventProducer<openlcb::TractionDefs::IS_TRAIN_EVENT>(
             impl->node_);
+    {
+      OSMutexLock l(&trainsLock_);
+      trainsByAddress_.emplace(impl->train_->legacy_address(), impl);
+    }
     return impl;
   } else {
     delete impl;
@@ -702,6 +764,10 @@ AllTrainNodes::~AllTrainNodes()
   for (auto* t : trains_) {
     delete t;
   }
+  for (auto &retired : retiredTrains_) {
+    delete retired.second;
+  }
+  trainsByAddress_.clear();
   memoryConfigService_->registry()->erase(
       nullptr, openlcb::MemoryConfigDefs::SPACE_FDI, fdiSpace_.get());
   memoryConfigService_->registry()->erase(
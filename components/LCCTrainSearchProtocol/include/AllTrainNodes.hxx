@@ -36,6 +36,7 @@
 #define _BRACZ_COMMANDSTATION_ALLTRAINNODES_HXX_
 
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include <openlcb/SimpleInfoProtocol.hxx>
@@ -66,7 +67,11 @@ class AllTrainNodes : public Singleton<AllTrainNodes>
                 openlcb::MemorySpace* tmp_train_cdi);
   ~AllTrainNodes();
 
-  /// Removes a TrainImpl for the requested address if it exists.
+  /// Removes a TrainImpl for the requested address if it exists, this must
+  /// be called on the LCC executor. The TrainImpl is only deleted once it
+  /// has been retired for RETIRED_TRAIN_DELAY so that a pointer returned by
+  /// @ref find_train_impl on another thread remains valid while the caller
+  /// completes its current command.
   void remove_train_impl(int address);
 
   openlcb::TrainImpl* get_train_impl(openlcb::NodeID id, bool allocate=true);
@@ -76,6 +81,24 @@ class AllTrainNodes : public Singleton<AllTrainNodes>
   /// @param address is the legacy address of the loco to find or create.
   openlcb::TrainImpl* get_train_impl(DccMode drive_type, int address);
 
+  /// Finds an existing TrainImpl for the requested address, this does not
+  /// create a train and can be called from any thread. The returned pointer
+  /// must not be kept beyond the current command, see
+  /// @ref remove_train_impl.
+  /// @param address is the legacy address of the loco to find.
+  /// @return the TrainImpl or nullptr if there is no active train with the
+  /// address.
+  openlcb::TrainImpl* find_train_impl(int address);
+
+  /// Finds or creates a TrainImpl for the requested address from outside of
+  /// the LCC executor. Existing trains are returned without involving the
+  /// executor, a new train is created on the LCC executor and the caller is
+  /// blocked until this completes.
+  /// @param drive_type is the drive type for the loco to create if it doesn't exist.
+  /// @param address is the legacy address of the loco to find or create.
+  openlcb::TrainImpl* find_or_create_train_impl(DccMode drive_type
+                                              , int address);
+
   /// Returns a traindb entry or nullptr if the id is too high.
   std::shared_ptr<TrainDbEntry> get_traindb_entry(int id);
 
@@ -121,9 +144,26 @@ class AllTrainNodes : public Singleton<AllTrainNodes>
   /// All train nodes that we know about.
   std::vector<Impl*> trains_;
   
-  /// Lock to protect trains_.
+  /// Active trains by legacy address, this allows the DCC++ and web
+  /// throttles to find a train without scanning trains_ or waiting for the
+  /// LCC executor. Entries are only added once the train node has been
+  /// fully constructed.
+  std::unordered_map<int, Impl*> trainsByAddress_;
+
+  /// Lock to protect trains_ and trainsByAddress_.
   OSMutex trainsLock_;
 
+  /// Time a removed train is retained before it is deleted.
+  static constexpr long long RETIRED_TRAIN_DELAY = SEC_TO_NSEC(5);
+
+  /// Trains which have been removed but not yet deleted, with the time they
+  /// were removed. Only accessed on the LCC executor.
+  std::vector<std::pair<long long, Impl*>> retiredTrains_;
+
+  /// Deletes the retired trains which have been retained for at least
+  /// RETIRED_TRAIN_DELAY, this must be called on the LCC executor.
+  void purge_retired_trains();
+
   friend class FindProtocolServer;
   std::unique_ptr<FindProtocolServer> findProtocolServer_;
 
@@ -16,6 +16,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 **********************************************************************/
 
 #include "FreeRTOSTaskMonitor.h"
+#include "Metrics.h"
 
 #include <algorithm>
 #include <freertos/task.h>
@@ -25,6 +26,43 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #define CONFIG_TASK_LIST_INTERVAL_SEC 300
 #endif
 
+// These are sampled when the metrics are read rather than being updated by
+// the periodic report.
+static esp32cs::Gauge uptime(
+  "uptime_seconds", "Seconds since startup", ""
+, []()
+  {
+    return (int32_t)USEC_TO_SEC(esp_timer_get_time());
+  });
+
+static esp32cs::Gauge free_heap(
+  "heap_free_bytes", "Free internal heap", ""
+, []()
+  {
+    return (int32_t)heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  });
+
+static esp32cs::Gauge largest_block(
+  "heap_largest_free_block_bytes", "Largest free heap block", ""
+, []()
+  {
+    return (int32_t)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  });
+
+static esp32cs::Gauge task_count(
+  "tasks", "Number of FreeRTOS tasks", ""
+, []()
+  {
+    return (int32_t)uxTaskGetNumberOfTasks();
+  });
+
+static esp32cs::Gauge buffer_pool(
+  "main_buffer_pool_bytes", "Memory allocated by the main buffer pool", ""
+, []()
+  {
+    return mainBufferPool ? (int32_t)mainBufferPool->total_size() : 0;
+  });
+
 FreeRTOSTaskMonitor::FreeRTOSTaskMonitor(Service *service)
   : StateFlowBase(service)
   // explicit cast is necessary for these next two lines due to compiler
@@ -0,0 +1,253 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "Metrics.h"
+
+#include <algorithm>
+#include <os/OS.hxx>
+#include <string.h>
+#include <utils/StringPrintf.hxx>
+#include <vector>
+
+namespace esp32cs
+{
+
+// Metrics are commonly declared as static variables in other translation
+// units so the registry is created on first use rather than relying on the
+// static initialization order.
+static OSMutex &registry_lock()
+{
+  static OSMutex lock;
+  return lock;
+}
+
+static std::vector<Metric *> &registry()
+{
+  static std::vector<Metric *> metrics;
+  return metrics;
+}
+
+// Returns the registered metrics ordered by name, the registry lock must be
+// held.
+static std::vector<Metric *> sorted_metrics()
+{
+  std::vector<Metric *> metrics = registry();
+  std::stable_sort(metrics.begin(), metrics.end()
+                 , [](const Metric *left, const Metric *right)
+                   {
+                     return strcmp(left->name(), right->name()) < 0;
+                   });
+  return metrics;
+}
+
+// Converts labels from the Prometheus name="value" format to JSON object
+// members.
+static std::string labels_to_json(const std::string &labels)
+{
+  std::string json;
+  bool in_value = false;
+  json.reserve(labels.size() + 8);
+  json += '"';
+  for (char ch : labels)
+  {
+    if (in_value)
+    {
+      json += ch;
+      in_value = (ch != '"');
+    }
+    else if (ch == '=')
+    {
+      json += "\":";
+    }
+    else if (ch == '"')
+    {
+      json += ch;
+      in_value = true;
+    }
+    else if (ch == ',')
+    {
+      json += ",\"";
+    }
+    else
+    {
+      json += ch;
+    }
+  }
+  return json;
+}
+
+Metric::Metric(Type type, const char *name, const char *help
+             , std::string labels)
+  : type_(type), name_(name), help_(help), labels_(std::move(labels))
+{
+  OSMutexLock l(&registry_lock());
+  registry().push_back(this);
+}
+
+Metric::~Metric()
+{
+  OSMutexLock l(&registry_lock());
+  auto &metrics = registry();
+  metrics.erase(std::remove(metrics.begin(), metrics.end(), this)
+              , metrics.end());
+}
+
+std::string Metric::to_text()
+{
+  static const char * const TYPE_NAMES[] = {"counter", "gauge", "histogram"};
+  std::string text;
+  OSMutexLock l(&registry_lock());
+  const char *last = nullptr;
+  for (auto metric : sorted_metrics())
+  {
+    if (!last || strcmp(last, metric->name_))
+    {
+      text += StringPrintf("# HELP %s %s\n# TYPE %s %s\n", metric->name_
+                         , metric->help_, metric->name_
+                         , TYPE_NAMES[static_cast<uint8_t>(metric->type_)]);
+      last = metric->name_;
+    }
+    metric->append_text(&text);
+  }
+  return text;
+}
+
+std::string Metric::to_json()
+{
+  std::string json = "{\"metrics\":[";
+  OSMutexLock l(&registry_lock());
+  for (auto metric : sorted_metrics())
+  {
+    if (json.back() != '[')
+    {
+      json += ",";
+    }
+    json += StringPrintf("{\"name\":\"%s\",", metric->name_);
+    if (!metric->labels_.empty())
+    {
+      json += labels_to_json(metric->labels_);
+      json += ",";
+    }
+    metric->append_json(&json);
+    json += "}";
+  }
+  json += "]}";
+  return json;
+}
+
+void Counter::append_text(std::string *text)
+{
+  if (labels_.empty())
+  {
+    text->append(StringPrintf("%s %u\n", name_, (unsigned)value()));
+  }
+  else
+  {
+    text->append(StringPrintf("%s{%s} %u\n", name_, labels_.c_str()
+                            , (unsigned)value()));
+  }
+}
+
+void Counter::append_json(std::string *json)
+{
+  json->append(StringPrintf("\"value\":%u", (unsigned)value()));
+}
+
+void Gauge::append_text(std::string *text)
+{
+  if (labels_.empty())
+  {
+    text->append(StringPrintf("%s %d\n", name_, (int)value()));
+  }
+  else
+  {
+    text->append(StringPrintf("%s{%s} %d\n", name_, labels_.c_str()
+                            , (int)value()));
+  }
+}
+
+void Gauge::append_json(std::string *json)
+{
+  json->append(StringPrintf("\"value\":%d", (int)value()));
+}
+
+Histogram::Histogram(const char *name, const char *help
+                   , std::initializer_list<uint32_t> bounds
+                   , std::string labels)
+  : Metric(Type::HISTOGRAM, name, help, std::move(labels))
+{
+  for (uint32_t bound : bounds)
+  {
+    if (numBounds_ == MAX_BOUNDS)
+    {
+      break;
+    }
+    bounds_[numBounds_++] = bound;
+  }
+  for (auto &bucket : buckets_)
+  {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::append_text(std::string *text)
+{
+  std::string prefix = labels_.empty() ? "" : labels_ + ",";
+  uint32_t count = 0;
+  for (size_t bucket = 0; bucket < numBounds_; bucket++)
+  {
+    count += buckets_[bucket].load(std::memory_order_relaxed);
+    text->append(StringPrintf("%s_bucket{%sle=\"%u\"} %u\n", name_
+                            , prefix.c_str(), (unsigned)bounds_[bucket]
+                            , (unsigned)count));
+  }
+  count += buckets_[numBounds_].load(std::memory_order_relaxed);
+  text->append(StringPrintf("%s_bucket{%sle=\"+Inf\"} %u\n", name_
+                          , prefix.c_str(), (unsigned)count));
+  if (labels_.empty())
+  {
+    text->append(StringPrintf("%s_sum %u\n%s_count %u\n", name_
+                            , (unsigned)sum_.load(std::memory_order_relaxed)
+                            , name_, (unsigned)count));
+  }
+  else
+  {
+    text->append(StringPrintf("%s_sum{%s} %u\n%s_count{%s} %u\n", name_
+                            , labels_.c_str()
+                            , (unsigned)sum_.load(std::memory_order_relaxed)
+                            , name_, labels_.c_str(), (unsigned)count));
+  }
+}
+
+void Histogram::append_json(std::string *json)
+{
+  uint32_t count = 0;
+  json->append("\"buckets\":{");
+  for (size_t bucket = 0; bucket < numBounds_; bucket++)
+  {
+    count += buckets_[bucket].load(std::memory_order_relaxed);
+    json->append(StringPrintf("\"%u\":%u,", (unsigned)bounds_[bucket]
+                            , (unsigned)count));
+  }
+  count += buckets_[numBounds_].load(std::memory_order_relaxed);
+  json->append(StringPrintf("\"+Inf\":%u},\"sum\":%u,\"count\":%u"
+                          , (unsigned)count
+                          , (unsigned)sum_.load(std::memory_order_relaxed)
+                          , (unsigned)count));
+}
+
+} // namespace esp32cs
@@ -0,0 +1,174 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <esp_ipc.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <os/OS.hxx>
+#include <utils/logging.h>
+#include <xtensa/hal.h>
+
+#ifndef CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ 240
+#endif
+
+namespace esp32cs
+{
+
+static_assert((CONFIG_TRACE_BUFFER_EVENTS &
+              (CONFIG_TRACE_BUFFER_EVENTS - 1)) == 0
+            , "CONFIG_TRACE_BUFFER_EVENTS must be a power of two");
+
+/// Version of the binary dump format.
+static constexpr uint8_t TRACE_FORMAT_VERSION = 1;
+
+/// Ring buffer of a single core.
+struct TraceBuffer
+{
+  /// Total number of records reserved, the next record is written to this
+  /// index modulo CONFIG_TRACE_BUFFER_EVENTS.
+  std::atomic<uint32_t> head;
+
+  /// Records of the buffer, nullptr until tracing has been enabled.
+  std::atomic<TraceRecord *> records;
+};
+
+/// Cycle counter and time captured together on a core.
+struct TraceReference
+{
+  /// Cycle counter of the core.
+  uint32_t ccount;
+
+  /// Microseconds since startup.
+  uint64_t usec;
+};
+
+static TraceBuffer buffers[portNUM_PROCESSORS];
+
+/// Lock protecting the allocation of the buffers and the dump.
+static OSMutex trace_lock;
+
+std::atomic<uint32_t> Trace::mask_{0};
+
+// Captures the cycle counter and time, this is invoked on the core the
+// reference is captured for.
+static void capture_reference(void *arg)
+{
+  TraceReference *ref = static_cast<TraceReference *>(arg);
+  ref->ccount = xthal_get_ccount();
+  ref->usec = esp_timer_get_time();
+}
+
+// Appends the binary representation of a value to the dump.
+template <typename T>
+static void append(std::string *data, const T &value)
+{
+  data->append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void Trace::record(TraceEvent event, uint16_t arg0, uint32_t arg1)
+{
+  // the core is read before the cycle counter, a task which migrates to the
+  // other core in between records a timestamp from that core but the slot
+  // reservation remains safe.
+  TraceBuffer &buf = buffers[xPortGetCoreID()];
+  uint32_t ccount = xthal_get_ccount();
+  TraceRecord *records = buf.records.load(std::memory_order_acquire);
+  if (!records)
+  {
+    return;
+  }
+  uint32_t index = buf.head.fetch_add(1, std::memory_order_relaxed) &
+                   (CONFIG_TRACE_BUFFER_EVENTS - 1);
+  records[index] = {ccount, (uint8_t)event, 0, arg0, arg1};
+}
+
+void Trace::set_events(uint32_t mask)
+{
+  OSMutexLock l(&trace_lock);
+  if (mask)
+  {
+    for (auto &buf : buffers)
+    {
+      if (!buf.records.load(std::memory_order_relaxed))
+      {
+        TraceRecord *records = static_cast<TraceRecord *>(
+          calloc(CONFIG_TRACE_BUFFER_EVENTS, sizeof(TraceRecord)));
+        if (!records)
+        {
+          LOG_ERROR("[Trace] Unable to allocate trace buffer (%zu bytes)"
+                  , CONFIG_TRACE_BUFFER_EVENTS * sizeof(TraceRecord));
+          return;
+        }
+        buf.records.store(records, std::memory_order_release);
+      }
+    }
+  }
+  mask_.store(mask, std::memory_order_relaxed);
+  LOG(INFO, "[Trace] Recording events: %08x", (unsigned)mask);
+}
+
+void Trace::clear()
+{
+  OSMutexLock l(&trace_lock);
+  for (auto &buf : buffers)
+  {
+    buf.head.store(0, std::memory_order_relaxed);
+  }
+}
+
+std::string Trace::dump()
+{
+  OSMutexLock l(&trace_lock);
+  uint32_t mask = mask_.exchange(0, std::memory_order_relaxed);
+  std::string data;
+  data.reserve(16 + portNUM_PROCESSORS *
+               (16 + CONFIG_TRACE_BUFFER_EVENTS * sizeof(TraceRecord)));
+  data.append("ESTR", 4);
+  append(&data, TRACE_FORMAT_VERSION);
+  append(&data, (uint8_t)portNUM_PROCESSORS);
+  append(&data, (uint16_t)sizeof(TraceRecord));
+  append(&data, (uint32_t)CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ);
+  append(&data, mask);
+  for (uint32_t core = 0; core < portNUM_PROCESSORS; core++)
+  {
+    TraceReference ref;
+    esp_ipc_call_blocking(core, capture_reference, &ref);
+    TraceBuffer &buf = buffers[core];
+    TraceRecord *records = buf.records.load(std::memory_order_acquire);
+    uint32_t head = buf.head.load(std::memory_order_relaxed);
+    uint32_t count = 0;
+    if (records)
+    {
+      count = std::min(head, (uint32_t)CONFIG_TRACE_BUFFER_EVENTS);
+    }
+    append(&data, ref.ccount);
+    append(&data, count);
+    append(&data, ref.usec);
+    for (uint32_t index = head - count; index != head; index++)
+    {
+      append(&data, records[index & (CONFIG_TRACE_BUFFER_EVENTS - 1)]);
+    }
+  }
+  mask_.store(mask, std::memory_order_relaxed);
+  return data;
+}
+
+} // namespace esp32cs
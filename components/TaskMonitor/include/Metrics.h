@@ -0,0 +1,249 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <stdint.h>
+#include <string>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_METRICS_FEED_INTERVAL_SEC
+#define CONFIG_METRICS_FEED_INTERVAL_SEC 5
+#endif
+
+namespace esp32cs
+{
+
+/// Base class for all runtime metrics.
+///
+/// Metrics register themselves with the registry on construction and are
+/// removed on destruction, they can be declared as static variables or as
+/// members of the object being monitored. Updating a metric only touches a
+/// single atomic variable and is safe from any task or ISR, the registry lock
+/// is only taken when a metric is created, destroyed or serialized.
+///
+/// Multiple metrics may share a name as long as the labels differ, for
+/// example one per track output using the label track="OPS".
+class Metric
+{
+public:
+  /// Type of a metric.
+  enum class Type : uint8_t
+  {
+    COUNTER,
+    GAUGE,
+    HISTOGRAM
+  };
+
+  /// Destructor.
+  virtual ~Metric();
+
+  /// @return the name of the metric.
+  const char *name() const
+  {
+    return name_;
+  }
+
+  /// @return all registered metrics in the Prometheus text format.
+  static std::string to_text();
+
+  /// @return all registered metrics as JSON.
+  static std::string to_json();
+
+protected:
+  /// Constructor.
+  ///
+  /// @param type is the type of the metric.
+  /// @param name is the name of the metric, this must be a string literal.
+  /// @param help is the description of the metric, this must be a string
+  /// literal.
+  /// @param labels are the optional labels of the metric, name="value"
+  /// separated by commas.
+  Metric(Type type, const char *name, const char *help, std::string labels);
+
+  /// Appends the value(s) of the metric in the Prometheus text format.
+  virtual void append_text(std::string *text) = 0;
+
+  /// Appends the value of the metric as a JSON value.
+  virtual void append_json(std::string *json) = 0;
+
+  /// Type of the metric.
+  const Type type_;
+
+  /// Name of the metric.
+  const char *name_;
+
+  /// Description of the metric.
+  const char *help_;
+
+  /// Labels of the metric, may be empty.
+  const std::string labels_;
+};
+
+/// Monotonically increasing count of events.
+class Counter : public Metric
+{
+public:
+  /// Constructor.
+  ///
+  /// @param name is the name of the metric.
+  /// @param help is the description of the metric.
+  /// @param labels are the optional labels of the metric.
+  Counter(const char *name, const char *help, std::string labels = "")
+    : Metric(Type::COUNTER, name, help, std::move(labels))
+  {
+  }
+
+  /// Increments the counter.
+  ///
+  /// @param count is the amount to add to the counter.
+  void inc(uint32_t count = 1)
+  {
+    value_.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  /// @return the current value of the counter.
+  uint32_t value() const
+  {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+private:
+  /// Current value of the counter.
+  std::atomic<uint32_t> value_{0};
+
+  void append_text(std::string *text) override;
+  void append_json(std::string *json) override;
+};
+
+/// Value which can go up and down.
+///
+/// When a sampler is provided the value is read from it when the metrics are
+/// serialized, this is used for values which are already tracked elsewhere
+/// (free heap, queue depth) and avoids updating the gauge on the hot path.
+class Gauge : public Metric
+{
+public:
+  /// Constructor.
+  ///
+  /// @param name is the name of the metric.
+  /// @param help is the description of the metric.
+  /// @param labels are the optional labels of the metric.
+  /// @param sampler is the optional function to read the value from.
+  Gauge(const char *name, const char *help, std::string labels = ""
+      , std::function<int32_t()> sampler = nullptr)
+    : Metric(Type::GAUGE, name, help, std::move(labels))
+    , sampler_(std::move(sampler))
+  {
+  }
+
+  /// Sets the value of the gauge.
+  void set(int32_t value)
+  {
+    value_.store(value, std::memory_order_relaxed);
+  }
+
+  /// Increments the value of the gauge.
+  void inc(int32_t count = 1)
+  {
+    value_.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  /// Decrements the value of the gauge.
+  void dec(int32_t count = 1)
+  {
+    value_.fetch_sub(count, std::memory_order_relaxed);
+  }
+
+  /// @return the current value of the gauge.
+  int32_t value() const
+  {
+    return sampler_ ? sampler_() : value_.load(std::memory_order_relaxed);
+  }
+
+private:
+  /// Current value of the gauge when there is no sampler.
+  std::atomic<int32_t> value_{0};
+
+  /// Function to read the value from, may be empty.
+  const std::function<int32_t()> sampler_;
+
+  void append_text(std::string *text) override;
+  void append_json(std::string *json) override;
+};
+
+/// Distribution of observed values in fixed buckets.
+///
+/// The bucket bounds are inclusive upper bounds in ascending order, values
+/// above the last bound are counted in an implicit "+Inf" bucket. Buckets are
+/// stored non-cumulative and are accumulated when serialized.
+class Histogram : public Metric
+{
+public:
+  /// Maximum number of bucket bounds.
+  static constexpr size_t MAX_BOUNDS = 8;
+
+  /// Constructor.
+  ///
+  /// @param name is the name of the metric.
+  /// @param help is the description of the metric.
+  /// @param bounds are the upper bounds of the buckets, at most
+  /// @ref MAX_BOUNDS, additional bounds are ignored.
+  /// @param labels are the optional labels of the metric.
+  Histogram(const char *name, const char *help
+          , std::initializer_list<uint32_t> bounds, std::string labels = "");
+
+  /// Records an observed value.
+  ///
+  /// @param value is the value to record.
+  void observe(uint32_t value)
+  {
+    size_t bucket = 0;
+    while (bucket < numBounds_ && value > bounds_[bucket])
+    {
+      bucket++;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+  }
+
+private:
+  /// Upper bounds of the buckets.
+  uint32_t bounds_[MAX_BOUNDS];
+
+  /// Number of entries used in @ref bounds_.
+  size_t numBounds_{0};
+
+  /// Number of observations per bucket, the last used entry is the "+Inf"
+  /// bucket.
+  std::atomic<uint32_t> buckets_[MAX_BOUNDS + 1];
+
+  /// Sum of all observed values.
+  std::atomic<uint32_t> sum_{0};
+
+  void append_text(std::string *text) override;
+  void append_json(std::string *json) override;
+};
+
+} // namespace esp32cs
+
+#endif // METRICS_H_
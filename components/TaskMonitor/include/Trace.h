@@ -0,0 +1,194 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_TRACE_BUFFER_EVENTS
+#define CONFIG_TRACE_BUFFER_EVENTS 1024
+#endif
+
+namespace esp32cs
+{
+
+/// Trace points along the path of a locomotive command, in the order they
+/// are reached. Unless noted otherwise arg0 is the DCC address of the
+/// locomotive (or the packet feedback key, which is the address for
+/// locomotive packets). The feedback key of other packets can be any
+/// uintptr_t value, only its low 16 bits are recorded.
+enum class TraceEvent : uint8_t
+{
+  /// Speed requested by a throttle, arg1 is the @ref TraceSource in the
+  /// upper 16 bits and the requested speed (float16 wire format) in the
+  /// lower 16 bits.
+  THROTTLE,
+
+  /// Update notification from the locomotive, arg1 is the
+  /// dcc::DccTrainUpdateCode.
+  UPDATE_NOTIFY,
+
+  /// Packet generated for a pending update, arg1 is the
+  /// dcc::DccTrainUpdateCode.
+  UPDATE_SEND,
+
+  /// Packet generated for a background refresh, arg1 is one for a speed
+  /// packet and zero otherwise.
+  REFRESH_SEND,
+
+  /// Packet written to a track device, arg1 is the file descriptor.
+  TRACK_WRITE,
+
+  /// Packet taken from the queue for transmission by the RMT, this is
+  /// recorded from the RMT ISR, arg1 is the RMT channel in the lower eight
+  /// bits and the repeat count in the next eight bits.
+  RMT_ENCODE,
+
+  /// RailCom reply received in the cutout after a packet, arg1 is the
+  /// number of decoded datagrams.
+  RAILCOM_REPLY
+};
+
+/// Origin of a @ref TraceEvent::THROTTLE event.
+enum class TraceSource : uint8_t
+{
+  DCCPP,
+  WITHROTTLE,
+  WEB
+};
+
+/// @return the bit used for a @ref TraceEvent in the trace event mask.
+static constexpr uint32_t trace_event_bit(TraceEvent event)
+{
+  return 1UL << (uint8_t)event;
+}
+
+/// @return the arg1 value for a @ref TraceEvent::THROTTLE event.
+static constexpr uint32_t trace_throttle_arg(TraceSource source
+                                           , uint16_t speed)
+{
+  return ((uint32_t)source << 16) | speed;
+}
+
+/// Single event recorded in the trace buffer.
+struct TraceRecord
+{
+  /// CPU cycle counter of the core which recorded the event.
+  uint32_t ccount;
+
+  /// @ref TraceEvent which was recorded.
+  uint8_t event;
+
+  /// Unused, zero.
+  uint8_t reserved;
+
+  /// First event argument, values wider than 16 bits (such as a packet
+  /// feedback key) are truncated to their low 16 bits.
+  uint16_t arg0;
+
+  /// Second event argument.
+  uint32_t arg1;
+};
+
+/// Fixed size binary trace of the locomotive command path.
+///
+/// Each core has its own ring buffer of CONFIG_TRACE_BUFFER_EVENTS records,
+/// a slot is reserved with a single atomic increment so recording is safe
+/// from any task or ISR and never blocks, once the buffer is full the oldest
+/// records are overwritten. The buffers are only allocated when tracing is
+/// first enabled via @ref set_events so there is no memory cost until it is
+/// used, and a disabled trace point only costs a load and a test.
+///
+/// The trace is downloaded via @ref dump in the following little-endian
+/// format:
+///
+///   header:   char magic[4] = "ESTR", uint8_t version = 1,
+///             uint8_t cores, uint16_t record_size, uint32_t cpu_mhz,
+///             uint32_t event_mask
+///   per core: uint32_t ref_ccount, uint32_t count, uint64_t ref_usec,
+///             followed by count @ref TraceRecord entries, oldest first.
+///
+/// ref_ccount and ref_usec are captured together on the core, the time of a
+/// record in microseconds since startup is:
+///   ref_usec - (uint32_t)(ref_ccount - ccount) / cpu_mhz
+/// which is valid for records up to 2^32 cycles (about 17 seconds at
+/// 240MHz) older than the dump.
+class Trace
+{
+public:
+  /// @return true if the event is being recorded.
+  static bool enabled(TraceEvent event)
+  {
+    return mask_.load(std::memory_order_relaxed) & trace_event_bit(event);
+  }
+
+  /// Records an event, callers should use TRACE_EVENT instead so that the
+  /// arguments are only evaluated when the event is enabled.
+  ///
+  /// @param event is the event to record.
+  /// @param arg0 is the first event argument, only the low 16 bits are
+  /// recorded.
+  /// @param arg1 is the second event argument.
+  static void record(TraceEvent event, uint16_t arg0, uint32_t arg1);
+
+  /// Selects the events to record, the trace buffers are allocated the
+  /// first time this is called with a non-zero mask.
+  ///
+  /// @param mask is the set of @ref trace_event_bit values to record.
+  static void set_events(uint32_t mask);
+
+  /// @return the set of @ref trace_event_bit values being recorded.
+  static uint32_t events()
+  {
+    return mask_.load(std::memory_order_relaxed);
+  }
+
+  /// Discards all recorded events.
+  static void clear();
+
+  /// @return the recorded events in the binary dump format, recording is
+  /// paused while the buffers are copied.
+  static std::string dump();
+
+private:
+  /// Events being recorded.
+  static std::atomic<uint32_t> mask_;
+};
+
+} // namespace esp32cs
+
+#if CONFIG_TRACE
+/// Records a trace event if it is enabled, the arguments are not evaluated
+/// when the event is disabled.
+#define TRACE_EVENT(event, arg0, arg1)                                \
+  do                                                                  \
+  {                                                                   \
+    if (esp32cs::Trace::enabled(event))                               \
+    {                                                                 \
+      esp32cs::Trace::record(event, arg0, arg1);                      \
+    }                                                                 \
+  } while (0)
+#else
+#define TRACE_EVENT(event, arg0, arg1) do {} while (0)
+#endif // CONFIG_TRACE
+
+#endif // TRACE_H_
@@ -0,0 +1,687 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "WiThrottleClientFlow.h"
+
+#include <algorithm>
+#include <AllTrainNodes.hxx>
+#include <DCCSignalVFS.h>
+#include <esp_timer.h>
+#include <fcntl.h>
+#include <Trace.h>
+#include <Turnouts.h>
+#include <utils/format_utils.hxx>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+using commandstation::AllTrainNodes;
+using commandstation::DccMode;
+using commandstation::TrainDbEntry;
+using dcc::SpeedType;
+using esp32cs::TraceEvent;
+using esp32cs::TraceSource;
+
+/// Separator between the locomotive key and the action of a "M" command.
+static constexpr const char *KEY_SEPARATOR = "<;>";
+
+/// Separator between the entries of a list.
+static constexpr const char *ENTRY_SEPARATOR = "]\\[";
+
+/// Separator between the fields of a list entry.
+static constexpr const char *FIELD_SEPARATOR = "}|{";
+
+/// Highest function number supported by the WiThrottle protocol.
+static constexpr uint8_t MAX_FUNCTION = 28;
+
+/// WiThrottle turnout state for a closed turnout.
+static constexpr char TURNOUT_CLOSED = '2';
+
+/// WiThrottle turnout state for a thrown turnout.
+static constexpr char TURNOUT_THROWN = '4';
+
+/// Interval at which the heartbeat is checked when no data is received.
+static constexpr long long HEARTBEAT_CHECK_INTERVAL_NSEC = SEC_TO_NSEC(1);
+
+std::map<uint32_t, WiThrottleClientFlow *> WiThrottleClientFlow::clients_;
+std::atomic<uint32_t> WiThrottleClientFlow::nextId_{0};
+
+// Returns the speed step of a locomotive, -1 for emergency stop.
+static inline int16_t get_speed_step(openlcb::TrainImpl *impl)
+{
+  if (impl->get_emergencystop())
+  {
+    return -1;
+  }
+  return (int16_t)(impl->get_speed().mph() + 0.5f);
+}
+
+// Returns the function state of a locomotive with one bit per function.
+static inline uint32_t get_functions(openlcb::TrainImpl *impl)
+{
+  uint32_t functions = 0;
+  for (uint8_t fn = 0; fn <= MAX_FUNCTION; fn++)
+  {
+    if (impl->get_fn(fn))
+    {
+      functions |= (1UL << fn);
+    }
+  }
+  return functions;
+}
+
+WiThrottleClientFlow::WiThrottleClientFlow(int fd, uint32_t remote_ip
+                                         , Service *service)
+  : StateFlowBase(service), id_(++nextId_), fd_(fd), remoteIP_(remote_ip)
+  , subscriber_(
+    [id = id_, service]()
+    {
+      // the wakeup is delivered on the executor since the timer can only be
+      // triggered there, the client may have disconnected by then.
+      service->executor()->add(new CallbackExecutable([id]()
+      {
+        WiThrottleClientFlow::wakeup(id);
+      }));
+    })
+{
+  LOG(INFO, "[WiThrottle %s] Connected", name().c_str());
+  ERRNOCHECK("fcntl_nonblock"
+           , ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL, 0) | O_NONBLOCK));
+  start_flow(STATE(start));
+}
+
+WiThrottleClientFlow::~WiThrottleClientFlow()
+{
+  LOG(INFO, "[WiThrottle %s] Disconnected", name().c_str());
+  ::close(fd_);
+}
+
+StateFlowBase::Action WiThrottleClientFlow::start()
+{
+  if (clients_.size() >= CONFIG_WITHROTTLE_MAX_CLIENTS)
+  {
+    LOG_ERROR("[WiThrottle %s] Rejecting connection, %d clients connected"
+            , name().c_str(), CONFIG_WITHROTTLE_MAX_CLIENTS);
+    return delete_this();
+  }
+  clients_[id_] = this;
+  lastRx_ = esp_timer_get_time();
+  send_initial_state();
+  LOG(VERBOSE, "[WiThrottle %s] %zu client(s), %zu bytes of initial state"
+    , name().c_str(), clients_.size(), res_.length());
+  return write_repeated(&helper_, fd_, res_.data(), res_.length()
+                      , STATE(wait_for_data));
+}
+
+StateFlowBase::Action WiThrottleClientFlow::wait_for_data()
+{
+  res_.clear();
+  if (helper_.hasError_ || closing_)
+  {
+    return call_immediately(STATE(disconnect));
+  }
+  if (!subscriber_.empty())
+  {
+    // state changes were published while the previous response was being
+    // written.
+    return call_immediately(STATE(read_data));
+  }
+  helper_.reset(Selectable::READ, fd_, Selectable::MAX_PRIO);
+  helper_.set_timed_wakeup();
+  service()->executor()->select(&helper_);
+  return sleep_and_call(&helper_.timer_, HEARTBEAT_CHECK_INTERVAL_NSEC
+                      , STATE(read_data));
+}
+
+StateFlowBase::Action WiThrottleClientFlow::read_data()
+{
+  if (service()->executor()->is_selected(&helper_))
+  {
+    service()->executor()->unselect(&helper_);
+  }
+  int64_t now = esp_timer_get_time();
+  int count = ::read(fd_, buf_, BUFFER_SIZE);
+  if (count == 0 ||
+      (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    return call_immediately(STATE(disconnect));
+  }
+  else if (count > 0)
+  {
+    LOG(VERBOSE, "[WiThrottle %s] received %d bytes", name().c_str(), count);
+    lastRx_ = now;
+    heartbeatExpired_ = false;
+    for (int index = 0; index < count; index++)
+    {
+      char ch = buf_[index];
+      if (ch == '\n' || ch == '\r')
+      {
+        if (!line_.empty())
+        {
+          process_line(line_);
+          line_.clear();
+        }
+      }
+      else if (line_.length() < MAX_LINE_LENGTH)
+      {
+        line_.push_back(ch);
+      }
+    }
+    // only the last speed received for each locomotive in this read is sent
+    // to the track.
+    flush_speed();
+  }
+  else if (heartbeat_ && !heartbeatExpired_ &&
+           (now - lastRx_) > SEC_TO_USEC(CONFIG_WITHROTTLE_HEARTBEAT_TIMEOUT))
+  {
+    LOG(WARNING, "[WiThrottle %s] Heartbeat not received, stopping all "
+                 "locomotives", name().c_str());
+    stop_all();
+    // wait for the client to resume sending data before checking again.
+    heartbeatExpired_ = true;
+  }
+  translate_state();
+  if (res_.empty())
+  {
+    return call_immediately(STATE(wait_for_data));
+  }
+  return write_repeated(&helper_, fd_, res_.data(), res_.length()
+                      , STATE(wait_for_data));
+}
+
+StateFlowBase::Action WiThrottleClientFlow::disconnect()
+{
+  clients_.erase(id_);
+  return delete_this();
+}
+
+void WiThrottleClientFlow::wakeup(uint32_t id)
+{
+  auto it = clients_.find(id);
+  if (it != clients_.end())
+  {
+    // this is a no-op when the flow is not waiting for data, the pending
+    // state will be drained before it waits again.
+    it->second->helper_.timer_.ensure_triggered();
+  }
+}
+
+std::string WiThrottleClientFlow::name()
+{
+  if (!name_.empty())
+  {
+    return StringPrintf("%s/%s", ipv4_to_string(remoteIP_).c_str()
+                      , name_.c_str());
+  }
+  return StringPrintf("%s/%d", ipv4_to_string(remoteIP_).c_str(), fd_);
+}
+
+void WiThrottleClientFlow::send_initial_state()
+{
+  res_.append("VN2.0\nHtESP32 Command Station\n");
+
+  auto trains = Singleton<AllTrainNodes>::instance();
+  std::string roster;
+  size_t roster_count = 0;
+  for (size_t index = 0; index < trains->size(); index++)
+  {
+    auto entry = trains->get_traindb_entry(index);
+    if (entry && entry->get_legacy_address() > 0)
+    {
+      int address = entry->get_legacy_address();
+      bool is_long =
+        commandstation::dcc_mode_to_address_type(entry->get_legacy_drive_mode(), address) ==
+          dcc::TrainAddressType::DCC_LONG_ADDRESS;
+      roster.append(ENTRY_SEPARATOR).append(entry->get_train_name())
+            .append(FIELD_SEPARATOR).append(integer_to_string(address))
+            .append(FIELD_SEPARATOR).append(is_long ? "L" : "S");
+      roster_count++;
+    }
+  }
+  res_.append(StringPrintf("RL%zu", roster_count)).append(roster).append("\n");
+
+  res_.append("PTT").append(ENTRY_SEPARATOR).append("Turnouts")
+      .append(FIELD_SEPARATOR).append("Turnout")
+      .append(ENTRY_SEPARATOR).append("Closed")
+      .append(FIELD_SEPARATOR).push_back(TURNOUT_CLOSED);
+  res_.append(ENTRY_SEPARATOR).append("Thrown")
+      .append(FIELD_SEPARATOR).push_back(TURNOUT_THROWN);
+  res_.append("\nPTL");
+  auto turnouts = Singleton<TurnoutManager>::instance();
+  for (uint16_t index = 0; index < turnouts->count(); index++)
+  {
+    auto turnout = turnouts->getByIndex(index);
+    if (turnout)
+    {
+      std::string address = integer_to_string(turnout->getAddress());
+      res_.append(ENTRY_SEPARATOR).append(address)
+          .append(FIELD_SEPARATOR).append(address)
+          .append(FIELD_SEPARATOR)
+          .push_back(turnout->isThrown() ? TURNOUT_THROWN : TURNOUT_CLOSED);
+    }
+  }
+  res_.append(StringPrintf("\nPPA%d\n*%d\n"
+                         , esp32cs::is_ops_track_output_enabled()
+                         , CONFIG_WITHROTTLE_HEARTBEAT_TIMEOUT));
+}
+
+void WiThrottleClientFlow::process_line(const std::string &line)
+{
+  LOG(VERBOSE, "[WiThrottle %s] %s", name().c_str(), line.c_str());
+  switch (line[0])
+  {
+    case 'M':
+      process_throttle(line);
+      break;
+    case '*':
+      // "*+" enables heartbeat monitoring, "*-" disables it and "*" is the
+      // heartbeat itself.
+      if (line.length() > 1)
+      {
+        heartbeat_ = line[1] == '+';
+      }
+      break;
+    case 'N':
+      name_.assign(line, 1, std::string::npos);
+      LOG(INFO, "[WiThrottle %s] Throttle name received", name().c_str());
+      res_.append(StringPrintf("*%d\n", CONFIG_WITHROTTLE_HEARTBEAT_TIMEOUT));
+      break;
+    case 'H':
+      if (line.length() > 2 && line[1] == 'U')
+      {
+        LOG(VERBOSE, "[WiThrottle %s] Throttle id %s", name().c_str()
+          , line.c_str() + 2);
+      }
+      break;
+    case 'P':
+      if (line.compare(0, 3, "PPA") == 0 && line.length() > 3)
+      {
+        if (line[3] == '1')
+        {
+          esp32cs::enable_ops_track_output();
+        }
+        else
+        {
+          esp32cs::disable_track_outputs();
+        }
+        // the track power state is published once the h-bridge state has
+        // been updated.
+      }
+      else if (line.compare(0, 3, "PTA") == 0)
+      {
+        process_turnout(line);
+      }
+      break;
+    case 'Q':
+      LOG(INFO, "[WiThrottle %s] Disconnect requested", name().c_str());
+      flush_speed();
+      locos_.clear();
+      closing_ = true;
+      break;
+    default:
+      LOG(VERBOSE, "[WiThrottle %s] Unsupported command: %s", name().c_str()
+        , line.c_str());
+  }
+}
+
+void WiThrottleClientFlow::process_throttle(const std::string &line)
+{
+  // M{THROTTLE}{COMMAND}{KEY}<;>{ACTION}
+  size_t separator = line.find(KEY_SEPARATOR);
+  if (line.length() < 4 || separator == std::string::npos)
+  {
+    return;
+  }
+  char throttle = line[1];
+  char command = line[2];
+  std::string key = line.substr(3, separator - 3);
+  std::string action = line.substr(separator + strlen(KEY_SEPARATOR));
+  if (command == '+')
+  {
+    acquire(throttle, key, action);
+  }
+  else if (command == '-')
+  {
+    // release or dispatch, the locomotive is left at its current speed.
+    auto it = locos_.begin();
+    while (it != locos_.end())
+    {
+      if (it->throttle == throttle && (key == "*" || it->key == key))
+      {
+        flush_speed(*it);
+        res_.append(StringPrintf("M%c-%s%s\n", throttle, it->key.c_str()
+                               , KEY_SEPARATOR));
+        it = locos_.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+  else if (command == 'A')
+  {
+    for (auto &loco : locos_)
+    {
+      if (loco.throttle == throttle && (key == "*" || loco.key == key))
+      {
+        apply(loco, action);
+      }
+    }
+  }
+}
+
+void WiThrottleClientFlow::acquire(char throttle, const std::string &key
+                                 , const std::string &action)
+{
+  auto match = [throttle, &key](const HeldLoco &loco)
+  {
+    return loco.throttle == throttle && loco.key == key;
+  };
+  if (key.length() < 2 ||
+      std::find_if(locos_.begin(), locos_.end(), match) != locos_.end())
+  {
+    return;
+  }
+  int address = std::atoi(key.c_str() + 1);
+  DccMode mode = key[0] == 'L' ? DccMode::DCC_128_LONG_ADDRESS
+                               : DccMode::DCC_128;
+  if (!action.empty() && action[0] == 'E')
+  {
+    // roster entries use the drive mode from the train database.
+    auto trains = Singleton<AllTrainNodes>::instance();
+    for (size_t index = 0; index < trains->size(); index++)
+    {
+      auto entry = trains->get_traindb_entry(index);
+      if (entry && entry->get_train_name() == action.substr(1))
+      {
+        address = entry->get_legacy_address();
+        mode = entry->get_legacy_drive_mode();
+        break;
+      }
+    }
+  }
+  if (address <= 0)
+  {
+    return;
+  }
+  auto impl = Singleton<AllTrainNodes>::instance()->find_or_create_train_impl(
+    mode, address);
+  if (!impl)
+  {
+    LOG_ERROR("[WiThrottle %s] Unable to acquire locomotive %d"
+            , name().c_str(), address);
+    return;
+  }
+  LOG(INFO, "[WiThrottle %s] Throttle %c acquired locomotive %d"
+    , name().c_str(), throttle, address);
+  locos_.push_back({throttle, key, (uint16_t)address, -1, 0, true, 0});
+  HeldLoco &loco = locos_.back();
+  res_.append(StringPrintf("M%c+%s%s\n", throttle, key.c_str()
+                         , KEY_SEPARATOR));
+  std::string prefix = StringPrintf("M%cA%s%s", throttle, key.c_str()
+                                  , KEY_SEPARATOR);
+  loco.functions = get_functions(impl);
+  for (uint8_t fn = 0; fn <= MAX_FUNCTION; fn++)
+  {
+    res_.append(StringPrintf("%sF%d%d\n", prefix.c_str()
+                           , (loco.functions & (1UL << fn)) != 0, fn));
+  }
+  loco.speed = get_speed_step(impl);
+  loco.forward = impl->get_speed().direction() == SpeedType::FORWARD;
+  res_.append(StringPrintf("%sV%d\n%sR%d\n%ss1\n", prefix.c_str(), loco.speed
+                         , prefix.c_str(), loco.forward, prefix.c_str()));
+}
+
+void WiThrottleClientFlow::apply(HeldLoco &loco, const std::string &action)
+{
+  if (action.empty())
+  {
+    return;
+  }
+  if (action[0] == 'V')
+  {
+    int speed = std::atoi(action.c_str() + 1);
+    if (action.length() > 1 && speed >= 0)
+    {
+      // coalesced with any further speed updates in the same read.
+      loco.pendingSpeed = std::min(speed, 126);
+      return;
+    }
+    // negative speed is an emergency stop request, this is applied
+    // immediately.
+  }
+  else if (action[0] == 'q')
+  {
+    // queries are answered with the last reported state.
+    std::string prefix = StringPrintf("M%cA%s%s", loco.throttle
+                                    , loco.key.c_str(), KEY_SEPARATOR);
+    if (action == "qV")
+    {
+      res_.append(StringPrintf("%sV%d\n", prefix.c_str(), loco.speed));
+    }
+    else if (action == "qR")
+    {
+      res_.append(StringPrintf("%sR%d\n", prefix.c_str(), loco.forward));
+    }
+    return;
+  }
+  auto impl = Singleton<AllTrainNodes>::instance()->find_train_impl(
+    loco.address);
+  if (!impl)
+  {
+    return;
+  }
+  switch (action[0])
+  {
+    case 'V':
+    case 'X':
+      loco.pendingSpeed = -1;
+      LOG(INFO, "[WiThrottle %s] Emergency stop locomotive %d"
+        , name().c_str(), loco.address);
+      impl->set_emergencystop();
+      break;
+    case 'I':
+    {
+      loco.pendingSpeed = -1;
+      SpeedType speed(impl->get_speed());
+      speed.set_mph(0);
+      TRACE_EVENT(TraceEvent::THROTTLE, loco.address
+                , trace_throttle_arg(TraceSource::WITHROTTLE
+                                   , speed.get_wire()));
+      impl->set_speed(speed);
+      break;
+    }
+    case 'R':
+    {
+      // apply any pending speed first so that it uses the old direction.
+      flush_speed(loco);
+      SpeedType speed(impl->get_speed());
+      speed.set_direction(action == "R1" ? SpeedType::FORWARD
+                                         : SpeedType::REVERSE);
+      TRACE_EVENT(TraceEvent::THROTTLE, loco.address
+                , trace_throttle_arg(TraceSource::WITHROTTLE
+                                   , speed.get_wire()));
+      impl->set_speed(speed);
+      break;
+    }
+    case 'F':
+      // function buttons are latching, the function is toggled when the
+      // button is pressed and the release is ignored.
+      if (action.length() > 2 && action[1] == '1')
+      {
+        int fn = std::atoi(action.c_str() + 2);
+        if (fn <= MAX_FUNCTION)
+        {
+          impl->set_fn(fn, !impl->get_fn(fn));
+        }
+      }
+      break;
+    case 'f':
+      if (action.length() > 2)
+      {
+        int fn = std::atoi(action.c_str() + 2);
+        if (fn <= MAX_FUNCTION)
+        {
+          impl->set_fn(fn, action[1] == '1');
+        }
+      }
+      break;
+    default:
+      LOG(VERBOSE, "[WiThrottle %s] Unsupported action: %s", name().c_str()
+        , action.c_str());
+  }
+}
+
+void WiThrottleClientFlow::process_turnout(const std::string &line)
+{
+  // PTA{ACTION}{ADDRESS} where ACTION is 2 (toggle), C (close) or T (throw).
+  if (line.length() < 5)
+  {
+    return;
+  }
+  size_t start = line.find_first_of("0123456789", 4);
+  if (start == std::string::npos)
+  {
+    return;
+  }
+  uint16_t address = std::atoi(line.c_str() + start);
+  auto turnouts = Singleton<TurnoutManager>::instance();
+  if (line[3] == 'C')
+  {
+    turnouts->set(address, false);
+  }
+  else if (line[3] == 'T')
+  {
+    turnouts->set(address, true);
+  }
+  else
+  {
+    turnouts->toggle(address);
+  }
+}
+
+void WiThrottleClientFlow::flush_speed()
+{
+  for (auto &loco : locos_)
+  {
+    flush_speed(loco);
+  }
+}
+
+void WiThrottleClientFlow::flush_speed(HeldLoco &loco)
+{
+  if (loco.pendingSpeed < 0)
+  {
+    return;
+  }
+  auto impl = Singleton<AllTrainNodes>::instance()->find_train_impl(
+    loco.address);
+  if (impl)
+  {
+    SpeedType speed(impl->get_speed());
+    speed.set_mph(loco.pendingSpeed);
+    TRACE_EVENT(TraceEvent::THROTTLE, loco.address
+              , trace_throttle_arg(TraceSource::WITHROTTLE
+                                 , speed.get_wire()));
+    impl->set_speed(speed);
+  }
+  loco.pendingSpeed = -1;
+}
+
+void WiThrottleClientFlow::stop_all()
+{
+  auto trains = Singleton<AllTrainNodes>::instance();
+  for (auto &loco : locos_)
+  {
+    loco.pendingSpeed = -1;
+    auto impl = trains->find_train_impl(loco.address);
+    if (impl)
+    {
+      impl->set_emergencystop();
+    }
+  }
+}
+
+void WiThrottleClientFlow::translate_state()
+{
+  subscriber_.drain(
+  [this](StateType type, uint16_t id, const std::string &state)
+  {
+    const char *message = state.c_str();
+    int value, speed_byte;
+    unsigned functions;
+    char track[16];
+    // turnouts and locomotives are published with the DCC address as id,
+    // the turnout message carries the DCC++ ID instead.
+    if (type == StateType::TURNOUT &&
+        sscanf(message, "<H %*d %d>", &value) == 1)
+    {
+      res_.append("PTA").append(1, value ? TURNOUT_THROWN : TURNOUT_CLOSED)
+          .append(integer_to_string(id)).append("\n");
+    }
+    else if (type == StateType::TRACK_POWER &&
+             sscanf(message, "<p%d %15[^>]>", &value, track) == 2 &&
+             !strcmp(track, CONFIG_OPS_TRACK_NAME))
+    {
+      // the overcurrent state (2) is reported as off.
+      res_.append(StringPrintf("PPA%d\n", value == 1));
+    }
+    else if (type == StateType::LOCO &&
+             sscanf(message, "<l %*d 0 %d %u>", &speed_byte, &functions) == 2)
+    {
+      int16_t speed = speed_byte & 0x7F;
+      // zero is stop and one is emergency stop, the remaining values are
+      // the speed step plus one.
+      speed = speed == 1 ? -1 : std::max(speed - 1, 0);
+      for (auto &loco : locos_)
+      {
+        if (loco.address == id)
+        {
+          report_loco(loco, speed, speed_byte & 0x80, functions);
+        }
+      }
+    }
+  });
+}
+
+void WiThrottleClientFlow::report_loco(HeldLoco &loco, int16_t speed
+                                     , bool forward, uint32_t functions)
+{
+  std::string prefix = StringPrintf("M%cA%s%s", loco.throttle
+                                  , loco.key.c_str(), KEY_SEPARATOR);
+  if (speed != loco.speed)
+  {
+    res_.append(StringPrintf("%sV%d\n", prefix.c_str(), speed));
+    loco.speed = speed;
+  }
+  if (forward != loco.forward)
+  {
+    res_.append(StringPrintf("%sR%d\n", prefix.c_str(), forward));
+    loco.forward = forward;
+  }
+  uint32_t changed = functions ^ loco.functions;
+  for (uint8_t fn = 0; changed && fn <= MAX_FUNCTION; fn++)
+  {
+    if (changed & (1UL << fn))
+    {
+      res_.append(StringPrintf("%sF%d%d\n", prefix.c_str()
+                             , (functions & (1UL << fn)) != 0, fn));
+      changed &= ~(1UL << fn);
+    }
+  }
+  loco.functions = functions;
+}
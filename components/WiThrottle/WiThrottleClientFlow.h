@@ -0,0 +1,208 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef WITHROTTLE_CLIENT_FLOW_H_
+#define WITHROTTLE_CLIENT_FLOW_H_
+
+#include <atomic>
+#include <executor/StateFlow.hxx>
+#include <map>
+#include <StateBroadcast.h>
+#include <string>
+#include <vector>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_WITHROTTLE_MAX_CLIENTS
+#define CONFIG_WITHROTTLE_MAX_CLIENTS 8
+#endif
+
+#ifndef CONFIG_WITHROTTLE_HEARTBEAT_TIMEOUT
+#define CONFIG_WITHROTTLE_HEARTBEAT_TIMEOUT 10
+#endif
+
+/// Handles a single WiThrottle protocol client (Engine Driver, WiThrottle).
+///
+/// The socket is non-blocking and the flow waits for data via select() on the
+/// executor with a timer for the heartbeat check, the timer is also triggered
+/// when state changes are published via @ref StateBroadcast so that turnout,
+/// power and locomotive updates are pushed without polling the socket.
+///
+/// Speed updates received from the client are coalesced per locomotive, only
+/// the last speed received in a single read is applied to the locomotive.
+class WiThrottleClientFlow : private StateFlowBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param fd is the socket of the client.
+  /// @param remote_ip is the IP address of the client.
+  /// @param service is the @ref Service to execute the flow on.
+  WiThrottleClientFlow(int fd, uint32_t remote_ip, Service *service);
+
+  /// Destructor.
+  virtual ~WiThrottleClientFlow();
+
+private:
+  /// Locomotive acquired by one of the throttles of the client.
+  struct HeldLoco
+  {
+    /// Throttle identifier the locomotive is held by.
+    char throttle;
+
+    /// Locomotive key as provided by the client, "S3" or "L341".
+    std::string key;
+
+    /// DCC address of the locomotive.
+    uint16_t address;
+
+    /// Speed received from the client which has not yet been applied, -1
+    /// when there is no pending speed.
+    int16_t pendingSpeed;
+
+    /// Last speed step reported to the client.
+    int16_t speed;
+
+    /// Last direction reported to the client.
+    bool forward;
+
+    /// Last function state reported to the client, one bit per function.
+    uint32_t functions;
+  };
+
+  /// Number of bytes to read from the socket at a time.
+  static constexpr size_t BUFFER_SIZE = 128;
+
+  /// Maximum length of a single line received from the client.
+  static constexpr size_t MAX_LINE_LENGTH = 256;
+
+  /// All active clients by id, this is only accessed on the executor and is
+  /// used to deliver @ref StateBroadcast wakeups to clients which may have
+  /// disconnected since the wakeup was queued.
+  static std::map<uint32_t, WiThrottleClientFlow *> clients_;
+
+  /// Next id to assign to a client.
+  static std::atomic<uint32_t> nextId_;
+
+  /// Unique id of this client.
+  const uint32_t id_;
+
+  /// Socket of the client.
+  int fd_;
+
+  /// IP address of the client.
+  uint32_t remoteIP_;
+
+  /// Name provided by the client via the "N" command.
+  std::string name_;
+
+  /// Buffer for data read from the socket.
+  uint8_t buf_[BUFFER_SIZE];
+
+  /// Partial line received from the client.
+  std::string line_;
+
+  /// Data to be sent to the client.
+  std::string res_;
+
+  /// Locomotives held by the throttles of this client.
+  std::vector<HeldLoco> locos_;
+
+  /// Time data was last received from the client.
+  int64_t lastRx_{0};
+
+  /// When true the client has enabled heartbeat monitoring.
+  bool heartbeat_{false};
+
+  /// When true the heartbeat has expired and the locomotives have been
+  /// stopped, this is cleared when data is received from the client.
+  bool heartbeatExpired_{false};
+
+  /// When true the connection will be closed once @ref res_ has been sent.
+  bool closing_{false};
+
+  /// Helper used for the socket I/O, the timer is used for the heartbeat
+  /// check and for state change wakeups.
+  StateFlowTimedSelectHelper helper_{this};
+
+  /// Pending state changes published by other clients and components.
+  StateSubscriber subscriber_;
+
+  STATE_FLOW_STATE(start);
+  STATE_FLOW_STATE(wait_for_data);
+  STATE_FLOW_STATE(read_data);
+  STATE_FLOW_STATE(disconnect);
+
+  /// Delivers a @ref StateBroadcast wakeup to a client, this must be called
+  /// on the executor.
+  ///
+  /// @param id is the id of the client to wake up.
+  static void wakeup(uint32_t id);
+
+  /// @return the client name used in log messages.
+  std::string name();
+
+  /// Appends the roster, turnout list and power state to @ref res_.
+  void send_initial_state();
+
+  /// Processes a single line received from the client.
+  void process_line(const std::string &line);
+
+  /// Processes a "M" multi-throttle command.
+  void process_throttle(const std::string &line);
+
+  /// Acquires a locomotive for a throttle.
+  ///
+  /// @param throttle is the throttle identifier.
+  /// @param key is the locomotive key, "S3" or "L341".
+  /// @param action is the acquire action, "L341" or "E" followed by the
+  /// roster entry name.
+  void acquire(char throttle, const std::string &key
+             , const std::string &action);
+
+  /// Applies a throttle action to a held locomotive.
+  void apply(HeldLoco &loco, const std::string &action);
+
+  /// Processes a "PTA" turnout command.
+  void process_turnout(const std::string &line);
+
+  /// Applies all coalesced speed updates.
+  void flush_speed();
+
+  /// Applies a coalesced speed update to a single locomotive.
+  void flush_speed(HeldLoco &loco);
+
+  /// Stops all locomotives held by this client, this is used when the
+  /// heartbeat has not been received in time.
+  void stop_all();
+
+  /// Translates the pending @ref StateBroadcast messages into WiThrottle
+  /// messages and appends them to @ref res_.
+  void translate_state();
+
+  /// Appends the changes in speed, direction and functions of a locomotive
+  /// which have not yet been reported to the client.
+  ///
+  /// @param loco is the held locomotive to report.
+  /// @param speed is the current speed step, -1 for emergency stop.
+  /// @param forward is the current direction.
+  /// @param functions is the current function state.
+  void report_loco(HeldLoco &loco, int16_t speed, bool forward
+                 , uint32_t functions);
+};
+
+#endif // WITHROTTLE_CLIENT_FLOW_H_
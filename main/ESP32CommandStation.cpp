@@ -24,8 +24,9 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <FileSystemManager.h>
 #include <dcc/ProgrammingTrackBackend.hxx>
 #include <dcc/RailcomHub.hxx>
-#include <dcc/SimpleUpdateLoop.hxx>
+#include <DCCProgrammer.h>
 #include <DCCSignalVFS.h>
+#include <DecoderBackup.h>
 #include <driver/uart.h>
 #include <DuplexedTrackIf.h>
 #include <esp_adc_cal.h>
@@ -42,6 +43,9 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <nvs_flash.h>
 #include <openlcb/SimpleInfoProtocol.hxx>
 #include <os/MDNS.hxx>
+#include <PersistenceService.h>
+#include <PriorityUpdateLoop.h>
+#include <Routes.h>
 #include <StatusDisplay.h>
 #include <StatusLED.h>
 #include <Turnouts.h>
@@ -61,6 +65,10 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <JmriInterface.h>
 #endif
 
+#if CONFIG_WITHROTTLE
+#include <WiThrottle.h>
+#endif
+
 const char * buildTime = __DATE__ " " __TIME__;
 
 #if CONFIG_LCC_GC_NEWLINES
@@ -242,6 +250,10 @@ extern "C" void app_main()
   // shorted to GND or the marker file is present.
   FileSystemManager fs;
 
+  // Background writer for persistent configuration data, this keeps slow
+  // SPIFFS/SD writes off of the LCC executor.
+  PersistenceService persistence;
+
   esp32cs::LCCStackManager stackManager(cfg);
 
   esp32cs::LCCWiFiManager wifiManager(stackManager.stack(), cfg);
@@ -266,6 +278,10 @@ extern "C" void app_main()
   init_jmri_interface();
 #endif // CONFIG_JMRI
 
+#if CONFIG_WITHROTTLE
+  init_withrottle_interface();
+#endif // CONFIG_WITHROTTLE
+
   // Initialize the turnout manager and register it with the LCC stack to
   // process accessories packets.
   TurnoutManager turnoutManager(stackManager.node()
@@ -278,7 +294,7 @@ extern "C" void app_main()
 
 #if CONFIG_GPIO_SENSORS
   LOG(INFO, "[Config] Enabling GPIO Inputs");
-  SensorManager::init();
+  SensorManager::init(stackManager.service());
   RemoteSensorManager::init();
 #if CONFIG_GPIO_S88
   S88BusManager s88(stackManager.node());
@@ -327,18 +343,33 @@ extern "C" void app_main()
                                , ops_track, prog_track);
 
   // Initialize the DCC Update Loop.
-  dcc::SimpleUpdateLoop dccUpdateLoop(stackManager.service(), &track);
+  esp32cs::PriorityUpdateLoop dccUpdateLoop(stackManager.service(), &track);
 
   // Attach the DCC update loop to the track interface
   PoolToQueueFlow<Buffer<dcc::Packet>> dccPacketFlow(stackManager.service()
                                                    , track.pool()
                                                    , &dccUpdateLoop);
 
+  // Initialize the route manager, this sends accessory packets directly to
+  // the track interface.
+  RouteManager routeManager(stackManager.node(), stackManager.service());
+
   // Starts the OpenMRN stack, this needs to be done *AFTER* all other LCC
   // dependent components as it will initiate configuration load and factory
   // reset calls.
   stackManager.start(fs.is_sd());
 
+  // Initialize the CV programming engine for the PROG track.
+  CVProgrammer cvProgrammer(stackManager.service());
+
+#if CONFIG_OPS_RAILCOM
+  // Initialize the RailCom based CV reader for the OPS track.
+  OpsCVReader opsCVReader(stackManager.service());
+#endif // CONFIG_OPS_RAILCOM
+
+  // Initialize the decoder backup and restore support.
+  DecoderBackup decoderBackup;
+
   // Initialize the DCC++ protocol adapter
   DCCPPProtocolHandler::init();
 
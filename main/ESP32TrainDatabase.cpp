@@ -22,6 +22,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include <FileSystemManager.h>
 #include <json.hpp>
 #include <JsonConstants.h>
+#include <PersistenceService.h>
 #include <TrainDbCdi.hxx>
 #include <utils/FileUtils.hxx>
 
@@ -210,8 +211,11 @@ void Esp32TrainDbEntry::recalcuate_max_fn()
 }
 
 static constexpr const char * TRAIN_DB_JSON_FILE = "trains.json";
+static constexpr char TRAIN_DB_SNAPSHOT_FILE[] = "/cfg/ESP32CS/trains.db";
+static constexpr char TRAIN_DB_JOURNAL_FILE[] = "/cfg/ESP32CS/trains.jnl";
 
 Esp32TrainDatabase::Esp32TrainDatabase(openlcb::SimpleStackBase *stack)
+  : journal_(TRAIN_DB_SNAPSHOT_FILE, TRAIN_DB_JOURNAL_FILE)
 {
   TrainConfigDef trainCfg(0);
   TrainTmpConfigDef tmpTrainCfg(0);
@@ -219,54 +223,61 @@ Esp32TrainDatabase::Esp32TrainDatabase(openlcb::SimpleStackBase *stack)
   CDIHelper::create_config_descriptor_xml(tmpTrainCfg, TEMP_TRAIN_CDI_FILE);
   trainCdiFile_.reset(new openlcb::ROFileMemorySpace(TRAIN_CDI_FILE));
   tempTrainCdiFile_.reset(new openlcb::ROFileMemorySpace(TEMP_TRAIN_CDI_FILE));
-  persistFlow_.emplace(stack->service()
+  // the roster journal is written directly by persist() so it is executed on
+  // the persistence thread rather than the LCC executor.
+  persistFlow_.emplace(Singleton<PersistenceService>::instance()
                      , SEC_TO_NSEC(CONFIG_ROSTER_PERSISTENCE_INTERVAL_SEC)
                      , std::bind(&Esp32TrainDatabase::persist, this));
 
   LOG(INFO, "[TrainDB] Initializing...");
-  if (Singleton<FileSystemManager>::instance()->exists(TRAIN_DB_JSON_FILE))
+  std::vector<Esp32PersistentTrainData> stored_trains;
+  if (!journal_.load(&stored_trains) &&
+      Singleton<FileSystemManager>::instance()->exists(TRAIN_DB_JSON_FILE))
   {
+    LOG(INFO, "[TrainDB] Importing roster from %s", TRAIN_DB_JSON_FILE);
     auto roster =
       Singleton<FileSystemManager>::instance()->load(TRAIN_DB_JSON_FILE);
-    json stored_trains = json::parse(roster, nullptr, false);
-    if (stored_trains.is_discarded())
+    json stored_json = json::parse(roster, nullptr, false);
+    if (stored_json.is_discarded())
     {
-      LOG_ERROR("[TrainDB] database is corrupt, no trains loaded!");
-      Singleton<FileSystemManager>::instance()->remove(TRAIN_DB_JSON_FILE);
-      return;
+      LOG_ERROR("[TrainDB] %s is corrupt, no trains loaded!"
+              , TRAIN_DB_JSON_FILE);
     }
-    for (auto &entry : stored_trains)
+    else
     {
-      auto data = entry.get<Esp32PersistentTrainData>();
-      auto ent = std::find_if(knownTrains_.begin(), knownTrains_.end(),
-      [data](const auto &train)
-      {
-        return train->get_legacy_address() == data.address;
-      });
-      if (ent == knownTrains_.end())
+      for (auto &entry : stored_json)
       {
-        LOG(INFO, "[TrainDB] Registering %u - %s (idle: %s, limited: %s)"
-          , data.address, data.name.c_str()
-          , data.automatic_idle ? JSON_VALUE_ON : JSON_VALUE_OFF
-          , data.show_on_limited_throttles ? JSON_VALUE_ON : JSON_VALUE_OFF);
-        auto train = new Esp32TrainDbEntry(data);
-        train->reset_dirty();
-        if (train->is_auto_idle())
-        {
-          uint16_t address = train->get_legacy_address();
-          stack->executor()->add(new CallbackExecutable([address]()
-          {
-            auto trainMgr = Singleton<AllTrainNodes>::instance();
-            trainMgr->allocate_node(DccMode::DCC_128, address);
-          }));
-        }
-        knownTrains_.emplace_back(train);
+        stored_trains.push_back(entry.get<Esp32PersistentTrainData>());
       }
-      else
+      journal_.compact(stored_trains);
+    }
+  }
+  for (auto &data : stored_trains)
+  {
+    if (!addressIndex_.count(data.address))
+    {
+      LOG(INFO, "[TrainDB] Registering %u - %s (idle: %s, limited: %s)"
+        , data.address, data.name.c_str()
+        , data.automatic_idle ? JSON_VALUE_ON : JSON_VALUE_OFF
+        , data.show_on_limited_throttles ? JSON_VALUE_ON : JSON_VALUE_OFF);
+      auto train = new Esp32TrainDbEntry(data);
+      train->reset_dirty();
+      if (train->is_auto_idle())
       {
-        LOG_ERROR("[TrainDB] Duplicate roster entry detected for loco addr %u."
-                , data.address);
+        uint16_t address = train->get_legacy_address();
+        stack->executor()->add(new CallbackExecutable([address]()
+        {
+          auto trainMgr = Singleton<AllTrainNodes>::instance();
+          trainMgr->allocate_node(DccMode::DCC_128, address);
+        }));
       }
+      knownTrains_.emplace_back(train);
+      add_to_index(knownTrains_.size() - 1);
+    }
+    else
+    {
+      LOG_ERROR("[TrainDB] Duplicate roster entry detected for loco addr %u."
+              , data.address);
     }
   }
 
@@ -274,20 +285,37 @@ Esp32TrainDatabase::Esp32TrainDatabase(openlcb::SimpleStackBase *stack)
     , knownTrains_.size());
 }
 
-#define FIND_TRAIN(id)                                    \
-  std::find_if(knownTrains_.begin(), knownTrains_.end(),  \
-    [id](const auto &train)                               \
-    {                                                     \
-      return train->get_legacy_address() == id;           \
-    })
-
-#define FIND_TRAIN_HINT(id, id2)                          \
-  std::find_if(knownTrains_.begin(), knownTrains_.end(),  \
-    [id,id2](const auto &train)                           \
-    {                                                     \
-      return train->get_traction_node() == id ||          \
-             train->get_legacy_address() == id2;          \
-    })
+// Adds the knownTrains_ entry at index to the address and node id indexes.
+void Esp32TrainDatabase::add_to_index(size_t index)
+{
+  auto train = knownTrains_[index];
+  addressIndex_[train->get_legacy_address()] = index;
+  nodeIndex_[train->get_traction_node()] = index;
+}
+
+// Regenerates the address and node id indexes, this is required whenever an
+// entry is removed from knownTrains_ as the index of the entries will shift.
+void Esp32TrainDatabase::rebuild_index()
+{
+  addressIndex_.clear();
+  nodeIndex_.clear();
+  for (size_t index = 0; index < knownTrains_.size(); index++)
+  {
+    add_to_index(index);
+  }
+}
+
+// Returns the entry for the provided address or nullptr if it is not known.
+std::shared_ptr<Esp32TrainDbEntry> Esp32TrainDatabase::find_train(
+  unsigned address)
+{
+  auto ent = addressIndex_.find(address);
+  if (ent != addressIndex_.end())
+  {
+    return knownTrains_[ent->second];
+  }
+  return nullptr;
+}
 
 std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_if_not_found(unsigned address
                                                                     , string name
@@ -295,16 +323,17 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_if_not_found(unsigned a
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for roster entry for address: %u", address);
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  auto entry = find_train(address);
+  if (entry)
   {
     LOG(VERBOSE, "[TrainDB] Found existing entry:%s."
-      , (*entry)->identifier().c_str());
-    return *entry;
+      , entry->identifier().c_str());
+    return entry;
   }
   auto index = knownTrains_.size();
   knownTrains_.emplace_back(
     new Esp32TrainDbEntry(Esp32PersistentTrainData(address, name, mode)));
+  add_to_index(index);
   LOG(VERBOSE, "[TrainDB] No entry was found, created new entry:%s."
     , knownTrains_[index]->identifier().c_str());
   return knownTrains_[index];
@@ -312,10 +341,10 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_if_not_found(unsigned a
 
 int Esp32TrainDatabase::get_index(unsigned address)
 {
-  auto ent = FIND_TRAIN(address);
-  if (ent != knownTrains_.end())
+  auto ent = addressIndex_.find(address);
+  if (ent != addressIndex_.end())
   {
-    return std::distance(knownTrains_.begin(), ent);
+    return ent->second;
   }
 
   return -1;
@@ -331,12 +360,12 @@ bool Esp32TrainDatabase::is_train_id_known(openlcb::NodeID train_id)
   if (TractionDefs::legacy_address_from_train_node_id(train_id, &type, &addr))
   {
     // only search with the address and discard the drive type (for now)
-    auto ent = FIND_TRAIN(addr);
-    if (ent != knownTrains_.end())
+    auto ent = find_train(addr);
+    if (ent)
     {
-      LOG(VERBOSE, "[TrainDB] %s", (*ent)->identifier().c_str());
+      LOG(VERBOSE, "[TrainDB] %s", ent->identifier().c_str());
     }
-    return ent != knownTrains_.end();
+    return ent != nullptr;
   }
   return false;
 }
@@ -344,12 +373,16 @@ bool Esp32TrainDatabase::is_train_id_known(openlcb::NodeID train_id)
 void Esp32TrainDatabase::delete_entry(unsigned address)
 {
   OSMutexLock l(&knownTrainsLock_);
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  int index = get_index(address);
+  if (index >= 0)
   {
     LOG(VERBOSE, "[TrainDB] Removing persistent entry for address %u", address);
-    knownTrains_.erase(entry);
-    entryDeleted_ = true;
+    if (knownTrains_[index]->is_persisted())
+    {
+      deletedEntries_.push_back(address);
+    }
+    knownTrains_.erase(knownTrains_.begin() + index);
+    rebuild_index();
   }
 }
 
@@ -362,12 +395,7 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::get_entry(unsigned train_id)
     return knownTrains_[train_id];
   }
   // check if the train_id is a locomotive address that we know of
-  auto entry = FIND_TRAIN(train_id);
-  if (entry != knownTrains_.end())
-  {
-    return *entry;
-  }
-  return nullptr;
+  return find_train(train_id);
 }
 
 std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::find_entry(openlcb::NodeID node_id
@@ -376,12 +404,21 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::find_entry(openlcb::NodeID nod
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for Train Node:%s, Hint:%u"
     , uint64_to_string(node_id).c_str(), hint);
-  auto entry = FIND_TRAIN_HINT(node_id, hint);
-  if (entry != knownTrains_.end())
+  std::shared_ptr<Esp32TrainDbEntry> entry = nullptr;
+  auto ent = nodeIndex_.find(node_id);
+  if (ent != nodeIndex_.end())
+  {
+    entry = knownTrains_[ent->second];
+  }
+  else
+  {
+    entry = find_train(hint);
+  }
+  if (entry)
   {
     LOG(VERBOSE, "[TrainDB] Found existing entry: %s."
-      , (*entry)->identifier().c_str());
-    return *entry;
+      , entry->identifier().c_str());
+    return entry;
   }
   LOG(VERBOSE, "[TrainDB] No entry found!");
   return nullptr;
@@ -397,10 +434,10 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
   LOG(VERBOSE, "[TrainDB] Searching for loco %d", address);
 
   // prevent duplicate entries in the roster
-  auto ent = FIND_TRAIN(address);
-  if (ent != knownTrains_.end())
+  auto ent = addressIndex_.find(address);
+  if (ent != addressIndex_.end())
   {
-    index = std::distance(knownTrains_.begin(), ent);
+    index = ent->second;
     LOG(VERBOSE, "[TrainDB] Found existing entry (%zu)", index);
   }
   else
@@ -430,6 +467,7 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
         Esp32PersistentTrainData(address, std::to_string(address), mode)
       , false));
 #endif
+    add_to_index(index);
   }
   return index;
 }
@@ -460,11 +498,11 @@ void Esp32TrainDatabase::set_train_name(unsigned address, std::string name)
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  auto entry = find_train(address);
+  if (entry)
   {
     LOG(VERBOSE, "[TrainDB] Setting train(%u) name: %s", address, name.c_str());
-    (*entry)->set_train_name(name);
+    entry->set_train_name(name);
   }
   else
   {
@@ -476,12 +514,12 @@ void Esp32TrainDatabase::set_train_auto_idle(unsigned address, bool idle)
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  auto entry = find_train(address);
+  if (entry)
   {
     LOG(VERBOSE, "[TrainDB] Setting auto-idle: %s"
       , idle ? JSON_VALUE_ON : JSON_VALUE_OFF);
-    (*entry)->set_auto_idle(idle);
+    entry->set_auto_idle(idle);
   }
   else
   {
@@ -495,12 +533,12 @@ void Esp32TrainDatabase::set_train_show_on_limited_throttle(unsigned address
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  auto entry = find_train(address);
+  if (entry)
   {
     LOG(VERBOSE, "[TrainDB] Setting visible on limited throttes: %s"
       , show ? JSON_VALUE_ON : JSON_VALUE_OFF);
-    (*entry)->set_show_on_limited_throttles(show);
+    entry->set_show_on_limited_throttles(show);
   }
   else
   {
@@ -513,10 +551,10 @@ void Esp32TrainDatabase::set_train_function_label(unsigned address, uint8_t fn_i
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  auto entry = find_train(address);
+  if (entry)
   {
-    (*entry)->set_function_label(fn_id, label);
+    entry->set_function_label(fn_id, label);
   }
   else
   {
@@ -529,10 +567,14 @@ void Esp32TrainDatabase::set_train_drive_mode(unsigned address, commandstation::
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  auto entry = find_train(address);
+  if (entry)
   {
-    (*entry)->set_legacy_drive_mode(mode);
+    // the traction node id is derived from the drive mode so the node index
+    // needs to be updated.
+    nodeIndex_.erase(entry->get_traction_node());
+    entry->set_legacy_drive_mode(mode);
+    nodeIndex_[entry->get_traction_node()] = get_index(address);
   }
   else
   {
@@ -541,20 +583,16 @@ void Esp32TrainDatabase::set_train_drive_mode(unsigned address, commandstation::
   }
 }
 
-string Esp32TrainDatabase::get_all_entries_as_json()
+std::vector<uint16_t> Esp32TrainDatabase::get_all_addresses()
 {
   OSMutexLock l(&knownTrainsLock_);
-  string res = "[";
-  for (auto entry : knownTrains_)
+  std::vector<uint16_t> addresses;
+  addresses.reserve(knownTrains_.size());
+  for (auto &entry : knownTrains_)
   {
-    if (res.length() > 1)
-    {
-      res += ",";
-    }
-    res += get_entry_as_json_locked(entry->get_legacy_address());
+    addresses.push_back(entry->get_legacy_address());
   }
-  res += "]";
-  return res;
+  return addresses;
 }
 
 string Esp32TrainDatabase::get_entry_as_json(unsigned address)
@@ -565,10 +603,9 @@ string Esp32TrainDatabase::get_entry_as_json(unsigned address)
 
 string Esp32TrainDatabase::get_entry_as_json_locked(unsigned address)
 {
-  auto entry = FIND_TRAIN(address);
-  if (entry != knownTrains_.end())
+  auto train = find_train(address);
+  if (train)
   {
-    auto train = (*entry);
     json j =
     {
       { "name", train->get_train_name() },
@@ -598,35 +635,71 @@ string Esp32TrainDatabase::get_entry_as_json_locked(unsigned address)
 
 void Esp32TrainDatabase::persist()
 {
-  OSMutexLock l(&knownTrainsLock_);
-  LOG(VERBOSE, "[TrainDB] Checking if roster needs to be persisted...");
-  auto ent = std::find_if(knownTrains_.begin(), knownTrains_.end(),
-    [](const auto &train)
-    {
-      return train->is_dirty() && train->is_persisted();
-    });
-  if (ent != knownTrains_.end() || entryDeleted_)
-  {
-    LOG(VERBOSE, "[TrainDB] At least one entry requires persistence.");
-    json j;
-    size_t count = 0;
+  std::vector<std::shared_ptr<Esp32TrainDbEntry>> dirty;
+  std::vector<Esp32PersistentTrainData> updated;
+  std::vector<uint16_t> deleted;
+  {
+    // only the snapshot of the changes is taken with the lock held, the
+    // journal is written without blocking other users of the roster.
+    OSMutexLock l(&knownTrainsLock_);
+    LOG(VERBOSE, "[TrainDB] Checking if roster needs to be persisted...");
     for (auto entry : knownTrains_)
     {
-      if (entry->is_persisted())
+      if (entry->is_dirty() && entry->is_persisted())
       {
-        j.push_back(entry->get_data());
-        count++;
+        dirty.push_back(entry);
+        updated.push_back(entry->get_data());
       }
       entry->reset_dirty();
     }
+    deleted.swap(deletedEntries_);
+  }
+  if (updated.empty() && deleted.empty())
+  {
+    LOG(VERBOSE, "[TrainDB] No entries require persistence");
+    return;
+  }
+
+  LOG(VERBOSE, "[TrainDB] %zu entries require persistence."
+    , updated.size() + deleted.size());
+  bool stored = !journal_.needs_compaction() &&
+                journal_.append(updated, deleted);
+  if (!stored || journal_.needs_compaction())
+  {
+    std::vector<Esp32PersistentTrainData> entries;
+    {
+      OSMutexLock l(&knownTrainsLock_);
+      for (auto entry : knownTrains_)
+      {
+        if (entry->is_persisted())
+        {
+          entries.push_back(entry->get_data());
+        }
+      }
+    }
+    stored = journal_.compact(entries) || stored;
+#if CONFIG_ROSTER_EXPORT_JSON
+    json j = entries;
     Singleton<FileSystemManager>::instance()->store(TRAIN_DB_JSON_FILE
                                                   , j.dump());
-    LOG(INFO, "[TrainDB] Persisted %zu entries.", count);
-    entryDeleted_ = false;
+#endif // CONFIG_ROSTER_EXPORT_JSON
+  }
+
+  if (stored)
+  {
+    LOG(INFO, "[TrainDB] Persisted %zu entries.", updated.size());
   }
   else
   {
-    LOG(VERBOSE, "[TrainDB] No entries require persistence");
+    // retry on the next call.
+    LOG_ERROR("[TrainDB] Failed to persist roster changes!");
+    OSMutexLock l(&knownTrainsLock_);
+    for (auto entry : dirty)
+    {
+      entry->reset_dirty(true);
+    }
+    deletedEntries_.insert(deletedEntries_.end(), deleted.begin()
+                         , deleted.end());
   }
 }
 
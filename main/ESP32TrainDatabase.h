@@ -18,6 +18,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #ifndef _ESP32_TRAIN_DB_H_
 #define _ESP32_TRAIN_DB_H_
 
+#include <unordered_map>
 #include <vector>
 
 #include <openlcb/Defs.hxx>
@@ -30,6 +31,8 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 
 #include <AutoPersistCallbackFlow.h>
 
+#include "ESP32TrainDbJournal.h"
+
 #include "sdkconfig.h"
 
 #ifndef CONFIG_ROSTER_AUTO_IDLE_NEW_LOCOS
@@ -251,7 +254,7 @@ namespace esp32cs
     void set_train_function_label(unsigned address, uint8_t fn_id, Symbols label);
     void set_train_drive_mode(unsigned address, DccMode mode);
 
-    std::string get_all_entries_as_json();
+    std::vector<uint16_t> get_all_addresses();
     std::string get_entry_as_json(unsigned address);
 
     openlcb::MemorySpace *get_train_cdi()
@@ -268,13 +271,24 @@ namespace esp32cs
 
   private:
     std::string get_entry_as_json_locked(unsigned address);
+    std::shared_ptr<Esp32TrainDbEntry> find_train(unsigned address);
+    void add_to_index(size_t index);
+    void rebuild_index();
     openlcb::SimpleStackBase *stack_;
-    bool entryDeleted_{false};
+    // addresses of persistent entries removed since the last persist().
+    std::vector<uint16_t> deletedEntries_;
     OSMutex knownTrainsLock_;
     std::vector<std::shared_ptr<Esp32TrainDbEntry>> knownTrains_;
+
+    // index into knownTrains_ by locomotive address.
+    std::unordered_map<unsigned, size_t> addressIndex_;
+
+    // index into knownTrains_ by traction node id.
+    std::unordered_map<openlcb::NodeID, size_t> nodeIndex_;
     std::unique_ptr<openlcb::MemorySpace> trainCdiFile_;
     std::unique_ptr<openlcb::MemorySpace> tempTrainCdiFile_;
     uninitialized<AutoPersistFlow> persistFlow_;
+    Esp32TrainDbJournal journal_;
   };
 
 } // namespace esp32cs
@@ -0,0 +1,431 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "ESP32TrainDbJournal.h"
+#include "ESP32TrainDatabase.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utils/Crc.hxx>
+#include <utils/FileUtils.hxx>
+#include <utils/logging.h>
+
+namespace esp32cs
+{
+
+using std::string;
+
+/// Marker byte at the start of every record.
+static constexpr uint8_t RECORD_SYNC = 0xA5;
+
+/// Record type for a roster entry which has been added or modified, the
+/// payload contains the full roster entry.
+static constexpr uint8_t RECORD_PUT = 1;
+
+/// Record type for a roster entry which has been removed, there is no
+/// payload.
+static constexpr uint8_t RECORD_DELETE = 2;
+
+/// Size of the record header: sync, type, address (2), payload length (2).
+static constexpr size_t RECORD_HEADER_SIZE = 6;
+
+/// Size of the CRC-16 which follows the record payload.
+static constexpr size_t RECORD_CRC_SIZE = 2;
+
+/// Size of the fixed portion of a @ref RECORD_PUT payload: mode, flags and
+/// function count.
+static constexpr size_t ENTRY_HEADER_SIZE = 3;
+
+/// Maximum number of characters stored for a roster entry name.
+static constexpr size_t MAX_NAME_LENGTH = 255;
+
+/// @ref RECORD_PUT flag for @ref Esp32PersistentTrainData::automatic_idle.
+static constexpr uint8_t ENTRY_FLAG_AUTO_IDLE = 0x01;
+
+/// @ref RECORD_PUT flag for
+/// @ref Esp32PersistentTrainData::show_on_limited_throttles.
+static constexpr uint8_t ENTRY_FLAG_LIMITED_THROTTLES = 0x02;
+
+/// Header at the start of the snapshot file, the last byte is the format
+/// version. The header is followed by the snapshot generation.
+static constexpr char SNAPSHOT_HEADER[] = {'T', 'D', 'B', 2};
+
+/// Header at the start of the journal file, the last byte is the format
+/// version. The header is followed by the generation of the snapshot which
+/// the journal applies to.
+static constexpr char JOURNAL_HEADER[] = {'T', 'D', 'J', 1};
+
+/// Size of the snapshot and journal file headers including the generation.
+static constexpr size_t FILE_HEADER_SIZE = sizeof(SNAPSHOT_HEADER) + 4;
+
+/// Suffix added to the snapshot and journal when the snapshot can not be
+/// read, the files are kept for manual recovery.
+static constexpr char DAMAGED_SUFFIX[] = ".bad";
+
+// Appends a little-endian uint16_t to the buffer.
+static inline void append_uint16(string &buf, uint16_t value)
+{
+  buf.push_back(value & 0xFF);
+  buf.push_back(value >> 8);
+}
+
+// Reads a little-endian uint16_t from the buffer.
+static inline uint16_t read_uint16(const uint8_t *buf)
+{
+  return buf[0] | (buf[1] << 8);
+}
+
+// Appends a little-endian uint32_t to the buffer.
+static inline void append_uint32(string &buf, uint32_t value)
+{
+  append_uint16(buf, value & 0xFFFF);
+  append_uint16(buf, value >> 16);
+}
+
+// Creates a snapshot or journal file header.
+static string encode_header(const char *magic, uint32_t generation)
+{
+  string buf(magic, sizeof(SNAPSHOT_HEADER));
+  append_uint32(buf, generation);
+  return buf;
+}
+
+// Validates a snapshot or journal file header and extracts the generation.
+static bool decode_header(const string &buf, const char *magic
+                        , uint32_t *generation)
+{
+  if (buf.size() < FILE_HEADER_SIZE ||
+      buf.compare(0, sizeof(SNAPSHOT_HEADER), magic, sizeof(SNAPSHOT_HEADER)))
+  {
+    return false;
+  }
+  const uint8_t *data = (const uint8_t *)buf.data() + sizeof(SNAPSHOT_HEADER);
+  *generation = read_uint16(data) | ((uint32_t)read_uint16(data + 2) << 16);
+  return true;
+}
+
+// Appends a single record to the buffer, the CRC covers the full record
+// excluding the sync byte.
+static void encode_record(string &buf, uint8_t type, uint16_t address
+                        , const string &payload)
+{
+  size_t start = buf.size();
+  buf.push_back(RECORD_SYNC);
+  buf.push_back(type);
+  append_uint16(buf, address);
+  append_uint16(buf, payload.size());
+  buf.append(payload);
+  append_uint16(buf, crc_16_ibm(buf.data() + start + 1
+                              , buf.size() - start - 1));
+}
+
+// Converts a roster entry into a RECORD_PUT payload.
+static string encode_entry(const Esp32PersistentTrainData &data)
+{
+  string payload;
+  payload.push_back(data.mode);
+  payload.push_back(
+    (data.automatic_idle ? ENTRY_FLAG_AUTO_IDLE : 0) |
+    (data.show_on_limited_throttles ? ENTRY_FLAG_LIMITED_THROTTLES : 0));
+  payload.push_back(data.functions.size());
+  payload.append(data.functions.begin(), data.functions.end());
+  payload.append(data.name, 0, MAX_NAME_LENGTH);
+  return payload;
+}
+
+// Converts a RECORD_PUT payload into a roster entry.
+static bool decode_entry(uint16_t address, const uint8_t *payload, size_t len
+                       , Esp32PersistentTrainData *data)
+{
+  if (len < ENTRY_HEADER_SIZE || len < ENTRY_HEADER_SIZE + payload[2])
+  {
+    return false;
+  }
+  const uint8_t *functions = payload + ENTRY_HEADER_SIZE;
+  const uint8_t *name = functions + payload[2];
+  data->address = address;
+  data->mode = payload[0];
+  data->automatic_idle = payload[1] & ENTRY_FLAG_AUTO_IDLE;
+  data->show_on_limited_throttles = payload[1] & ENTRY_FLAG_LIMITED_THROTTLES;
+  data->functions.assign(functions, name);
+  data->name.assign((const char *)name, (payload + len) - name);
+  return true;
+}
+
+Esp32TrainDbJournal::Esp32TrainDbJournal(const string &snapshot
+                                       , const string &journal)
+  : snapshotPath_(snapshot), snapshotTempPath_(snapshot + ".tmp")
+  , journalPath_(journal)
+{
+}
+
+bool Esp32TrainDbJournal::load(std::vector<Esp32PersistentTrainData> *entries)
+{
+  struct stat statbuf;
+  bool have_snapshot = !stat(snapshotPath_.c_str(), &statbuf);
+  if (!stat(snapshotTempPath_.c_str(), &statbuf))
+  {
+    if (have_snapshot)
+    {
+      // compaction was interrupted before the new snapshot was complete, the
+      // previous snapshot and journal are still valid.
+      LOG(WARNING, "[TrainDB] Discarding incomplete roster snapshot.");
+      unlink(snapshotTempPath_.c_str());
+    }
+    else
+    {
+      // compaction was interrupted after the previous snapshot was removed,
+      // the new snapshot is complete and only needs to be moved into place.
+      LOG(WARNING, "[TrainDB] Recovering roster snapshot from compaction.");
+      have_snapshot = !rename(snapshotTempPath_.c_str()
+                            , snapshotPath_.c_str());
+    }
+  }
+  bool have_journal = !stat(journalPath_.c_str(), &statbuf);
+  if (!have_snapshot && !have_journal)
+  {
+    return false;
+  }
+
+  std::unordered_map<uint16_t, size_t> index;
+  generation_ = 0;
+  if (have_snapshot)
+  {
+    string snapshot = read_file_to_string(snapshotPath_);
+    if (!decode_header(snapshot, SNAPSHOT_HEADER, &generation_) ||
+        replay(snapshot, FILE_HEADER_SIZE, entries, &index) != snapshot.size())
+    {
+      // the journal only holds the changes made after the snapshot was
+      // written, compacting the roster without the snapshot would discard
+      // all other entries. Both files are kept for manual recovery and the
+      // roster is imported from the JSON export instead.
+      LOG_ERROR("[TrainDB] Roster snapshot is not readable, moving it to "
+                "%s%s.", snapshotPath_.c_str(), DAMAGED_SUFFIX);
+      rename(snapshotPath_.c_str(), (snapshotPath_ + DAMAGED_SUFFIX).c_str());
+      if (have_journal)
+      {
+        rename(journalPath_.c_str(), (journalPath_ + DAMAGED_SUFFIX).c_str());
+      }
+      entries->clear();
+      generation_ = 0;
+      journalSize_ = 0;
+      return false;
+    }
+  }
+  if (have_journal)
+  {
+    string journal = read_file_to_string(journalPath_);
+    uint32_t generation;
+    if (!decode_header(journal, JOURNAL_HEADER, &generation) ||
+        generation != generation_)
+    {
+      // power was lost after a new snapshot was published but before the
+      // journal was removed, all of its records are part of the snapshot.
+      LOG(WARNING, "[TrainDB] Discarding stale roster journal.");
+      unlink(journalPath_.c_str());
+    }
+    else
+    {
+      journalSize_ = replay(journal, FILE_HEADER_SIZE, entries, &index);
+      if (journalSize_ != journal.size())
+      {
+        LOG(WARNING
+          , "[TrainDB] Discarding %zu bytes of incomplete roster journal data."
+          , journal.size() - journalSize_);
+        tornWrite_ = true;
+      }
+    }
+  }
+
+  // if any damaged records were found rewrite the snapshot immediately so
+  // that new journal records are not appended after the damaged data.
+  if (tornWrite_)
+  {
+    compact(*entries);
+  }
+  LOG(VERBOSE, "[TrainDB] Loaded %zu roster entries, journal: %zu bytes."
+    , entries->size(), journalSize_);
+  return true;
+}
+
+bool Esp32TrainDbJournal::append(
+  const std::vector<Esp32PersistentTrainData> &updated
+, const std::vector<uint16_t> &deleted)
+{
+  // appending after a damaged record would make the new records unreachable.
+  if (tornWrite_)
+  {
+    return false;
+  }
+  // deletions are recorded first as an entry may have been removed and then
+  // recreated with the same address.
+  string buf;
+  for (uint16_t address : deleted)
+  {
+    encode_record(buf, RECORD_DELETE, address, "");
+  }
+  for (auto &entry : updated)
+  {
+    encode_record(buf, RECORD_PUT, entry.address, encode_entry(entry));
+  }
+  if (buf.empty())
+  {
+    return true;
+  }
+  // a new journal is started with the generation of the snapshot it applies
+  // to, replacing any journal left behind by an interrupted compaction.
+  bool new_journal = !journalSize_;
+  if (new_journal)
+  {
+    buf.insert(0, encode_header(JOURNAL_HEADER, generation_));
+  }
+  if (!write_file(journalPath_, buf, !new_journal))
+  {
+    // the journal may contain a partial record now.
+    tornWrite_ = true;
+    return false;
+  }
+  journalSize_ += buf.size();
+  LOG(VERBOSE, "[TrainDB] Appended %zu bytes to roster journal (%zu bytes)."
+    , buf.size(), journalSize_);
+  return true;
+}
+
+bool Esp32TrainDbJournal::compact(
+  const std::vector<Esp32PersistentTrainData> &entries)
+{
+  // the new snapshot has a new generation so that the current journal is
+  // ignored by load() if power is lost before it has been removed.
+  string buf = encode_header(SNAPSHOT_HEADER, generation_ + 1);
+  for (auto &entry : entries)
+  {
+    encode_record(buf, RECORD_PUT, entry.address, encode_entry(entry));
+  }
+  if (!write_file(snapshotTempPath_, buf, false))
+  {
+    unlink(snapshotTempPath_.c_str());
+    return false;
+  }
+  // Neither SPIFFS nor FAT will replace an existing file via rename so the
+  // previous snapshot must be removed first. If power is lost between these
+  // two calls load() will recover the new snapshot from the temporary file.
+  unlink(snapshotPath_.c_str());
+  if (rename(snapshotTempPath_.c_str(), snapshotPath_.c_str()))
+  {
+    LOG_ERROR("[TrainDB] Unable to replace roster snapshot: %s"
+            , strerror(errno));
+    return false;
+  }
+  unlink(journalPath_.c_str());
+  generation_++;
+  journalSize_ = 0;
+  tornWrite_ = false;
+  LOG(VERBOSE, "[TrainDB] Compacted %zu roster entries into %zu bytes."
+    , entries.size(), buf.size());
+  return true;
+}
+
+size_t Esp32TrainDbJournal::replay(const string &buf, size_t offs
+                                 , std::vector<Esp32PersistentTrainData> *entries
+                                 , std::unordered_map<uint16_t, size_t> *index)
+{
+  while (offs + RECORD_HEADER_SIZE + RECORD_CRC_SIZE <= buf.size())
+  {
+    const uint8_t *record = (const uint8_t *)buf.data() + offs;
+    size_t len = read_uint16(record + 4);
+    size_t size = RECORD_HEADER_SIZE + len + RECORD_CRC_SIZE;
+    if (record[0] != RECORD_SYNC || offs + size > buf.size() ||
+        crc_16_ibm(record + 1, RECORD_HEADER_SIZE + len - 1) !=
+          read_uint16(record + RECORD_HEADER_SIZE + len))
+    {
+      break;
+    }
+    uint16_t address = read_uint16(record + 2);
+    auto ent = index->find(address);
+    if (record[1] == RECORD_PUT)
+    {
+      Esp32PersistentTrainData data;
+      if (!decode_entry(address, record + RECORD_HEADER_SIZE, len, &data))
+      {
+        break;
+      }
+      if (ent != index->end())
+      {
+        (*entries)[ent->second] = std::move(data);
+      }
+      else
+      {
+        (*index)[address] = entries->size();
+        entries->push_back(std::move(data));
+      }
+    }
+    else if (record[1] == RECORD_DELETE)
+    {
+      if (ent != index->end())
+      {
+        entries->erase(entries->begin() + ent->second);
+        // the offsets of all following entries have shifted.
+        index->clear();
+        for (size_t idx = 0; idx < entries->size(); idx++)
+        {
+          (*index)[(*entries)[idx].address] = idx;
+        }
+      }
+    }
+    else
+    {
+      break;
+    }
+    offs += size;
+  }
+  return offs;
+}
+
+bool Esp32TrainDbJournal::write_file(const string &path, const string &data
+                                   , bool append)
+{
+  int fd = ::open(path.c_str()
+                , O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+  if (fd < 0)
+  {
+    LOG_ERROR("[TrainDB] Unable to open %s: %s", path.c_str()
+            , strerror(errno));
+    return false;
+  }
+  const char *buf = data.data();
+  size_t remaining = data.size();
+  while (remaining)
+  {
+    ssize_t written = ::write(fd, buf, remaining);
+    if (written <= 0)
+    {
+      LOG_ERROR("[TrainDB] Failed to write %s: %s", path.c_str()
+              , strerror(errno));
+      ::close(fd);
+      return false;
+    }
+    buf += written;
+    remaining -= written;
+  }
+  fsync(fd);
+  return !::close(fd);
+}
+
+} // namespace esp32cs
@@ -0,0 +1,139 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef ESP32_TRAIN_DB_JOURNAL_H_
+#define ESP32_TRAIN_DB_JOURNAL_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sdkconfig.h"
+
+#ifndef CONFIG_ROSTER_JOURNAL_COMPACTION_SIZE
+#define CONFIG_ROSTER_JOURNAL_COMPACTION_SIZE 4096
+#endif
+
+namespace esp32cs
+{
+
+struct Esp32PersistentTrainData;
+
+/// Persistent storage for the locomotive roster.
+///
+/// The roster is stored as a binary snapshot holding one record per roster
+/// entry and an append-only journal of the changes made since the snapshot
+/// was written. Every record carries a CRC-16 so that a torn write at the end
+/// of the journal (power loss during an update) is detected and discarded
+/// when the roster is loaded.
+///
+/// Once the journal reaches CONFIG_ROSTER_JOURNAL_COMPACTION_SIZE bytes the
+/// roster is compacted into a new snapshot which replaces the previous one
+/// via rename, after which the journal is discarded. Each snapshot carries a
+/// generation number which is also recorded in the journal header, a journal
+/// which does not match the snapshot generation was left behind by an
+/// interrupted compaction and is ignored.
+class Esp32TrainDbJournal
+{
+public:
+  /// Constructor.
+  ///
+  /// @param snapshot is the full path to the roster snapshot file.
+  /// @param journal is the full path to the roster journal file.
+  Esp32TrainDbJournal(const std::string &snapshot, const std::string &journal);
+
+  /// Loads the roster snapshot and replays the journal on top of it.
+  ///
+  /// @param entries will receive the roster entries in roster order.
+  ///
+  /// @return false if neither the snapshot nor the journal exist or if the
+  /// snapshot could not be read, in which case it is moved aside together
+  /// with the journal and entries will be empty.
+  bool load(std::vector<Esp32PersistentTrainData> *entries);
+
+  /// Appends roster changes to the journal.
+  ///
+  /// @param updated are the roster entries which have been added or modified.
+  /// @param deleted are the addresses of roster entries which were removed.
+  ///
+  /// @return true if the changes have been written to the journal.
+  bool append(const std::vector<Esp32PersistentTrainData> &updated
+            , const std::vector<uint16_t> &deleted);
+
+  /// Replaces the snapshot with the provided roster entries and discards the
+  /// journal.
+  ///
+  /// @param entries are the roster entries to store.
+  ///
+  /// @return true if the snapshot has been replaced.
+  bool compact(const std::vector<Esp32PersistentTrainData> &entries);
+
+  /// @return true if the journal should be compacted into a new snapshot.
+  bool needs_compaction()
+  {
+    return tornWrite_ ||
+           journalSize_ >= CONFIG_ROSTER_JOURNAL_COMPACTION_SIZE;
+  }
+
+private:
+  /// Full path to the snapshot file.
+  const std::string snapshotPath_;
+
+  /// Full path to the temporary file used while writing a new snapshot.
+  const std::string snapshotTempPath_;
+
+  /// Full path to the journal file.
+  const std::string journalPath_;
+
+  /// Generation of the current snapshot, zero when there is no snapshot.
+  uint32_t generation_{0};
+
+  /// Number of bytes in the journal.
+  size_t journalSize_{0};
+
+  /// Set to true when a damaged record was found during @ref load, the
+  /// journal will be compacted on the next persistence call to discard it.
+  bool tornWrite_{false};
+
+  /// Applies the records contained in a buffer to the roster entries.
+  ///
+  /// @param buf is the buffer containing the records.
+  /// @param offs is the offset of the first record within buf.
+  /// @param entries are the roster entries to update.
+  /// @param index maps the roster address to the offset within entries.
+  ///
+  /// @return the offset following the last valid record in buf.
+  size_t replay(const std::string &buf, size_t offs
+              , std::vector<Esp32PersistentTrainData> *entries
+              , std::unordered_map<uint16_t, size_t> *index);
+
+  /// Writes a buffer to a file, optionally appending to it.
+  ///
+  /// @param path is the full path to the file.
+  /// @param data is the data to write.
+  /// @param append when true the data will be added to the end of the file,
+  /// otherwise the file will be truncated before writing.
+  ///
+  /// @return true if the data has been written and flushed to storage.
+  bool write_file(const std::string &path, const std::string &data
+                , bool append);
+};
+
+} // namespace esp32cs
+
+#endif // ESP32_TRAIN_DB_JOURNAL_H_
@@ -24,6 +24,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include <LCCStackManager.h>
 #include <LCCWiFiManager.h>
 #include <os/OS.hxx>
+#include <PersistenceService.h>
 #include <StatusDisplay.h>
 #include <StatusLED.h>
 #include <Turnouts.h>
@@ -49,6 +50,9 @@ void *node_reboot(void *arg)
   Singleton<esp32cs::LCCWiFiManager>::instance()->shutdown();
   Singleton<esp32cs::LCCStackManager>::instance()->shutdown();
   
+  // write any pending configuration data before the filesystem is unmounted.
+  Singleton<PersistenceService>::instance()->flush();
+
   // shutdown and cleanup the configuration manager
   Singleton<FileSystemManager>::instance()->shutdown();
 
@@ -22,6 +22,7 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <FileSystemManager.h>
 #include <DCCppProtocol.h>
 #include <DCCProgrammer.h>
+#include <DecoderBackup.h>
 #include <dcc/Loco.hxx>
 #include <Dnsd.h>
 #include <DCCSignalVFS.h>
@@ -32,6 +33,11 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <JsonConstants.h>
 #include <LCCStackManager.h>
 #include <LCCWiFiManager.h>
+#include <Metrics.h>
+#include <RailComFeedback.h>
+#include <Routes.h>
+#include <StateBroadcast.h>
+#include <Trace.h>
 #include <Turnouts.h>
 #include <utils/FileUtils.hxx>
 #include <utils/SocketClientParams.hxx>
@@ -57,6 +63,8 @@ using http::HttpStatusCode;
 using http::AbstractHttpResponse;
 using http::StringResponse;
 using http::JsonResponse;
+using http::JsonArrayResponse;
+using http::FileResponse;
 using http::WebSocketFlow;
 using http::MIME_TYPE_TEXT_HTML;
 using http::MIME_TYPE_TEXT_JAVASCRIPT;
@@ -65,15 +73,30 @@ using http::MIME_TYPE_TEXT_XML;
 using http::MIME_TYPE_TEXT_CSS;
 using http::MIME_TYPE_IMAGE_PNG;
 using http::MIME_TYPE_IMAGE_GIF;
+using http::MIME_TYPE_OCTET_STREAM;
 using http::HTTP_ENCODING_GZIP;
 using http::WebSocketEvent;
 using openlcb::TcpClientDefaultParams;
+using esp32cs::TraceEvent;
+using esp32cs::TraceSource;
+
+static void send_websocket_state(int clientID);
 
 class WebSocketClient : public DCCPPProtocolConsumer
 {
 public:
   WebSocketClient(int clientID, uint32_t remoteIP)
     : DCCPPProtocolConsumer(), _id(clientID), _remoteIP(remoteIP)
+    , _state([clientID]()
+      {
+        // state changes are published from many contexts, defer sending
+        // them to the Httpd executor.
+        Singleton<Httpd>::instance()->executor()->add(
+          new CallbackExecutable([clientID]()
+          {
+            send_websocket_state(clientID);
+          }));
+      }, ALL_STATE_TYPES)
   {
     LOG(INFO, "[WS %s] Connected", name().c_str());
   }
@@ -89,9 +112,33 @@ public:
   {
     return StringPrintf("%s/%d", ipv4_to_string(_remoteIP).c_str(), _id);
   }
+  // Sends pending state changes to the client, this is a no-op while text
+  // previously queued for the client has not been sent. In that case the
+  // state changes will be sent (coalesced) once the WebSocket reports that
+  // it is ready for more text.
+  void send_state()
+  {
+    if (!_sendReady)
+    {
+      return;
+    }
+    string text;
+    if (_state.drain(&text))
+    {
+      _sendReady = false;
+      Singleton<Httpd>::instance()->send_websocket_text(_id, text);
+    }
+  }
+  void send_ready()
+  {
+    _sendReady = true;
+    send_state();
+  }
 private:
   uint32_t _id;
   uint32_t _remoteIP;
+  StateSubscriber _state;
+  bool _sendReady{true};
 };
 
 // Captive Portal landing page
@@ -110,12 +157,57 @@ static constexpr const char * const CAPTIVE_PORTAL_HTML = R"!^!(
 
 OSMutex webSocketLock;
 std::vector<std::unique_ptr<WebSocketClient>> webSocketClients;
+
+#if CONFIG_METRICS_FEED_INTERVAL_SEC
+// Periodically publishes the runtime metrics to the WebSocket clients, the
+// metrics are only serialized when there is at least one client connected.
+class MetricsFeedFlow : public StateFlowBase
+{
+public:
+  MetricsFeedFlow(Service *service) : StateFlowBase(service)
+  {
+    start_flow(STATE(delay));
+  }
+private:
+  StateFlowTimer timer_{this};
+
+  Action delay()
+  {
+    return sleep_and_call(&timer_
+                        , SEC_TO_NSEC(CONFIG_METRICS_FEED_INTERVAL_SEC)
+                        , STATE(publish));
+  }
+
+  Action publish()
+  {
+    bool have_clients = false;
+    {
+      OSMutexLock h(&webSocketLock);
+      have_clients = !webSocketClients.empty();
+    }
+    if (have_clients)
+    {
+      StateBroadcast::publish(StateType::METRICS, 0
+                            , esp32cs::Metric::to_json());
+    }
+    return call_immediately(STATE(delay));
+  }
+};
+
+std::unique_ptr<MetricsFeedFlow> metricsFeed;
+#endif // CONFIG_METRICS_FEED_INTERVAL_SEC
+
 WEBSOCKET_STREAM_HANDLER(process_websocket_event);
 HTTP_STREAM_HANDLER(process_ota);
 HTTP_HANDLER(process_power);
 HTTP_HANDLER(process_config);
 HTTP_HANDLER(process_prog);
+HTTP_HANDLER(process_decoder_backup);
+#if CONFIG_TRACE
+HTTP_HANDLER(process_trace);
+#endif // CONFIG_TRACE
 HTTP_HANDLER(process_turnouts);
+HTTP_HANDLER(process_routes);
 HTTP_HANDLER(process_loco);
 HTTP_HANDLER(process_outputs);
 HTTP_HANDLER(process_sensors);
@@ -364,32 +456,52 @@ void init_webserver(const esp32cs::Esp32ConfigDef &cfg)
   [&](HttpRequest *request) -> AbstractHttpResponse *
   {
     string path = request->param("path");
-    struct stat statbuf;
-    // verify that the requested path exists
-    if (!stat(path.c_str(), &statbuf))
+    string mimetype = http::MIME_TYPE_TEXT_PLAIN;
+    if (path.find(".xml") != string::npos)
     {
-      string data = read_file_to_string(path);
-      string mimetype = http::MIME_TYPE_TEXT_PLAIN;
-      if (path.find(".xml") != string::npos)
-      {
-        mimetype = MIME_TYPE_TEXT_XML;
-      }
-      else if (path.find(".json") != string::npos)
-      {
-        mimetype = http::MIME_TYPE_APPLICATION_JSON;
-      }
-      return new StringResponse(data, mimetype);
+      mimetype = MIME_TYPE_TEXT_XML;
     }
-    request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
-    return nullptr;
+    else if (path.find(".json") != string::npos)
+    {
+      mimetype = http::MIME_TYPE_APPLICATION_JSON;
+    }
+    // the file is streamed to the client rather than loaded into memory,
+    // FileResponse responds with 404 when the path does not exist.
+    return new FileResponse(request, path, mimetype);
   });
   httpd->uri("/power", HttpMethod::GET | HttpMethod::PUT, process_power);
   httpd->uri("/config", HttpMethod::GET | HttpMethod::POST, process_config);
   httpd->uri("/programmer", HttpMethod::GET | HttpMethod::POST, process_prog);
+  httpd->uri("/programmer/backup"
+           , HttpMethod::GET | HttpMethod::POST | HttpMethod::DELETE
+           , process_decoder_backup);
+#if CONFIG_OPS_RAILCOM
+  httpd->uri("/railcom", HttpMethod::GET, [&](HttpRequest *req)
+  {
+    auto railcom = Singleton<esp32cs::RailComFeedbackCache>::instance();
+    return new JsonResponse(railcom->get_state_as_json());
+  });
+#endif // CONFIG_OPS_RAILCOM
+  httpd->uri("/metrics", HttpMethod::GET, [&](HttpRequest *req)
+  {
+    return new StringResponse(esp32cs::Metric::to_text()
+                            , MIME_TYPE_TEXT_PLAIN);
+  });
+#if CONFIG_METRICS_FEED_INTERVAL_SEC
+  metricsFeed.reset(new MetricsFeedFlow(httpd));
+#endif // CONFIG_METRICS_FEED_INTERVAL_SEC
+#if CONFIG_TRACE
+  httpd->uri("/trace", HttpMethod::GET | HttpMethod::PUT | HttpMethod::DELETE
+           , process_trace);
+#endif // CONFIG_TRACE
   httpd->uri("/turnouts"
            , HttpMethod::GET | HttpMethod::POST |
              HttpMethod::PUT | HttpMethod::DELETE
            , process_turnouts);
+  httpd->uri("/routes"
+           , HttpMethod::GET | HttpMethod::POST |
+             HttpMethod::PUT | HttpMethod::DELETE
+           , process_routes);
   httpd->uri("/locomotive"
            , HttpMethod::GET | HttpMethod::POST |
              HttpMethod::PUT | HttpMethod::DELETE
@@ -441,6 +553,19 @@ WEBSOCKET_STREAM_HANDLER_IMPL(process_websocket_event, client, event, data
         return inst->id() == client->id();
       }));
   }
+  else if (event == WebSocketEvent::WS_EVENT_SEND_READY)
+  {
+    auto ent = std::find_if(webSocketClients.begin(), webSocketClients.end()
+    , [client](const auto &inst) -> bool
+      {
+        return inst->id() == client->id();
+      }
+    );
+    if (ent != webSocketClients.end())
+    {
+      (*ent)->send_ready();
+    }
+  }
   else if (event == WebSocketEvent::WS_EVENT_TEXT)
   {
     auto ent = std::find_if(webSocketClients.begin(), webSocketClients.end()
@@ -461,6 +586,21 @@ WEBSOCKET_STREAM_HANDLER_IMPL(process_websocket_event, client, event, data
   }
 }
 
+static void send_websocket_state(int clientID)
+{
+  OSMutexLock h(&webSocketLock);
+  auto ent = std::find_if(webSocketClients.begin(), webSocketClients.end()
+  , [clientID](const auto &inst) -> bool
+    {
+      return inst->id() == clientID;
+    }
+  );
+  if (ent != webSocketClients.end())
+  {
+    (*ent)->send_state();
+  }
+}
+
 esp_ota_handle_t otaHandle;
 esp_partition_t *ota_partition = nullptr;
 HTTP_STREAM_HANDLER_IMPL(process_ota, request, filename, size, data, length
@@ -647,7 +787,31 @@ HTTP_HANDLER_IMPL(process_prog, request)
   {
     if (request->param(JSON_PROG_ON_MAIN, false))
     {
+#if CONFIG_OPS_RAILCOM
+      // reading from the OPS track requires a RailCom reply from the decoder.
+      uint16_t address = request->param(JSON_ADDRESS_NODE, 0);
+      uint16_t cvNumber = request->param(JSON_CV_NODE, 0);
+      if (address == 0 || cvNumber == 0)
+      {
+        request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+      }
+      else
+      {
+        // the reply is pushed to WebSocket clients once it arrives, a value
+        // of -1 indicates the decoder did not reply.
+        Singleton<OpsCVReader>::instance()->submit(address, cvNumber,
+        [address](uint16_t cv, int16_t value)
+        {
+          StateBroadcast::publish(StateType::POM_READ, address,
+            StringPrintf("{\"%s\":{\"%s\":%d,\"%s\":%d,\"%s\":%d}}"
+                       , JSON_PROG_ON_MAIN, JSON_ADDRESS_NODE, address
+                       , JSON_CV_NODE, cv, JSON_VALUE_NODE, value));
+        });
+        request->set_status(HttpStatusCode::STATUS_ACCEPTED);
+      }
+#else
       request->set_status(HttpStatusCode::STATUS_NOT_ALLOWED);
+#endif // CONFIG_OPS_RAILCOM
     }
     else if (request->has_param(JSON_IDENTIFY_NODE))
     {
@@ -811,6 +975,121 @@ HTTP_HANDLER_IMPL(process_prog, request)
   return nullptr;
 }
 
+// GET /programmer/backup - state of the current (or last) backup/restore job
+// GET /programmer/backup?address=<address> - stored decoder image as JSON
+// POST /programmer/backup?address=<address>&cvs=<list>[&resume=true] - start
+//      reading the CVs in <list> from the decoder on the PROG track, see
+//      DecoderBackup::parse_cv_list for the list format. When resume is true
+//      CVs already stored for the address will not be read again.
+// POST /programmer/backup?address=<address>&restore=true - start writing the
+//      stored decoder image to the decoder on the PROG track.
+// POST /programmer/backup?resume=true - resume the last failed or cancelled
+//      job.
+// DELETE /programmer/backup - cancel the running job.
+//
+// Jobs run in the background and report progress via the /ws WebSocket. For
+// successful requests the result code will be 200 or 202 when a job has been
+// started, 400 (bad request), 404 (no decoder image) or 409 (a job is already
+// running or there is no job to resume) otherwise.
+HTTP_HANDLER_IMPL(process_decoder_backup, request)
+{
+  auto backup = Singleton<DecoderBackup>::instance();
+  uint16_t address = request->param(JSON_ADDRESS_NODE, 0);
+  if (request->method() == HttpMethod::GET)
+  {
+    if (!request->has_param(JSON_ADDRESS_NODE))
+    {
+      return new JsonResponse(backup->get_state_as_json());
+    }
+    string image = backup->get_image_as_json(address);
+    if (!image.empty())
+    {
+      return new JsonResponse(image);
+    }
+    request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
+  }
+  else if (request->method() == HttpMethod::DELETE)
+  {
+    backup->cancel();
+    request->set_status(HttpStatusCode::STATUS_OK);
+  }
+  else if (!request->has_param(JSON_ADDRESS_NODE) &&
+           request->param(JSON_RESUME_NODE, false))
+  {
+    request->set_status(backup->resume() ? HttpStatusCode::STATUS_ACCEPTED
+                                         : HttpStatusCode::STATUS_CONFLICT);
+  }
+  else if (address < 1 || address > 10239)
+  {
+    request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+  }
+  else if (request->param(JSON_RESTORE_NODE, false))
+  {
+    if (backup->get_image_as_json(address).empty())
+    {
+      request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
+    }
+    else if (!backup->restore(address))
+    {
+      request->set_status(HttpStatusCode::STATUS_CONFLICT);
+    }
+    else
+    {
+      request->set_status(HttpStatusCode::STATUS_ACCEPTED);
+    }
+  }
+  else
+  {
+    std::vector<uint32_t> cvs;
+    if (!DecoderBackup::parse_cv_list(request->param(JSON_CVS_NODE), &cvs))
+    {
+      request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+    }
+    else if (!backup->backup(address, cvs
+                           , request->param(JSON_RESUME_NODE, false)))
+    {
+      request->set_status(HttpStatusCode::STATUS_CONFLICT);
+    }
+    else
+    {
+      request->set_status(HttpStatusCode::STATUS_ACCEPTED);
+    }
+  }
+  return nullptr;
+}
+
+#if CONFIG_TRACE
+// GET /trace - download the recorded trace events, see esp32cs::Trace for
+//      the binary format.
+// PUT /trace?events=<mask> - select the events to record, see
+//      esp32cs::TraceEvent for the bit assignments. A mask of zero stops
+//      recording.
+// DELETE /trace - discard all recorded events.
+//
+// For PUT and DELETE the result code will be 200 and the selected events
+// will be returned.
+HTTP_HANDLER_IMPL(process_trace, request)
+{
+  if (request->method() == HttpMethod::GET)
+  {
+    return new StringResponse(esp32cs::Trace::dump()
+                            , MIME_TYPE_OCTET_STREAM);
+  }
+  else if (request->method() == HttpMethod::DELETE)
+  {
+    esp32cs::Trace::clear();
+  }
+  else if (request->has_param("events"))
+  {
+    esp32cs::Trace::set_events(
+      strtoul(request->param("events").c_str(), nullptr, 0));
+  }
+  request->set_status(HttpStatusCode::STATUS_OK);
+  return new JsonResponse(
+    StringPrintf("{\"events\":%u}", (unsigned)esp32cs::Trace::events()));
+}
+#endif // CONFIG_TRACE
+
 // GET /turnouts - full list of turnouts, note that turnout state is STRING type for display
 // GET /turnouts?readbleStrings=[0,1] - full list of turnouts, turnout state will be returned as true/false (boolean) when readableStrings=0.
 // GET /turnouts?address=<address> - retrieve turnout by DCC address
@@ -828,7 +1107,11 @@ HTTP_HANDLER_IMPL(process_turnouts, request)
      !request->has_param(JSON_ADDRESS_NODE))
   {
     bool readable = request->param(JSON_TURNOUTS_READABLE_STRINGS_NODE, false);
-    return new JsonResponse(turnoutMgr->getStateAsJson(readable));
+    return new JsonArrayResponse(
+    [turnoutMgr, readable](size_t index, string *json)
+    {
+      return turnoutMgr->getStateAsJson(index, json, readable);
+    });
   }
 
   uint16_t address = request->param(JSON_ADDRESS_NODE, 0);
@@ -875,6 +1158,78 @@ HTTP_HANDLER_IMPL(process_turnouts, request)
   return nullptr;
 }
 
+// GET /routes - full list of routes
+// GET /routes?name=<name> - retrieve route by name
+// PUT /routes?name=<name> - queues the route for execution
+// POST /routes?name=<name>&turnouts=<address:state,...>&event=<event> -
+//      creates or updates a route, event is optional
+// DELETE /routes?name=<name> - delete route by name
+HTTP_HANDLER_IMPL(process_routes, request)
+{
+  auto routeMgr = Singleton<RouteManager>::instance();
+  if (request->method() == HttpMethod::GET &&
+     !request->has_param(JSON_NAME_NODE))
+  {
+    return new JsonArrayResponse([routeMgr](size_t index, string *json)
+    {
+      return routeMgr->getStateAsJson(index, json);
+    });
+  }
+
+  string name = request->param(JSON_NAME_NODE);
+  if (name.empty())
+  {
+    request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+  }
+  else if (request->method() == HttpMethod::GET)
+  {
+    string route = routeMgr->getStateAsJson(name);
+    if (!route.empty())
+    {
+      return new JsonResponse(route);
+    }
+    request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
+  }
+  else if (request->method() == HttpMethod::POST)
+  {
+    std::vector<RouteStep> steps;
+    string event = request->param(JSON_EVENT_NODE);
+    if (!RouteManager::parse_steps(request->param(JSON_TURNOUTS_NODE), &steps)
+     || !routeMgr->createOrUpdate(name, std::move(steps)
+                                , event.empty() ? 0 : string_to_uint64(event)))
+    {
+      request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+    }
+    else
+    {
+      return new JsonResponse(routeMgr->getStateAsJson(name));
+    }
+  }
+  else if (request->method() == HttpMethod::DELETE)
+  {
+    if (routeMgr->remove(name))
+    {
+      request->set_status(HttpStatusCode::STATUS_NO_CONTENT);
+    }
+    else
+    {
+      request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
+    }
+  }
+  else if (request->method() == HttpMethod::PUT)
+  {
+    if (routeMgr->trigger(name))
+    {
+      request->set_status(HttpStatusCode::STATUS_ACCEPTED);
+    }
+    else
+    {
+      request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
+    }
+  }
+  return nullptr;
+}
+
 string convert_loco_to_json(openlcb::TrainImpl *t)
 {
   if (!t)
@@ -902,19 +1257,13 @@ string convert_loco_to_json(openlcb::TrainImpl *t)
   return res;
 }
 
-#define GET_LOCO_VIA_EXECUTOR(NAME, address)                                          \
-  openlcb::TrainImpl *NAME = nullptr;                                                 \
-  {                                                                                   \
-    SyncNotifiable n;                                                                 \
-    Singleton<esp32cs::LCCStackManager>::instance()->stack()->executor()->add(        \
-    new CallbackExecutable([&]()                                                      \
-    {                                                                                 \
-      NAME = Singleton<commandstation::AllTrainNodes>::instance()->get_train_impl(    \
-                                        commandstation::DccMode::DCC_128, address);   \
-      n.notify();                                                                     \
-    }));                                                                              \
-    n.wait_for_notification();                                                        \
-  }
+// Retrieves the train for a DCC address. Existing trains are found without
+// involving the LCC executor, only the creation of a new train will block
+// until the LCC executor has processed it.
+#define GET_LOCO(NAME, address)                                                       \
+  openlcb::TrainImpl *NAME =                                                          \
+    Singleton<commandstation::AllTrainNodes>::instance()->find_or_create_train_impl(  \
+                                        commandstation::DccMode::DCC_128, address)
 
 #define REMOVE_LOCO_VIA_EXECUTOR(address)                                             \
   {                                                                                   \
@@ -958,7 +1307,26 @@ HTTP_HANDLER_IMPL(process_loco, request)
     if (request->method() == HttpMethod::GET &&
        !request->has_param(JSON_ADDRESS_NODE))
     {
-      return new JsonResponse(traindb->get_all_entries_as_json());
+      // the roster is streamed from a snapshot of the roster addresses so
+      // that neither the full roster nor the train database lock is held for
+      // the duration of the response.
+      return new JsonArrayResponse(
+      [traindb, addresses = traindb->get_all_addresses()](size_t index
+                                                         , string *json)
+      {
+        if (index >= addresses.size())
+        {
+          return false;
+        }
+        string entry = traindb->get_entry_as_json(addresses[index]);
+        // skip any entries which have been deleted since the snapshot was
+        // taken.
+        if (entry != "{}")
+        {
+          json->append(entry);
+        }
+        return true;
+      });
     }
     else if (request->has_param(JSON_ADDRESS_NODE))
     {
@@ -1060,10 +1428,13 @@ HTTP_HANDLER_IMPL(process_loco, request)
       if (request->method() == HttpMethod::PUT ||
           request->method() == HttpMethod::POST)
       {
-        GET_LOCO_VIA_EXECUTOR(loco, address);
+        GET_LOCO(loco, address);
         // Creation / Update of active locomotive
         if (request->has_param(JSON_IDLE_NODE))
         {
+          TRACE_EVENT(TraceEvent::THROTTLE, address
+                    , trace_throttle_arg(TraceSource::WEB
+                                       , dcc::SpeedType(0).get_wire()));
           loco->set_speed(dcc::SpeedType(0));
         }
         if (request->has_param(JSON_SPEED_NODE))
@@ -1078,6 +1449,8 @@ HTTP_HANDLER_IMPL(process_loco, request)
           {
             speed.set_direction(dcc::SpeedType::REVERSE);
           }
+          TRACE_EVENT(TraceEvent::THROTTLE, address
+                    , trace_throttle_arg(TraceSource::WEB, speed.get_wire()));
           loco->set_speed(speed);
         }
         else if (request->has_param(JSON_DIRECTION_NODE))
@@ -1087,6 +1460,9 @@ HTTP_HANDLER_IMPL(process_loco, request)
           auto upd_speed = loco->get_speed();
           upd_speed.set_direction(forward ? dcc::SpeedType::FORWARD
                                           : dcc::SpeedType::REVERSE);
+          TRACE_EVENT(TraceEvent::THROTTLE, address
+                    , trace_throttle_arg(TraceSource::WEB
+                                       , upd_speed.get_wire()));
           loco->set_speed(upd_speed);
         }
         
@@ -1110,7 +1486,7 @@ HTTP_HANDLER_IMPL(process_loco, request)
       }
       else
       {
-        GET_LOCO_VIA_EXECUTOR(loco, address);
+        GET_LOCO(loco, address);
         return new JsonResponse(convert_loco_to_json(loco));
       }
     }
@@ -1123,7 +1499,10 @@ HTTP_HANDLER_IMPL(process_outputs, request)
 {
   if (request->method() == HttpMethod::GET && !request->params())
   {
-    return new JsonResponse(OutputManager::getStateAsJson());
+    return new JsonArrayResponse([](size_t index, string *json)
+    {
+      return OutputManager::getStateAsJson(index, json);
+    });
   }
   request->set_status(HttpStatusCode::STATUS_OK);
   int16_t output_id = request->param(JSON_ID_NODE, -1);
@@ -1188,7 +1567,10 @@ HTTP_HANDLER_IMPL(process_sensors, request)
   if (request->method() == HttpMethod::GET &&
      !request->has_param(JSON_ID_NODE))
   {
-    return new JsonResponse(SensorManager::getStateAsJson());
+    return new JsonArrayResponse([](size_t index, string *json)
+    {
+      return SensorManager::getStateAsJson(index, json);
+    });
   }
   else if (!request->has_param(JSON_ID_NODE))
   {
@@ -1253,7 +1635,10 @@ HTTP_HANDLER_IMPL(process_remote_sensors, request)
   request->set_status(HttpStatusCode::STATUS_OK);
   if (request->method() == HttpMethod::GET)
   {
-    return new JsonResponse(RemoteSensorManager::getStateAsJson());
+    return new JsonArrayResponse([](size_t index, string *json)
+    {
+      return RemoteSensorManager::getStateAsJson(index, json);
+    });
   }
   else if (request->method() == HttpMethod::POST)
   {
@@ -1273,7 +1658,10 @@ HTTP_HANDLER_IMPL(process_s88, request)
   request->set_status(HttpStatusCode::STATUS_OK);
   if (request->method() == HttpMethod::GET)
   {
-    return new JsonResponse(S88BusManager::instance()->get_state_as_json());
+    return new JsonArrayResponse([](size_t index, string *json)
+    {
+      return S88BusManager::instance()->get_state_as_json(index, json);
+    });
   }
   else if (request->method() == HttpMethod::POST)
   {